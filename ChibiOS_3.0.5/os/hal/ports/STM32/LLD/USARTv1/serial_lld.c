@@ -163,21 +163,26 @@ static void serve_interrupt(SerialDriver *sdp) {
     osalSysUnlockFromISR();
   }
 
-  /* Data available.*/
-  osalSysLockFromISR();
-  while (sr & (USART_SR_RXNE | USART_SR_ORE | USART_SR_NE | USART_SR_FE |
-               USART_SR_PE)) {
-    uint8_t b;
-
-    /* Error condition detection.*/
-    if (sr & (USART_SR_ORE | USART_SR_NE | USART_SR_FE  | USART_SR_PE))
-      set_error(sdp, sr);
-    b = u->DR;
-    if (sr & USART_SR_RXNE)
-      sdIncomingDataI(sdp, b);
-    sr = u->SR;
+  /* Data available, unless the receiver is served by the hook.*/
+  if (sdp->rxhook != NULL) {
+    sdp->rxhook(sdp->rxhookp, sr);
+  }
+  else {
+    osalSysLockFromISR();
+    while (sr & (USART_SR_RXNE | USART_SR_ORE | USART_SR_NE | USART_SR_FE |
+                 USART_SR_PE)) {
+      uint8_t b;
+
+      /* Error condition detection.*/
+      if (sr & (USART_SR_ORE | USART_SR_NE | USART_SR_FE  | USART_SR_PE))
+        set_error(sdp, sr);
+      b = u->DR;
+      if (sr & USART_SR_RXNE)
+        sdIncomingDataI(sdp, b);
+      sr = u->SR;
+    }
+    osalSysUnlockFromISR();
   }
-  osalSysUnlockFromISR();
 
   /* Transmission buffer empty.*/
   if ((cr1 & USART_CR1_TXEIE) && (sr & USART_SR_TXE)) {
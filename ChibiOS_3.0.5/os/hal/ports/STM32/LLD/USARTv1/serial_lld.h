@@ -249,7 +249,13 @@ typedef struct {
   uint8_t                   ob[SERIAL_BUFFERS_SIZE];                        \
   /* End of the mandatory fields.*/                                         \
   /* Pointer to the USART registers block.*/                                \
-  USART_TypeDef             *usart;
+  USART_TypeDef             *usart;                                         \
+  /* Receive hook, when set it is called with the status register instead  \
+     of reading the data register into the input queue, e.g. while a DMA    \
+     stream receives the data.*/                                            \
+  void                      (*rxhook)(void *p, uint16_t sr);                \
+  /* Parameter of the receive hook.*/                                       \
+  void                      *rxhookp;
 
 /*===========================================================================*/
 /* Driver macros.                                                            */
@@ -23,6 +23,8 @@
 #include "hw.h"
 #include "packet.h"
 #include "commands.h"
+#include "uart_dma_rx.h"
+#include "stm32f4xx_conf.h"
 
 #include <string.h>
 
@@ -30,6 +32,9 @@
 #define BAUDRATE					115200
 #define PACKET_HANDLER				1
 #define PACKET_HANDLER_P			2
+#define TX_COALESCE_MAX_AGE			MS2ST(2)
+#define RX_DMA_BUFFER_SIZE			512
+#define RX_DMA_EVENT				EVENT_MASK(1)
 
 // Threads
 static THD_FUNCTION(packet_process_thread, arg);
@@ -38,17 +43,32 @@ static THD_WORKING_AREA(packet_process_thread_wa, 4096);
 // Variables
 static volatile bool thread_is_running = false;
 static volatile bool uart_is_running = false;
+static thread_t *process_tp = 0;
 static mutex_t send_mutex;
 static bool send_mutex_init_done = false;
+static systime_t tx_pending_since = 0;
+
+#ifdef HW_UART_RX_DMA_STREAM
+static uart_dma_rx rx_dma;
+static uint8_t rx_dma_buffer[RX_DMA_BUFFER_SIZE];
+#endif
 
 #ifdef HW_UART_P_DEV
 static mutex_t send_mutex_p;
 static bool send_mutex_p_init_done = false;
+static systime_t tx_pending_since_p = 0;
+#ifdef HW_UART_P_RX_DMA_STREAM
+static uart_dma_rx rx_dma_p;
+static uint8_t rx_dma_buffer_p[RX_DMA_BUFFER_SIZE];
+#endif
 #endif
 
 // Private functions
 static void process_packet(unsigned char *data, unsigned int len);
 static void send_packet(unsigned char *data, unsigned int len);
+static void send_coalesced(int handler_num, systime_t *pending_since, unsigned char *data, unsigned int len);
+static void flush_packets(bool force);
+static void start_thread(void);
 
 #ifdef HW_UART_P_DEV
 static void process_packet_p(unsigned char *data, unsigned int len);
@@ -101,16 +121,65 @@ static void send_packet_p(unsigned char *data, unsigned int len) {
 }
 #endif
 
+/*
+ * Replies from the process thread are coalesced and flushed by it after
+ * the received bytes have been processed, or when they get older than
+ * TX_COALESCE_MAX_AGE while input keeps coming. Packets from other threads flush
+ * what is pending and are written directly, so the order is kept. Must be
+ * called with the send mutex of the handler locked.
+ */
+static void send_coalesced(int handler_num, systime_t *pending_since, unsigned char *data, unsigned int len) {
+	bool coalesce = process_tp != 0 && chThdGetSelfX() == process_tp;
+
+	// Do not hold back replies of long running commands for too long
+	if (coalesce && packet_tx_pending(handler_num) > 0 &&
+			chVTTimeElapsedSinceX(*pending_since) > TX_COALESCE_MAX_AGE) {
+		packet_flush(handler_num);
+	}
+
+	if (packet_tx_pending(handler_num) == 0) {
+		*pending_since = chVTGetSystemTimeX();
+	}
+
+	packet_set_coalescing(coalesce, handler_num);
+	packet_send_packet(data, len, handler_num);
+}
+
+/*
+ * Send the coalesced replies, always or only when the oldest one has waited
+ * for TX_COALESCE_MAX_AGE.
+ */
+static void flush_packets(bool force) {
+	if (send_mutex_init_done) {
+		chMtxLock(&send_mutex);
+		if (force || (packet_tx_pending(PACKET_HANDLER) > 0 &&
+				chVTTimeElapsedSinceX(tx_pending_since) > TX_COALESCE_MAX_AGE)) {
+			packet_flush(PACKET_HANDLER);
+		}
+		chMtxUnlock(&send_mutex);
+	}
+
+#ifdef HW_UART_P_DEV
+	if (send_mutex_p_init_done) {
+		chMtxLock(&send_mutex_p);
+		if (force || (packet_tx_pending(PACKET_HANDLER_P) > 0 &&
+				chVTTimeElapsedSinceX(tx_pending_since_p) > TX_COALESCE_MAX_AGE)) {
+			packet_flush(PACKET_HANDLER_P);
+		}
+		chMtxUnlock(&send_mutex_p);
+	}
+#endif
+}
+
 void app_uartcomm_start(void) {
 	packet_init(send_packet, process_packet, PACKET_HANDLER);
 
-	if (!thread_is_running) {
-		chThdCreateStatic(packet_process_thread_wa, sizeof(packet_process_thread_wa),
-				NORMALPRIO, packet_process_thread, NULL);
-		thread_is_running = true;
-	}
+	start_thread();
 
 	sdStart(&HW_UART_DEV, &uart_cfg);
+#ifdef HW_UART_RX_DMA_STREAM
+	uart_dma_rx_start(&rx_dma);
+#endif
 	palSetPadMode(HW_UART_TX_PORT, HW_UART_TX_PIN, PAL_MODE_ALTERNATE(HW_UART_GPIO_AF) |
 			PAL_STM32_OSPEED_HIGHEST |
 			PAL_STM32_PUDR_PULLUP);
@@ -125,13 +194,12 @@ void app_uartcomm_start_permanent(void) {
 #ifdef HW_UART_P_DEV
 	packet_init(send_packet_p, process_packet_p, PACKET_HANDLER_P);
 
-	if (!thread_is_running) {
-		chThdCreateStatic(packet_process_thread_wa, sizeof(packet_process_thread_wa),
-				NORMALPRIO, packet_process_thread, NULL);
-		thread_is_running = true;
-	}
+	start_thread();
 
 	sdStart(&HW_UART_P_DEV, &uart_p_cfg);
+#ifdef HW_UART_P_RX_DMA_STREAM
+	uart_dma_rx_start(&rx_dma_p);
+#endif
 
 #ifdef HW_UART_P_DEV_TX
 	sdStart(&HW_UART_P_DEV_TX, &uart_p_cfg);
@@ -150,6 +218,9 @@ void app_uartcomm_start_permanent(void) {
 
 void app_uartcomm_stop(void) {
 	if (uart_is_running) {
+#ifdef HW_UART_RX_DMA_STREAM
+		uart_dma_rx_stop(&rx_dma);
+#endif
 		sdStop(&HW_UART_DEV);
 		palSetPadMode(HW_UART_TX_PORT, HW_UART_TX_PIN, PAL_MODE_INPUT_PULLUP);
 		palSetPadMode(HW_UART_RX_PORT, HW_UART_RX_PIN, PAL_MODE_INPUT_PULLUP);
@@ -166,7 +237,7 @@ void app_uartcomm_send_packet(unsigned char *data, unsigned int len) {
 	}
 
 	chMtxLock(&send_mutex);
-	packet_send_packet(data, len, PACKET_HANDLER);
+	send_coalesced(PACKET_HANDLER, &tx_pending_since, data, len);
 	chMtxUnlock(&send_mutex);
 }
 
@@ -178,7 +249,7 @@ void app_uartcomm_send_packet_p(unsigned char *data, unsigned int len) {
 	}
 
 	chMtxLock(&send_mutex_p);
-	packet_send_packet(data, len, PACKET_HANDLER_P);
+	send_coalesced(PACKET_HANDLER_P, &tx_pending_since_p, data, len);
 	chMtxUnlock(&send_mutex_p);
 #else
 	(void)data;
@@ -190,7 +261,15 @@ void app_uartcomm_configure(uint32_t baudrate, bool permanent_enabled) {
 	uart_cfg.speed = baudrate;
 
 	if (thread_is_running && uart_is_running) {
+#ifdef HW_UART_RX_DMA_STREAM
+		// sdStart rewrites the control registers, so give the receiver back
+		// to the serial driver first and take it again afterwards
+		uart_dma_rx_stop(&rx_dma);
+#endif
 		sdStart(&HW_UART_DEV, &uart_cfg);
+#ifdef HW_UART_RX_DMA_STREAM
+		uart_dma_rx_start(&rx_dma);
+#endif
 	}
 
 #ifdef HW_UART_P_DEV
@@ -210,15 +289,37 @@ void app_uartcomm_configure(uint32_t baudrate, bool permanent_enabled) {
 #endif
 }
 
+static void start_thread(void) {
+	if (thread_is_running) {
+		return;
+	}
+
+	process_tp = chThdCreateStatic(packet_process_thread_wa, sizeof(packet_process_thread_wa),
+			NORMALPRIO, packet_process_thread, NULL);
+	thread_is_running = true;
+
+#ifdef HW_UART_RX_DMA_STREAM
+	uart_dma_rx_init(&rx_dma, &HW_UART_DEV, HW_UART_RX_DMA_STREAM, HW_UART_RX_DMA_CHANNEL,
+			HW_UART_RX_DMA_IRQ_PRIO, rx_dma_buffer, sizeof(rx_dma_buffer), process_tp, RX_DMA_EVENT);
+#endif
+
+#ifdef HW_UART_P_RX_DMA_STREAM
+	uart_dma_rx_init(&rx_dma_p, &HW_UART_P_DEV, HW_UART_P_RX_DMA_STREAM, HW_UART_P_RX_DMA_CHANNEL,
+			HW_UART_P_RX_DMA_IRQ_PRIO, rx_dma_buffer_p, sizeof(rx_dma_buffer_p), process_tp, RX_DMA_EVENT);
+#endif
+}
+
 static THD_FUNCTION(packet_process_thread, arg) {
 	(void)arg;
 
 	chRegSetThreadName("uartcomm proc");
 
+#ifndef HW_UART_RX_DMA_STREAM
 	event_listener_t el;
 	chEvtRegisterMaskWithFlags(&HW_UART_DEV.event, &el, EVENT_MASK(0), CHN_INPUT_AVAILABLE);
+#endif
 
-#ifdef HW_UART_P_DEV
+#if defined(HW_UART_P_DEV) && !defined(HW_UART_P_RX_DMA_STREAM)
 	event_listener_t elp;
 	chEvtRegisterMaskWithFlags(&HW_UART_P_DEV.event, &elp, EVENT_MASK(0), CHN_INPUT_AVAILABLE);
 #endif
@@ -231,6 +332,19 @@ static THD_FUNCTION(packet_process_thread, arg) {
 			rx = false;
 
 			if (uart_is_running) {
+#ifdef HW_UART_RX_DMA_STREAM
+				const uint8_t *data;
+				unsigned int len = uart_dma_rx_get(&rx_dma, &data);
+				if (len > 0) {
+#ifdef HW_UART_P_DEV
+					from_p_uart = false;
+#endif
+					// Consumed first, as processing can restart the receiver
+					uart_dma_rx_consume(&rx_dma, len);
+					packet_process_bytes(data, len, PACKET_HANDLER);
+					rx = true;
+				}
+#else
 				msg_t res = sdGetTimeout(&HW_UART_DEV, TIME_IMMEDIATE);
 				if (res != MSG_TIMEOUT) {
 #ifdef HW_UART_P_DEV
@@ -239,9 +353,20 @@ static THD_FUNCTION(packet_process_thread, arg) {
 					packet_process_byte(res, PACKET_HANDLER);
 					rx = true;
 				}
+#endif
 			}
 
 #ifdef HW_UART_P_DEV
+#ifdef HW_UART_P_RX_DMA_STREAM
+			const uint8_t *data_p;
+			unsigned int len_p = uart_dma_rx_get(&rx_dma_p, &data_p);
+			if (len_p > 0) {
+				from_p_uart = true;
+				uart_dma_rx_consume(&rx_dma_p, len_p);
+				packet_process_bytes(data_p, len_p, PACKET_HANDLER_P);
+				rx = true;
+			}
+#else
 			msg_t res = sdGetTimeout(&HW_UART_P_DEV, TIME_IMMEDIATE);
 			if (res != MSG_TIMEOUT) {
 				from_p_uart = true;
@@ -249,6 +374,14 @@ static THD_FUNCTION(packet_process_thread, arg) {
 				rx = true;
 			}
 #endif
+#endif
+
+			// With a continuous stream of input this loop does not end, so
+			// the replies cannot wait for that
+			flush_packets(false);
 		}
+
+		// Send the replies to everything that was just decoded together
+		flush_packets(true);
 	}
 }
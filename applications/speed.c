@@ -500,6 +500,7 @@ static THD_FUNCTION(motor_ready_thread, arg) // @suppress("No return")
     // read the motor current, and see if the blades are unobstructed and the scooter is in water
     float motor_amps = 0.0;
     float filtered;
+    mc_snapshot snapshot;
     LPF_CONTEXT lpfy;
     lpf_init (&lpfy, settings->f_alpha, 0.0);
 
@@ -527,7 +528,8 @@ static THD_FUNCTION(motor_ready_thread, arg) // @suppress("No return")
             break;
 
         case TIMER_EXPIRY:
-            motor_amps = mc_interface_get_tot_current_filtered ();
+            mc_interface_get_snapshot (&snapshot);
+            motor_amps = snapshot.current_filtered;
             filtered = lpf_sample (&lpfy, motor_amps);
 
             if (filtered < settings->guard_high)
@@ -45,6 +45,23 @@ void buffer_append_uint32(uint8_t* buffer, uint32_t number, int32_t *index) {
 	buffer[(*index)++] = number;
 }
 
+/*
+ * Variable length integers: 7 bits per byte, least significant group first,
+ * with the top bit set on all bytes but the last. Signed numbers are zigzag
+ * encoded first so that small negative numbers also become short.
+ */
+void buffer_append_var_uint32(uint8_t* buffer, uint32_t number, int32_t *index) {
+	while (number >= 0x80) {
+		buffer[(*index)++] = (number & 0x7F) | 0x80;
+		number >>= 7;
+	}
+	buffer[(*index)++] = number;
+}
+
+void buffer_append_var_int32(uint8_t* buffer, int32_t number, int32_t *index) {
+	buffer_append_var_uint32(buffer, ((uint32_t)number << 1) ^ (uint32_t)(number >> 31), index);
+}
+
 void buffer_append_float16(uint8_t* buffer, float number, float scale, int32_t *index) {
     buffer_append_int16(buffer, (int16_t)(number * scale), index);
 }
@@ -144,6 +161,25 @@ uint32_t buffer_get_uint32(const uint8_t *buffer, int32_t *index) {
 	return res;
 }
 
+uint32_t buffer_get_var_uint32(const uint8_t *buffer, int32_t *index) {
+	uint32_t res = 0;
+	int shift = 0;
+	uint8_t b;
+
+	do {
+		b = buffer[(*index)++];
+		res |= (uint32_t)(b & 0x7F) << shift;
+		shift += 7;
+	} while ((b & 0x80) && shift < 35);
+
+	return res;
+}
+
+int32_t buffer_get_var_int32(const uint8_t *buffer, int32_t *index) {
+	uint32_t res = buffer_get_var_uint32(buffer, index);
+	return (int32_t)(res >> 1) ^ -(int32_t)(res & 1);
+}
+
 float buffer_get_float16(const uint8_t *buffer, float scale, int32_t *index) {
     return (float)buffer_get_int16(buffer, index) / scale;
 }
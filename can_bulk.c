@@ -0,0 +1,487 @@
+/*
+	Copyright 2026 agent	agent@local
+
+	This file is part of the VESC firmware.
+
+	The VESC firmware is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    The VESC firmware is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+#include <string.h>
+#include "can_bulk.h"
+#include "crc.h"
+
+#if CAN_BULK_MAX_FRAMES > 256
+#error "CAN_BULK_MAX_LEN does not fit the 8 bit frame index"
+#endif
+
+#if CAN_BULK_WINDOW_FRAMES > 16
+#error "CAN_BULK_WINDOW_FRAMES does not fit the missing frames field of the ack"
+#endif
+
+#if CAN_BULK_MAX_WINDOWS > 32
+#error "Too many windows for CAN_BULK_MAX_LEN"
+#endif
+
+// Private functions
+static unsigned int window_bytes(unsigned int len, int window);
+static uint16_t window_mask(int frames, int window);
+static void tx_send_data(can_bulk_tx *tx, int frame);
+static void tx_send_end(can_bulk_tx *tx, int window);
+static void tx_send_window(can_bulk_tx *tx, int window, uint16_t frames);
+static void tx_fill(can_bulk_tx *tx);
+static void tx_restart(can_bulk_tx *tx);
+static void rx_send_ack(can_bulk_send_func send, uint8_t own_id, uint8_t sender,
+		uint8_t transfer_id, uint8_t nonce, int window, CAN_BULK_ACK status, uint16_t missing);
+
+/**
+ * Start sending a buffer. The first windows are sent right away, after that
+ * can_bulk_tx_ack has to be called for every ack from the receiver and
+ * can_bulk_tx_timeout when no ack came in time, until tx->state is no longer
+ * CAN_BULK_TX_BUSY.
+ *
+ * @param tx
+ * Transfer state.
+ *
+ * @param send
+ * Function to transmit a frame.
+ *
+ * @param own_id
+ * ID of this node, used by the receiver to address its acks.
+ *
+ * @param dest
+ * ID of the receiver.
+ *
+ * @param transfer_id
+ * Should be different for consecutive transfers, so that old acks are ignored.
+ *
+ * @param nonce
+ * Chosen at boot, so that the receiver can tell a transfer after a reboot
+ * from an earlier one with the same transfer id.
+ *
+ * @param mode
+ * What the receiver does with the buffer, same as the send argument of
+ * comm_can_send_buffer.
+ *
+ * @param data
+ * The buffer, has to stay valid during the transfer.
+ *
+ * @param len
+ * Length of the buffer, at most CAN_BULK_MAX_LEN.
+ */
+void can_bulk_tx_start(can_bulk_tx *tx, can_bulk_send_func send, uint8_t own_id, uint8_t dest,
+		uint8_t transfer_id, uint8_t nonce, uint8_t mode, const uint8_t *data, unsigned int len) {
+	memset(tx, 0, sizeof(can_bulk_tx));
+	tx->send = send;
+	tx->data = data;
+	tx->len = len;
+	tx->own_id = own_id;
+	tx->dest = dest;
+	tx->transfer_id = transfer_id;
+	tx->nonce = nonce;
+	tx->mode = mode;
+	tx->frames = (len + CAN_BULK_FRAME_BYTES - 1) / CAN_BULK_FRAME_BYTES;
+	tx->windows = (tx->frames + CAN_BULK_WINDOW_FRAMES - 1) / CAN_BULK_WINDOW_FRAMES;
+
+	if (len == 0 || len > CAN_BULK_MAX_LEN) {
+		tx->state = CAN_BULK_TX_FAILED;
+		return;
+	}
+
+	tx_restart(tx);
+}
+
+/**
+ * Handle an ack frame from the receiver.
+ *
+ * @param tx
+ * Transfer state.
+ *
+ * @param data8
+ * Payload of the CAN_PACKET_BULK_ACK frame.
+ *
+ * @param len
+ * Length of the payload.
+ */
+void can_bulk_tx_ack(can_bulk_tx *tx, const uint8_t *data8, int len) {
+	if (len < 7 || tx->state != CAN_BULK_TX_BUSY ||
+			data8[0] != tx->dest || data8[1] != tx->transfer_id || data8[6] != tx->nonce) {
+		return;
+	}
+
+	int window = data8[2];
+	CAN_BULK_ACK status = data8[3];
+	uint16_t missing = (uint16_t)data8[4] << 8 | data8[5];
+
+	tx->acks++;
+
+	// Acks come in window order, so an older window without ack lost its end
+	// frame or the ack for it. Ask again right away instead of waiting for the
+	// timeout.
+	if (status == CAN_BULK_ACK_OK || status == CAN_BULK_ACK_MISSING) {
+		for (int i = tx->base;i < window && i < tx->next;i++) {
+			if (!(tx->acked & (1 << i))) {
+				tx_send_end(tx, i);
+			}
+		}
+	}
+
+	switch (status) {
+	case CAN_BULK_ACK_OK:
+	case CAN_BULK_ACK_DONE:
+		tx->retries = 0;
+		if (window >= tx->base && window < tx->next) {
+			tx->acked |= 1 << window;
+			while (tx->base < tx->next && (tx->acked & (1 << tx->base))) {
+				tx->base++;
+			}
+
+			if (tx->base == tx->windows) {
+				tx->state = CAN_BULK_TX_DONE;
+			} else {
+				tx_fill(tx);
+			}
+		}
+		break;
+
+	case CAN_BULK_ACK_MISSING:
+		tx->retries = 0;
+		if (window >= tx->base && window < tx->next && !(tx->acked & (1 << window))) {
+			missing &= window_mask(tx->frames, window);
+			for (int i = 0;i < CAN_BULK_WINDOW_FRAMES;i++) {
+				if (missing & (1 << i)) {
+					tx->frames_resent++;
+				}
+			}
+			tx_send_window(tx, window, missing);
+		}
+		break;
+
+	case CAN_BULK_ACK_NO_TRANSFER:
+		// The receiver lost the start frame or was reset
+		if (++tx->retries > CAN_BULK_MAX_RETRIES) {
+			tx->state = CAN_BULK_TX_FAILED;
+		} else {
+			tx_restart(tx);
+		}
+		break;
+
+	default:
+		tx->state = CAN_BULK_TX_FAILED;
+		break;
+	}
+}
+
+/**
+ * Call when no ack was received for a while. The end frames of all windows
+ * that are not acknowledged yet are sent again, so that the receiver reports
+ * what is missing.
+ *
+ * @param tx
+ * Transfer state.
+ */
+void can_bulk_tx_timeout(can_bulk_tx *tx) {
+	if (tx->state != CAN_BULK_TX_BUSY) {
+		return;
+	}
+
+	tx->timeouts++;
+
+	if (++tx->retries > CAN_BULK_MAX_RETRIES) {
+		tx->state = CAN_BULK_TX_FAILED;
+		return;
+	}
+
+	for (int i = tx->base;i < tx->next;i++) {
+		if (!(tx->acked & (1 << i))) {
+			tx_send_end(tx, i);
+		}
+	}
+}
+
+/**
+ * Initialize the receiver state.
+ *
+ * @param rx
+ * Receiver state.
+ *
+ * @param buffer
+ * Buffer for the received data, at least CAN_BULK_MAX_LEN bytes.
+ */
+void can_bulk_rx_init(can_bulk_rx *rx, uint8_t *buffer) {
+	memset(rx, 0, sizeof(can_bulk_rx));
+	rx->buffer = buffer;
+}
+
+/**
+ * Handle a CAN_PACKET_BULK_START frame.
+ */
+void can_bulk_rx_start(can_bulk_rx *rx, const uint8_t *data8, int len) {
+	if (len < 8) {
+		return;
+	}
+
+	unsigned int data_len = (unsigned int)data8[3] << 8 | data8[4];
+
+	// The sender restarts when a window end is answered with
+	// CAN_BULK_ACK_NO_TRANSFER. Once per answer, so a restart of a transfer
+	// that is already running must not throw away what was received. A
+	// finished transfer stays active to answer late window ends, but the
+	// same ids after it start a new transfer.
+	if (rx->active && !rx->done && rx->sender == data8[0] &&
+			rx->transfer_id == data8[1] && rx->nonce == data8[7]) {
+		return;
+	}
+
+	rx->active = false;
+	if (data_len == 0 || data_len > CAN_BULK_MAX_LEN) {
+		return;
+	}
+
+	rx->done = false;
+	rx->sender = data8[0];
+	rx->transfer_id = data8[1];
+	rx->nonce = data8[7];
+	rx->mode = data8[2];
+	rx->len = data_len;
+	rx->crc = (uint16_t)data8[5] << 8 | data8[6];
+	rx->frames = (data_len + CAN_BULK_FRAME_BYTES - 1) / CAN_BULK_FRAME_BYTES;
+	rx->windows = (rx->frames + CAN_BULK_WINDOW_FRAMES - 1) / CAN_BULK_WINDOW_FRAMES;
+	rx->verified = 0;
+	memset(rx->received, 0, sizeof(rx->received));
+	rx->active = true;
+}
+
+/**
+ * Handle a CAN_PACKET_BULK_DATA frame.
+ */
+void can_bulk_rx_data(can_bulk_rx *rx, const uint8_t *data8, int len) {
+	if (!rx->active || rx->done || len < 2) {
+		return;
+	}
+
+	int frame = data8[0];
+	if (frame >= rx->frames) {
+		return;
+	}
+
+	unsigned int ofs = frame * CAN_BULK_FRAME_BYTES;
+	unsigned int bytes = rx->len - ofs;
+	if (bytes > CAN_BULK_FRAME_BYTES) {
+		bytes = CAN_BULK_FRAME_BYTES;
+	}
+
+	if ((unsigned int)len != bytes + 1) {
+		return;
+	}
+
+	memcpy(rx->buffer + ofs, data8 + 1, bytes);
+	rx->received[frame / 8] |= 1 << (frame % 8);
+}
+
+/**
+ * Handle a CAN_PACKET_BULK_END frame and send the ack for the window.
+ *
+ * @param rx
+ * Receiver state.
+ *
+ * @param send
+ * Function to transmit the ack.
+ *
+ * @param own_id
+ * ID of this node.
+ *
+ * @param data8
+ * Payload of the frame.
+ *
+ * @param len
+ * Length of the payload.
+ *
+ * @return
+ * True when this completed the transfer and the whole buffer passed the CRC
+ * check. It is then in rx->buffer and should be processed according to rx->mode.
+ */
+bool can_bulk_rx_end(can_bulk_rx *rx, can_bulk_send_func send, uint8_t own_id,
+		const uint8_t *data8, int len) {
+	if (len < 6) {
+		return false;
+	}
+
+	uint8_t sender = data8[0];
+	uint8_t transfer_id = data8[1];
+	int window = data8[2];
+	uint16_t crc = (uint16_t)data8[3] << 8 | data8[4];
+	uint8_t nonce = data8[5];
+
+	if (!rx->active || sender != rx->sender || transfer_id != rx->transfer_id || nonce != rx->nonce) {
+		rx_send_ack(send, own_id, sender, transfer_id, nonce, window, CAN_BULK_ACK_NO_TRANSFER, 0);
+		return false;
+	}
+
+	if (window >= rx->windows) {
+		return false;
+	}
+
+	if (rx->done) {
+		rx_send_ack(send, own_id, sender, transfer_id, nonce, window, CAN_BULK_ACK_DONE, 0);
+		return false;
+	}
+
+	int first = window * CAN_BULK_WINDOW_FRAMES;
+	uint16_t mask = window_mask(rx->frames, window);
+	uint16_t missing = 0;
+
+	for (int i = 0;i < CAN_BULK_WINDOW_FRAMES;i++) {
+		int frame = first + i;
+		if ((mask & (1 << i)) && !(rx->received[frame / 8] & (1 << (frame % 8)))) {
+			missing |= 1 << i;
+		}
+	}
+
+	if (missing == 0) {
+		unsigned int ofs = first * CAN_BULK_FRAME_BYTES;
+		if (crc16(rx->buffer + ofs, window_bytes(rx->len, window)) != crc) {
+			// Received, but corrupted. Start over with this window.
+			for (int i = 0;i < CAN_BULK_WINDOW_FRAMES;i++) {
+				int frame = first + i;
+				rx->received[frame / 8] &= ~(1 << (frame % 8));
+			}
+			missing = mask;
+		}
+	}
+
+	if (missing) {
+		rx_send_ack(send, own_id, sender, transfer_id, nonce, window, CAN_BULK_ACK_MISSING, missing);
+		return false;
+	}
+
+	rx->verified |= 1 << window;
+
+	if (rx->verified != (uint32_t)((1ULL << rx->windows) - 1)) {
+		rx_send_ack(send, own_id, sender, transfer_id, nonce, window, CAN_BULK_ACK_OK, 0);
+		return false;
+	}
+
+	if (crc16(rx->buffer, rx->len) != rx->crc) {
+		rx->active = false;
+		rx_send_ack(send, own_id, sender, transfer_id, nonce, window, CAN_BULK_ACK_CRC_FAIL, 0);
+		return false;
+	}
+
+	rx->done = true;
+	rx_send_ack(send, own_id, sender, transfer_id, nonce, window, CAN_BULK_ACK_DONE, 0);
+	return true;
+}
+
+static unsigned int window_bytes(unsigned int len, int window) {
+	unsigned int ofs = window * CAN_BULK_WINDOW_FRAMES * CAN_BULK_FRAME_BYTES;
+	unsigned int bytes = len - ofs;
+
+	if (bytes > CAN_BULK_WINDOW_FRAMES * CAN_BULK_FRAME_BYTES) {
+		bytes = CAN_BULK_WINDOW_FRAMES * CAN_BULK_FRAME_BYTES;
+	}
+
+	return bytes;
+}
+
+static uint16_t window_mask(int frames, int window) {
+	int num = frames - window * CAN_BULK_WINDOW_FRAMES;
+
+	if (num >= CAN_BULK_WINDOW_FRAMES) {
+		return (uint16_t)((1UL << CAN_BULK_WINDOW_FRAMES) - 1);
+	}
+
+	return (uint16_t)((1UL << num) - 1);
+}
+
+static void tx_send_data(can_bulk_tx *tx, int frame) {
+	uint8_t buffer[8];
+	unsigned int ofs = frame * CAN_BULK_FRAME_BYTES;
+	unsigned int bytes = tx->len - ofs;
+
+	if (bytes > CAN_BULK_FRAME_BYTES) {
+		bytes = CAN_BULK_FRAME_BYTES;
+	}
+
+	buffer[0] = frame;
+	memcpy(buffer + 1, tx->data + ofs, bytes);
+	tx->send(tx->dest, CAN_PACKET_BULK_DATA, buffer, bytes + 1);
+	tx->frames_sent++;
+}
+
+static void tx_send_end(can_bulk_tx *tx, int window) {
+	uint8_t buffer[6];
+	unsigned int ofs = window * CAN_BULK_WINDOW_FRAMES * CAN_BULK_FRAME_BYTES;
+	uint16_t crc = crc16((unsigned char*)tx->data + ofs, window_bytes(tx->len, window));
+
+	buffer[0] = tx->own_id;
+	buffer[1] = tx->transfer_id;
+	buffer[2] = window;
+	buffer[3] = crc >> 8;
+	buffer[4] = crc & 0xFF;
+	buffer[5] = tx->nonce;
+	tx->send(tx->dest, CAN_PACKET_BULK_END, buffer, 6);
+}
+
+static void tx_send_window(can_bulk_tx *tx, int window, uint16_t frames) {
+	int first = window * CAN_BULK_WINDOW_FRAMES;
+
+	for (int i = 0;i < CAN_BULK_WINDOW_FRAMES;i++) {
+		if (frames & (1 << i)) {
+			tx_send_data(tx, first + i);
+		}
+	}
+
+	tx_send_end(tx, window);
+}
+
+static void tx_fill(can_bulk_tx *tx) {
+	while (tx->next < tx->windows && (tx->next - tx->base) < CAN_BULK_WINDOWS_IN_FLIGHT) {
+		tx_send_window(tx, tx->next, window_mask(tx->frames, tx->next));
+		tx->next++;
+	}
+}
+
+static void tx_restart(can_bulk_tx *tx) {
+	uint8_t buffer[8];
+	uint16_t crc = crc16((unsigned char*)tx->data, tx->len);
+
+	buffer[0] = tx->own_id;
+	buffer[1] = tx->transfer_id;
+	buffer[2] = tx->mode;
+	buffer[3] = tx->len >> 8;
+	buffer[4] = tx->len & 0xFF;
+	buffer[5] = crc >> 8;
+	buffer[6] = crc & 0xFF;
+	buffer[7] = tx->nonce;
+	tx->send(tx->dest, CAN_PACKET_BULK_START, buffer, 8);
+
+	tx->base = 0;
+	tx->next = 0;
+	tx->acked = 0;
+	tx_fill(tx);
+}
+
+static void rx_send_ack(can_bulk_send_func send, uint8_t own_id, uint8_t sender,
+		uint8_t transfer_id, uint8_t nonce, int window, CAN_BULK_ACK status, uint16_t missing) {
+	uint8_t buffer[7];
+
+	buffer[0] = own_id;
+	buffer[1] = transfer_id;
+	buffer[2] = window;
+	buffer[3] = status;
+	buffer[4] = missing >> 8;
+	buffer[5] = missing & 0xFF;
+	buffer[6] = nonce;
+	send(sender, CAN_PACKET_BULK_ACK, buffer, 7);
+}
@@ -0,0 +1,140 @@
+/*
+	Copyright 2026 agent	agent@local
+
+	This file is part of the VESC firmware.
+
+	The VESC firmware is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    The VESC firmware is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+#ifndef CAN_BULK_H_
+#define CAN_BULK_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "datatypes.h"
+#include "packet.h"
+
+/*
+ * Windowed transfer of a buffer to one node, as an alternative to the
+ * FILL_RX_BUFFER frames followed by PROCESS_RX_BUFFER. The data is sent in
+ * windows of CAN_BULK_WINDOW_FRAMES frames and the receiver acknowledges every
+ * window after checking its CRC, so that only lost frames have to be sent
+ * again. Up to CAN_BULK_WINDOWS_IN_FLIGHT windows are sent before waiting for
+ * the oldest acknowledgement.
+ *
+ * Start: sender id, transfer id, send mode, length (uint16), CRC (uint16), nonce
+ * Data: frame index, up to 7 bytes
+ * End: sender id, transfer id, window, CRC of the window (uint16), nonce
+ * Ack: receiver id, transfer id, window, CAN_BULK_ACK, missing frames (uint16), nonce
+ *
+ * The transfer id wraps and starts over when the sender reboots, so the
+ * sender also picks a nonce at boot. A transfer is identified by the sender
+ * id, the transfer id and the nonce.
+ *
+ * Nodes that support it set CAN_BULK_CAP_WINDOWED in a second byte of their
+ * PONG, old nodes only send their id.
+ */
+
+// Settings
+#ifndef CAN_BULK_MAX_LEN
+#define CAN_BULK_MAX_LEN				PACKET_MAX_PL_LEN
+#endif
+
+#ifndef CAN_BULK_WINDOW_FRAMES
+#define CAN_BULK_WINDOW_FRAMES			16
+#endif
+
+#ifndef CAN_BULK_WINDOWS_IN_FLIGHT
+#define CAN_BULK_WINDOWS_IN_FLIGHT		2
+#endif
+
+// Timeouts or restarts in a row before giving up
+#ifndef CAN_BULK_MAX_RETRIES
+#define CAN_BULK_MAX_RETRIES			5
+#endif
+
+// Constants
+#define CAN_BULK_CAP_WINDOWED			0x01
+#define CAN_BULK_FRAME_BYTES			7
+#define CAN_BULK_MAX_FRAMES				((CAN_BULK_MAX_LEN + CAN_BULK_FRAME_BYTES - 1) / CAN_BULK_FRAME_BYTES)
+#define CAN_BULK_MAX_WINDOWS			((CAN_BULK_MAX_FRAMES + CAN_BULK_WINDOW_FRAMES - 1) / CAN_BULK_WINDOW_FRAMES)
+
+typedef enum {
+	CAN_BULK_ACK_OK = 0,
+	CAN_BULK_ACK_MISSING,
+	CAN_BULK_ACK_NO_TRANSFER,
+	CAN_BULK_ACK_DONE,
+	CAN_BULK_ACK_CRC_FAIL
+} CAN_BULK_ACK;
+
+typedef enum {
+	CAN_BULK_TX_BUSY = 0,
+	CAN_BULK_TX_DONE,
+	CAN_BULK_TX_FAILED
+} CAN_BULK_TX_STATE;
+
+typedef void (*can_bulk_send_func)(uint8_t id, CAN_PACKET_ID cmd, const uint8_t *data, uint8_t len);
+
+typedef struct {
+	can_bulk_send_func send;
+	const uint8_t *data;
+	unsigned int len;
+	uint8_t own_id;
+	uint8_t dest;
+	uint8_t transfer_id;
+	uint8_t nonce;
+	uint8_t mode;
+	int frames;
+	int windows;
+	// Oldest window that is not acknowledged and next window to send
+	int base;
+	int next;
+	uint32_t acked;
+	int retries;
+	CAN_BULK_TX_STATE state;
+	// Statistics
+	int acks;
+	int frames_sent;
+	int frames_resent;
+	int timeouts;
+} can_bulk_tx;
+
+typedef struct {
+	uint8_t *buffer;
+	bool active;
+	bool done;
+	uint8_t sender;
+	uint8_t transfer_id;
+	uint8_t nonce;
+	uint8_t mode;
+	unsigned int len;
+	uint16_t crc;
+	int frames;
+	int windows;
+	uint32_t verified;
+	uint8_t received[(CAN_BULK_MAX_FRAMES + 7) / 8];
+} can_bulk_rx;
+
+// Functions
+void can_bulk_tx_start(can_bulk_tx *tx, can_bulk_send_func send, uint8_t own_id, uint8_t dest,
+		uint8_t transfer_id, uint8_t nonce, uint8_t mode, const uint8_t *data, unsigned int len);
+void can_bulk_tx_ack(can_bulk_tx *tx, const uint8_t *data8, int len);
+void can_bulk_tx_timeout(can_bulk_tx *tx);
+void can_bulk_rx_init(can_bulk_rx *rx, uint8_t *buffer);
+void can_bulk_rx_start(can_bulk_rx *rx, const uint8_t *data8, int len);
+void can_bulk_rx_data(can_bulk_rx *rx, const uint8_t *data8, int len);
+bool can_bulk_rx_end(can_bulk_rx *rx, can_bulk_send_func send, uint8_t own_id,
+		const uint8_t *data8, int len);
+
+#endif /* CAN_BULK_H_ */
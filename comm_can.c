@@ -37,10 +37,35 @@
 #include "utils.h"
 #include "mempools.h"
 #include "shutdown.h"
+#include "can_bulk.h"
+#include "timer.h"
 
 // Settings
-#define RX_FRAMES_SIZE	100
+#define RX_FRAMES_SIZE	128 // Must be a power of two
 #define RX_BUFFER_SIZE	PACKET_MAX_PL_LEN
+#define BULK_ACK_QUEUE_LEN	8 // Must be a power of two
+#define BULK_ACK_TIMEOUT_MS	10
+#define BULK_PROBE_RETRY_MS	1000
+
+#ifdef HW_HAS_DUAL_MOTORS
+#define STATUS_MOTORS		2
+#else
+#define STATUS_MOTORS		1
+#endif
+
+// Private types
+typedef struct {
+	CAN_PACKET_ID cmd;
+	int fields;
+	uint8_t size[4];
+	int32_t deadband[4]; // In the units of the encoded fields
+} status_msg_def;
+
+typedef struct {
+	bool valid;
+	systime_t time;
+	int32_t last[4];
+} status_tx_state;
 
 #if CAN_ENABLE
 // Threads
@@ -57,22 +82,74 @@ static THD_WORKING_AREA(cancom_status_internal_thread_wa, 512);
 #endif
 
 static mutex_t can_mtx;
-static mutex_t can_rx_mtx;
 static uint8_t rx_buffer[RX_BUFFER_SIZE];
 static unsigned int rx_buffer_last_id;
+
+// Single producer (read thread), single consumer (process or UAVCAN thread)
+// ring. The indexes run freely and are only masked when accessing the ring.
 static CANRxFrame rx_frames[RX_FRAMES_SIZE];
-static int rx_frame_read;
-static int rx_frame_write;
+static CANRxFrame rx_frame_overflow;
+static volatile unsigned int rx_frame_read;
+static volatile unsigned int rx_frame_write;
+static volatile uint32_t rx_frames_received;
+static volatile uint32_t rx_frames_dropped;
 static thread_t *process_tp = 0;
 static thread_t *ping_tp = 0;
+
+// Windowed transfers. Nodes that answered a ping are marked in bulk_probed and
+// the ones that support windowed transfers also in bulk_supported. Every ping
+// without answer blocks the sender for the ping timeout, so nodes that did
+// not answer are marked in bulk_no_answer and are not pinged again until
+// BULK_PROBE_RETRY_MS after the last ping that was not answered.
+static mutex_t can_bulk_mtx;
+static can_bulk_tx bulk_tx;
+static can_bulk_rx bulk_rx;
+static uint8_t bulk_transfer_id = 0;
+static uint8_t bulk_nonce = 0;
+static bool bulk_nonce_set = false;
+static uint32_t bulk_probed[8];
+static uint32_t bulk_supported[8];
+static uint32_t bulk_no_answer[8];
+static systime_t bulk_no_answer_time = 0;
+static uint8_t bulk_ack_queue[BULK_ACK_QUEUE_LEN][7];
+static volatile unsigned int bulk_ack_read;
+static volatile unsigned int bulk_ack_write;
+static thread_t *bulk_tp = 0;
+
+// Status messages. Each message is encoded from up to four integer fields, so
+// that the adaptive mode compares exactly what the receivers would see.
+static const status_msg_def status_defs[CAN_STATUS_MSG_NUM] = {
+		{CAN_PACKET_STATUS, 3, {4, 2, 2}, {
+				(int32_t)(COMM_CAN_STATUS_DB_RPM),
+				(int32_t)(COMM_CAN_STATUS_DB_CURRENT * 1e1),
+				(int32_t)(COMM_CAN_STATUS_DB_DUTY * 1e3)}},
+		{CAN_PACKET_STATUS_2, 2, {4, 4}, {
+				(int32_t)(COMM_CAN_STATUS_DB_AH * 1e4),
+				(int32_t)(COMM_CAN_STATUS_DB_AH * 1e4)}},
+		{CAN_PACKET_STATUS_3, 2, {4, 4}, {
+				(int32_t)(COMM_CAN_STATUS_DB_WH * 1e4),
+				(int32_t)(COMM_CAN_STATUS_DB_WH * 1e4)}},
+		{CAN_PACKET_STATUS_4, 4, {2, 2, 2, 2}, {
+				(int32_t)(COMM_CAN_STATUS_DB_TEMP * 1e1),
+				(int32_t)(COMM_CAN_STATUS_DB_TEMP * 1e1),
+				(int32_t)(COMM_CAN_STATUS_DB_CURRENT * 1e1),
+				(int32_t)(COMM_CAN_STATUS_DB_POS * 50.0)}},
+		{CAN_PACKET_STATUS_5, 3, {4, 2, 2}, {
+				(int32_t)(COMM_CAN_STATUS_DB_TACHO),
+				(int32_t)(COMM_CAN_STATUS_DB_V_IN * 1e1),
+				0}},
+};
+
+static volatile bool status_adaptive = COMM_CAN_STATUS_ADAPTIVE;
+static volatile systime_t status_heartbeat = MS2ST(COMM_CAN_STATUS_HEARTBEAT_MS);
+static status_tx_state status_tx[STATUS_MOTORS][CAN_STATUS_MSG_NUM];
+static can_status_tx_stats status_stats[CAN_STATUS_MSG_NUM];
+static systime_t status_stats_start;
 #endif
 
 // Variables
-static can_status_msg stat_msgs[CAN_STATUS_MSGS_TO_STORE];
-static can_status_msg_2 stat_msgs_2[CAN_STATUS_MSGS_TO_STORE];
-static can_status_msg_3 stat_msgs_3[CAN_STATUS_MSGS_TO_STORE];
-static can_status_msg_4 stat_msgs_4[CAN_STATUS_MSGS_TO_STORE];
-static can_status_msg_5 stat_msgs_5[CAN_STATUS_MSGS_TO_STORE];
+static can_status_node stat_nodes[CAN_STATUS_MSGS_TO_STORE];
+static uint8_t stat_node_index[256]; // Controller ID to stat_nodes index, 0xFF for none
 static unsigned int detect_all_foc_res_index = 0;
 static int8_t detect_all_foc_res[50];
 
@@ -89,14 +166,19 @@ static CANConfig cancfg = {
 
 // Private functions
 static void set_timing(int brp, int ts1, int ts2);
+static void status_node_reset(can_status_node *node, int id);
 #if CAN_ENABLE
 static void send_packet_wrapper(unsigned char *data, unsigned int len);
+static void process_rx_buffer(uint8_t commands_send, unsigned int len);
+static bool send_buffer_bulk(uint8_t controller_id, uint8_t *data, unsigned int len, uint8_t send);
+static void bulk_send(uint8_t id, CAN_PACKET_ID cmd, const uint8_t *data, uint8_t len);
 static void decode_msg(uint32_t eid, uint8_t *data8, int len, bool is_replaced);
-static void send_status1(uint8_t id, bool replace);
-static void send_status2(uint8_t id, bool replace);
-static void send_status3(uint8_t id, bool replace);
-static void send_status4(uint8_t id, bool replace);
-static void send_status5(uint8_t id, bool replace);
+static can_status_node *status_node_get(uint8_t id);
+static void status_node_rx(can_status_node *node, int msg, int *msg_id, systime_t *msg_rx_time);
+static void status_fields(int msg, const mc_snapshot *s, int32_t *fields);
+static void send_status(uint8_t id, int msg, const int32_t *fields, bool replace);
+static void send_status_cycle(uint8_t id, status_tx_state *state, const mc_snapshot *s,
+		int msgs, systime_t now, systime_t period);
 #endif
 
 // Function pointers
@@ -104,19 +186,21 @@ static void(*sid_callback)(uint32_t id, uint8_t *data, uint8_t len) = 0;
 static void(*eid_callback)(uint32_t id, uint8_t *data, uint8_t len) = 0;
 
 void comm_can_init(void) {
+	memset(stat_node_index, 0xFF, sizeof(stat_node_index));
 	for (int i = 0;i < CAN_STATUS_MSGS_TO_STORE;i++) {
-		stat_msgs[i].id = -1;
-		stat_msgs_2[i].id = -1;
-		stat_msgs_3[i].id = -1;
-		stat_msgs_4[i].id = -1;
+		status_node_reset(&stat_nodes[i], -1);
 	}
 
 #if CAN_ENABLE
 	rx_frame_read = 0;
 	rx_frame_write = 0;
+	rx_frames_received = 0;
+	rx_frames_dropped = 0;
+	comm_can_reset_status_tx_stats();
 
 	chMtxObjectInit(&can_mtx);
-	chMtxObjectInit(&can_rx_mtx);
+	chMtxObjectInit(&can_bulk_mtx);
+	can_bulk_rx_init(&bulk_rx, rx_buffer);
 
 	palSetPadMode(HW_CANRX_PORT, HW_CANRX_PIN,
 			PAL_MODE_ALTERNATE(HW_CAN_GPIO_AF) |
@@ -145,6 +229,29 @@ void comm_can_init(void) {
 #endif
 }
 
+/**
+ * Get the bit rate for a CAN_BAUD setting.
+ *
+ * @param baud
+ * The setting.
+ *
+ * @return
+ * The bit rate in bits per second, 0 for unknown settings.
+ */
+uint32_t comm_can_baud_rate(CAN_BAUD baud) {
+	switch (baud) {
+	case CAN_BAUD_125K:	return 125000;
+	case CAN_BAUD_250K:	return 250000;
+	case CAN_BAUD_500K:	return 500000;
+	case CAN_BAUD_1M:	return 1000000;
+	case CAN_BAUD_10K:	return 10000;
+	case CAN_BAUD_20K:	return 20000;
+	case CAN_BAUD_50K:	return 50000;
+	case CAN_BAUD_75K:	return 75000;
+	default: return 0;
+	}
+}
+
 void comm_can_set_baud(CAN_BAUD baud) {
 	switch (baud) {
 	case CAN_BAUD_125K:	set_timing(15, 14, 4); break;
@@ -284,6 +391,12 @@ void comm_can_set_eid_rx_callback(void (*p_func)(uint32_t id, uint8_t *data, uin
 void comm_can_send_buffer(uint8_t controller_id, uint8_t *data, unsigned int len, uint8_t send) {
 	uint8_t send_buffer[8];
 
+#if CAN_ENABLE
+	if (len > 6 && send_buffer_bulk(controller_id, data, len, send)) {
+		return;
+	}
+#endif
+
 	if (len <= 6) {
 		uint32_t ind = 0;
 		send_buffer[ind++] = app_get_configuration()->controller_id;
@@ -635,8 +748,8 @@ void comm_can_shutdown(uint8_t controller_id) {
  * The message or 0 for an invalid index.
  */
 can_status_msg *comm_can_get_status_msg_index(int index) {
-	if (index < CAN_STATUS_MSGS_TO_STORE) {
-		return &stat_msgs[index];
+	if (index >= 0 && index < CAN_STATUS_MSGS_TO_STORE) {
+		return &stat_nodes[index].msg;
 	} else {
 		return 0;
 	}
@@ -652,10 +765,9 @@ can_status_msg *comm_can_get_status_msg_index(int index) {
  * The message or 0 for an invalid id.
  */
 can_status_msg *comm_can_get_status_msg_id(int id) {
-	for (int i = 0;i < CAN_STATUS_MSGS_TO_STORE;i++) {
-		if (stat_msgs[i].id == id) {
-			return &stat_msgs[i];
-		}
+	can_status_node *node = comm_can_get_status_node_id(id);
+	if (node && node->msg.id >= 0) {
+		return &node->msg;
 	}
 
 	return 0;
@@ -671,8 +783,8 @@ can_status_msg *comm_can_get_status_msg_id(int id) {
  * The message or 0 for an invalid index.
  */
 can_status_msg_2 *comm_can_get_status_msg_2_index(int index) {
-	if (index < CAN_STATUS_MSGS_TO_STORE) {
-		return &stat_msgs_2[index];
+	if (index >= 0 && index < CAN_STATUS_MSGS_TO_STORE) {
+		return &stat_nodes[index].msg_2;
 	} else {
 		return 0;
 	}
@@ -688,10 +800,9 @@ can_status_msg_2 *comm_can_get_status_msg_2_index(int index) {
  * The message or 0 for an invalid id.
  */
 can_status_msg_2 *comm_can_get_status_msg_2_id(int id) {
-	for (int i = 0;i < CAN_STATUS_MSGS_TO_STORE;i++) {
-		if (stat_msgs_2[i].id == id) {
-			return &stat_msgs_2[i];
-		}
+	can_status_node *node = comm_can_get_status_node_id(id);
+	if (node && node->msg_2.id >= 0) {
+		return &node->msg_2;
 	}
 
 	return 0;
@@ -707,8 +818,8 @@ can_status_msg_2 *comm_can_get_status_msg_2_id(int id) {
  * The message or 0 for an invalid index.
  */
 can_status_msg_3 *comm_can_get_status_msg_3_index(int index) {
-	if (index < CAN_STATUS_MSGS_TO_STORE) {
-		return &stat_msgs_3[index];
+	if (index >= 0 && index < CAN_STATUS_MSGS_TO_STORE) {
+		return &stat_nodes[index].msg_3;
 	} else {
 		return 0;
 	}
@@ -724,10 +835,9 @@ can_status_msg_3 *comm_can_get_status_msg_3_index(int index) {
  * The message or 0 for an invalid id.
  */
 can_status_msg_3 *comm_can_get_status_msg_3_id(int id) {
-	for (int i = 0;i < CAN_STATUS_MSGS_TO_STORE;i++) {
-		if (stat_msgs_3[i].id == id) {
-			return &stat_msgs_3[i];
-		}
+	can_status_node *node = comm_can_get_status_node_id(id);
+	if (node && node->msg_3.id >= 0) {
+		return &node->msg_3;
 	}
 
 	return 0;
@@ -743,8 +853,8 @@ can_status_msg_3 *comm_can_get_status_msg_3_id(int id) {
  * The message or 0 for an invalid index.
  */
 can_status_msg_4 *comm_can_get_status_msg_4_index(int index) {
-	if (index < CAN_STATUS_MSGS_TO_STORE) {
-		return &stat_msgs_4[index];
+	if (index >= 0 && index < CAN_STATUS_MSGS_TO_STORE) {
+		return &stat_nodes[index].msg_4;
 	} else {
 		return 0;
 	}
@@ -760,10 +870,9 @@ can_status_msg_4 *comm_can_get_status_msg_4_index(int index) {
  * The message or 0 for an invalid id.
  */
 can_status_msg_4 *comm_can_get_status_msg_4_id(int id) {
-	for (int i = 0;i < CAN_STATUS_MSGS_TO_STORE;i++) {
-		if (stat_msgs_4[i].id == id) {
-			return &stat_msgs_4[i];
-		}
+	can_status_node *node = comm_can_get_status_node_id(id);
+	if (node && node->msg_4.id >= 0) {
+		return &node->msg_4;
 	}
 
 	return 0;
@@ -779,8 +888,8 @@ can_status_msg_4 *comm_can_get_status_msg_4_id(int id) {
  * The message or 0 for an invalid index.
  */
 can_status_msg_5 *comm_can_get_status_msg_5_index(int index) {
-	if (index < CAN_STATUS_MSGS_TO_STORE) {
-		return &stat_msgs_5[index];
+	if (index >= 0 && index < CAN_STATUS_MSGS_TO_STORE) {
+		return &stat_nodes[index].msg_5;
 	} else {
 		return 0;
 	}
@@ -796,43 +905,207 @@ can_status_msg_5 *comm_can_get_status_msg_5_index(int index) {
  * The message or 0 for an invalid id.
  */
 can_status_msg_5 *comm_can_get_status_msg_5_id(int id) {
-	for (int i = 0;i < CAN_STATUS_MSGS_TO_STORE;i++) {
-		if (stat_msgs_5[i].id == id) {
-			return &stat_msgs_5[i];
-		}
+	can_status_node *node = comm_can_get_status_node_id(id);
+	if (node && node->msg_5.id >= 0) {
+		return &node->msg_5;
 	}
 
 	return 0;
 }
 
-CANRxFrame *comm_can_get_rx_frame(void) {
-#if CAN_ENABLE
-	chMtxLock(&can_rx_mtx);
-	if (rx_frame_read != rx_frame_write) {
-		CANRxFrame *res = &rx_frames[rx_frame_read++];
+/**
+ * Get all status messages of a node by index.
+ *
+ * The status getters return pointers into the status table, which is updated
+ * in place as frames arrive. An entry stays with its node until the node has
+ * been silent for CAN_STATUS_EVICT_MS, and can then be reset and given to
+ * another node. A pointer is therefore safe to use right after checking that
+ * the status is younger than CAN_STATUS_STALE_MS, as the callers do, but must
+ * not be kept across sleeps without checking the id and the age again.
+ *
+ * @param index
+ * Index in the array
+ *
+ * @return
+ * The node or 0 for an invalid index. Unused entries have the id -1.
+ */
+can_status_node *comm_can_get_status_node_index(int index) {
+	if (index >= 0 && index < CAN_STATUS_MSGS_TO_STORE) {
+		return &stat_nodes[index];
+	} else {
+		return 0;
+	}
+}
 
-		if (rx_frame_read == RX_FRAMES_SIZE) {
-			rx_frame_read = 0;
-		}
+/**
+ * Get all status messages of a node by id. This is a direct lookup. See
+ * comm_can_get_status_node_index for how long the pointer stays valid.
+ *
+ * @param id
+ * Id of the controller that sent the status messages.
+ *
+ * @return
+ * The node or 0 if no status has been received from it.
+ */
+can_status_node *comm_can_get_status_node_id(int id) {
+	if (id < 0 || id > 255) {
+		return 0;
+	}
 
-		chMtxUnlock(&can_rx_mtx);
-		return res;
-	} else {
-		chMtxUnlock(&can_rx_mtx);
+	uint8_t index = stat_node_index[id];
+	if (index >= CAN_STATUS_MSGS_TO_STORE) {
+		return 0;
+	}
+
+	can_status_node *node = &stat_nodes[index];
+	return node->id == id ? node : 0;
+}
+
+/**
+ * Get the oldest received CAN frame without removing it from the RX ring. The
+ * frame can be decoded in place and must be released with
+ * comm_can_rx_frame_release when done. Only one thread may consume frames.
+ *
+ * @return
+ * The frame or 0 if the ring is empty.
+ */
+CANRxFrame *comm_can_rx_frame_peek(void) {
+#if CAN_ENABLE
+	unsigned int read = rx_frame_read;
+
+	if (read == rx_frame_write) {
 		return 0;
 	}
+
+	// Do not read the frame before the write index that published it
+	__DMB();
+	return &rx_frames[read & (RX_FRAMES_SIZE - 1)];
 #else
 	return 0;
 #endif
 }
 
+/**
+ * Release the frame returned by comm_can_rx_frame_peek, so that its slot can
+ * be reused by the read thread.
+ */
+void comm_can_rx_frame_release(void) {
+#if CAN_ENABLE
+	if (rx_frame_read != rx_frame_write) {
+		// Finish reading the frame before handing the slot back
+		__DMB();
+		rx_frame_read++;
+	}
+#endif
+}
+
+/**
+ * Get the CAN RX counters.
+ *
+ * @param received
+ * Frames taken from the CAN peripheral since startup.
+ *
+ * @param dropped
+ * Frames among them that were dropped because the RX ring was full.
+ */
+void comm_can_get_rx_stats(uint32_t *received, uint32_t *dropped) {
+#if CAN_ENABLE
+	*received = rx_frames_received;
+	*dropped = rx_frames_dropped;
+#else
+	*received = 0;
+	*dropped = 0;
+#endif
+}
+
+/**
+ * Enable or disable the adaptive status mode, see comm_can.h. The status
+ * statistics are reset, so that they only cover the new mode.
+ *
+ * @param adaptive
+ * Only send status messages when their content has changed.
+ *
+ * @param heartbeat_ms
+ * Longest interval between two messages of the same kind in the adaptive
+ * mode, limited to CAN_STATUS_HEARTBEAT_MAX_MS. Values <= 0 keep the current
+ * heartbeat.
+ */
+void comm_can_set_status_adaptive(bool adaptive, int heartbeat_ms) {
+#if CAN_ENABLE
+	if (heartbeat_ms > CAN_STATUS_HEARTBEAT_MAX_MS) {
+		heartbeat_ms = CAN_STATUS_HEARTBEAT_MAX_MS;
+	}
+
+	if (heartbeat_ms > 0) {
+		status_heartbeat = MS2ST(heartbeat_ms);
+	}
+
+	status_adaptive = adaptive;
+	comm_can_reset_status_tx_stats();
+#else
+	(void)adaptive;
+	(void)heartbeat_ms;
+#endif
+}
+
+/**
+ * Check if the adaptive status mode is enabled.
+ *
+ * @param heartbeat_ms
+ * The heartbeat interval in milliseconds is stored here. Can be null.
+ *
+ * @return
+ * true if the adaptive status mode is enabled.
+ */
+bool comm_can_get_status_adaptive(int *heartbeat_ms) {
+#if CAN_ENABLE
+	if (heartbeat_ms) {
+		*heartbeat_ms = ST2MS(status_heartbeat);
+	}
+
+	return status_adaptive;
+#else
+	if (heartbeat_ms) {
+		*heartbeat_ms = 0;
+	}
+
+	return false;
+#endif
+}
+
+/**
+ * Get the transmit statistics of the status messages from this node.
+ *
+ * @param stats
+ * Array of CAN_STATUS_MSG_NUM entries, one for each status message. Skipped
+ * messages are the ones the adaptive mode did not send.
+ *
+ * @param seconds
+ * The time the statistics were collected over.
+ */
+void comm_can_get_status_tx_stats(can_status_tx_stats *stats, float *seconds) {
+#if CAN_ENABLE
+	memcpy(stats, status_stats, sizeof(status_stats));
+	*seconds = UTILS_AGE_S(status_stats_start);
+#else
+	memset(stats, 0, sizeof(can_status_tx_stats) * CAN_STATUS_MSG_NUM);
+	*seconds = 0.0;
+#endif
+}
+
+void comm_can_reset_status_tx_stats(void) {
+#if CAN_ENABLE
+	memset(status_stats, 0, sizeof(status_stats));
+	status_stats_start = chVTGetSystemTimeX();
+#endif
+}
+
 #if CAN_ENABLE
 static THD_FUNCTION(cancom_read_thread, arg) {
 	(void)arg;
 	chRegSetThreadName("CAN read");
 
 	event_listener_t el;
-	CANRxFrame rxmsg;
 
 	chEvtRegister(&HW_CAN_DEV.rxfull_event, &el, 0);
 
@@ -844,19 +1117,37 @@ static THD_FUNCTION(cancom_read_thread, arg) {
 			continue;
 		}
 
-		msg_t result = canReceive(&HW_CAN_DEV, CAN_ANY_MAILBOX, &rxmsg, TIME_IMMEDIATE);
+		bool received = false;
 
-		while (result == MSG_OK) {
-			chMtxLock(&can_rx_mtx);
-			rx_frames[rx_frame_write++] = rxmsg;
-			if (rx_frame_write == RX_FRAMES_SIZE) {
-				rx_frame_write = 0;
+		for (;;) {
+			unsigned int write = rx_frame_write;
+			bool full = (write - rx_frame_read) >= RX_FRAMES_SIZE;
+
+			// Receive directly into the ring. When it is full the frame still
+			// has to be taken out of the mailbox, but it is dropped.
+			CANRxFrame *rxmsg = full ? &rx_frame_overflow :
+					&rx_frames[write & (RX_FRAMES_SIZE - 1)];
+
+			if (canReceive(&HW_CAN_DEV, CAN_ANY_MAILBOX, rxmsg, TIME_IMMEDIATE) != MSG_OK) {
+				break;
 			}
-			chMtxUnlock(&can_rx_mtx);
 
-			chEvtSignal(process_tp, (eventmask_t) 1);
+			rx_frames_received++;
 
-			result = canReceive(&HW_CAN_DEV, CAN_ANY_MAILBOX, &rxmsg, TIME_IMMEDIATE);
+			if (full) {
+				rx_frames_dropped++;
+				continue;
+			}
+
+			// Publish the frame only after it is completely written
+			__DMB();
+			rx_frame_write = write + 1;
+			received = true;
+		}
+
+		// One event for all frames taken from the mailboxes
+		if (received && process_tp) {
+			chEvtSignal(process_tp, (eventmask_t) 1);
 		}
 	}
 
@@ -875,37 +1166,38 @@ static THD_FUNCTION(cancom_process_thread, arg) {
 		if (app_get_configuration()->can_mode == CAN_MODE_UAVCAN) {
 			continue;
 		} else if (app_get_configuration()->can_mode == CAN_MODE_COMM_BRIDGE) {
-			CANRxFrame *rxmsg_tmp;
-			while ((rxmsg_tmp = comm_can_get_rx_frame()) != 0) {
-				CANRxFrame rxmsg = *rxmsg_tmp;
-				commands_fwd_can_frame(rxmsg.DLC, rxmsg.data8,
-						rxmsg.IDE == CAN_IDE_EXT ? rxmsg.EID : rxmsg.SID,
-						rxmsg.IDE == CAN_IDE_EXT);
-
-				if (rxmsg.IDE == CAN_IDE_STD) {
+			CANRxFrame *rxmsg;
+			while ((rxmsg = comm_can_rx_frame_peek()) != 0) {
+				commands_fwd_can_frame(rxmsg->DLC, rxmsg->data8,
+						rxmsg->IDE == CAN_IDE_EXT ? rxmsg->EID : rxmsg->SID,
+						rxmsg->IDE == CAN_IDE_EXT);
+
+				if (rxmsg->IDE == CAN_IDE_STD) {
 					if (sid_callback) {
-						sid_callback(rxmsg.SID, rxmsg.data8, rxmsg.DLC);
+						sid_callback(rxmsg->SID, rxmsg->data8, rxmsg->DLC);
 					}
 				} else {
 					if (eid_callback) {
-						eid_callback(rxmsg.EID, rxmsg.data8, rxmsg.DLC);
+						eid_callback(rxmsg->EID, rxmsg->data8, rxmsg->DLC);
 					}
 				}
+
+				comm_can_rx_frame_release();
 			}
 			continue;
 		}
 
-		CANRxFrame *rxmsg_tmp;
-		while ((rxmsg_tmp = comm_can_get_rx_frame()) != 0) {
-			CANRxFrame rxmsg = *rxmsg_tmp;
-
-			if (rxmsg.IDE == CAN_IDE_EXT) {
-				decode_msg(rxmsg.EID, rxmsg.data8, rxmsg.DLC, false);
+		CANRxFrame *rxmsg;
+		while ((rxmsg = comm_can_rx_frame_peek()) != 0) {
+			if (rxmsg->IDE == CAN_IDE_EXT) {
+				decode_msg(rxmsg->EID, rxmsg->data8, rxmsg->DLC, false);
 			} else {
 				if (sid_callback) {
-					sid_callback(rxmsg.SID, rxmsg.data8, rxmsg.DLC);
+					sid_callback(rxmsg->SID, rxmsg->data8, rxmsg->DLC);
 				}
 			}
+
+			comm_can_rx_frame_release();
 		}
 	}
 }
@@ -922,11 +1214,15 @@ static THD_FUNCTION(cancom_status_internal_thread, arg) {
 	mc_interface_select_motor_thread(2);
 
 	for (;;) {
-		send_status1(utils_second_motor_id(), true);
-		send_status2(utils_second_motor_id(), true);
-		send_status3(utils_second_motor_id(), true);
-		send_status4(utils_second_motor_id(), true);
-		send_status5(utils_second_motor_id(), true);
+		mc_snapshot s;
+		mc_interface_get_snapshot(&s);
+
+		for (int i = 0;i < CAN_STATUS_MSG_NUM;i++) {
+			int32_t fields[4];
+			status_fields(i, &s, fields);
+			send_status(utils_second_motor_id(), i, fields, true);
+		}
+
 		chThdSleepMilliseconds(2);
 	}
 }
@@ -940,60 +1236,29 @@ static THD_FUNCTION(cancom_status_thread, arg) {
 		const app_configuration *conf = app_get_configuration();
 
 		if (conf->can_mode == CAN_MODE_VESC) {
-			if (conf->send_can_status == CAN_STATUS_1 ||
-					conf->send_can_status == CAN_STATUS_1_2 ||
-					conf->send_can_status == CAN_STATUS_1_2_3 ||
-					conf->send_can_status == CAN_STATUS_1_2_3_4 ||
-					conf->send_can_status == CAN_STATUS_1_2_3_4_5) {
-				mc_interface_select_motor_thread(1);
-				send_status1(conf->controller_id, false);
+			// All messages of a cycle are sent from the same snapshot
+			mc_snapshot s1;
+			mc_interface_select_motor_thread(1);
+			mc_interface_get_snapshot(&s1);
 #ifdef HW_HAS_DUAL_MOTORS
-				mc_interface_select_motor_thread(2);
-				send_status1(utils_second_motor_id(), false);
+			mc_snapshot s2;
+			mc_interface_select_motor_thread(2);
+			mc_interface_get_snapshot(&s2);
 #endif
-			}
 
-			if (conf->send_can_status == CAN_STATUS_1_2 ||
-					conf->send_can_status == CAN_STATUS_1_2_3||
-					conf->send_can_status == CAN_STATUS_1_2_3_4 ||
-					conf->send_can_status == CAN_STATUS_1_2_3_4_5) {
-				mc_interface_select_motor_thread(1);
-				send_status2(conf->controller_id, false);
-#ifdef HW_HAS_DUAL_MOTORS
-				mc_interface_select_motor_thread(2);
-				send_status2(utils_second_motor_id(), false);
-#endif
+			// The status modes send the first n messages
+			int msgs = conf->send_can_status;
+			if (msgs > CAN_STATUS_MSG_NUM) {
+				msgs = CAN_STATUS_MSG_NUM;
 			}
 
-			if (conf->send_can_status == CAN_STATUS_1_2_3 ||
-					conf->send_can_status == CAN_STATUS_1_2_3_4 ||
-					conf->send_can_status == CAN_STATUS_1_2_3_4_5) {
-				mc_interface_select_motor_thread(1);
-				send_status3(conf->controller_id, false);
-#ifdef HW_HAS_DUAL_MOTORS
-				mc_interface_select_motor_thread(2);
-				send_status3(utils_second_motor_id(), false);
-#endif
-			}
+			systime_t now = chVTGetSystemTimeX();
+			systime_t period = CH_CFG_ST_FREQUENCY / conf->send_can_status_rate_hz;
 
-			if (conf->send_can_status == CAN_STATUS_1_2_3_4 ||
-					conf->send_can_status == CAN_STATUS_1_2_3_4_5) {
-				mc_interface_select_motor_thread(1);
-				send_status4(conf->controller_id, false);
+			send_status_cycle(conf->controller_id, status_tx[0], &s1, msgs, now, period);
 #ifdef HW_HAS_DUAL_MOTORS
-				mc_interface_select_motor_thread(2);
-				send_status4(utils_second_motor_id(), false);
+			send_status_cycle(utils_second_motor_id(), status_tx[1], &s2, msgs, now, period);
 #endif
-			}
-
-			if (conf->send_can_status == CAN_STATUS_1_2_3_4_5) {
-				mc_interface_select_motor_thread(1);
-				send_status5(conf->controller_id, false);
-#ifdef HW_HAS_DUAL_MOTORS
-				mc_interface_select_motor_thread(2);
-				send_status5(utils_second_motor_id(), false);
-#endif
-			}
 		}
 
 		systime_t sleep_time = CH_CFG_ST_FREQUENCY / conf->send_can_status_rate_hz;
@@ -1009,6 +1274,107 @@ static void send_packet_wrapper(unsigned char *data, unsigned int len) {
 	comm_can_send_buffer(rx_buffer_last_id, data, len, 1);
 }
 
+static void process_rx_buffer(uint8_t commands_send, unsigned int len) {
+	switch (commands_send) {
+	case 0:
+		commands_process_packet(rx_buffer, len, send_packet_wrapper);
+		break;
+	case 1:
+		commands_send_packet(rx_buffer, len);
+		break;
+	case 2:
+		commands_process_packet(rx_buffer, len, 0);
+		break;
+	default:
+		break;
+	}
+}
+
+/*
+ * Send a buffer with a windowed transfer if the receiver supports it, see
+ * can_bulk.h. Returns false when the transfer was not possible, in which case
+ * the buffer has to be sent the old way.
+ */
+static bool send_buffer_bulk(uint8_t controller_id, uint8_t *data, unsigned int len, uint8_t send) {
+	// Broadcasts have no single receiver to acknowledge the windows and the
+	// acks are decoded by the process thread, so it cannot wait for them.
+	if (controller_id == 255 || len > CAN_BULK_MAX_LEN ||
+			chThdGetSelfX() == process_tp ||
+			app_get_configuration()->can_mode != CAN_MODE_VESC) {
+		return false;
+	}
+
+#ifdef HW_HAS_DUAL_MOTORS
+	if (controller_id == utils_second_motor_id() ||
+			controller_id == app_get_configuration()->controller_id) {
+		return false;
+	}
+#endif
+
+	uint32_t bit = 1 << (controller_id % 32);
+
+	// The pong tells if windowed transfers are supported
+	if (!(bulk_probed[controller_id / 32] & bit)) {
+		if (chVTTimeElapsedSinceX(bulk_no_answer_time) > MS2ST(BULK_PROBE_RETRY_MS)) {
+			memset(bulk_no_answer, 0, sizeof(bulk_no_answer));
+		}
+
+		if (!(bulk_no_answer[controller_id / 32] & bit) && !comm_can_ping(controller_id)) {
+			bulk_no_answer[controller_id / 32] |= bit;
+			bulk_no_answer_time = chVTGetSystemTimeX();
+		}
+	}
+
+	if (!(bulk_supported[controller_id / 32] & bit) || !chMtxTryLock(&can_bulk_mtx)) {
+		return false;
+	}
+
+	// The boot sequence always takes the same time, but the first transfer
+	// is started by a command from outside, so the low bits of the 10 MHz
+	// timer differ between boots
+	if (!bulk_nonce_set) {
+		bulk_nonce = timer_time_now() & 0xFF;
+		bulk_nonce_set = true;
+	}
+
+	bulk_ack_read = bulk_ack_write;
+	bulk_tp = chThdGetSelfX();
+	chEvtGetAndClearEvents(1 << 28);
+
+	can_bulk_tx_start(&bulk_tx, bulk_send, app_get_configuration()->controller_id,
+			controller_id, bulk_transfer_id++, bulk_nonce, send, data, len);
+
+	while (bulk_tx.state == CAN_BULK_TX_BUSY) {
+		if (bulk_ack_read == bulk_ack_write &&
+				chEvtWaitAnyTimeout(1 << 28, MS2ST(BULK_ACK_TIMEOUT_MS)) == 0) {
+			can_bulk_tx_timeout(&bulk_tx);
+			continue;
+		}
+
+		while (bulk_ack_read != bulk_ack_write) {
+			__DMB();
+			can_bulk_tx_ack(&bulk_tx, bulk_ack_queue[bulk_ack_read & (BULK_ACK_QUEUE_LEN - 1)], 7);
+			bulk_ack_read++;
+		}
+	}
+
+	bulk_tp = 0;
+
+	// Not a single ack, maybe the node was updated to an older firmware
+	if (bulk_tx.acks == 0) {
+		bulk_supported[controller_id / 32] &= ~bit;
+	}
+
+	bool res = bulk_tx.state == CAN_BULK_TX_DONE;
+	chMtxUnlock(&can_bulk_mtx);
+
+	return res;
+}
+
+static void bulk_send(uint8_t id, CAN_PACKET_ID cmd, const uint8_t *data, uint8_t len) {
+	comm_can_transmit_eid_replace(id | ((uint32_t)cmd << 8), data, len, false);
+}
+
 static void decode_msg(uint32_t eid, uint8_t *data8, int len, bool is_replaced) {
 	int32_t ind = 0;
 	unsigned int rxbuf_len;
@@ -1016,6 +1382,7 @@ static void decode_msg(uint32_t eid, uint8_t *data8, int len, bool is_replaced)
 	uint8_t crc_low;
 	uint8_t crc_high;
 	uint8_t commands_send;
+	can_status_node *node;
 
 	uint8_t id = eid & 0xFF;
 	CAN_PACKET_ID cmd = eid >> 8;
@@ -1101,24 +1468,38 @@ static void decode_msg(uint32_t eid, uint8_t *data8, int len, bool is_replaced)
 							rx_buffer[0] == COMM_ERASE_NEW_APP ||
 							rx_buffer[0] == COMM_WRITE_NEW_APP_DATA ||
 							rx_buffer[0] == COMM_WRITE_NEW_APP_DATA_LZO ||
+							rx_buffer[0] == COMM_WRITE_NEW_APP_PATCH ||
 							rx_buffer[0] == COMM_ERASE_BOOTLOADER) {
 						break;
 					}
 				}
 
-				switch (commands_send) {
-				case 0:
-					commands_process_packet(rx_buffer, rxbuf_len, send_packet_wrapper);
-					break;
-				case 1:
-					commands_send_packet(rx_buffer, rxbuf_len);
-					break;
-				case 2:
-					commands_process_packet(rx_buffer, rxbuf_len, 0);
-					break;
-				default:
-					break;
-				}
+				process_rx_buffer(commands_send, rxbuf_len);
+			}
+			break;
+
+		case CAN_PACKET_BULK_START:
+			can_bulk_rx_start(&bulk_rx, data8, len);
+			break;
+
+		case CAN_PACKET_BULK_DATA:
+			can_bulk_rx_data(&bulk_rx, data8, len);
+			break;
+
+		case CAN_PACKET_BULK_END:
+			if (can_bulk_rx_end(&bulk_rx, bulk_send, id, data8, len)) {
+				rx_buffer_last_id = bulk_rx.sender;
+				process_rx_buffer(bulk_rx.mode, bulk_rx.len);
+			}
+			break;
+
+		case CAN_PACKET_BULK_ACK:
+			// Handed to the thread in send_buffer_bulk
+			if (bulk_tp && len >= 7 && (bulk_ack_write - bulk_ack_read) < BULK_ACK_QUEUE_LEN) {
+				memcpy(bulk_ack_queue[bulk_ack_write & (BULK_ACK_QUEUE_LEN - 1)], data8, 7);
+				__DMB();
+				bulk_ack_write++;
+				chEvtSignal(bulk_tp, 1 << 28);
 			}
 			break;
 
@@ -1132,6 +1513,7 @@ static void decode_msg(uint32_t eid, uint8_t *data8, int len, bool is_replaced)
 						data8[ind] == COMM_ERASE_NEW_APP ||
 						data8[ind] == COMM_WRITE_NEW_APP_DATA ||
 						data8[ind] == COMM_WRITE_NEW_APP_DATA_LZO ||
+						data8[ind] == COMM_WRITE_NEW_APP_PATCH ||
 						data8[ind] == COMM_ERASE_BOOTLOADER) {
 					break;
 				}
@@ -1177,14 +1559,23 @@ static void decode_msg(uint32_t eid, uint8_t *data8, int len, bool is_replaced)
 				break;
 
 			case CAN_PACKET_PING: {
-				uint8_t buffer[1];
+				uint8_t buffer[2];
 				buffer[0] = app_get_configuration()->controller_id;
+				buffer[1] = CAN_BULK_CAP_WINDOWED;
 				comm_can_transmit_eid(data8[0] |
-						((uint32_t)CAN_PACKET_PONG << 8), buffer, 1);
+						((uint32_t)CAN_PACKET_PONG << 8), buffer, 2);
 			} break;
 
 			case CAN_PACKET_PONG:
 				// data8[0]; // Sender ID
+				// data8[1]; // Capabilities, not sent by old firmware
+				bulk_probed[data8[0] / 32] |= 1 << (data8[0] % 32);
+				if (len >= 2 && (data8[1] & CAN_BULK_CAP_WINDOWED)) {
+					bulk_supported[data8[0] / 32] |= 1 << (data8[0] % 32);
+				} else {
+					bulk_supported[data8[0] / 32] &= ~(1 << (data8[0] % 32));
+				}
+
 				if (ping_tp) {
 					chEvtSignal(ping_tp, 1 << 29);
 				}
@@ -1351,75 +1742,55 @@ static void decode_msg(uint32_t eid, uint8_t *data8, int len, bool is_replaced)
 
 	switch (cmd) {
 	case CAN_PACKET_STATUS:
-		for (int i = 0;i < CAN_STATUS_MSGS_TO_STORE;i++) {
-			can_status_msg *stat_tmp = &stat_msgs[i];
-			if (stat_tmp->id == id || stat_tmp->id == -1) {
-				ind = 0;
-				stat_tmp->id = id;
-				stat_tmp->rx_time = chVTGetSystemTime();
-				stat_tmp->rpm = (float)buffer_get_int32(data8, &ind);
-				stat_tmp->current = (float)buffer_get_int16(data8, &ind) / 10.0;
-				stat_tmp->duty = (float)buffer_get_int16(data8, &ind) / 1000.0;
-				break;
-			}
+		if ((node = status_node_get(id)) != 0) {
+			can_status_msg *stat_tmp = &node->msg;
+			status_node_rx(node, 0, &stat_tmp->id, &stat_tmp->rx_time);
+			ind = 0;
+			stat_tmp->rpm = (float)buffer_get_int32(data8, &ind);
+			stat_tmp->current = (float)buffer_get_int16(data8, &ind) / 10.0;
+			stat_tmp->duty = (float)buffer_get_int16(data8, &ind) / 1000.0;
 		}
 		break;
 
 	case CAN_PACKET_STATUS_2:
-		for (int i = 0;i < CAN_STATUS_MSGS_TO_STORE;i++) {
-			can_status_msg_2 *stat_tmp_2 = &stat_msgs_2[i];
-			if (stat_tmp_2->id == id || stat_tmp_2->id == -1) {
-				ind = 0;
-				stat_tmp_2->id = id;
-				stat_tmp_2->rx_time = chVTGetSystemTime();
-				stat_tmp_2->amp_hours = (float)buffer_get_int32(data8, &ind) / 1e4;
-				stat_tmp_2->amp_hours_charged = (float)buffer_get_int32(data8, &ind) / 1e4;
-				break;
-			}
+		if ((node = status_node_get(id)) != 0) {
+			can_status_msg_2 *stat_tmp_2 = &node->msg_2;
+			status_node_rx(node, 1, &stat_tmp_2->id, &stat_tmp_2->rx_time);
+			ind = 0;
+			stat_tmp_2->amp_hours = (float)buffer_get_int32(data8, &ind) / 1e4;
+			stat_tmp_2->amp_hours_charged = (float)buffer_get_int32(data8, &ind) / 1e4;
 		}
 		break;
 
 	case CAN_PACKET_STATUS_3:
-		for (int i = 0;i < CAN_STATUS_MSGS_TO_STORE;i++) {
-			can_status_msg_3 *stat_tmp_3 = &stat_msgs_3[i];
-			if (stat_tmp_3->id == id || stat_tmp_3->id == -1) {
-				ind = 0;
-				stat_tmp_3->id = id;
-				stat_tmp_3->rx_time = chVTGetSystemTime();
-				stat_tmp_3->watt_hours = (float)buffer_get_int32(data8, &ind) / 1e4;
-				stat_tmp_3->watt_hours_charged = (float)buffer_get_int32(data8, &ind) / 1e4;
-				break;
-			}
+		if ((node = status_node_get(id)) != 0) {
+			can_status_msg_3 *stat_tmp_3 = &node->msg_3;
+			status_node_rx(node, 2, &stat_tmp_3->id, &stat_tmp_3->rx_time);
+			ind = 0;
+			stat_tmp_3->watt_hours = (float)buffer_get_int32(data8, &ind) / 1e4;
+			stat_tmp_3->watt_hours_charged = (float)buffer_get_int32(data8, &ind) / 1e4;
 		}
 		break;
 
 	case CAN_PACKET_STATUS_4:
-		for (int i = 0;i < CAN_STATUS_MSGS_TO_STORE;i++) {
-			can_status_msg_4 *stat_tmp_4 = &stat_msgs_4[i];
-			if (stat_tmp_4->id == id || stat_tmp_4->id == -1) {
-				ind = 0;
-				stat_tmp_4->id = id;
-				stat_tmp_4->rx_time = chVTGetSystemTime();
-				stat_tmp_4->temp_fet = (float)buffer_get_int16(data8, &ind) / 10.0;
-				stat_tmp_4->temp_motor = (float)buffer_get_int16(data8, &ind) / 10.0;
-				stat_tmp_4->current_in = (float)buffer_get_int16(data8, &ind) / 10.0;
-				stat_tmp_4->pid_pos_now = (float)buffer_get_int16(data8, &ind) / 50.0;
-				break;
-			}
+		if ((node = status_node_get(id)) != 0) {
+			can_status_msg_4 *stat_tmp_4 = &node->msg_4;
+			status_node_rx(node, 3, &stat_tmp_4->id, &stat_tmp_4->rx_time);
+			ind = 0;
+			stat_tmp_4->temp_fet = (float)buffer_get_int16(data8, &ind) / 10.0;
+			stat_tmp_4->temp_motor = (float)buffer_get_int16(data8, &ind) / 10.0;
+			stat_tmp_4->current_in = (float)buffer_get_int16(data8, &ind) / 10.0;
+			stat_tmp_4->pid_pos_now = (float)buffer_get_int16(data8, &ind) / 50.0;
 		}
 		break;
 
 	case CAN_PACKET_STATUS_5:
-		for (int i = 0;i < CAN_STATUS_MSGS_TO_STORE;i++) {
-			can_status_msg_5 *stat_tmp_5 = &stat_msgs_5[i];
-			if (stat_tmp_5->id == id || stat_tmp_5->id == -1) {
-				ind = 0;
-				stat_tmp_5->id = id;
-				stat_tmp_5->rx_time = chVTGetSystemTime();
-				stat_tmp_5->tacho_value = buffer_get_int32(data8, &ind);
-				stat_tmp_5->v_in = (float)buffer_get_int16(data8, &ind) / 1e1;
-				break;
-			}
+		if ((node = status_node_get(id)) != 0) {
+			can_status_msg_5 *stat_tmp_5 = &node->msg_5;
+			status_node_rx(node, 4, &stat_tmp_5->id, &stat_tmp_5->rx_time);
+			ind = 0;
+			stat_tmp_5->tacho_value = buffer_get_int32(data8, &ind);
+			stat_tmp_5->v_in = (float)buffer_get_int16(data8, &ind) / 1e1;
 		}
 		break;
 
@@ -1432,56 +1803,208 @@ static void decode_msg(uint32_t eid, uint8_t *data8, int len, bool is_replaced)
 #endif
 }
 
-static void send_status1(uint8_t id, bool replace) {
-	int32_t send_index = 0;
-	uint8_t buffer[8];
-	buffer_append_int32(buffer, (int32_t)mc_interface_get_rpm(), &send_index);
-	buffer_append_int16(buffer, (int16_t)(mc_interface_get_tot_current_filtered() * 1e1), &send_index);
-	buffer_append_int16(buffer, (int16_t)(mc_interface_get_duty_cycle_now() * 1e3), &send_index);
-	comm_can_transmit_eid_replace(id | ((uint32_t)CAN_PACKET_STATUS << 8),
-			buffer, send_index, replace);
+/*
+ * Look up the status table entry of a node, or allocate one. When the table is
+ * full, the node that has been silent the longest is replaced if it has been
+ * silent for at least CAN_STATUS_EVICT_MS. Live nodes are never replaced, so
+ * callers that have just checked the age of an entry keep a valid pointer.
+ */
+static can_status_node *status_node_get(uint8_t id) {
+	can_status_node *node = comm_can_get_status_node_id(id);
+	if (node) {
+		return node;
+	}
+
+	// Status can also be decoded from the status threads through
+	// comm_can_transmit_eid_replace, so allocate atomically.
+	chSysLock();
+
+	int free_index = -1;
+	int oldest_index = -1;
+	systime_t oldest_age = 0;
+	systime_t now = chVTGetSystemTimeX();
+
+	for (int i = 0;i < CAN_STATUS_MSGS_TO_STORE;i++) {
+		if (stat_nodes[i].id == id) {
+			free_index = i;
+			break;
+		}
+
+		if (stat_nodes[i].id < 0) {
+			if (free_index < 0) {
+				free_index = i;
+			}
+			continue;
+		}
+
+		systime_t age = now - stat_nodes[i].rx_time;
+		if (age >= oldest_age) {
+			oldest_age = age;
+			oldest_index = i;
+		}
+	}
+
+	if (free_index < 0 && oldest_index >= 0 &&
+			oldest_age >= MS2ST(CAN_STATUS_EVICT_MS)) {
+		free_index = oldest_index;
+	}
+
+	if (free_index >= 0) {
+		node = &stat_nodes[free_index];
+		if (node->id != id) {
+			if (node->id >= 0) {
+				stat_node_index[node->id] = 0xFF;
+			}
+
+			status_node_reset(node, id);
+			stat_node_index[id] = free_index;
+		}
+	}
+
+	chSysUnlock();
+
+	return node;
 }
 
-static void send_status2(uint8_t id, bool replace) {
-	int32_t send_index = 0;
-	uint8_t buffer[8];
-	buffer_append_int32(buffer, (int32_t)(mc_interface_get_amp_hours(false) * 1e4), &send_index);
-	buffer_append_int32(buffer, (int32_t)(mc_interface_get_amp_hours_charged(false) * 1e4), &send_index);
-	comm_can_transmit_eid_replace(id | ((uint32_t)CAN_PACKET_STATUS_2 << 8),
-			buffer, send_index, replace);
+/*
+ * Update the timestamps and the rate counters of a node when status message
+ * msg (0 to 4 for status 1 to 5) has been received.
+ */
+static void status_node_rx(can_status_node *node, int msg, int *msg_id, systime_t *msg_rx_time) {
+	systime_t now = chVTGetSystemTime();
+
+	if (*msg_id >= 0) {
+		float interval = (float)(systime_t)(now - *msg_rx_time) / (float)CH_CFG_ST_FREQUENCY;
+		if (node->rx_interval[msg] == 0.0) {
+			node->rx_interval[msg] = interval;
+		} else {
+			UTILS_LP_FAST(node->rx_interval[msg], interval, 0.1);
+		}
+	}
+
+	*msg_id = node->id;
+	*msg_rx_time = now;
+	node->rx_time = now;
+	node->rx_cnt[msg]++;
 }
 
-static void send_status3(uint8_t id, bool replace) {
-	int32_t send_index = 0;
-	uint8_t buffer[8];
-	buffer_append_int32(buffer, (int32_t)(mc_interface_get_watt_hours(false) * 1e4), &send_index);
-	buffer_append_int32(buffer, (int32_t)(mc_interface_get_watt_hours_charged(false) * 1e4), &send_index);
-	comm_can_transmit_eid_replace(id | ((uint32_t)CAN_PACKET_STATUS_3 << 8),
-			buffer, send_index, replace);
+static void status_fields(int msg, const mc_snapshot *s, int32_t *fields) {
+	memset(fields, 0, sizeof(int32_t) * 4);
+
+	switch (msg) {
+	case 0:
+		fields[0] = (int32_t)s->rpm;
+		fields[1] = (int16_t)(s->current_filtered * 1e1);
+		fields[2] = (int16_t)(s->duty_now * 1e3);
+		break;
+
+	case 1:
+		fields[0] = (int32_t)(s->amp_hours * 1e4);
+		fields[1] = (int32_t)(s->amp_hours_charged * 1e4);
+		break;
+
+	case 2:
+		fields[0] = (int32_t)(s->watt_hours * 1e4);
+		fields[1] = (int32_t)(s->watt_hours_charged * 1e4);
+		break;
+
+	case 3:
+		fields[0] = (int16_t)(s->temp_fet * 1e1);
+		fields[1] = (int16_t)(s->temp_motor * 1e1);
+		fields[2] = (int16_t)(s->current_in_filtered * 1e1);
+		fields[3] = (int16_t)(s->position * 50.0);
+		break;
+
+	case 4:
+		fields[0] = s->tachometer;
+		fields[1] = (int16_t)(s->v_in * 1e1);
+		fields[2] = 0; // Reserved for now
+		break;
+
+	default:
+		break;
+	}
 }
 
-static void send_status4(uint8_t id, bool replace) {
-	int32_t send_index = 0;
-	uint8_t buffer[8];
-	buffer_append_int16(buffer, (int16_t)(mc_interface_temp_fet_filtered() * 1e1), &send_index);
-	buffer_append_int16(buffer, (int16_t)(mc_interface_temp_motor_filtered() * 1e1), &send_index);
-	buffer_append_int16(buffer, (int16_t)(mc_interface_get_tot_current_in_filtered() * 1e1), &send_index);
-	buffer_append_int16(buffer, (int16_t)(mc_interface_get_pid_pos_now() * 50.0), &send_index);
-	comm_can_transmit_eid_replace(id | ((uint32_t)CAN_PACKET_STATUS_4 << 8),
-			buffer, send_index, replace);
+static uint8_t status_len(int msg) {
+	uint8_t len = 0;
+	for (int i = 0;i < 4;i++) {
+		len += status_defs[msg].size[i];
+	}
+	return len;
 }
 
-static void send_status5(uint8_t id, bool replace) {
+static void send_status(uint8_t id, int msg, const int32_t *fields, bool replace) {
+	const status_msg_def *def = &status_defs[msg];
 	int32_t send_index = 0;
 	uint8_t buffer[8];
-	buffer_append_int32(buffer, mc_interface_get_tachometer_value(false), &send_index);
-	buffer_append_int16(buffer, (int16_t)(GET_INPUT_VOLTAGE() * 1e1), &send_index);
-	buffer_append_int16(buffer, 0, &send_index); // Reserved for now
-	comm_can_transmit_eid_replace(id | ((uint32_t)CAN_PACKET_STATUS_5 << 8),
+
+	for (int i = 0;i < 4 && def->size[i] > 0;i++) {
+		if (def->size[i] == 4) {
+			buffer_append_int32(buffer, fields[i], &send_index);
+		} else {
+			buffer_append_int16(buffer, (int16_t)fields[i], &send_index);
+		}
+	}
+
+	comm_can_transmit_eid_replace(id | ((uint32_t)def->cmd << 8),
 			buffer, send_index, replace);
 }
+
+/*
+ * Send the first msgs status messages of one motor. In the adaptive mode a
+ * message is skipped unless one of its fields has moved past the deadband
+ * since it was sent last, or unless waiting another period would exceed the
+ * heartbeat.
+ */
+static void send_status_cycle(uint8_t id, status_tx_state *state, const mc_snapshot *s,
+		int msgs, systime_t now, systime_t period) {
+	bool adaptive = status_adaptive;
+	systime_t heartbeat = status_heartbeat;
+
+	for (int i = 0;i < msgs;i++) {
+		const status_msg_def *def = &status_defs[i];
+		status_tx_state *st = &state[i];
+		int32_t fields[4];
+		status_fields(i, s, fields);
+
+		bool send = !adaptive || !st->valid ||
+				(systime_t)(now - st->time) + period > heartbeat;
+
+		for (int j = 0;j < def->fields && !send;j++) {
+			int64_t diff = (int64_t)fields[j] - (int64_t)st->last[j];
+			if (diff > def->deadband[j] || diff < -def->deadband[j]) {
+				send = true;
+			}
+		}
+
+		if (send) {
+			send_status(id, i, fields, false);
+			memcpy(st->last, fields, sizeof(st->last));
+			st->time = now;
+			st->valid = true;
+
+			// Extended data frame with interframe space and typical bit stuffing
+			uint32_t len = status_len(i);
+			status_stats[i].sent++;
+			status_stats[i].bits += 67 + 8 * len + (54 + 8 * len) / 5;
+		} else {
+			status_stats[i].skipped++;
+		}
+	}
+}
 #endif
 
+static void status_node_reset(can_status_node *node, int id) {
+	memset(node, 0, sizeof(can_status_node));
+	node->id = id;
+	node->msg.id = -1;
+	node->msg_2.id = -1;
+	node->msg_3.id = -1;
+	node->msg_4.id = -1;
+	node->msg_5.id = -1;
+}
+
 /**
  * Set the CAN timing. The CAN is clocked at 42 MHz, and the baud rate can be
  * calculated with
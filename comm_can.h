@@ -24,7 +24,62 @@
 #include "hal.h"
 
 // Settings
+// Nodes in the status table, at most 255. Every node takes about 140 bytes of
+// RAM, so hardware for large buses can raise this in its hwconf file.
+#ifndef CAN_STATUS_MSGS_TO_STORE
 #define CAN_STATUS_MSGS_TO_STORE	10
+#endif
+#define CAN_STATUS_STALE_MS			100 // Nodes are live when heard from this recently
+#define CAN_STATUS_EVICT_MS			1000 // Silent nodes can be replaced after this time
+#define CAN_STATUS_MSG_NUM			5
+
+// The entry of a node that is live must never be reused for another node
+#if CAN_STATUS_EVICT_MS < (2 * CAN_STATUS_STALE_MS)
+#error "CAN_STATUS_EVICT_MS must be well above CAN_STATUS_STALE_MS"
+#endif
+
+// In the adaptive status mode a message is only sent when one of its fields
+// has moved past its deadband since it was sent last, or when the heartbeat
+// interval would otherwise be exceeded. Receivers consider status older than
+// CAN_STATUS_STALE_MS stale, so the heartbeat is limited to half of that to
+// tolerate one lost frame.
+#define CAN_STATUS_HEARTBEAT_MAX_MS	(CAN_STATUS_STALE_MS / 2)
+#ifndef COMM_CAN_STATUS_ADAPTIVE
+#define COMM_CAN_STATUS_ADAPTIVE		0
+#endif
+#ifndef COMM_CAN_STATUS_HEARTBEAT_MS
+#define COMM_CAN_STATUS_HEARTBEAT_MS	50
+#endif
+#if COMM_CAN_STATUS_HEARTBEAT_MS > CAN_STATUS_HEARTBEAT_MAX_MS
+#error "COMM_CAN_STATUS_HEARTBEAT_MS must not exceed CAN_STATUS_HEARTBEAT_MAX_MS"
+#endif
+#ifndef COMM_CAN_STATUS_DB_RPM
+#define COMM_CAN_STATUS_DB_RPM			50.0 // ERPM
+#endif
+#ifndef COMM_CAN_STATUS_DB_CURRENT
+#define COMM_CAN_STATUS_DB_CURRENT		0.5 // A
+#endif
+#ifndef COMM_CAN_STATUS_DB_DUTY
+#define COMM_CAN_STATUS_DB_DUTY			0.005
+#endif
+#ifndef COMM_CAN_STATUS_DB_AH
+#define COMM_CAN_STATUS_DB_AH			0.01 // Ah
+#endif
+#ifndef COMM_CAN_STATUS_DB_WH
+#define COMM_CAN_STATUS_DB_WH			0.1 // Wh
+#endif
+#ifndef COMM_CAN_STATUS_DB_TEMP
+#define COMM_CAN_STATUS_DB_TEMP			0.5 // Degrees C
+#endif
+#ifndef COMM_CAN_STATUS_DB_POS
+#define COMM_CAN_STATUS_DB_POS			1.0 // Degrees
+#endif
+#ifndef COMM_CAN_STATUS_DB_TACHO
+#define COMM_CAN_STATUS_DB_TACHO		60 // Counts
+#endif
+#ifndef COMM_CAN_STATUS_DB_V_IN
+#define COMM_CAN_STATUS_DB_V_IN			0.2 // V
+#endif
 
 // Functions
 void comm_can_init(void);
@@ -66,6 +121,15 @@ can_status_msg_4 *comm_can_get_status_msg_4_index(int index);
 can_status_msg_4 *comm_can_get_status_msg_4_id(int id);
 can_status_msg_5 *comm_can_get_status_msg_5_index(int index);
 can_status_msg_5 *comm_can_get_status_msg_5_id(int id);
-CANRxFrame *comm_can_get_rx_frame(void);
+can_status_node *comm_can_get_status_node_index(int index);
+can_status_node *comm_can_get_status_node_id(int id);
+CANRxFrame *comm_can_rx_frame_peek(void);
+void comm_can_rx_frame_release(void);
+void comm_can_get_rx_stats(uint32_t *received, uint32_t *dropped);
+void comm_can_set_status_adaptive(bool adaptive, int heartbeat_ms);
+bool comm_can_get_status_adaptive(int *heartbeat_ms);
+void comm_can_get_status_tx_stats(can_status_tx_stats *stats, float *seconds);
+void comm_can_reset_status_tx_stats(void);
+uint32_t comm_can_baud_rate(CAN_BAUD baud);
 
 #endif /* COMM_CAN_H_ */
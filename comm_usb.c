@@ -27,46 +27,39 @@
 // Settings
 #define PACKET_HANDLER				0
 
+#define SERIAL_RX_BUFFER_SIZE		2048 // Must be a power of two
+#define TX_COALESCE_MAX_AGE			MS2ST(2)
+
 // Private variables
-#define SERIAL_RX_BUFFER_SIZE		2048
+// Single producer (read thread), single consumer (process thread) ring. The
+// positions run freely and are only masked when accessing the buffer.
 static uint8_t serial_rx_buffer[SERIAL_RX_BUFFER_SIZE];
-static int serial_rx_read_pos = 0;
-static int serial_rx_write_pos = 0;
+static volatile unsigned int serial_rx_read_pos = 0;
+static volatile unsigned int serial_rx_write_pos = 0;
+static volatile unsigned int rx_overflow_cnt = 0;
 static THD_WORKING_AREA(serial_read_thread_wa, 256);
 static THD_WORKING_AREA(serial_process_thread_wa, 4096);
 static mutex_t send_mutex;
 static thread_t *process_tp;
 static volatile unsigned int write_timeout_cnt = 0;
 static volatile bool was_timeout = false;
+static systime_t tx_pending_since = 0;
 
 // Private functions
 static void process_packet(unsigned char *data, unsigned int len);
 static void send_packet_raw(unsigned char *buffer, unsigned int len);
+static unsigned int serial_rx_fill(void);
+static void serial_rx_drain(void);
+static void flush_replies(bool force);
 
 static THD_FUNCTION(serial_read_thread, arg) {
 	(void)arg;
 
 	chRegSetThreadName("USB read");
 
-	uint8_t buffer[2];
-	int had_data = 0;
-
 	for(;;) {
-		int len = chSequentialStreamRead(&SDU1, (uint8_t*) buffer, 1);
-
-		for (int i = 0;i < len;i++) {
-			serial_rx_buffer[serial_rx_write_pos++] = buffer[i];
-
-			if (serial_rx_write_pos == SERIAL_RX_BUFFER_SIZE) {
-				serial_rx_write_pos = 0;
-			}
-
-			had_data = 1;
-		}
-
-		if (had_data) {
+		if (serial_rx_fill() > 0) {
 			chEvtSignal(process_tp, (eventmask_t) 1);
-			had_data = 0;
 		}
 	}
 }
@@ -80,17 +73,95 @@ static THD_FUNCTION(serial_process_thread, arg) {
 
 	for(;;) {
 		chEvtWaitAny((eventmask_t) 1);
+		serial_rx_drain();
+
+		// Send the replies to everything that was just decoded together
+		flush_replies(true);
+	}
+}
+
+/*
+ * Wait for data from USB and read everything that has arrived into the ring,
+ * up to the free contiguous space. Returns the number of bytes read.
+ */
+static unsigned int serial_rx_fill(void) {
+	unsigned int write_pos = serial_rx_write_pos;
+	unsigned int free = SERIAL_RX_BUFFER_SIZE - (write_pos - serial_rx_read_pos);
+
+	if (free == 0) {
+		// Nothing is lost, as USB stops the host when the input queue of the
+		// driver fills up. Count it and give the process thread some time.
+		rx_overflow_cnt++;
+		chThdSleepMilliseconds(1);
+		return 0;
+	}
+
+	unsigned int ofs = write_pos & (SERIAL_RX_BUFFER_SIZE - 1);
+	unsigned int len = SERIAL_RX_BUFFER_SIZE - ofs;
+	if (len > free) {
+		len = free;
+	}
+
+	// Block for the first byte, then take what is left of the USB packets
+	// that have been received without waiting.
+	unsigned int read = chSequentialStreamRead(&SDU1, serial_rx_buffer + ofs, 1);
+	if (read > 0 && len > 1) {
+		read += SDU1.vmt->readt(&SDU1, serial_rx_buffer + ofs + 1, len - 1, TIME_IMMEDIATE);
+	}
+
+	// Publish the data only after it is in the buffer
+	__DMB();
+	serial_rx_write_pos = write_pos + read;
+
+	return read;
+}
+
+/*
+ * Decode everything in the ring, one contiguous span at a time.
+ */
+static void serial_rx_drain(void) {
+	for (;;) {
+		unsigned int read_pos = serial_rx_read_pos;
+		unsigned int len = serial_rx_write_pos - read_pos;
+
+		if (len == 0) {
+			break;
+		}
 
-		while (serial_rx_read_pos != serial_rx_write_pos) {
-			packet_process_byte(serial_rx_buffer[serial_rx_read_pos++], PACKET_HANDLER);
+		__DMB();
 
-			if (serial_rx_read_pos == SERIAL_RX_BUFFER_SIZE) {
-				serial_rx_read_pos = 0;
-			}
+		unsigned int ofs = read_pos & (SERIAL_RX_BUFFER_SIZE - 1);
+		if (len > SERIAL_RX_BUFFER_SIZE - ofs) {
+			len = SERIAL_RX_BUFFER_SIZE - ofs;
 		}
+
+		packet_process_bytes(serial_rx_buffer + ofs, len, PACKET_HANDLER);
+
+		// Done reading before the space is handed back
+		__DMB();
+		serial_rx_read_pos = read_pos + len;
+
+		// With a continuous stream of input the drain does not end, so the
+		// replies cannot wait for that
+		flush_replies(false);
 	}
 }
 
+/*
+ * Send the replies that the process thread has coalesced, always or only when
+ * the oldest one has waited for TX_COALESCE_MAX_AGE.
+ */
+static void flush_replies(bool force) {
+	chMtxLock(&send_mutex);
+
+	if (force || (packet_tx_pending(PACKET_HANDLER) > 0 &&
+			chVTTimeElapsedSinceX(tx_pending_since) > TX_COALESCE_MAX_AGE)) {
+		packet_flush(PACKET_HANDLER);
+	}
+
+	chMtxUnlock(&send_mutex);
+}
+
 static void process_packet(unsigned char *data, unsigned int len) {
 	commands_process_packet(data, len, comm_usb_send_packet);
 }
@@ -127,8 +198,29 @@ void comm_usb_init(void) {
 	chThdCreateStatic(serial_process_thread_wa, sizeof(serial_process_thread_wa), NORMALPRIO, serial_process_thread, NULL);
 }
 
+/**
+ * Send a packet over USB. Replies from the process thread are coalesced into
+ * as few USB writes as possible and sent when the received data has been
+ * processed, or when they get older than TX_COALESCE_MAX_AGE while input
+ * keeps coming. Packets from other threads flush what is pending and are
+ * written directly, so the order is kept.
+ */
 void comm_usb_send_packet(unsigned char *data, unsigned int len) {
 	chMtxLock(&send_mutex);
+
+	bool coalesce = chThdGetSelfX() == process_tp;
+
+	// Do not hold back replies of long running commands for too long
+	if (coalesce && packet_tx_pending(PACKET_HANDLER) > 0 &&
+			chVTTimeElapsedSinceX(tx_pending_since) > TX_COALESCE_MAX_AGE) {
+		packet_flush(PACKET_HANDLER);
+	}
+
+	if (packet_tx_pending(PACKET_HANDLER) == 0) {
+		tx_pending_since = chVTGetSystemTimeX();
+	}
+
+	packet_set_coalescing(coalesce, PACKET_HANDLER);
 	packet_send_packet(data, len, PACKET_HANDLER);
 	chMtxUnlock(&send_mutex);
 }
@@ -136,3 +228,7 @@ void comm_usb_send_packet(unsigned char *data, unsigned int len) {
 unsigned int comm_usb_get_write_timeout_cnt(void) {
 	return write_timeout_cnt;
 }
+
+unsigned int comm_usb_get_rx_overflow_cnt(void) {
+	return rx_overflow_cnt;
+}
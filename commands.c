@@ -40,6 +40,7 @@
 #include "nrf_driver.h"
 #include "gpdrive.h"
 #include "confgenerator.h"
+#include "confdelta.h"
 #include "imu.h"
 #include "shutdown.h"
 #if HAS_BLACKMAGIC
@@ -47,6 +48,8 @@
 #endif
 #include "minilzo.h"
 #include "mempools.h"
+#include "telemetry.h"
+#include "isr_prof.h"
 
 #include <math.h>
 #include <string.h>
@@ -199,9 +202,25 @@ void commands_process_packet(unsigned char *data, unsigned int len,
 		chThdSleepMilliseconds(100);
 		/* Falls through. */
 		/* no break */
-	case COMM_JUMP_TO_BOOTLOADER:
-		flash_helper_jump_to_bootloader();
-		break;
+	case COMM_JUMP_TO_BOOTLOADER: {
+		// The bootloader would not accept an image that fails this, and only
+		// reset.
+		uint32_t verify_res = flash_helper_verify_new_app();
+		if (verify_res == FAULT_CODE_NONE) {
+			flash_helper_jump_to_bootloader();
+		}
+
+		if (packet_id == COMM_JUMP_TO_BOOTLOADER_ALL_CAN) {
+			commands_printf("Not jumping to the bootloader, the new app failed verification: %s",
+					mc_interface_fault_to_string(verify_res));
+		}
+
+		int32_t ind = 0;
+		uint8_t send_buffer[50];
+		send_buffer[ind++] = COMM_JUMP_TO_BOOTLOADER;
+		send_buffer[ind++] = verify_res;
+		reply_func(send_buffer, ind);
+	} break;
 
 	case COMM_ERASE_NEW_APP_ALL_CAN:
 		if (nrf_driver_ext_nrf_running()) {
@@ -235,9 +254,23 @@ void commands_process_packet(unsigned char *data, unsigned int len,
 			memcpy(send_buffer_global, data + 6, len - 6);
 			int32_t ind = 4;
 			lzo_uint decompressed_len = buffer_get_uint16(data, &ind);
-			lzo1x_decompress_safe(send_buffer_global, len - 6, data + 4, &decompressed_len, NULL);
+			int lzo_res = lzo1x_decompress_safe(send_buffer_global, len - 6, data + 4,
+					&decompressed_len, NULL);
 			chMtxUnlock(&send_buffer_mutex);
 			len = decompressed_len + 4;
+
+			if (lzo_res != LZO_E_OK) {
+				ind = 0;
+				uint32_t new_app_offset = buffer_get_uint32(data, &ind);
+
+				ind = 0;
+				uint8_t send_buffer[50];
+				send_buffer[ind++] = COMM_WRITE_NEW_APP_DATA;
+				send_buffer[ind++] = 0;
+				buffer_append_uint32(send_buffer, new_app_offset, &ind);
+				reply_func(send_buffer, ind);
+				break;
+			}
 		}
 
 		if (nrf_driver_ext_nrf_running()) {
@@ -251,31 +284,85 @@ void commands_process_packet(unsigned char *data, unsigned int len,
 		/* no break */
 	case COMM_WRITE_NEW_APP_DATA_LZO:
 	case COMM_WRITE_NEW_APP_DATA: {
+		int32_t ind = 0;
+		uint32_t new_app_offset = buffer_get_uint32(data, &ind);
+
+		if (nrf_driver_ext_nrf_running()) {
+			nrf_driver_pause(2000);
+		}
+
+		// The chunk is decompressed or copied into the write pipeline and
+		// programmed while the next one is received.
+		uint8_t *new_app_buffer = flash_helper_new_app_buffer_get();
+		uint32_t new_app_len = 0;
+
 		if (packet_id == COMM_WRITE_NEW_APP_DATA_LZO) {
-			chMtxLock(&send_buffer_mutex);
-			memcpy(send_buffer_global, data + 6, len - 6);
-			int32_t ind = 4;
 			lzo_uint decompressed_len = buffer_get_uint16(data, &ind);
-			lzo1x_decompress_safe(send_buffer_global, len - 6, data + 4, &decompressed_len, NULL);
-			chMtxUnlock(&send_buffer_mutex);
-			len = decompressed_len + 4;
+			if (decompressed_len > PACKET_MAX_PL_LEN) {
+				decompressed_len = PACKET_MAX_PL_LEN;
+			}
+
+			if (lzo1x_decompress_safe(data + ind, len - ind, new_app_buffer,
+					&decompressed_len, NULL) == LZO_E_OK) {
+				new_app_len = decompressed_len;
+			}
+		} else if ((len - ind) <= PACKET_MAX_PL_LEN) {
+			new_app_len = len - ind;
+			memcpy(new_app_buffer, data + ind, new_app_len);
+		}
+
+		uint16_t flash_res = flash_helper_new_app_buffer_commit(new_app_offset, new_app_len);
+		if (new_app_len == 0 && len > (unsigned int)ind) {
+			flash_res = FLASH_ERROR_PROGRAM;
+		}
+
+		SHUTDOWN_RESET();
+
+		ind = 0;
+		uint8_t send_buffer[50];
+		send_buffer[ind++] = COMM_WRITE_NEW_APP_DATA;
+		send_buffer[ind++] = flash_res == FLASH_COMPLETE ? 1 : 0;
+		buffer_append_uint32(send_buffer, new_app_offset, &ind);
+		reply_func(send_buffer, ind);
+	} break;
+
+	case COMM_WRITE_NEW_APP_PATCH_ALL_CAN:
+		if (nrf_driver_ext_nrf_running()) {
+			nrf_driver_pause(2000);
 		}
 
+		// Forwarded compressed, every device applies it to its own image
+		data[-1] = COMM_WRITE_NEW_APP_PATCH;
+		comm_can_send_buffer(255, data - 1, len + 1, 2);
+		/* Falls through. */
+		/* no break */
+	case COMM_WRITE_NEW_APP_PATCH: {
 		int32_t ind = 0;
-		uint32_t new_app_offset = buffer_get_uint32(data, &ind);
+		uint32_t patch_offset = buffer_get_uint32(data, &ind);
+		lzo_uint decompressed_len = buffer_get_uint16(data, &ind);
 
 		if (nrf_driver_ext_nrf_running()) {
 			nrf_driver_pause(2000);
 		}
-		uint16_t flash_res = flash_helper_write_new_app_data(new_app_offset, data + ind, len - ind);
+
+		uint16_t flash_res = FLASH_ERROR_OPERATION;
+
+		chMtxLock(&send_buffer_mutex);
+		if (decompressed_len <= PACKET_MAX_PL_LEN &&
+				lzo1x_decompress_safe(data + ind, len - ind, send_buffer_global,
+						&decompressed_len, NULL) == LZO_E_OK) {
+			flash_res = flash_helper_write_new_app_patch(patch_offset,
+					send_buffer_global, decompressed_len);
+		}
+		chMtxUnlock(&send_buffer_mutex);
 
 		SHUTDOWN_RESET();
 
 		ind = 0;
 		uint8_t send_buffer[50];
-		send_buffer[ind++] = COMM_WRITE_NEW_APP_DATA;
+		send_buffer[ind++] = COMM_WRITE_NEW_APP_PATCH;
 		send_buffer[ind++] = flash_res == FLASH_COMPLETE ? 1 : 0;
-		buffer_append_uint32(send_buffer, new_app_offset, &ind);
+		buffer_append_uint32(send_buffer, patch_offset, &ind);
 		reply_func(send_buffer, ind);
 	} break;
 
@@ -293,72 +380,83 @@ void commands_process_packet(unsigned char *data, unsigned int len,
 			buffer_append_uint32(send_buffer, mask, &ind);
 		}
 
+		// The averages are since the previous request for the same motor
+		static mc_snapshot prev[2];
+		static bool prev_valid[2] = {false, false};
+		const int motor = mc_interface_get_motor_thread() == 2 ? 1 : 0;
+		const mc_snapshot *p = prev_valid[motor] ? &prev[motor] : 0;
+		mc_snapshot s;
+		mc_interface_get_snapshot(&s);
+
 		if (mask & ((uint32_t)1 << 0)) {
-			buffer_append_float16(send_buffer, mc_interface_temp_fet_filtered(), 1e1, &ind);
+			buffer_append_float16(send_buffer, s.temp_fet, 1e1, &ind);
 		}
 		if (mask & ((uint32_t)1 << 1)) {
-			buffer_append_float16(send_buffer, mc_interface_temp_motor_filtered(), 1e1, &ind);
+			buffer_append_float16(send_buffer, s.temp_motor, 1e1, &ind);
 		}
 		if (mask & ((uint32_t)1 << 2)) {
-			buffer_append_float32(send_buffer, mc_interface_read_reset_avg_motor_current(), 1e2, &ind);
+			buffer_append_float32(send_buffer, mc_interface_snapshot_avg(&s, p, MC_AVG_CURRENT_MOTOR), 1e2, &ind);
 		}
 		if (mask & ((uint32_t)1 << 3)) {
-			buffer_append_float32(send_buffer, mc_interface_read_reset_avg_input_current(), 1e2, &ind);
+			buffer_append_float32(send_buffer, mc_interface_snapshot_avg(&s, p, MC_AVG_CURRENT_IN), 1e2, &ind);
 		}
 		if (mask & ((uint32_t)1 << 4)) {
-			buffer_append_float32(send_buffer, mc_interface_read_reset_avg_id(), 1e2, &ind);
+			buffer_append_float32(send_buffer, mc_interface_snapshot_avg(&s, p, MC_AVG_ID), 1e2, &ind);
 		}
 		if (mask & ((uint32_t)1 << 5)) {
-			buffer_append_float32(send_buffer, mc_interface_read_reset_avg_iq(), 1e2, &ind);
+			buffer_append_float32(send_buffer, mc_interface_snapshot_avg(&s, p, MC_AVG_IQ), 1e2, &ind);
 		}
 		if (mask & ((uint32_t)1 << 6)) {
-			buffer_append_float16(send_buffer, mc_interface_get_duty_cycle_now(), 1e3, &ind);
+			buffer_append_float16(send_buffer, s.duty_now, 1e3, &ind);
 		}
 		if (mask & ((uint32_t)1 << 7)) {
-			buffer_append_float32(send_buffer, mc_interface_get_rpm(), 1e0, &ind);
+			buffer_append_float32(send_buffer, s.rpm, 1e0, &ind);
 		}
 		if (mask & ((uint32_t)1 << 8)) {
-			buffer_append_float16(send_buffer, GET_INPUT_VOLTAGE(), 1e1, &ind);
+			buffer_append_float16(send_buffer, s.v_in, 1e1, &ind);
 		}
 		if (mask & ((uint32_t)1 << 9)) {
-			buffer_append_float32(send_buffer, mc_interface_get_amp_hours(false), 1e4, &ind);
+			buffer_append_float32(send_buffer, s.amp_hours, 1e4, &ind);
 		}
 		if (mask & ((uint32_t)1 << 10)) {
-			buffer_append_float32(send_buffer, mc_interface_get_amp_hours_charged(false), 1e4, &ind);
+			buffer_append_float32(send_buffer, s.amp_hours_charged, 1e4, &ind);
 		}
 		if (mask & ((uint32_t)1 << 11)) {
-			buffer_append_float32(send_buffer, mc_interface_get_watt_hours(false), 1e4, &ind);
+			buffer_append_float32(send_buffer, s.watt_hours, 1e4, &ind);
 		}
 		if (mask & ((uint32_t)1 << 12)) {
-			buffer_append_float32(send_buffer, mc_interface_get_watt_hours_charged(false), 1e4, &ind);
+			buffer_append_float32(send_buffer, s.watt_hours_charged, 1e4, &ind);
 		}
 		if (mask & ((uint32_t)1 << 13)) {
-			buffer_append_int32(send_buffer, mc_interface_get_tachometer_value(false), &ind);
+			buffer_append_int32(send_buffer, s.tachometer, &ind);
 		}
 		if (mask & ((uint32_t)1 << 14)) {
-			buffer_append_int32(send_buffer, mc_interface_get_tachometer_abs_value(false), &ind);
+			buffer_append_int32(send_buffer, s.tachometer_abs, &ind);
 		}
 		if (mask & ((uint32_t)1 << 15)) {
-			send_buffer[ind++] = mc_interface_get_fault();
+			send_buffer[ind++] = s.fault;
 		}
 		if (mask & ((uint32_t)1 << 16)) {
-			buffer_append_float32(send_buffer, mc_interface_get_pid_pos_now(), 1e6, &ind);
+			buffer_append_float32(send_buffer, s.position, 1e6, &ind);
 		}
 		if (mask & ((uint32_t)1 << 17)) {
 			send_buffer[ind++] = app_get_configuration()->controller_id;
 		}
 		if (mask & ((uint32_t)1 << 18)) {
-			buffer_append_float16(send_buffer, NTC_TEMP_MOS1(), 1e1, &ind);
-			buffer_append_float16(send_buffer, NTC_TEMP_MOS2(), 1e1, &ind);
-			buffer_append_float16(send_buffer, NTC_TEMP_MOS3(), 1e1, &ind);
+			buffer_append_float16(send_buffer, s.temp_mos_1, 1e1, &ind);
+			buffer_append_float16(send_buffer, s.temp_mos_2, 1e1, &ind);
+			buffer_append_float16(send_buffer, s.temp_mos_3, 1e1, &ind);
 		}
 		if (mask & ((uint32_t)1 << 19)) {
-			buffer_append_float32(send_buffer, mc_interface_read_reset_avg_vd(), 1e3, &ind);
+			buffer_append_float32(send_buffer, mc_interface_snapshot_avg(&s, p, MC_AVG_VD), 1e3, &ind);
 		}
 		if (mask & ((uint32_t)1 << 20)) {
-			buffer_append_float32(send_buffer, mc_interface_read_reset_avg_vq(), 1e3, &ind);
+			buffer_append_float32(send_buffer, mc_interface_snapshot_avg(&s, p, MC_AVG_VQ), 1e3, &ind);
 		}
 
+		prev[motor] = s;
+		prev_valid[motor] = true;
+
 		reply_func(send_buffer, ind);
 		chMtxUnlock(&send_buffer_mutex);
 	} break;
@@ -421,11 +519,19 @@ void commands_process_packet(unsigned char *data, unsigned int len,
 #endif
 	} break;
 
-	case COMM_SET_MCCONF: {
+	case COMM_SET_MCCONF:
+	case COMM_SET_MCCONF_DELTA: {
 		mc_configuration *mcconf = mempools_alloc_mcconf();
 		*mcconf = *mc_interface_get_configuration();
 
-		if (confgenerator_deserialize_mcconf(data, mcconf)) {
+		bool ok = false;
+		if (packet_id == COMM_SET_MCCONF_DELTA) {
+			ok = confdelta_deserialize_mcconf(data, len, mcconf);
+		} else {
+			ok = confgenerator_deserialize_mcconf(data, mcconf);
+		}
+
+		if (ok) {
 			utils_truncate_number(&mcconf->l_current_max_scale , 0.0, 1.0);
 			utils_truncate_number(&mcconf->l_current_min_scale , 0.0, 1.0);
 
@@ -460,10 +566,11 @@ void commands_process_packet(unsigned char *data, unsigned int len,
 	} break;
 
 	case COMM_GET_MCCONF:
-	case COMM_GET_MCCONF_DEFAULT: {
+	case COMM_GET_MCCONF_DEFAULT:
+	case COMM_GET_MCCONF_DELTA: {
 		mc_configuration *mcconf = mempools_alloc_mcconf();
 
-		if (packet_id == COMM_GET_MCCONF) {
+		if (packet_id != COMM_GET_MCCONF_DEFAULT) {
 			*mcconf = *mc_interface_get_configuration();
 		} else {
 			confgenerator_set_defaults_mcconf(mcconf, true);
@@ -473,11 +580,19 @@ void commands_process_packet(unsigned char *data, unsigned int len,
 		mempools_free_mcconf(mcconf);
 	} break;
 
-	case COMM_SET_APPCONF: {
+	case COMM_SET_APPCONF:
+	case COMM_SET_APPCONF_DELTA: {
 		app_configuration *appconf = mempools_alloc_appconf();
 		*appconf = *app_get_configuration();
 #ifdef _STORE_CONFIGS_
-		if (confgenerator_deserialize_appconf(data, appconf)) {
+		bool ok = false;
+		if (packet_id == COMM_SET_APPCONF_DELTA) {
+			ok = confdelta_deserialize_appconf(data, len, appconf);
+		} else {
+			ok = confgenerator_deserialize_appconf(data, appconf);
+		}
+
+		if (ok) {
 #ifdef HW_HAS_DUAL_MOTORS
 			// Ignore ID when setting second motor config
 			if (mc_interface_get_motor_thread() == 2) {
@@ -503,10 +618,11 @@ void commands_process_packet(unsigned char *data, unsigned int len,
 	} break;
 
 	case COMM_GET_APPCONF:
-	case COMM_GET_APPCONF_DEFAULT: {
+	case COMM_GET_APPCONF_DEFAULT:
+	case COMM_GET_APPCONF_DELTA: {
 		app_configuration *appconf = mempools_alloc_appconf();
 
-		if (packet_id == COMM_GET_APPCONF) {
+		if (packet_id != COMM_GET_APPCONF_DEFAULT) {
 			*appconf = *app_get_configuration();
 		} else {
 			confgenerator_set_defaults_appconf(appconf);
@@ -527,12 +643,18 @@ void commands_process_packet(unsigned char *data, unsigned int len,
 		uint16_t sample_len;
 		uint8_t decimation;
 		debug_sampling_mode mode;
+		debug_sampling_format format = DEBUG_SAMPLING_FORMAT_PACKETS;
 
 		int32_t ind = 0;
 		mode = data[ind++];
 		sample_len = buffer_get_uint16(data, &ind);
 		decimation = data[ind++];
-		mc_interface_sample_print_data(mode, sample_len, decimation);
+
+		if (len > (unsigned int)ind) {
+			format = data[ind++];
+		}
+
+		mc_interface_sample_print_data(mode, sample_len, decimation, format);
 	} break;
 
 	case COMM_REBOOT:
@@ -702,6 +824,8 @@ void commands_process_packet(unsigned char *data, unsigned int len,
 	case COMM_GET_VALUES_SETUP:
 	case COMM_GET_VALUES_SETUP_SELECTIVE: {
 		setup_values val = mc_interface_get_setup_values();
+		mc_snapshot s;
+		mc_interface_get_snapshot(&s);
 
 		float wh_batt_left = 0.0;
 		float battery_level = mc_interface_get_battery_level(&wh_batt_left);
@@ -719,10 +843,10 @@ void commands_process_packet(unsigned char *data, unsigned int len,
 		}
 
 		if (mask & ((uint32_t)1 << 0)) {
-			buffer_append_float16(send_buffer, mc_interface_temp_fet_filtered(), 1e1, &ind);
+			buffer_append_float16(send_buffer, s.temp_fet, 1e1, &ind);
 		}
 		if (mask & ((uint32_t)1 << 1)) {
-			buffer_append_float16(send_buffer, mc_interface_temp_motor_filtered(), 1e1, &ind);
+			buffer_append_float16(send_buffer, s.temp_motor, 1e1, &ind);
 		}
 		if (mask & ((uint32_t)1 << 2)) {
 			buffer_append_float32(send_buffer, val.current_tot, 1e2, &ind);
@@ -731,16 +855,16 @@ void commands_process_packet(unsigned char *data, unsigned int len,
 			buffer_append_float32(send_buffer, val.current_in_tot, 1e2, &ind);
 		}
 		if (mask & ((uint32_t)1 << 4)) {
-			buffer_append_float16(send_buffer, mc_interface_get_duty_cycle_now(), 1e3, &ind);
+			buffer_append_float16(send_buffer, s.duty_now, 1e3, &ind);
 		}
 		if (mask & ((uint32_t)1 << 5)) {
-			buffer_append_float32(send_buffer, mc_interface_get_rpm(), 1e0, &ind);
+			buffer_append_float32(send_buffer, s.rpm, 1e0, &ind);
 		}
 		if (mask & ((uint32_t)1 << 6)) {
 			buffer_append_float32(send_buffer, mc_interface_get_speed(), 1e3, &ind);
 		}
 		if (mask & ((uint32_t)1 << 7)) {
-			buffer_append_float16(send_buffer, GET_INPUT_VOLTAGE(), 1e1, &ind);
+			buffer_append_float16(send_buffer, s.v_in, 1e1, &ind);
 		}
 		if (mask & ((uint32_t)1 << 8)) {
 			buffer_append_float16(send_buffer, battery_level, 1e3, &ind);
@@ -764,10 +888,10 @@ void commands_process_packet(unsigned char *data, unsigned int len,
 			buffer_append_float32(send_buffer, mc_interface_get_distance_abs(), 1e3, &ind);
 		}
 		if (mask & ((uint32_t)1 << 15)) {
-			buffer_append_float32(send_buffer, mc_interface_get_pid_pos_now(), 1e6, &ind);
+			buffer_append_float32(send_buffer, s.position, 1e6, &ind);
 		}
 		if (mask & ((uint32_t)1 << 16)) {
-			send_buffer[ind++] = mc_interface_get_fault();
+			send_buffer[ind++] = s.fault;
 		}
 		if (mask & ((uint32_t)1 << 17)) {
 			send_buffer[ind++] = app_get_configuration()->controller_id;
@@ -1101,6 +1225,55 @@ void commands_process_packet(unsigned char *data, unsigned int len,
 		}
 	} break;
 
+	case COMM_TELEMETRY_SUBSCRIBE: {
+		int32_t ind = 0;
+		uint32_t mask = buffer_get_uint32(data, &ind);
+		uint16_t rate = buffer_get_uint16(data, &ind);
+
+		rate = telemetry_subscribe(mask, rate, reply_func);
+
+		ind = 0;
+		uint8_t send_buffer[50];
+		send_buffer[ind++] = packet_id;
+		buffer_append_uint32(send_buffer, mask, &ind);
+		buffer_append_uint16(send_buffer, rate, &ind);
+		buffer_append_uint32(send_buffer, CH_CFG_ST_FREQUENCY, &ind);
+		reply_func(send_buffer, ind);
+	} break;
+
+	case COMM_GET_ISR_PROFILE: {
+		// Optional reset after reading
+		bool reset = len > 0 && data[0];
+
+		int32_t ind = 0;
+		uint8_t send_buffer[8 + ISR_PROF_MOTORS * ISR_PROF_NUM * 32];
+		send_buffer[ind++] = packet_id;
+		send_buffer[ind++] = ISR_PROF_NUM;
+		send_buffer[ind++] = ISR_PROF_MOTORS;
+
+		for (int m = 0;m < ISR_PROF_MOTORS;m++) {
+			for (int i = 0;i < ISR_PROF_NUM;i++) {
+				isr_prof_stats s;
+				isr_prof_get_stats(i, m == 1, &s);
+
+				buffer_append_uint32(send_buffer, s.count, &ind);
+				buffer_append_float32_auto(send_buffer, s.period_avg, &ind);
+				buffer_append_float32_auto(send_buffer, s.duration_p50, &ind);
+				buffer_append_float32_auto(send_buffer, s.duration_p99, &ind);
+				buffer_append_float32_auto(send_buffer, s.duration_max, &ind);
+				buffer_append_float32_auto(send_buffer, s.jitter_p50, &ind);
+				buffer_append_float32_auto(send_buffer, s.jitter_p99, &ind);
+				buffer_append_float32_auto(send_buffer, s.jitter_max, &ind);
+			}
+		}
+
+		if (reset) {
+			isr_prof_reset();
+		}
+
+		reply_func(send_buffer, ind);
+	} break;
+
 	// Blocking commands. Only one of them runs at any given time, in their
 	// own thread. If other blocking commands come before the previous one has
 	// finished, they are discarded.
@@ -1225,16 +1398,52 @@ void commands_send_gpd_buffer_notify(void) {
 
 void commands_send_mcconf(COMM_PACKET_ID packet_id, mc_configuration *mcconf) {
 	chMtxLock(&send_buffer_mutex);
+	int32_t len = -1;
+
+	// The delta is against the defaults. When nearly everything differs it
+	// can be larger than the full configuration, so send that instead.
+	if (packet_id == COMM_GET_MCCONF_DELTA) {
+		mc_configuration *defaults = mempools_alloc_mcconf();
+		confgenerator_set_defaults_mcconf(defaults, true);
+		len = confdelta_serialize_mcconf(send_buffer_global + 1, PACKET_MAX_PL_LEN - 1,
+				mcconf, defaults, CONF_DELTA_BASE_DEFAULT);
+		mempools_free_mcconf(defaults);
+
+		if (len < 0) {
+			packet_id = COMM_GET_MCCONF;
+		}
+	}
+
+	if (len < 0) {
+		len = confgenerator_serialize_mcconf(send_buffer_global + 1, mcconf);
+	}
+
 	send_buffer_global[0] = packet_id;
-	int32_t len = confgenerator_serialize_mcconf(send_buffer_global + 1, mcconf);
 	commands_send_packet(send_buffer_global, len + 1);
 	chMtxUnlock(&send_buffer_mutex);
 }
 
 void commands_send_appconf(COMM_PACKET_ID packet_id, app_configuration *appconf) {
 	chMtxLock(&send_buffer_mutex);
+	int32_t len = -1;
+
+	if (packet_id == COMM_GET_APPCONF_DELTA) {
+		app_configuration *defaults = mempools_alloc_appconf();
+		confgenerator_set_defaults_appconf(defaults);
+		len = confdelta_serialize_appconf(send_buffer_global + 1, PACKET_MAX_PL_LEN - 1,
+				appconf, defaults, CONF_DELTA_BASE_DEFAULT);
+		mempools_free_appconf(defaults);
+
+		if (len < 0) {
+			packet_id = COMM_GET_APPCONF;
+		}
+	}
+
+	if (len < 0) {
+		len = confgenerator_serialize_appconf(send_buffer_global + 1, appconf);
+	}
+
 	send_buffer_global[0] = packet_id;
-	int32_t len = confgenerator_serialize_appconf(send_buffer_global + 1, appconf);
 	commands_send_packet(send_buffer_global, len + 1);
 	chMtxUnlock(&send_buffer_mutex);
 }
@@ -33,6 +33,7 @@
 #include "confgenerator.h"
 #include "mempools.h"
 #include "worker.h"
+#include "flash_helper.h"
 
 #include <applications/settings.h>
 #include <string.h>
@@ -45,10 +46,16 @@
 #define EEPROM_BASE_CUSTOM		4000
 #define EEPROM_BASE_MCCONF_2	5000
 
+#define STORE_WORDS_MAX			((sizeof(mc_configuration) > sizeof(app_configuration) ? \
+								sizeof(mc_configuration) : sizeof(app_configuration)) / 2)
+
 // Global variables
 uint16_t VirtAddVarTab[NB_OF_VAR];
 bool conf_general_permanent_nrf_found = false;
 
+// Private variables
+static uint16_t m_store_words[STORE_WORDS_MAX];
+
 // Private functions
 static bool read_eeprom_var(eeprom_var *v, int address, uint16_t base);
 static bool store_eeprom_var(eeprom_var *v, int address, uint16_t base);
@@ -74,11 +81,13 @@ void conf_general_init(void) {
 		VirtAddVarTab[ind++] = EEPROM_BASE_CUSTOM + i;
 	}
 
+	flash_helper_lock();
 	FLASH_Unlock();
 	FLASH_ClearFlag(FLASH_FLAG_OPERR | FLASH_FLAG_WRPERR | FLASH_FLAG_PGAERR |
 			FLASH_FLAG_PGPERR | FLASH_FLAG_PGSERR);
 	EE_Init();
 	FLASH_Lock();
+	flash_helper_unlock();
 }
 
 /**
@@ -149,6 +158,7 @@ static bool read_eeprom_var(eeprom_var *v, int address, uint16_t base) {
 	bool is_ok = true;
 	uint16_t var0, var1;
 
+	flash_helper_lock();
 	if (EE_ReadVariable(base + 2 * address, &var0) == 0 &&
 			EE_ReadVariable(base + 2 * address + 1, &var1) == 0) {
 		uint32_t res = ((uint32_t)var0) << 16 | var1;
@@ -156,6 +166,7 @@ static bool read_eeprom_var(eeprom_var *v, int address, uint16_t base) {
 	} else {
 		is_ok = false;
 	}
+	flash_helper_unlock();
 
 	return is_ok;
 }
@@ -169,6 +180,7 @@ static bool store_eeprom_var(eeprom_var *v, int address, uint16_t base) {
 
 	timeout_configure_IWDT_slowest();
 
+	flash_helper_lock();
 	FLASH_Unlock();
 	FLASH_ClearFlag(FLASH_FLAG_OPERR | FLASH_FLAG_WRPERR | FLASH_FLAG_PGAERR |
 			FLASH_FLAG_PGPERR | FLASH_FLAG_PGSERR);
@@ -184,6 +196,7 @@ static bool store_eeprom_var(eeprom_var *v, int address, uint16_t base) {
 	}
 
 	FLASH_Lock();
+	flash_helper_unlock();
 
 	timeout_configure_IWDT();
 
@@ -201,6 +214,7 @@ void conf_general_read_app_configuration(app_configuration *conf) {
 	uint8_t *conf_addr = (uint8_t*)conf;
 	uint16_t var;
 
+	flash_helper_lock();
 	for (unsigned int i = 0;i < (sizeof(app_configuration) / 2);i++) {
 		if (EE_ReadVariable(EEPROM_BASE_APPCONF + i, &var) == 0) {
 			conf_addr[2 * i] = (var >> 8) & 0xFF;
@@ -210,6 +224,7 @@ void conf_general_read_app_configuration(app_configuration *conf) {
 			break;
 		}
 	}
+	flash_helper_unlock();
 
 	// Set the default configuration
 	if (!is_ok) {
@@ -225,55 +240,8 @@ void conf_general_read_app_configuration(app_configuration *conf) {
  * A pointer to the configuration that should be stored.
  */
 bool conf_general_store_app_configuration(app_configuration *conf) {
-	int motor_old = mc_interface_get_motor_thread();
-
-	mc_interface_select_motor_thread(1);
-	mc_interface_unlock();
-	mc_interface_release_motor();
-	mc_interface_lock();
-
-	mc_interface_select_motor_thread(2);
-	mc_interface_unlock();
-	mc_interface_release_motor();
-	mc_interface_lock();
-
-	utils_sys_lock_cnt();
-
-	timeout_configure_IWDT_slowest();
-
-	bool is_ok = true;
-	uint8_t *conf_addr = (uint8_t*)conf;
-	uint16_t var;
-
-	FLASH_Unlock();
-	FLASH_ClearFlag(FLASH_FLAG_OPERR | FLASH_FLAG_WRPERR | FLASH_FLAG_PGAERR |
-			FLASH_FLAG_PGPERR | FLASH_FLAG_PGSERR);
-
-	for (unsigned int i = 0;i < (sizeof(app_configuration) / 2);i++) {
-		var = (conf_addr[2 * i] << 8) & 0xFF00;
-		var |= conf_addr[2 * i + 1] & 0xFF;
-
-		if (EE_WriteVariable(EEPROM_BASE_APPCONF + i, var) != FLASH_COMPLETE) {
-			is_ok = false;
-			break;
-		}
-	}
-	FLASH_Lock();
-
-	timeout_configure_IWDT();
-
-	chThdSleepMilliseconds(100);
-
-	mc_interface_select_motor_thread(1);
-	mc_interface_unlock();
-	mc_interface_select_motor_thread(2);
-	mc_interface_unlock();
-
-	utils_sys_unlock_cnt();
-
-	mc_interface_select_motor_thread(motor_old);
-
-	return is_ok;
+	return conf_general_store_diff(EEPROM_BASE_APPCONF, (uint8_t*)conf,
+			sizeof(app_configuration), 0);
 }
 
 /**
@@ -288,6 +256,7 @@ void conf_general_read_mc_configuration(mc_configuration *conf, bool is_motor_2)
 	uint16_t var;
 	unsigned int base = is_motor_2 ? EEPROM_BASE_MCCONF_2 : EEPROM_BASE_MCCONF;
 
+	flash_helper_lock();
 	for (unsigned int i = 0;i < (sizeof(mc_configuration) / 2);i++) {
 		if (EE_ReadVariable(base + i, &var) == 0) {
 			conf_addr[2 * i] = (var >> 8) & 0xFF;
@@ -297,6 +266,7 @@ void conf_general_read_mc_configuration(mc_configuration *conf, bool is_motor_2)
 			break;
 		}
 	}
+	flash_helper_unlock();
 
 	if (!is_ok) {
 		confgenerator_set_defaults_mcconf(conf, true);
@@ -316,6 +286,64 @@ void conf_general_read_mc_configuration(mc_configuration *conf, bool is_motor_2)
  * A pointer to the configuration that should be stored.
  */
 bool conf_general_store_mc_configuration(mc_configuration *conf, bool is_motor_2) {
+	return conf_general_store_diff(is_motor_2 ? EEPROM_BASE_MCCONF_2 : EEPROM_BASE_MCCONF,
+			(uint8_t*)conf, sizeof(mc_configuration), 0);
+}
+
+/**
+ * Store a block of data in emulated EEPROM, only programming the words that
+ * differ from what is stored already. The motors are released while the flash
+ * is written, but if nothing changed they are not touched at all.
+ *
+ * @param base
+ * The virtual address of the first word.
+ *
+ * @param data
+ * The data to store. Every two bytes are stored as one big endian word, a
+ * trailing odd byte is not stored.
+ *
+ * @param len
+ * Length of data in bytes.
+ *
+ * @param programmed
+ * If not null, the number of words that were programmed to flash will be
+ * written here. This includes the words moved if the page had to be compacted.
+ *
+ * @return
+ * true for success, false if something went wrong.
+ */
+bool conf_general_store_diff(uint16_t base, const uint8_t *data, unsigned int len, int *programmed) {
+	unsigned int words = len / 2;
+	bool changed = false;
+
+	if (programmed) {
+		*programmed = 0;
+	}
+
+	if (words > STORE_WORDS_MAX) {
+		return false;
+	}
+
+	// Held from the comparison until the block is written, as the EEPROM
+	// and m_store_words are shared with other writers
+	flash_helper_lock();
+
+	for (unsigned int i = 0;i < words;i++) {
+		uint16_t var_old;
+		uint16_t var = (data[2 * i] << 8) & 0xFF00;
+		var |= data[2 * i + 1] & 0xFF;
+
+		if (EE_ReadVariable(base + i, &var_old) != 0 || var_old != var) {
+			changed = true;
+			break;
+		}
+	}
+
+	if (!changed) {
+		flash_helper_unlock();
+		return true;
+	}
+
 	int motor_old = mc_interface_get_motor_thread();
 
 	mc_interface_select_motor_thread(1);
@@ -332,23 +360,17 @@ bool conf_general_store_mc_configuration(mc_configuration *conf, bool is_motor_2
 
 	timeout_configure_IWDT_slowest();
 
-	bool is_ok = true;
-	uint8_t *conf_addr = (uint8_t*)conf;
-	unsigned int base = is_motor_2 ? EEPROM_BASE_MCCONF_2 : EEPROM_BASE_MCCONF;
+	for (unsigned int i = 0;i < words;i++) {
+		m_store_words[i] = (data[2 * i] << 8) & 0xFF00;
+		m_store_words[i] |= data[2 * i + 1] & 0xFF;
+	}
+
+	uint16_t written = 0;
 
 	FLASH_Unlock();
 	FLASH_ClearFlag(FLASH_FLAG_OPERR | FLASH_FLAG_WRPERR | FLASH_FLAG_PGAERR |
 			FLASH_FLAG_PGPERR | FLASH_FLAG_PGSERR);
-
-	for (unsigned int i = 0;i < (sizeof(mc_configuration) / 2);i++) {
-		uint16_t var = (conf_addr[2 * i] << 8) & 0xFF00;
-		var |= conf_addr[2 * i + 1] & 0xFF;
-
-		if (EE_WriteVariable(base + i, var) != FLASH_COMPLETE) {
-			is_ok = false;
-			break;
-		}
-	}
+	bool is_ok = EE_WriteBlock(base, m_store_words, words, &written) == FLASH_COMPLETE;
 	FLASH_Lock();
 
 	timeout_configure_IWDT();
@@ -361,9 +383,14 @@ bool conf_general_store_mc_configuration(mc_configuration *conf, bool is_motor_2
 	mc_interface_unlock();
 
 	utils_sys_unlock_cnt();
+	flash_helper_unlock();
 
 	mc_interface_select_motor_thread(motor_old);
 
+	if (programmed) {
+		*programmed = written;
+	}
+
 	return is_ok;
 }
 
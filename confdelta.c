@@ -0,0 +1,541 @@
+/*
+	Copyright 2026 agent	agent@local
+
+	This file is part of the VESC firmware.
+
+	The VESC firmware is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    The VESC firmware is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+#include "confdelta.h"
+#include "confgenerator.h"
+#include "buffer.h"
+#include <string.h>
+#include <stddef.h>
+
+/*
+ * Delta encoding of mc_configuration and app_configuration, as the list of
+ * fields that differ from a base. The field tables follow the full
+ * serialization in confgenerator.c, which is generated by VESC Tool, and
+ * have to be updated with it.
+ */
+
+// Field types in the serialized configuration
+typedef enum {
+	CONF_FIELD_U8 = 0,
+	CONF_FIELD_I8,
+	CONF_FIELD_U16,
+	CONF_FIELD_I16,
+	CONF_FIELD_U32,
+	CONF_FIELD_I32,
+	CONF_FIELD_F32
+} CONF_FIELD_TYPE;
+
+typedef struct {
+	uint16_t offset;
+	uint8_t size;
+	uint8_t type;
+} conf_field;
+
+#define CONF_FIELD(conf_type, member, field_type) \
+	{offsetof(conf_type, member), sizeof(((conf_type*)0)->member), field_type}
+
+// Private functions
+static int32_t serialize_delta(uint8_t *buffer, int32_t max_len, uint32_t signature,
+		const conf_field *fields, int field_num,
+		const uint8_t *conf, const uint8_t *base, CONF_DELTA_BASE base_type);
+static int delta_check(const uint8_t *buffer, int32_t len, uint32_t signature,
+		const conf_field *fields, int field_num);
+static void delta_apply(const uint8_t *buffer, int32_t len,
+		const conf_field *fields, uint8_t *conf);
+
+// Field tables for the delta encoding, in the same order as the full serialization.
+// The index in the table is the field ID.
+
+static const conf_field mcconf_fields[] = {
+	CONF_FIELD(mc_configuration, pwm_mode, CONF_FIELD_U8),
+	CONF_FIELD(mc_configuration, comm_mode, CONF_FIELD_U8),
+	CONF_FIELD(mc_configuration, motor_type, CONF_FIELD_U8),
+	CONF_FIELD(mc_configuration, sensor_mode, CONF_FIELD_U8),
+	CONF_FIELD(mc_configuration, l_current_max, CONF_FIELD_F32),
+	CONF_FIELD(mc_configuration, l_current_min, CONF_FIELD_F32),
+	CONF_FIELD(mc_configuration, l_in_current_max, CONF_FIELD_F32),
+	CONF_FIELD(mc_configuration, l_in_current_min, CONF_FIELD_F32),
+	CONF_FIELD(mc_configuration, l_abs_current_max, CONF_FIELD_F32),
+	CONF_FIELD(mc_configuration, l_min_erpm, CONF_FIELD_F32),
+	CONF_FIELD(mc_configuration, l_max_erpm, CONF_FIELD_F32),
+	CONF_FIELD(mc_configuration, l_erpm_start, CONF_FIELD_F32),
+	CONF_FIELD(mc_configuration, l_max_erpm_fbrake, CONF_FIELD_F32),
+	CONF_FIELD(mc_configuration, l_max_erpm_fbrake_cc, CONF_FIELD_F32),
+	CONF_FIELD(mc_configuration, l_min_vin, CONF_FIELD_F32),
+	CONF_FIELD(mc_configuration, l_max_vin, CONF_FIELD_F32),
+	CONF_FIELD(mc_configuration, l_battery_cut_start, CONF_FIELD_F32),
+	CONF_FIELD(mc_configuration, l_battery_cut_end, CONF_FIELD_F32),
+	CONF_FIELD(mc_configuration, l_slow_abs_current, CONF_FIELD_U8),
+	CONF_FIELD(mc_configuration, l_temp_fet_start, CONF_FIELD_F32),
+	CONF_FIELD(mc_configuration, l_temp_fet_end, CONF_FIELD_F32),
+	CONF_FIELD(mc_configuration, l_temp_motor_start, CONF_FIELD_F32),
+	CONF_FIELD(mc_configuration, l_temp_motor_end, CONF_FIELD_F32),
+	CONF_FIELD(mc_configuration, l_temp_accel_dec, CONF_FIELD_F32),
+	CONF_FIELD(mc_configuration, l_min_duty, CONF_FIELD_F32),
+	CONF_FIELD(mc_configuration, l_max_duty, CONF_FIELD_F32),
+	CONF_FIELD(mc_configuration, l_watt_max, CONF_FIELD_F32),
+	CONF_FIELD(mc_configuration, l_watt_min, CONF_FIELD_F32),
+	CONF_FIELD(mc_configuration, l_current_max_scale, CONF_FIELD_F32),
+	CONF_FIELD(mc_configuration, l_current_min_scale, CONF_FIELD_F32),
+	CONF_FIELD(mc_configuration, l_duty_start, CONF_FIELD_F32),
+	CONF_FIELD(mc_configuration, sl_min_erpm, CONF_FIELD_F32),
+	CONF_FIELD(mc_configuration, sl_min_erpm_cycle_int_limit, CONF_FIELD_F32),
+	CONF_FIELD(mc_configuration, sl_max_fullbreak_current_dir_change, CONF_FIELD_F32),
+	CONF_FIELD(mc_configuration, sl_cycle_int_limit, CONF_FIELD_F32),
+	CONF_FIELD(mc_configuration, sl_phase_advance_at_br, CONF_FIELD_F32),
+	CONF_FIELD(mc_configuration, sl_cycle_int_rpm_br, CONF_FIELD_F32),
+	CONF_FIELD(mc_configuration, sl_bemf_coupling_k, CONF_FIELD_F32),
+	CONF_FIELD(mc_configuration, hall_table[0], CONF_FIELD_I8),
+	CONF_FIELD(mc_configuration, hall_table[1], CONF_FIELD_I8),
+	CONF_FIELD(mc_configuration, hall_table[2], CONF_FIELD_I8),
+	CONF_FIELD(mc_configuration, hall_table[3], CONF_FIELD_I8),
+	CONF_FIELD(mc_configuration, hall_table[4], CONF_FIELD_I8),
+	CONF_FIELD(mc_configuration, hall_table[5], CONF_FIELD_I8),
+	CONF_FIELD(mc_configuration, hall_table[6], CONF_FIELD_I8),
+	CONF_FIELD(mc_configuration, hall_table[7], CONF_FIELD_I8),
+	CONF_FIELD(mc_configuration, hall_sl_erpm, CONF_FIELD_F32),
+	CONF_FIELD(mc_configuration, foc_current_kp, CONF_FIELD_F32),
+	CONF_FIELD(mc_configuration, foc_current_ki, CONF_FIELD_F32),
+	CONF_FIELD(mc_configuration, foc_f_sw, CONF_FIELD_F32),
+	CONF_FIELD(mc_configuration, foc_dt_us, CONF_FIELD_F32),
+	CONF_FIELD(mc_configuration, foc_encoder_inverted, CONF_FIELD_U8),
+	CONF_FIELD(mc_configuration, foc_encoder_offset, CONF_FIELD_F32),
+	CONF_FIELD(mc_configuration, foc_encoder_ratio, CONF_FIELD_F32),
+	CONF_FIELD(mc_configuration, foc_encoder_sin_gain, CONF_FIELD_F32),
+	CONF_FIELD(mc_configuration, foc_encoder_cos_gain, CONF_FIELD_F32),
+	CONF_FIELD(mc_configuration, foc_encoder_sin_offset, CONF_FIELD_F32),
+	CONF_FIELD(mc_configuration, foc_encoder_cos_offset, CONF_FIELD_F32),
+	CONF_FIELD(mc_configuration, foc_encoder_sincos_filter_constant, CONF_FIELD_F32),
+	CONF_FIELD(mc_configuration, foc_sensor_mode, CONF_FIELD_U8),
+	CONF_FIELD(mc_configuration, foc_pll_kp, CONF_FIELD_F32),
+	CONF_FIELD(mc_configuration, foc_pll_ki, CONF_FIELD_F32),
+	CONF_FIELD(mc_configuration, foc_motor_l, CONF_FIELD_F32),
+	CONF_FIELD(mc_configuration, foc_motor_r, CONF_FIELD_F32),
+	CONF_FIELD(mc_configuration, foc_motor_flux_linkage, CONF_FIELD_F32),
+	CONF_FIELD(mc_configuration, foc_observer_gain, CONF_FIELD_F32),
+	CONF_FIELD(mc_configuration, foc_observer_gain_slow, CONF_FIELD_F32),
+	CONF_FIELD(mc_configuration, foc_duty_dowmramp_kp, CONF_FIELD_F32),
+	CONF_FIELD(mc_configuration, foc_duty_dowmramp_ki, CONF_FIELD_F32),
+	CONF_FIELD(mc_configuration, foc_openloop_rpm, CONF_FIELD_F32),
+	CONF_FIELD(mc_configuration, foc_sl_openloop_hyst, CONF_FIELD_F32),
+	CONF_FIELD(mc_configuration, foc_sl_openloop_time, CONF_FIELD_F32),
+	CONF_FIELD(mc_configuration, foc_sl_d_current_duty, CONF_FIELD_F32),
+	CONF_FIELD(mc_configuration, foc_sl_d_current_factor, CONF_FIELD_F32),
+	CONF_FIELD(mc_configuration, foc_hall_table[0], CONF_FIELD_U8),
+	CONF_FIELD(mc_configuration, foc_hall_table[1], CONF_FIELD_U8),
+	CONF_FIELD(mc_configuration, foc_hall_table[2], CONF_FIELD_U8),
+	CONF_FIELD(mc_configuration, foc_hall_table[3], CONF_FIELD_U8),
+	CONF_FIELD(mc_configuration, foc_hall_table[4], CONF_FIELD_U8),
+	CONF_FIELD(mc_configuration, foc_hall_table[5], CONF_FIELD_U8),
+	CONF_FIELD(mc_configuration, foc_hall_table[6], CONF_FIELD_U8),
+	CONF_FIELD(mc_configuration, foc_hall_table[7], CONF_FIELD_U8),
+	CONF_FIELD(mc_configuration, foc_sl_erpm, CONF_FIELD_F32),
+	CONF_FIELD(mc_configuration, foc_sample_v0_v7, CONF_FIELD_U8),
+	CONF_FIELD(mc_configuration, foc_sample_high_current, CONF_FIELD_U8),
+	CONF_FIELD(mc_configuration, foc_sat_comp, CONF_FIELD_F32),
+	CONF_FIELD(mc_configuration, foc_temp_comp, CONF_FIELD_U8),
+	CONF_FIELD(mc_configuration, foc_temp_comp_base_temp, CONF_FIELD_F32),
+	CONF_FIELD(mc_configuration, foc_current_filter_const, CONF_FIELD_F32),
+	CONF_FIELD(mc_configuration, foc_cc_decoupling, CONF_FIELD_U8),
+	CONF_FIELD(mc_configuration, foc_observer_type, CONF_FIELD_U8),
+	CONF_FIELD(mc_configuration, foc_hfi_voltage_start, CONF_FIELD_F32),
+	CONF_FIELD(mc_configuration, foc_hfi_voltage_run, CONF_FIELD_F32),
+	CONF_FIELD(mc_configuration, foc_hfi_voltage_max, CONF_FIELD_F32),
+	CONF_FIELD(mc_configuration, foc_sl_erpm_hfi, CONF_FIELD_F32),
+	CONF_FIELD(mc_configuration, foc_hfi_start_samples, CONF_FIELD_U16),
+	CONF_FIELD(mc_configuration, foc_hfi_obs_ovr_sec, CONF_FIELD_F32),
+	CONF_FIELD(mc_configuration, foc_hfi_samples, CONF_FIELD_U8),
+	CONF_FIELD(mc_configuration, gpd_buffer_notify_left, CONF_FIELD_I16),
+	CONF_FIELD(mc_configuration, gpd_buffer_interpol, CONF_FIELD_I16),
+	CONF_FIELD(mc_configuration, gpd_current_filter_const, CONF_FIELD_F32),
+	CONF_FIELD(mc_configuration, gpd_current_kp, CONF_FIELD_F32),
+	CONF_FIELD(mc_configuration, gpd_current_ki, CONF_FIELD_F32),
+	CONF_FIELD(mc_configuration, s_pid_kp, CONF_FIELD_F32),
+	CONF_FIELD(mc_configuration, s_pid_ki, CONF_FIELD_F32),
+	CONF_FIELD(mc_configuration, s_pid_kd, CONF_FIELD_F32),
+	CONF_FIELD(mc_configuration, s_pid_kd_filter, CONF_FIELD_F32),
+	CONF_FIELD(mc_configuration, s_pid_min_erpm, CONF_FIELD_F32),
+	CONF_FIELD(mc_configuration, s_pid_allow_braking, CONF_FIELD_U8),
+	CONF_FIELD(mc_configuration, p_pid_kp, CONF_FIELD_F32),
+	CONF_FIELD(mc_configuration, p_pid_ki, CONF_FIELD_F32),
+	CONF_FIELD(mc_configuration, p_pid_kd, CONF_FIELD_F32),
+	CONF_FIELD(mc_configuration, p_pid_kd_filter, CONF_FIELD_F32),
+	CONF_FIELD(mc_configuration, p_pid_ang_div, CONF_FIELD_F32),
+	CONF_FIELD(mc_configuration, cc_startup_boost_duty, CONF_FIELD_F32),
+	CONF_FIELD(mc_configuration, cc_min_current, CONF_FIELD_F32),
+	CONF_FIELD(mc_configuration, cc_gain, CONF_FIELD_F32),
+	CONF_FIELD(mc_configuration, cc_ramp_step_max, CONF_FIELD_F32),
+	CONF_FIELD(mc_configuration, m_fault_stop_time_ms, CONF_FIELD_I32),
+	CONF_FIELD(mc_configuration, m_duty_ramp_step, CONF_FIELD_F32),
+	CONF_FIELD(mc_configuration, m_current_backoff_gain, CONF_FIELD_F32),
+	CONF_FIELD(mc_configuration, m_encoder_counts, CONF_FIELD_U32),
+	CONF_FIELD(mc_configuration, m_sensor_port_mode, CONF_FIELD_U8),
+	CONF_FIELD(mc_configuration, m_invert_direction, CONF_FIELD_U8),
+	CONF_FIELD(mc_configuration, m_drv8301_oc_mode, CONF_FIELD_U8),
+	CONF_FIELD(mc_configuration, m_drv8301_oc_adj, CONF_FIELD_U8),
+	CONF_FIELD(mc_configuration, m_bldc_f_sw_min, CONF_FIELD_F32),
+	CONF_FIELD(mc_configuration, m_bldc_f_sw_max, CONF_FIELD_F32),
+	CONF_FIELD(mc_configuration, m_dc_f_sw, CONF_FIELD_F32),
+	CONF_FIELD(mc_configuration, m_ntc_motor_beta, CONF_FIELD_F32),
+	CONF_FIELD(mc_configuration, m_out_aux_mode, CONF_FIELD_U8),
+	CONF_FIELD(mc_configuration, m_motor_temp_sens_type, CONF_FIELD_U8),
+	CONF_FIELD(mc_configuration, m_ptc_motor_coeff, CONF_FIELD_F32),
+	CONF_FIELD(mc_configuration, si_motor_poles, CONF_FIELD_U8),
+	CONF_FIELD(mc_configuration, si_gear_ratio, CONF_FIELD_F32),
+	CONF_FIELD(mc_configuration, si_wheel_diameter, CONF_FIELD_F32),
+	CONF_FIELD(mc_configuration, si_battery_type, CONF_FIELD_U8),
+	CONF_FIELD(mc_configuration, si_battery_cells, CONF_FIELD_U8),
+	CONF_FIELD(mc_configuration, si_battery_ah, CONF_FIELD_F32),
+};
+
+static const conf_field appconf_fields[] = {
+	CONF_FIELD(app_configuration, controller_id, CONF_FIELD_U8),
+	CONF_FIELD(app_configuration, timeout_msec, CONF_FIELD_U32),
+	CONF_FIELD(app_configuration, timeout_brake_current, CONF_FIELD_F32),
+	CONF_FIELD(app_configuration, send_can_status, CONF_FIELD_U8),
+	CONF_FIELD(app_configuration, send_can_status_rate_hz, CONF_FIELD_U16),
+	CONF_FIELD(app_configuration, can_baud_rate, CONF_FIELD_U8),
+	CONF_FIELD(app_configuration, pairing_done, CONF_FIELD_U8),
+	CONF_FIELD(app_configuration, permanent_uart_enabled, CONF_FIELD_U8),
+	CONF_FIELD(app_configuration, shutdown_mode, CONF_FIELD_U8),
+	CONF_FIELD(app_configuration, can_mode, CONF_FIELD_U8),
+	CONF_FIELD(app_configuration, uavcan_esc_index, CONF_FIELD_U8),
+	CONF_FIELD(app_configuration, app_to_use, CONF_FIELD_U8),
+	CONF_FIELD(app_configuration, app_ppm_conf.ctrl_type, CONF_FIELD_U8),
+	CONF_FIELD(app_configuration, app_ppm_conf.pid_max_erpm, CONF_FIELD_F32),
+	CONF_FIELD(app_configuration, app_ppm_conf.hyst, CONF_FIELD_F32),
+	CONF_FIELD(app_configuration, app_ppm_conf.pulse_start, CONF_FIELD_F32),
+	CONF_FIELD(app_configuration, app_ppm_conf.pulse_end, CONF_FIELD_F32),
+	CONF_FIELD(app_configuration, app_ppm_conf.pulse_center, CONF_FIELD_F32),
+	CONF_FIELD(app_configuration, app_ppm_conf.median_filter, CONF_FIELD_U8),
+	CONF_FIELD(app_configuration, app_ppm_conf.safe_start, CONF_FIELD_U8),
+	CONF_FIELD(app_configuration, app_ppm_conf.throttle_exp, CONF_FIELD_F32),
+	CONF_FIELD(app_configuration, app_ppm_conf.throttle_exp_brake, CONF_FIELD_F32),
+	CONF_FIELD(app_configuration, app_ppm_conf.throttle_exp_mode, CONF_FIELD_U8),
+	CONF_FIELD(app_configuration, app_ppm_conf.ramp_time_pos, CONF_FIELD_F32),
+	CONF_FIELD(app_configuration, app_ppm_conf.ramp_time_neg, CONF_FIELD_F32),
+	CONF_FIELD(app_configuration, app_ppm_conf.multi_esc, CONF_FIELD_U8),
+	CONF_FIELD(app_configuration, app_ppm_conf.tc, CONF_FIELD_U8),
+	CONF_FIELD(app_configuration, app_ppm_conf.tc_max_diff, CONF_FIELD_F32),
+	CONF_FIELD(app_configuration, app_ppm_conf.max_erpm_for_dir, CONF_FIELD_F32),
+	CONF_FIELD(app_configuration, app_ppm_conf.smart_rev_max_duty, CONF_FIELD_F32),
+	CONF_FIELD(app_configuration, app_ppm_conf.smart_rev_ramp_time, CONF_FIELD_F32),
+	CONF_FIELD(app_configuration, app_adc_conf.ctrl_type, CONF_FIELD_U8),
+	CONF_FIELD(app_configuration, app_adc_conf.hyst, CONF_FIELD_F32),
+	CONF_FIELD(app_configuration, app_adc_conf.voltage_start, CONF_FIELD_F32),
+	CONF_FIELD(app_configuration, app_adc_conf.voltage_end, CONF_FIELD_F32),
+	CONF_FIELD(app_configuration, app_adc_conf.voltage_center, CONF_FIELD_F32),
+	CONF_FIELD(app_configuration, app_adc_conf.voltage2_start, CONF_FIELD_F32),
+	CONF_FIELD(app_configuration, app_adc_conf.voltage2_end, CONF_FIELD_F32),
+	CONF_FIELD(app_configuration, app_adc_conf.use_filter, CONF_FIELD_U8),
+	CONF_FIELD(app_configuration, app_adc_conf.safe_start, CONF_FIELD_U8),
+	CONF_FIELD(app_configuration, app_adc_conf.cc_button_inverted, CONF_FIELD_U8),
+	CONF_FIELD(app_configuration, app_adc_conf.rev_button_inverted, CONF_FIELD_U8),
+	CONF_FIELD(app_configuration, app_adc_conf.voltage_inverted, CONF_FIELD_U8),
+	CONF_FIELD(app_configuration, app_adc_conf.voltage2_inverted, CONF_FIELD_U8),
+	CONF_FIELD(app_configuration, app_adc_conf.throttle_exp, CONF_FIELD_F32),
+	CONF_FIELD(app_configuration, app_adc_conf.throttle_exp_brake, CONF_FIELD_F32),
+	CONF_FIELD(app_configuration, app_adc_conf.throttle_exp_mode, CONF_FIELD_U8),
+	CONF_FIELD(app_configuration, app_adc_conf.ramp_time_pos, CONF_FIELD_F32),
+	CONF_FIELD(app_configuration, app_adc_conf.ramp_time_neg, CONF_FIELD_F32),
+	CONF_FIELD(app_configuration, app_adc_conf.multi_esc, CONF_FIELD_U8),
+	CONF_FIELD(app_configuration, app_adc_conf.tc, CONF_FIELD_U8),
+	CONF_FIELD(app_configuration, app_adc_conf.tc_max_diff, CONF_FIELD_F32),
+	CONF_FIELD(app_configuration, app_adc_conf.update_rate_hz, CONF_FIELD_U16),
+	CONF_FIELD(app_configuration, app_uart_baudrate, CONF_FIELD_U32),
+	CONF_FIELD(app_configuration, app_chuk_conf.ctrl_type, CONF_FIELD_U8),
+	CONF_FIELD(app_configuration, app_chuk_conf.hyst, CONF_FIELD_F32),
+	CONF_FIELD(app_configuration, app_chuk_conf.ramp_time_pos, CONF_FIELD_F32),
+	CONF_FIELD(app_configuration, app_chuk_conf.ramp_time_neg, CONF_FIELD_F32),
+	CONF_FIELD(app_configuration, app_chuk_conf.stick_erpm_per_s_in_cc, CONF_FIELD_F32),
+	CONF_FIELD(app_configuration, app_chuk_conf.throttle_exp, CONF_FIELD_F32),
+	CONF_FIELD(app_configuration, app_chuk_conf.throttle_exp_brake, CONF_FIELD_F32),
+	CONF_FIELD(app_configuration, app_chuk_conf.throttle_exp_mode, CONF_FIELD_U8),
+	CONF_FIELD(app_configuration, app_chuk_conf.multi_esc, CONF_FIELD_U8),
+	CONF_FIELD(app_configuration, app_chuk_conf.tc, CONF_FIELD_U8),
+	CONF_FIELD(app_configuration, app_chuk_conf.tc_max_diff, CONF_FIELD_F32),
+	CONF_FIELD(app_configuration, app_chuk_conf.use_smart_rev, CONF_FIELD_U8),
+	CONF_FIELD(app_configuration, app_chuk_conf.smart_rev_max_duty, CONF_FIELD_F32),
+	CONF_FIELD(app_configuration, app_chuk_conf.smart_rev_ramp_time, CONF_FIELD_F32),
+	CONF_FIELD(app_configuration, app_nrf_conf.speed, CONF_FIELD_U8),
+	CONF_FIELD(app_configuration, app_nrf_conf.power, CONF_FIELD_U8),
+	CONF_FIELD(app_configuration, app_nrf_conf.crc_type, CONF_FIELD_U8),
+	CONF_FIELD(app_configuration, app_nrf_conf.retry_delay, CONF_FIELD_U8),
+	CONF_FIELD(app_configuration, app_nrf_conf.retries, CONF_FIELD_I8),
+	CONF_FIELD(app_configuration, app_nrf_conf.channel, CONF_FIELD_I8),
+	CONF_FIELD(app_configuration, app_nrf_conf.address[0], CONF_FIELD_U8),
+	CONF_FIELD(app_configuration, app_nrf_conf.address[1], CONF_FIELD_U8),
+	CONF_FIELD(app_configuration, app_nrf_conf.address[2], CONF_FIELD_U8),
+	CONF_FIELD(app_configuration, app_nrf_conf.send_crc_ack, CONF_FIELD_U8),
+	CONF_FIELD(app_configuration, app_balance_conf.kp, CONF_FIELD_F32),
+	CONF_FIELD(app_configuration, app_balance_conf.ki, CONF_FIELD_F32),
+	CONF_FIELD(app_configuration, app_balance_conf.kd, CONF_FIELD_F32),
+	CONF_FIELD(app_configuration, app_balance_conf.hertz, CONF_FIELD_U16),
+	CONF_FIELD(app_configuration, app_balance_conf.pitch_fault, CONF_FIELD_F32),
+	CONF_FIELD(app_configuration, app_balance_conf.roll_fault, CONF_FIELD_F32),
+	CONF_FIELD(app_configuration, app_balance_conf.adc1, CONF_FIELD_F32),
+	CONF_FIELD(app_configuration, app_balance_conf.adc2, CONF_FIELD_F32),
+	CONF_FIELD(app_configuration, app_balance_conf.overspeed_duty, CONF_FIELD_F32),
+	CONF_FIELD(app_configuration, app_balance_conf.tiltback_duty, CONF_FIELD_F32),
+	CONF_FIELD(app_configuration, app_balance_conf.tiltback_angle, CONF_FIELD_F32),
+	CONF_FIELD(app_configuration, app_balance_conf.tiltback_speed, CONF_FIELD_F32),
+	CONF_FIELD(app_configuration, app_balance_conf.tiltback_high_voltage, CONF_FIELD_F32),
+	CONF_FIELD(app_configuration, app_balance_conf.tiltback_low_voltage, CONF_FIELD_F32),
+	CONF_FIELD(app_configuration, app_balance_conf.startup_pitch_tolerance, CONF_FIELD_F32),
+	CONF_FIELD(app_configuration, app_balance_conf.startup_roll_tolerance, CONF_FIELD_F32),
+	CONF_FIELD(app_configuration, app_balance_conf.startup_speed, CONF_FIELD_F32),
+	CONF_FIELD(app_configuration, app_balance_conf.deadzone, CONF_FIELD_F32),
+	CONF_FIELD(app_configuration, app_balance_conf.current_boost, CONF_FIELD_F32),
+	CONF_FIELD(app_configuration, app_balance_conf.multi_esc, CONF_FIELD_U8),
+	CONF_FIELD(app_configuration, app_balance_conf.yaw_kp, CONF_FIELD_F32),
+	CONF_FIELD(app_configuration, app_balance_conf.yaw_ki, CONF_FIELD_F32),
+	CONF_FIELD(app_configuration, app_balance_conf.yaw_kd, CONF_FIELD_F32),
+	CONF_FIELD(app_configuration, app_balance_conf.roll_steer_kp, CONF_FIELD_F32),
+	CONF_FIELD(app_configuration, app_balance_conf.brake_current, CONF_FIELD_F32),
+	CONF_FIELD(app_configuration, app_balance_conf.overspeed_delay, CONF_FIELD_U16),
+	CONF_FIELD(app_configuration, app_balance_conf.fault_delay, CONF_FIELD_U16),
+	CONF_FIELD(app_configuration, app_balance_conf.tiltback_constant, CONF_FIELD_F32),
+	CONF_FIELD(app_configuration, app_balance_conf.roll_steer_erpm_kp, CONF_FIELD_F32),
+	CONF_FIELD(app_configuration, app_balance_conf.yaw_current_clamp, CONF_FIELD_F32),
+	CONF_FIELD(app_configuration, app_balance_conf.adc_half_fault_erpm, CONF_FIELD_U16),
+	CONF_FIELD(app_configuration, app_balance_conf.setpoint_pitch_filter, CONF_FIELD_F32),
+	CONF_FIELD(app_configuration, app_balance_conf.setpoint_target_filter, CONF_FIELD_F32),
+	CONF_FIELD(app_configuration, app_balance_conf.setpoint_clamp, CONF_FIELD_F32),
+	CONF_FIELD(app_configuration, imu_conf.type, CONF_FIELD_U8),
+	CONF_FIELD(app_configuration, imu_conf.mode, CONF_FIELD_U8),
+	CONF_FIELD(app_configuration, imu_conf.sample_rate_hz, CONF_FIELD_U16),
+	CONF_FIELD(app_configuration, imu_conf.accel_confidence_decay, CONF_FIELD_F32),
+	CONF_FIELD(app_configuration, imu_conf.mahony_kp, CONF_FIELD_F32),
+	CONF_FIELD(app_configuration, imu_conf.mahony_ki, CONF_FIELD_F32),
+	CONF_FIELD(app_configuration, imu_conf.madgwick_beta, CONF_FIELD_F32),
+	CONF_FIELD(app_configuration, imu_conf.rot_roll, CONF_FIELD_F32),
+	CONF_FIELD(app_configuration, imu_conf.rot_pitch, CONF_FIELD_F32),
+	CONF_FIELD(app_configuration, imu_conf.rot_yaw, CONF_FIELD_F32),
+	CONF_FIELD(app_configuration, imu_conf.accel_offsets[0], CONF_FIELD_F32),
+	CONF_FIELD(app_configuration, imu_conf.accel_offsets[1], CONF_FIELD_F32),
+	CONF_FIELD(app_configuration, imu_conf.accel_offsets[2], CONF_FIELD_F32),
+	CONF_FIELD(app_configuration, imu_conf.gyro_offsets[0], CONF_FIELD_F32),
+	CONF_FIELD(app_configuration, imu_conf.gyro_offsets[1], CONF_FIELD_F32),
+	CONF_FIELD(app_configuration, imu_conf.gyro_offsets[2], CONF_FIELD_F32),
+	CONF_FIELD(app_configuration, imu_conf.gyro_offset_comp_fact[0], CONF_FIELD_F32),
+	CONF_FIELD(app_configuration, imu_conf.gyro_offset_comp_fact[1], CONF_FIELD_F32),
+	CONF_FIELD(app_configuration, imu_conf.gyro_offset_comp_fact[2], CONF_FIELD_F32),
+	CONF_FIELD(app_configuration, imu_conf.gyro_offset_comp_clamp, CONF_FIELD_F32),
+};
+
+int32_t confdelta_serialize_mcconf(uint8_t *buffer, int32_t max_len,
+		const mc_configuration *conf, const mc_configuration *base, CONF_DELTA_BASE base_type) {
+	return serialize_delta(buffer, max_len, MCCONF_SIGNATURE,
+			mcconf_fields, sizeof(mcconf_fields) / sizeof(mcconf_fields[0]),
+			(const uint8_t*)conf, (const uint8_t*)base, base_type);
+}
+
+int32_t confdelta_serialize_appconf(uint8_t *buffer, int32_t max_len,
+		const app_configuration *conf, const app_configuration *base, CONF_DELTA_BASE base_type) {
+	return serialize_delta(buffer, max_len, APPCONF_SIGNATURE,
+			appconf_fields, sizeof(appconf_fields) / sizeof(appconf_fields[0]),
+			(const uint8_t*)conf, (const uint8_t*)base, base_type);
+}
+
+bool confdelta_deserialize_mcconf(const uint8_t *buffer, int32_t len, mc_configuration *conf) {
+	int base = delta_check(buffer, len, MCCONF_SIGNATURE,
+			mcconf_fields, sizeof(mcconf_fields) / sizeof(mcconf_fields[0]));
+
+	if (base < 0) {
+		return false;
+	}
+
+	if (base == CONF_DELTA_BASE_DEFAULT) {
+		confgenerator_set_defaults_mcconf(conf, true);
+	}
+
+	delta_apply(buffer, len, mcconf_fields, (uint8_t*)conf);
+	return true;
+}
+
+bool confdelta_deserialize_appconf(const uint8_t *buffer, int32_t len, app_configuration *conf) {
+	int base = delta_check(buffer, len, APPCONF_SIGNATURE,
+			appconf_fields, sizeof(appconf_fields) / sizeof(appconf_fields[0]));
+
+	if (base < 0) {
+		return false;
+	}
+
+	if (base == CONF_DELTA_BASE_DEFAULT) {
+		confgenerator_set_defaults_appconf(conf);
+	}
+
+	delta_apply(buffer, len, appconf_fields, (uint8_t*)conf);
+	return true;
+}
+
+static int field_len(uint8_t type) {
+	switch (type) {
+	case CONF_FIELD_U8:
+	case CONF_FIELD_I8:
+		return 1;
+	case CONF_FIELD_U16:
+	case CONF_FIELD_I16:
+		return 2;
+	default:
+		return 4;
+	}
+}
+
+/*
+ * The delta is [signature][base] followed by [field ID][value] for every
+ * field that differs from base, with the value serialized the same way as
+ * in the full configuration. The signature is the schema hash from VESC
+ * Tool, so a delta for another firmware version is rejected.
+ */
+static int32_t serialize_delta(uint8_t *buffer, int32_t max_len, uint32_t signature,
+		const conf_field *fields, int field_num,
+		const uint8_t *conf, const uint8_t *base, CONF_DELTA_BASE base_type) {
+	int32_t ind = 0;
+
+	buffer_append_uint32(buffer, signature, &ind);
+	buffer[ind++] = base_type;
+
+	for (int i = 0;i < field_num;i++) {
+		const conf_field *f = &fields[i];
+		const uint8_t *p = conf + f->offset;
+
+		if (memcmp(p, base + f->offset, f->size) == 0) {
+			continue;
+		}
+
+		if ((ind + 1 + field_len(f->type)) > max_len) {
+			return -1;
+		}
+
+		buffer[ind++] = i;
+
+		if (f->type == CONF_FIELD_F32) {
+			float val;
+			memcpy(&val, p, sizeof(float));
+			buffer_append_float32_auto(buffer, val, &ind);
+			continue;
+		}
+
+		uint32_t val = 0;
+		if (f->size == 1) {
+			val = *p;
+		} else if (f->size == 2) {
+			uint16_t v16;
+			memcpy(&v16, p, 2);
+			val = v16;
+		} else {
+			memcpy(&val, p, 4);
+		}
+
+		switch (f->type) {
+		case CONF_FIELD_U8:
+		case CONF_FIELD_I8:
+			buffer[ind++] = (uint8_t)val;
+			break;
+		case CONF_FIELD_U16:
+		case CONF_FIELD_I16:
+			buffer_append_uint16(buffer, (uint16_t)val, &ind);
+			break;
+		default:
+			buffer_append_uint32(buffer, val, &ind);
+			break;
+		}
+	}
+
+	return ind;
+}
+
+/**
+ * Check a delta before anything is applied, so that a bad one leaves the
+ * configuration unchanged.
+ *
+ * @return
+ * The base of the delta, or -1 if it is invalid.
+ */
+static int delta_check(const uint8_t *buffer, int32_t len, uint32_t signature,
+		const conf_field *fields, int field_num) {
+	int32_t ind = 0;
+
+	if (len < 5 || buffer_get_uint32(buffer, &ind) != signature) {
+		return -1;
+	}
+
+	int base = buffer[ind++];
+	if (base != CONF_DELTA_BASE_DEFAULT && base != CONF_DELTA_BASE_CURRENT) {
+		return -1;
+	}
+
+	int last = -1;
+	while (ind < len) {
+		int id = buffer[ind++];
+		if (id <= last || id >= field_num) {
+			return -1;
+		}
+
+		ind += field_len(fields[id].type);
+		last = id;
+	}
+
+	return ind == len ? base : -1;
+}
+
+static void delta_apply(const uint8_t *buffer, int32_t len,
+		const conf_field *fields, uint8_t *conf) {
+	int32_t ind = 5;
+
+	while (ind < len) {
+		const conf_field *f = &fields[buffer[ind++]];
+		uint8_t *p = conf + f->offset;
+
+		if (f->type == CONF_FIELD_F32) {
+			float val = buffer_get_float32_auto(buffer, &ind);
+			memcpy(p, &val, sizeof(float));
+			continue;
+		}
+
+		uint32_t val;
+		switch (f->type) {
+		case CONF_FIELD_U8:
+			val = buffer[ind++];
+			break;
+		case CONF_FIELD_I8:
+			val = (int8_t)buffer[ind++];
+			break;
+		case CONF_FIELD_U16:
+			val = buffer_get_uint16(buffer, &ind);
+			break;
+		case CONF_FIELD_I16:
+			val = buffer_get_int16(buffer, &ind);
+			break;
+		default:
+			val = buffer_get_uint32(buffer, &ind);
+			break;
+		}
+
+		if (f->size == 1) {
+			*p = val;
+		} else if (f->size == 2) {
+			uint16_t v16 = val;
+			memcpy(p, &v16, 2);
+		} else {
+			memcpy(p, &val, 4);
+		}
+	}
+}
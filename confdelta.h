@@ -0,0 +1,42 @@
+/*
+	Copyright 2026 agent	agent@local
+
+	This file is part of the VESC firmware.
+
+	The VESC firmware is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    The VESC firmware is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+#ifndef CONFDELTA_H_
+#define CONFDELTA_H_
+
+#include "datatypes.h"
+#include <stdint.h>
+#include <stdbool.h>
+
+// Base of a delta configuration
+typedef enum {
+	CONF_DELTA_BASE_DEFAULT = 0,
+	CONF_DELTA_BASE_CURRENT
+} CONF_DELTA_BASE;
+
+// Functions
+int32_t confdelta_serialize_mcconf(uint8_t *buffer, int32_t max_len,
+		const mc_configuration *conf, const mc_configuration *base, CONF_DELTA_BASE base_type);
+int32_t confdelta_serialize_appconf(uint8_t *buffer, int32_t max_len,
+		const app_configuration *conf, const app_configuration *base, CONF_DELTA_BASE base_type);
+
+bool confdelta_deserialize_mcconf(const uint8_t *buffer, int32_t len, mc_configuration *conf);
+bool confdelta_deserialize_appconf(const uint8_t *buffer, int32_t len, app_configuration *conf);
+
+#endif /* CONFDELTA_H_ */
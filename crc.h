@@ -22,10 +22,17 @@
 
 #include <stdint.h>
 
+// Number of bytes crc16 processes per table step: 1, 4 or 8. Each step above
+// one byte costs one 512 byte table in flash per additional byte.
+#ifndef CRC16_SLICING
+#define CRC16_SLICING			4
+#endif
+
 /*
  * Functions
  */
 unsigned short crc16(unsigned char *buf, unsigned int len);
+unsigned short crc16_update(unsigned short crc, const unsigned char *buf, unsigned int len);
 uint32_t crc32(uint32_t *buf, uint32_t len);
 void crc32_reset(void);
 
@@ -188,6 +188,12 @@ typedef enum {
 	DEBUG_SAMPLING_SEND_LAST_SAMPLES
 } debug_sampling_mode;
 
+typedef enum {
+	DEBUG_SAMPLING_FORMAT_PACKETS = 0,
+	DEBUG_SAMPLING_FORMAT_STREAM,
+	DEBUG_SAMPLING_FORMAT_STREAM_LZO
+} debug_sampling_format;
+
 typedef enum {
 	CAN_BAUD_125K = 0,
 	CAN_BAUD_250K,
@@ -773,7 +779,17 @@ typedef enum {
 	COMM_SET_BLE_NAME,
 	COMM_SET_BLE_PIN,
 	COMM_SET_CAN_MODE,
-	COMM_GET_IMU_CALIBRATION
+	COMM_GET_IMU_CALIBRATION,
+	COMM_SAMPLE_STREAM,
+	COMM_TELEMETRY_SUBSCRIBE,
+	COMM_TELEMETRY_DATA,
+	COMM_GET_ISR_PROFILE,
+	COMM_WRITE_NEW_APP_PATCH,
+	COMM_WRITE_NEW_APP_PATCH_ALL_CAN,
+	COMM_GET_MCCONF_DELTA,
+	COMM_SET_MCCONF_DELTA,
+	COMM_GET_APPCONF_DELTA,
+	COMM_SET_APPCONF_DELTA
 } COMM_PACKET_ID;
 
 // CAN commands
@@ -809,7 +825,11 @@ typedef enum {
 	CAN_PACKET_POLL_TS5700N8501_STATUS,
 	CAN_PACKET_CONF_BATTERY_CUT,
 	CAN_PACKET_CONF_STORE_BATTERY_CUT,
-	CAN_PACKET_SHUTDOWN
+	CAN_PACKET_SHUTDOWN,
+	CAN_PACKET_BULK_START,
+	CAN_PACKET_BULK_DATA,
+	CAN_PACKET_BULK_END,
+	CAN_PACKET_BULK_ACK
 } CAN_PACKET_ID;
 
 // Logged fault data
@@ -894,6 +914,26 @@ typedef struct {
 	int32_t tacho_value;
 } can_status_msg_5;
 
+typedef struct {
+	uint32_t sent;
+	uint32_t skipped;
+	uint32_t bits;
+} can_status_tx_stats;
+
+// All status messages from one node. The id of a message stays -1 until that
+// message has been received from the node.
+typedef struct {
+	int id;
+	systime_t rx_time; // Last status message of any kind
+	can_status_msg msg;
+	can_status_msg_2 msg_2;
+	can_status_msg_3 msg_3;
+	can_status_msg_4 msg_4;
+	can_status_msg_5 msg_5;
+	uint32_t rx_cnt[5];
+	float rx_interval[5]; // Filtered time between messages in seconds
+} can_status_node;
+
 typedef struct {
 	uint8_t js_x;
 	uint8_t js_y;
@@ -942,6 +982,46 @@ typedef struct {
     float vq;
 } mc_values;
 
+// Averages of the motor ISR samples, see mc_interface_snapshot_avg
+#define MC_AVG_SUM_SCALE		1000.0
+
+typedef enum {
+	MC_AVG_CURRENT_MOTOR = 0,
+	MC_AVG_CURRENT_IN,
+	MC_AVG_ID,
+	MC_AVG_IQ,
+	MC_AVG_VD,
+	MC_AVG_VQ,
+	MC_AVG_NUM
+} mc_avg_value;
+
+// Motor state, published by mc_interface at a fixed rate
+typedef struct {
+	systime_t time;
+	mc_state state;
+	mc_fault_code fault;
+	float v_in;
+	float temp_fet;
+	float temp_motor;
+	float temp_mos_1;
+	float temp_mos_2;
+	float temp_mos_3;
+	float duty_now;
+	float rpm;
+	float current_filtered;
+	float current_in_filtered;
+	float amp_hours;
+	float amp_hours_charged;
+	float watt_hours;
+	float watt_hours_charged;
+	int tachometer;
+	int tachometer_abs;
+	float position;
+	float avg_last[MC_AVG_NUM]; // Over the last interval
+	int64_t avg_sum[MC_AVG_NUM]; // Running sums since boot, in units of 1 / MC_AVG_SUM_SCALE
+	uint32_t avg_samples;
+} mc_snapshot;
+
 typedef enum {
 	NRF_PAIR_STARTED = 0,
 	NRF_PAIR_OK,
@@ -26,15 +26,32 @@
 /* Includes ------------------------------------------------------------------*/
 #include "eeprom.h"
 #include "flash_helper.h"
+#include <string.h>
 
 /* Private typedef -----------------------------------------------------------*/
 /* Private define ------------------------------------------------------------*/
 /* Private macro -------------------------------------------------------------*/
+/* Fibonacci hashing, as the virtual addresses come in contiguous ranges */
+#define EE_INDEX_HASH(VirtAddress)  ((uint16_t)((VirtAddress) * 40503U) >> (16 - EE_INDEX_BITS))
+
 /* Private variables ---------------------------------------------------------*/
 
 /* Global variable used to store variable value in read sequence */
 uint16_t DataVar = 0;
 
+/* Offsets of the latest entries in EE_IndexPage, 0 for empty slots */
+static uint16_t EE_Index[EE_INDEX_SIZE];
+static uint16_t EE_IndexCount = 0;
+static uint16_t EE_IndexPage = NO_VALID_PAGE;
+
+/* Where the last write ended, so that the next one doesn't have to search
+   for the first erased entry from the start of the page */
+static uint16_t EE_NextPage = NO_VALID_PAGE;
+static uint16_t EE_NextOffset = 0;
+
+/* Number of variables programmed, including page transfers */
+static uint32_t EE_ProgramCount = 0;
+
 /* Virtual address defined by the user: 0xFFFF value is prohibited */
 extern uint16_t VirtAddVarTab[NB_OF_VAR];
 
@@ -43,8 +60,12 @@ extern uint16_t VirtAddVarTab[NB_OF_VAR];
 static FLASH_Status EE_Format(void);
 static uint16_t EE_FindValidPage(uint8_t Operation);
 static uint16_t EE_VerifyPageFullWriteVariable(uint16_t VirtAddress, uint16_t Data);
-static uint16_t EE_PageTransfer(uint16_t VirtAddress, uint16_t Data);
+static uint16_t EE_PageTransfer(uint16_t VirtAddress, const uint16_t* Data, uint16_t Words);
+static uint16_t EE_FreeEntries(uint16_t Page);
 static uint16_t EE_EraseSectorIfNotEmpty(uint32_t FLASH_Sector, uint8_t VoltageRange);
+static void EE_IndexBuild(void);
+static uint16_t EE_IndexFind(uint32_t PageStartAddress, uint16_t VirtAddress);
+static void EE_IndexUpdate(uint32_t PageStartAddress, uint16_t VirtAddress, uint16_t Offset);
 
 /**
  * @brief  Restore the pages to a known good state in case of page's status
@@ -61,6 +82,10 @@ uint16_t EE_Init(void)
 	int16_t x = -1;
 	uint16_t  FlashStatus;
 
+	/* The pages might get repaired below, so read by scanning until done */
+	EE_IndexPage = NO_VALID_PAGE;
+	EE_NextPage = NO_VALID_PAGE;
+
 	/* Get Page0 status */
 	PageStatus0 = (*(__IO uint16_t*)PAGE0_BASE_ADDRESS);
 	/* Get Page1 status */
@@ -255,6 +280,8 @@ uint16_t EE_Init(void)
 		break;
 	}
 
+	EE_IndexBuild();
+
 	return FLASH_COMPLETE;
 }
 
@@ -286,6 +313,20 @@ uint16_t EE_ReadVariable(uint16_t VirtAddress, uint16_t* Data)
 	/* Get the valid Page start Address */
 	PageStartAddress = (uint32_t)(EEPROM_START_ADDRESS + (uint32_t)(ValidPage * PAGE_SIZE));
 
+	/* Use the index if it is up to date with the valid page */
+	if (ValidPage == EE_IndexPage)
+	{
+		uint16_t Offset = EE_IndexFind(PageStartAddress, VirtAddress);
+
+		if (Offset == 0)
+		{
+			return 1;
+		}
+
+		*Data = (*(__IO uint16_t*)(PageStartAddress + Offset));
+		return 0;
+	}
+
 	/* Get the valid Page end Address */
 	Address = (uint32_t)((EEPROM_START_ADDRESS - 2) + (uint32_t)((1 + ValidPage) * PAGE_SIZE));
 
@@ -352,13 +393,75 @@ uint16_t EE_WriteVariable(uint16_t VirtAddress, uint16_t Data)
 		if (Status == PAGE_FULL)
 		{
 			/* Perform Page transfer */
-			Status = EE_PageTransfer(VirtAddress, Data);
+			Status = EE_PageTransfer(VirtAddress, &Data, 1);
 		}
 	}
 	/* Return last operation status */
 	return Status;
 }
 
+/**
+ * @brief  Writes/updates a block of variables with consecutive virtual
+ *   addresses. Only the variables whose value differs from the stored one
+ *   are programmed. If they don't fit in the valid page, the whole block is
+ *   written to the other page during a single page transfer.
+ * @param  VirtAddress: virtual address of the first variable
+ * @param  Data: 16 bit data of each variable
+ * @param  Words: number of variables
+ * @param  Programmed: if not NULL, set to the number of variables that were
+ *   programmed, including the ones moved by a page transfer
+ * @retval Success or error status:
+ *           - FLASH_COMPLETE: on success
+ *           - PAGE_FULL: if the block does not fit in an empty page
+ *           - NO_VALID_PAGE: if no valid page was found
+ *           - Flash error code: on write Flash error
+ */
+uint16_t EE_WriteBlock(uint16_t VirtAddress, const uint16_t* Data, uint16_t Words, uint16_t* Programmed)
+{
+	uint16_t Status = FLASH_COMPLETE;
+	uint16_t Changed = 0, VarIdx = 0;
+	uint32_t ProgramCountStart = EE_ProgramCount;
+
+	for (VarIdx = 0; VarIdx < Words; VarIdx++)
+	{
+		if (EE_ReadVariable(VirtAddress + VarIdx, &DataVar) != 0 || DataVar != Data[VarIdx])
+		{
+			Changed++;
+		}
+	}
+
+	if (Changed == 0)
+	{
+		/* Nothing to do */
+	}
+	/* Return error if MCU VDD is below 2.9V */
+	else if (PWR->CSR & PWR_CSR_PVDO)
+	{
+		Status = FLASH_ERROR_PROGRAM;
+	}
+	else if (Changed <= EE_FreeEntries(EE_FindValidPage(WRITE_IN_VALID_PAGE)))
+	{
+		for (VarIdx = 0; VarIdx < Words && Status == FLASH_COMPLETE; VarIdx++)
+		{
+			if (EE_ReadVariable(VirtAddress + VarIdx, &DataVar) != 0 || DataVar != Data[VarIdx])
+			{
+				Status = EE_VerifyPageFullWriteVariable(VirtAddress + VarIdx, Data[VarIdx]);
+			}
+		}
+	}
+	else
+	{
+		Status = EE_PageTransfer(VirtAddress, Data, Words);
+	}
+
+	if (Programmed)
+	{
+		*Programmed = (uint16_t)(EE_ProgramCount - ProgramCountStart);
+	}
+
+	return Status;
+}
+
 /**
  * @brief  Erases PAGE and PAGE1 and writes VALID_PAGE header to PAGE
  * @param  None
@@ -480,6 +583,7 @@ static uint16_t EE_VerifyPageFullWriteVariable(uint16_t VirtAddress, uint16_t Da
 	FLASH_Status FlashStatus = FLASH_COMPLETE;
 	uint16_t ValidPage = PAGE0;
 	uint32_t Address = EEPROM_START_ADDRESS, PageEndAddress = EEPROM_START_ADDRESS+PAGE_SIZE;
+	uint32_t PageStartAddress = EEPROM_START_ADDRESS;
 
 	/* Get valid Page for write operation */
 	ValidPage = EE_FindValidPage(WRITE_IN_VALID_PAGE);
@@ -491,7 +595,14 @@ static uint16_t EE_VerifyPageFullWriteVariable(uint16_t VirtAddress, uint16_t Da
 	}
 
 	/* Get the valid Page start Address */
-	Address = (uint32_t)(EEPROM_START_ADDRESS + (uint32_t)(ValidPage * PAGE_SIZE));
+	PageStartAddress = (uint32_t)(EEPROM_START_ADDRESS + (uint32_t)(ValidPage * PAGE_SIZE));
+	Address = PageStartAddress;
+
+	/* Continue where the last write to this page ended */
+	if (ValidPage == EE_NextPage)
+	{
+		Address += EE_NextOffset;
+	}
 
 	/* Get the valid Page end Address */
 	PageEndAddress = (uint32_t)((EEPROM_START_ADDRESS - 2) + (uint32_t)((1 + ValidPage) * PAGE_SIZE));
@@ -511,6 +622,19 @@ static uint16_t EE_VerifyPageFullWriteVariable(uint16_t VirtAddress, uint16_t Da
 			}
 			/* Set variable virtual address */
 			FlashStatus = FLASH_ProgramHalfWord(Address + 2, VirtAddress);
+			if (FlashStatus == FLASH_COMPLETE)
+			{
+				EE_ProgramCount++;
+				EE_NextPage = ValidPage;
+				EE_NextOffset = (uint16_t)(Address + 4 - PageStartAddress);
+
+				/* Keep the index coherent. During a page transfer the index refers
+				   to the old page, which is still the one reads go to. */
+				if (ValidPage == EE_IndexPage)
+				{
+					EE_IndexUpdate(PageStartAddress, VirtAddress, (uint16_t)(Address - PageStartAddress));
+				}
+			}
 			/* Return program operation status */
 			return FlashStatus;
 		}
@@ -528,15 +652,16 @@ static uint16_t EE_VerifyPageFullWriteVariable(uint16_t VirtAddress, uint16_t Da
 /**
  * @brief  Transfers last updated variables data from the full Page to
  *   an empty one.
- * @param  VirtAddress: 16 bit virtual address of the variable
- * @param  Data: 16 bit data to be written as variable value
+ * @param  VirtAddress: 16 bit virtual address of the first variable to write
+ * @param  Data: 16 bit data to be written as variable values
+ * @param  Words: number of variables to write, with consecutive addresses
  * @retval Success or error status:
  *           - FLASH_COMPLETE: on success
  *           - PAGE_FULL: if valid page is full
  *           - NO_VALID_PAGE: if no valid page was found
  *           - Flash error code: on write Flash error
  */
-static uint16_t EE_PageTransfer(uint16_t VirtAddress, uint16_t Data)
+static uint16_t EE_PageTransfer(uint16_t VirtAddress, const uint16_t* Data, uint16_t Words)
 {
 	FLASH_Status FlashStatus = FLASH_COMPLETE;
 	uint32_t NewPageAddress = EEPROM_START_ADDRESS;
@@ -576,18 +701,22 @@ static uint16_t EE_PageTransfer(uint16_t VirtAddress, uint16_t Data)
 		return FlashStatus;
 	}
 
-	/* Write the variable passed as parameter in the new active page */
-	EepromStatus = EE_VerifyPageFullWriteVariable(VirtAddress, Data);
-	/* If program operation was failed, a Flash error code is returned */
-	if (EepromStatus != FLASH_COMPLETE)
+	/* Write the variables passed as parameter in the new active page */
+	for (VarIdx = 0; VarIdx < Words; VarIdx++)
 	{
-		return EepromStatus;
+		EepromStatus = EE_VerifyPageFullWriteVariable(VirtAddress + VarIdx, Data[VarIdx]);
+		/* If program operation was failed, a Flash error code is returned */
+		if (EepromStatus != FLASH_COMPLETE)
+		{
+			return EepromStatus;
+		}
 	}
 
 	/* Transfer process: transfer variables from old to the new active page */
 	for (VarIdx = 0; VarIdx < NB_OF_VAR; VarIdx++)
 	{
-		if (VirtAddVarTab[VarIdx] != VirtAddress)  /* Check each variable except the one passed as parameter */
+		/* Check each variable except the ones passed as parameter */
+		if (VirtAddVarTab[VarIdx] < VirtAddress || VirtAddVarTab[VarIdx] >= (VirtAddress + Words))
 		{
 			/* Read the other last variable updates */
 			ReadStatus = EE_ReadVariable(VirtAddVarTab[VarIdx], &DataVar);
@@ -605,6 +734,9 @@ static uint16_t EE_PageTransfer(uint16_t VirtAddress, uint16_t Data)
 		}
 	}
 
+	/* The index points into the old Page */
+	EE_IndexPage = NO_VALID_PAGE;
+
 	/* Erase the old Page: Set old Page status to ERASED status */
 	FlashStatus = EE_EraseSectorIfNotEmpty(OldPageId, VOLTAGE_RANGE);
 	/* If erase operation was failed, a Flash error code is returned */
@@ -621,6 +753,8 @@ static uint16_t EE_PageTransfer(uint16_t VirtAddress, uint16_t Data)
 		return FlashStatus;
 	}
 
+	EE_IndexBuild();
+
 	/* Return last operation flash status */
 	return FlashStatus;
 }
@@ -632,6 +766,9 @@ static uint16_t EE_PageTransfer(uint16_t VirtAddress, uint16_t Data)
 static uint16_t EE_EraseSectorIfNotEmpty(uint32_t FLASH_Sector, uint8_t VoltageRange) {
 	uint8_t *addr = flash_helper_get_sector_address(FLASH_Sector);
 
+	// Writes have to search for the first erased entry again
+	EE_NextPage = NO_VALID_PAGE;
+
 	for (unsigned int i = 0;i < PAGE_SIZE;i++) {
 		if (addr[i] != 0xFF) {
 			return FLASH_EraseSector(FLASH_Sector, VoltageRange);
@@ -641,6 +778,97 @@ static uint16_t EE_EraseSectorIfNotEmpty(uint32_t FLASH_Sector, uint8_t VoltageR
 	return FLASH_COMPLETE;
 }
 
+/*
+ * Number of entries that can be written to Page before it is full.
+ */
+static uint16_t EE_FreeEntries(uint16_t Page) {
+	if (Page == NO_VALID_PAGE) {
+		return 0;
+	}
+
+	uint32_t PageStartAddress = (uint32_t)(EEPROM_START_ADDRESS + (uint32_t)(Page * PAGE_SIZE));
+	uint32_t offset = Page == EE_NextPage ? EE_NextOffset : 0;
+
+	while (offset < PAGE_SIZE && (*(__IO uint32_t*)(PageStartAddress + offset)) != 0xFFFFFFFF) {
+		offset += 4;
+	}
+
+	return (PAGE_SIZE - offset) / 4;
+}
+
+/*
+ * Index the latest entry of every virtual address in the valid page, so that
+ * reads don't have to scan the page. The page is scanned from the beginning
+ * once, so later entries replace earlier ones. Entries where the virtual
+ * address is not written (power loss while writing) are ignored, like the
+ * backwards scan in EE_ReadVariable does. If the index gets too full, it is
+ * left invalid and reads fall back to scanning.
+ */
+static void EE_IndexBuild(void) {
+	uint16_t ValidPage = EE_FindValidPage(READ_FROM_VALID_PAGE);
+
+	EE_IndexPage = NO_VALID_PAGE;
+	EE_IndexCount = 0;
+	memset(EE_Index, 0, sizeof(EE_Index));
+
+	if (ValidPage == NO_VALID_PAGE) {
+		return;
+	}
+
+	uint32_t PageStartAddress = (uint32_t)(EEPROM_START_ADDRESS + (uint32_t)(ValidPage * PAGE_SIZE));
+
+	// The first entry is right after the page status
+	EE_IndexPage = ValidPage;
+	for (uint32_t offset = 4;offset < PAGE_SIZE;offset += 4) {
+		uint16_t VirtAddress = (*(__IO uint16_t*)(PageStartAddress + offset + 2));
+		if (VirtAddress != 0xFFFF) {
+			EE_IndexUpdate(PageStartAddress, VirtAddress, offset);
+		}
+	}
+}
+
+/*
+ * Get the offset of the latest entry of VirtAddress in the indexed page, or 0
+ * if the variable is not stored. Only the offsets are kept in RAM, the keys
+ * are read from the entries in flash.
+ */
+static uint16_t EE_IndexFind(uint32_t PageStartAddress, uint16_t VirtAddress) {
+	uint16_t slot = EE_INDEX_HASH(VirtAddress);
+
+	for (;;) {
+		uint16_t offset = EE_Index[slot];
+		if (offset == 0 || (*(__IO uint16_t*)(PageStartAddress + offset + 2)) == VirtAddress) {
+			return offset;
+		}
+		slot = (slot + 1) & (EE_INDEX_SIZE - 1);
+	}
+}
+
+static void EE_IndexUpdate(uint32_t PageStartAddress, uint16_t VirtAddress, uint16_t Offset) {
+	uint16_t slot = EE_INDEX_HASH(VirtAddress);
+
+	for (;;) {
+		uint16_t offset = EE_Index[slot];
+		if (offset == 0) {
+			// Keep at least a quarter of the slots empty so that lookups stay short
+			if (EE_IndexCount >= (EE_INDEX_SIZE / 4) * 3) {
+				EE_IndexPage = NO_VALID_PAGE;
+				return;
+			}
+			EE_IndexCount++;
+			break;
+		}
+
+		if ((*(__IO uint16_t*)(PageStartAddress + offset + 2)) == VirtAddress) {
+			break;
+		}
+
+		slot = (slot + 1) & (EE_INDEX_SIZE - 1);
+	}
+
+	EE_Index[slot] = Offset;
+}
+
 /**
  * @}
  */
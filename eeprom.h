@@ -69,6 +69,12 @@
 /* Page full define */
 #define PAGE_FULL             ((uint8_t)0x80)
 
+/* RAM index from virtual address to the latest entry in the valid page. The
+   number of slots has to be a power of two and should be well above the
+   number of distinct virtual addresses in use. */
+#define EE_INDEX_BITS         11
+#define EE_INDEX_SIZE         ((uint16_t)(1 << EE_INDEX_BITS))
+
 /* Variables' number */
 #define NB_OF_VAR             ((uint16_t)((2 * sizeof(mc_configuration) + sizeof(app_configuration) + 1) / 2) + \
                               EEPROM_VARS_HW * 2 + EEPROM_VARS_CUSTOM * 2)
@@ -79,6 +85,7 @@
 uint16_t EE_Init(void);
 uint16_t EE_ReadVariable(uint16_t VirtAddress, uint16_t* Data);
 uint16_t EE_WriteVariable(uint16_t VirtAddress, uint16_t Data);
+uint16_t EE_WriteBlock(uint16_t VirtAddress, const uint16_t* Data, uint16_t Words, uint16_t* Programmed);
 
 #endif /* __EEPROM_H */
 
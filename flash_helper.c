@@ -26,6 +26,9 @@
 #include "timeout.h"
 #include "hw.h"
 #include "crc.h"
+#include "packet.h"
+#include "buffer.h"
+#include "flash_patch.h"
 #include <string.h>
 
 /*
@@ -37,6 +40,9 @@
 #define NEW_APP_BASE							8
 #define NEW_APP_SECTORS							3
 #define APP_MAX_SIZE							(393216 - 8) // Note that the bootloader needs 8 extra bytes
+#define NEW_APP_BUFFERS							2 // Power of two
+#define NEW_APP_SLICE_WORDS						16 // Words to program with the system locked
+#define NEW_APP_HEADER_LEN						6 // Size and CRC in front of the new app
 
 // Base address of the Flash sectors
 #define ADDR_FLASH_SECTOR_0    					((uint32_t)0x08000000) // Base @ of Sector 0, 16 Kbytes
@@ -68,6 +74,12 @@ typedef struct {
 	uint32_t crc;
 }crc_info_t;
 
+typedef struct {
+	uint32_t offset;
+	uint32_t len;
+	uint8_t data[PACKET_MAX_PL_LEN] __attribute__((aligned(4)));
+} new_app_buffer_t;
+
 //Make sure the app image has the CRC bits set to '1' to later write the flag and CRC.
 const crc_info_t __attribute__((section (".crcinfo"))) crc_info = {0xFFFFFFFF, 0xFFFFFFFF};
 
@@ -101,7 +113,69 @@ static const uint16_t flash_sector[FLASH_SECTORS] = {
 		FLASH_Sector_11
 };
 
+// Private variables
+static mutex_t flash_mutex;
+static new_app_buffer_t new_app_buffers[NEW_APP_BUFFERS];
+static volatile unsigned int new_app_write = 0;
+static volatile unsigned int new_app_read = 0;
+static volatile uint16_t new_app_res = FLASH_COMPLETE;
+static mutex_t new_app_mutex;
+static bool new_app_init_done = false;
+static thread_t *new_app_tp = 0;
+static THD_WORKING_AREA(new_app_thread_wa, 256);
+
+// Incremental CRC of the new app, over the data that has arrived in order
+static uint32_t new_app_crc_pos = 0;
+static uint8_t new_app_header[NEW_APP_HEADER_LEN];
+static uint32_t new_app_image_size = 0;
+static uint16_t new_app_image_crc = 0;
+static uint16_t new_app_crc = 0;
+static bool new_app_in_order = true;
+
+// Patch applied to the running image
+static flash_patch new_app_patch;
+static uint32_t new_app_patch_pos = 0;
+static uint32_t new_app_patch_out = 0;
+static uint32_t new_app_patch_buffer_len = 0;
+static uint8_t new_app_patch_buffer[PACKET_MAX_PL_LEN] __attribute__((aligned(4)));
+
+// Private functions
+static void new_app_pipeline_init(void);
+static bool new_app_patch_output(const uint8_t *data, uint32_t len, void *arg);
+static uint16_t new_app_patch_flush(void);
+static void new_app_write_queued(void);
+static void new_app_crc_reset(void);
+static bool new_app_crc_update(uint32_t offset, const uint8_t *data, uint32_t len);
+static THD_FUNCTION(new_app_thread, arg);
+
+void flash_helper_init(void) {
+	chMtxObjectInit(&flash_mutex);
+}
+
+/**
+ * Take the flash for programming or erasing, or for reading the emulated
+ * EEPROM, which is moved between pages by writes. Every writer goes through
+ * this, so that the new app write thread, the EEPROM and the configuration
+ * writers never program the flash at the same time. Must not be called
+ * with the system locked.
+ */
+void flash_helper_lock(void) {
+	chMtxLock(&flash_mutex);
+}
+
+/**
+ * Release the flash after flash_helper_lock.
+ */
+void flash_helper_unlock(void) {
+	chMtxUnlock(&flash_mutex);
+}
+
 uint16_t flash_helper_erase_new_app(uint32_t new_app_size) {
+	flash_helper_new_app_wait();
+	new_app_res = FLASH_COMPLETE;
+	new_app_crc_reset();
+
+	flash_helper_lock();
 	FLASH_Unlock();
 	FLASH_ClearFlag(FLASH_FLAG_OPERR | FLASH_FLAG_WRPERR | FLASH_FLAG_PGAERR |
 			FLASH_FLAG_PGPERR | FLASH_FLAG_PGSERR);
@@ -120,6 +194,7 @@ uint16_t flash_helper_erase_new_app(uint32_t new_app_size) {
 				FLASH_Lock();
 				timeout_configure_IWDT();
 				utils_sys_unlock_cnt();
+				flash_helper_unlock();
 				return res;
 			}
 		} else {
@@ -130,11 +205,13 @@ uint16_t flash_helper_erase_new_app(uint32_t new_app_size) {
 	FLASH_Lock();
 	timeout_configure_IWDT();
 	utils_sys_unlock_cnt();
+	flash_helper_unlock();
 
 	return FLASH_COMPLETE;
 }
 
 uint16_t flash_helper_erase_bootloader(void) {
+	flash_helper_lock();
 	FLASH_Unlock();
 	FLASH_ClearFlag(FLASH_FLAG_OPERR | FLASH_FLAG_WRPERR | FLASH_FLAG_PGAERR |
 			FLASH_FLAG_PGPERR | FLASH_FLAG_PGSERR);
@@ -145,42 +222,260 @@ uint16_t flash_helper_erase_bootloader(void) {
 	timeout_configure_IWDT_slowest();
 
 	uint16_t res = FLASH_EraseSector(flash_sector[BOOTLOADER_BASE], VoltageRange_3);
-	if (res != FLASH_COMPLETE) {
-		FLASH_Lock();
-		return res;
-	}
 
 	FLASH_Lock();
 	timeout_configure_IWDT();
 	utils_sys_unlock_cnt();
+	flash_helper_unlock();
 
-	return FLASH_COMPLETE;
+	return res;
 }
 
+/**
+ * Program data into the new app area and wait until it is done. Aligned
+ * words are programmed with one operation each. The system is only locked
+ * for NEW_APP_SLICE_WORDS operations at a time, so that the communication
+ * threads and interrupts can run in between.
+ *
+ * @param offset
+ * The offset from the start of the new app area.
+ *
+ * @param data
+ * The data to program.
+ *
+ * @param len
+ * The length of the data in bytes.
+ *
+ * @return
+ * FLASH_COMPLETE, or the status of the first operation that failed.
+ */
 uint16_t flash_helper_write_new_app_data(uint32_t offset, uint8_t *data, uint32_t len) {
+	flash_helper_lock();
 	FLASH_Unlock();
 	FLASH_ClearFlag(FLASH_FLAG_OPERR | FLASH_FLAG_WRPERR | FLASH_FLAG_PGAERR |
 			FLASH_FLAG_PGPERR | FLASH_FLAG_PGSERR);
 
 	mc_interface_unlock();
 	mc_interface_release_motor();
-	utils_sys_lock_cnt();
 	timeout_configure_IWDT_slowest();
 
-	for (uint32_t i = 0;i < len;i++) {
-		uint16_t res = FLASH_ProgramByte(flash_addr[NEW_APP_BASE] + offset + i, data[i]);
-		if (res != FLASH_COMPLETE) {
-			FLASH_Lock();
-			return res;
+	uint32_t addr = flash_addr[NEW_APP_BASE] + offset;
+	uint16_t res = FLASH_COMPLETE;
+
+	while (len > 0 && res == FLASH_COMPLETE) {
+		utils_sys_lock_cnt();
+
+		for (int i = 0;i < NEW_APP_SLICE_WORDS && len > 0;i++) {
+			uint32_t step = 1;
+
+			if ((addr & 3) == 0 && len >= 4) {
+				uint32_t word;
+				memcpy(&word, data, 4);
+				res = FLASH_ProgramWord(addr, word);
+				step = 4;
+			} else {
+				res = FLASH_ProgramByte(addr, data[0]);
+			}
+
+			if (res != FLASH_COMPLETE) {
+				break;
+			}
+
+			addr += step;
+			data += step;
+			len -= step;
 		}
+
+		utils_sys_unlock_cnt();
 	}
-	FLASH_Lock();
 
+	FLASH_Lock();
 	timeout_configure_IWDT();
+	flash_helper_unlock();
 
-	utils_sys_unlock_cnt();
+	return res;
+}
 
-	return FLASH_COMPLETE;
+/**
+ * Get the buffer to put the next chunk of the new app in. The chunk is
+ * programmed in the background after flash_helper_new_app_buffer_commit,
+ * which has to follow every call to this function. Waits until a buffer
+ * is free.
+ *
+ * @return
+ * A buffer of PACKET_MAX_PL_LEN bytes.
+ */
+uint8_t *flash_helper_new_app_buffer_get(void) {
+	if (!new_app_init_done) {
+		new_app_pipeline_init();
+	}
+
+	chMtxLock(&new_app_mutex);
+
+	while ((new_app_write - new_app_read) >= NEW_APP_BUFFERS) {
+		chThdSleep(1);
+	}
+
+	return new_app_buffers[new_app_write & (NEW_APP_BUFFERS - 1)].data;
+}
+
+/**
+ * Queue the chunk in the buffer from flash_helper_new_app_buffer_get for
+ * programming.
+ *
+ * @param offset
+ * The offset of the chunk in the new app area.
+ *
+ * @param len
+ * The length of the chunk. 0 releases the buffer without programming
+ * anything.
+ *
+ * @return
+ * FLASH_COMPLETE if all chunks that have been programmed so far were
+ * verified without errors, otherwise the first error. As the chunks are
+ * programmed in the background, an error is usually returned for the chunk
+ * after the one that failed. The chunk that reaches the end of the image in
+ * the header is therefore waited for, so that its own result and the CRC of
+ * the new app are returned for it. A CRC mismatch gives FLASH_ERROR_PROGRAM.
+ */
+uint16_t flash_helper_new_app_buffer_commit(uint32_t offset, uint32_t len) {
+	if (len > PACKET_MAX_PL_LEN) {
+		len = 0;
+	}
+
+	bool complete = false;
+	bool last = false;
+
+	if (len > 0) {
+		new_app_buffer_t *buf = &new_app_buffers[new_app_write & (NEW_APP_BUFFERS - 1)];
+		buf->offset = offset;
+		buf->len = len;
+		complete = new_app_crc_update(offset, buf->data, len);
+
+		// The header is also needed to find the end when the chunks did not
+		// arrive in order
+		if (offset == 0 && len >= NEW_APP_HEADER_LEN && new_app_image_size == 0) {
+			int32_t ind = 0;
+			new_app_image_size = buffer_get_uint32(buf->data, &ind);
+		}
+
+		last = new_app_image_size > 0 &&
+				offset + len >= NEW_APP_HEADER_LEN + new_app_image_size;
+
+		__DSB();
+		new_app_write++;
+		chEvtSignal(new_app_tp, (eventmask_t)1);
+	}
+
+	chMtxUnlock(&new_app_mutex);
+
+	if (last) {
+		uint16_t res = flash_helper_new_app_wait();
+		if (res == FLASH_COMPLETE) {
+			// Without all chunks in order the image is checked in flash
+			if (complete ? new_app_crc != new_app_image_crc :
+					flash_helper_verify_new_app() != FAULT_CODE_NONE) {
+				res = FLASH_ERROR_PROGRAM;
+			}
+		}
+		return res;
+	}
+
+	return new_app_res;
+}
+
+/**
+ * Wait until all queued chunks of the new app are programmed.
+ *
+ * @return
+ * FLASH_COMPLETE, or the first error since the new app area was erased.
+ */
+uint16_t flash_helper_new_app_wait(void) {
+	while (new_app_read != new_app_write) {
+		chThdSleep(1);
+	}
+
+	return new_app_res;
+}
+
+/**
+ * Apply the next part of a patch against the running image, writing the
+ * result to the new app area through the write pipeline. See flash_patch.c
+ * for the format. The new app area has to be erased first.
+ *
+ * @param offset
+ * The offset of this part in the patch. 0 starts a new patch, and parts
+ * that have been applied already are acknowledged again without applying
+ * them.
+ *
+ * @param data
+ * The part of the patch.
+ *
+ * @param len
+ * The length of the part.
+ *
+ * @return
+ * FLASH_COMPLETE when the part has been applied and all writes so far have
+ * succeeded. When the patch is complete the new image is also verified.
+ */
+uint16_t flash_helper_write_new_app_patch(uint32_t offset, uint8_t *data, uint32_t len) {
+	if (offset == 0) {
+		flash_patch_init(&new_app_patch, (const uint8_t*)flash_addr[APP_BASE], APP_MAX_SIZE - 8,
+				flash_addr[1] - flash_addr[0], EEPROM_EMULATION_SIZE,
+				NEW_APP_SECTORS * 128 * 1024 - NEW_APP_HEADER_LEN,
+				new_app_patch_output, 0);
+		new_app_patch_pos = 0;
+		new_app_patch_out = 0;
+		new_app_patch_buffer_len = 0;
+	}
+
+	if (offset + len <= new_app_patch_pos && new_app_patch.res <= FLASH_PATCH_DONE) {
+		return new_app_res;
+	}
+
+	if (offset != new_app_patch_pos) {
+		return FLASH_ERROR_OPERATION;
+	}
+
+	FLASH_PATCH_RES res = flash_patch_process(&new_app_patch, data, len);
+	new_app_patch_pos += len;
+
+	if (res == FLASH_PATCH_DONE) {
+		uint16_t flash_res = new_app_patch_flush();
+		if (flash_res == FLASH_COMPLETE && flash_helper_verify_new_app() != FAULT_CODE_NONE) {
+			flash_res = FLASH_ERROR_PROGRAM;
+		}
+		return flash_res;
+	} else if (res != FLASH_PATCH_OK) {
+		return FLASH_ERROR_OPERATION;
+	}
+
+	return new_app_res;
+}
+
+/**
+ * Check the image in the new app area against its size and CRC, the same
+ * way as the bootloader will.
+ *
+ * @return
+ * FAULT_CODE_NONE or FAULT_CODE_FLASH_CORRUPTION
+ */
+uint32_t flash_helper_verify_new_app(void) {
+	if (flash_helper_new_app_wait() != FLASH_COMPLETE) {
+		return FAULT_CODE_FLASH_CORRUPTION;
+	}
+
+	uint8_t *new_app = (uint8_t*)flash_addr[NEW_APP_BASE];
+	int32_t ind = 0;
+	uint32_t size = buffer_get_uint32(new_app, &ind);
+	uint16_t crc = buffer_get_uint16(new_app, &ind);
+
+	if (size == 0 || size > (NEW_APP_SECTORS * 128 * 1024 - NEW_APP_HEADER_LEN)) {
+		return FAULT_CODE_FLASH_CORRUPTION;
+	}
+
+	return crc16(new_app + NEW_APP_HEADER_LEN, size) == crc ?
+			FAULT_CODE_NONE : FAULT_CODE_FLASH_CORRUPTION;
 }
 
 /**
@@ -189,6 +484,8 @@ uint16_t flash_helper_write_new_app_data(uint32_t offset, uint8_t *data, uint32_
 void flash_helper_jump_to_bootloader(void) {
 	typedef void (*pFunction)(void);
 
+	flash_helper_new_app_wait();
+
 	mc_interface_unlock();
 	mc_interface_release_motor();
 	usbDisconnectBus(&USBD1);
@@ -268,6 +565,7 @@ uint32_t flash_helper_verify_flash_memory(void) {
 		// A CRC over the full image should return zero.
 		return (crc == 0) ? FAULT_CODE_NONE : FAULT_CODE_FLASH_CORRUPTION;
 	} else {
+		flash_helper_lock();
 		FLASH_Unlock();
 		FLASH_ClearFlag(FLASH_FLAG_OPERR | FLASH_FLAG_WRPERR | FLASH_FLAG_PGAERR |
 				FLASH_FLAG_PGPERR | FLASH_FLAG_PGSERR);
@@ -276,6 +574,7 @@ uint32_t flash_helper_verify_flash_memory(void) {
 		uint16_t res = FLASH_ProgramWord((uint32_t)APP_CRC_WAS_CALCULATED_FLAG_ADDRESS, APP_CRC_WAS_CALCULATED_FLAG);
 		if (res != FLASH_COMPLETE) {
 			FLASH_Lock();
+			flash_helper_unlock();
 			return FAULT_CODE_FLASH_CORRUPTION;
 		}
 
@@ -297,9 +596,11 @@ uint32_t flash_helper_verify_flash_memory(void) {
 		res = FLASH_ProgramWord((uint32_t)APP_CRC_ADDRESS, crc);
 		if (res != FLASH_COMPLETE) {
 			FLASH_Lock();
+			flash_helper_unlock();
 			return FAULT_CODE_FLASH_CORRUPTION;
 		}
 		FLASH_Lock();
+		flash_helper_unlock();
 
 		// reboot
 		NVIC_SystemReset();
@@ -339,3 +640,133 @@ uint32_t flash_helper_verify_flash_memory_chunk(void) {
 
 	return res;
 }
+
+static void new_app_pipeline_init(void) {
+	chMtxObjectInit(&new_app_mutex);
+	new_app_tp = chThdCreateStatic(new_app_thread_wa, sizeof(new_app_thread_wa),
+			NORMALPRIO - 1, new_app_thread, NULL);
+	new_app_init_done = true;
+}
+
+static void new_app_write_queued(void) {
+	while (new_app_read != new_app_write) {
+		new_app_buffer_t *buf = &new_app_buffers[new_app_read & (NEW_APP_BUFFERS - 1)];
+
+		uint16_t res = flash_helper_write_new_app_data(buf->offset, buf->data, buf->len);
+
+		// Read back, as a bit that was cleared already cannot be programmed
+		if (res == FLASH_COMPLETE &&
+				memcmp((uint8_t*)flash_addr[NEW_APP_BASE] + buf->offset, buf->data, buf->len) != 0) {
+			res = FLASH_ERROR_PROGRAM;
+		}
+
+		if (res != FLASH_COMPLETE && new_app_res == FLASH_COMPLETE) {
+			new_app_res = res;
+		}
+
+		__DSB();
+		new_app_read++;
+	}
+}
+
+static void new_app_crc_reset(void) {
+	new_app_crc_pos = 0;
+	new_app_image_size = 0;
+	new_app_image_crc = 0;
+	new_app_crc = 0;
+	new_app_in_order = true;
+}
+
+/*
+ * Update the CRC with a chunk of the new app. Chunks that have been seen
+ * already are skipped and a gap stops the check until the next erase.
+ *
+ * Returns true when the chunk completes the new app.
+ */
+static bool new_app_crc_update(uint32_t offset, const uint8_t *data, uint32_t len) {
+	if (!new_app_in_order || offset + len <= new_app_crc_pos) {
+		return false;
+	}
+
+	if (offset > new_app_crc_pos) {
+		new_app_in_order = false;
+		return false;
+	}
+
+	uint32_t skip = new_app_crc_pos - offset;
+	data += skip;
+	len -= skip;
+
+	while (len > 0 && new_app_crc_pos < NEW_APP_HEADER_LEN) {
+		new_app_header[new_app_crc_pos++] = *data++;
+		len--;
+
+		if (new_app_crc_pos == NEW_APP_HEADER_LEN) {
+			int32_t ind = 0;
+			new_app_image_size = buffer_get_uint32(new_app_header, &ind);
+			new_app_image_crc = buffer_get_uint16(new_app_header, &ind);
+		}
+	}
+
+	if (new_app_crc_pos < NEW_APP_HEADER_LEN) {
+		return false;
+	}
+
+	uint32_t left = NEW_APP_HEADER_LEN + new_app_image_size - new_app_crc_pos;
+	if (len > left) {
+		len = left;
+	}
+
+	new_app_crc = crc16_update(new_app_crc, data, len);
+	new_app_crc_pos += len;
+
+	return len > 0 && new_app_crc_pos == NEW_APP_HEADER_LEN + new_app_image_size;
+}
+
+static THD_FUNCTION(new_app_thread, arg) {
+	(void)arg;
+
+	chRegSetThreadName("Flash write");
+
+	for(;;) {
+		chEvtWaitAny((eventmask_t)1);
+		new_app_write_queued();
+	}
+}
+
+static bool new_app_patch_output(const uint8_t *data, uint32_t len, void *arg) {
+	(void)arg;
+
+	while (len > 0) {
+		uint32_t n = sizeof(new_app_patch_buffer) - new_app_patch_buffer_len;
+		if (n > len) {
+			n = len;
+		}
+
+		memcpy(new_app_patch_buffer + new_app_patch_buffer_len, data, n);
+		new_app_patch_buffer_len += n;
+		data += n;
+		len -= n;
+
+		if (new_app_patch_buffer_len == sizeof(new_app_patch_buffer) &&
+				new_app_patch_flush() != FLASH_COMPLETE) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+static uint16_t new_app_patch_flush(void) {
+	uint16_t res = new_app_res;
+
+	if (new_app_patch_buffer_len > 0) {
+		uint8_t *buffer = flash_helper_new_app_buffer_get();
+		memcpy(buffer, new_app_patch_buffer, new_app_patch_buffer_len);
+		res = flash_helper_new_app_buffer_commit(new_app_patch_out, new_app_patch_buffer_len);
+		new_app_patch_out += new_app_patch_buffer_len;
+		new_app_patch_buffer_len = 0;
+	}
+
+	return res;
+}
@@ -23,9 +23,17 @@
 #include "conf_general.h"
 
 // Functions
+void flash_helper_init(void);
+void flash_helper_lock(void);
+void flash_helper_unlock(void);
 uint16_t flash_helper_erase_new_app(uint32_t new_app_size);
 uint16_t flash_helper_erase_bootloader(void);
 uint16_t flash_helper_write_new_app_data(uint32_t offset, uint8_t *data, uint32_t len);
+uint8_t *flash_helper_new_app_buffer_get(void);
+uint16_t flash_helper_new_app_buffer_commit(uint32_t offset, uint32_t len);
+uint16_t flash_helper_new_app_wait(void);
+uint16_t flash_helper_write_new_app_patch(uint32_t offset, uint8_t *data, uint32_t len);
+uint32_t flash_helper_verify_new_app(void);
 void flash_helper_jump_to_bootloader(void);
 uint8_t* flash_helper_get_sector_address(uint32_t fsector);
 uint32_t flash_helper_verify_flash_memory(void);
@@ -0,0 +1,452 @@
+/*
+	Copyright 2026 agent	agent@local
+
+	This file is part of the VESC firmware.
+
+	The VESC firmware is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    The VESC firmware is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+#include "flash_patch.h"
+#include "buffer.h"
+#include "crc.h"
+#include <string.h>
+
+/**
+ * Apply a binary patch to the running image, producing the new image as a
+ * stream. The new image is built from ranges of the base image that are
+ * copied as they are, with the addresses of code that moved updated, or with
+ * small differences added, and from new data. Patches are made with the host tool in
+ * tests/fw_patch.
+ *
+ * The output starts with the size and CRC of the new image, so that it can
+ * be written to the new app area as it is. The patch can arrive in pieces
+ * of any length.
+ */
+
+// Private types
+typedef enum {
+	STATE_HEADER = 0,
+	STATE_OP,
+	STATE_ARGS,
+	STATE_ADD,
+	STATE_INSERT,
+	STATE_DONE
+} patch_state;
+
+// Private functions
+static FLASH_PATCH_RES header_done(flash_patch *p);
+static FLASH_PATCH_RES args_done(flash_patch *p);
+static FLASH_PATCH_RES op_done(flash_patch *p);
+static bool emit(flash_patch *p, const uint8_t *data, uint32_t len);
+static bool base_range_ok(flash_patch *p, uint32_t src, uint32_t len);
+
+/**
+ * Start applying a patch.
+ *
+ * @param p
+ * The patch state.
+ *
+ * @param base
+ * The running image.
+ *
+ * @param base_max
+ * The largest base length that a patch may use.
+ *
+ * @param hole_start
+ * Start of a range in the base that differs from the image it was built
+ * from, e.g. the emulated EEPROM. It is left out of the CRC and cannot be
+ * copied from.
+ *
+ * @param hole_len
+ * Length of that range, 0 for none.
+ *
+ * @param new_max
+ * The largest new image that fits in the output.
+ *
+ * @param output
+ * Called with the output in order. Returns false to stop with an error.
+ *
+ * @param arg
+ * Passed to output.
+ */
+void flash_patch_init(flash_patch *p, const uint8_t *base, uint32_t base_max,
+		uint32_t hole_start, uint32_t hole_len, uint32_t new_max,
+		bool (*output)(const uint8_t *data, uint32_t len, void *arg), void *arg) {
+	p->base = base;
+	p->base_max = base_max;
+	p->hole_start = hole_start;
+	p->hole_len = hole_len;
+	p->new_max = new_max;
+	p->output = output;
+	p->arg = arg;
+
+	p->state = STATE_HEADER;
+	p->field_pos = 0;
+	p->field_len = FLASH_PATCH_HEADER_LEN;
+	p->op = 0;
+	p->src = 0;
+	p->remaining = 0;
+	p->base_len = 0;
+	p->new_len = 0;
+	p->out_len = 0;
+	p->reloc_cnt = 0;
+	p->res = FLASH_PATCH_OK;
+}
+
+/**
+ * Process the next piece of the patch.
+ *
+ * @param p
+ * The patch state.
+ *
+ * @param data
+ * The data.
+ *
+ * @param len
+ * The length of the data.
+ *
+ * @return
+ * FLASH_PATCH_OK when more data is needed, FLASH_PATCH_DONE when the new
+ * image is complete, or an error. Errors are kept until flash_patch_init
+ * is called again.
+ */
+FLASH_PATCH_RES flash_patch_process(flash_patch *p, const uint8_t *data, uint32_t len) {
+	while (len > 0 && p->res == FLASH_PATCH_OK) {
+		switch (p->state) {
+		case STATE_HEADER:
+		case STATE_ARGS: {
+			uint32_t n = p->field_len - p->field_pos;
+			if (n > len) {
+				n = len;
+			}
+
+			memcpy(p->field + p->field_pos, data, n);
+			p->field_pos += n;
+			data += n;
+			len -= n;
+
+			if (p->field_pos == p->field_len) {
+				p->res = p->state == STATE_HEADER ? header_done(p) : args_done(p);
+			}
+		} break;
+
+		case STATE_OP:
+			p->op = *data++;
+			len--;
+			p->field_pos = 0;
+			p->state = STATE_ARGS;
+
+			switch (p->op) {
+			case FLASH_PATCH_OP_COPY:
+			case FLASH_PATCH_OP_ADD:
+			case FLASH_PATCH_OP_COPY_RELOC: p->field_len = 8; break;
+			case FLASH_PATCH_OP_RELOC: p->field_len = 12; break;
+			case FLASH_PATCH_OP_INSERT: p->field_len = 4; break;
+			case FLASH_PATCH_OP_FILL: p->field_len = 5; break;
+			default: p->res = FLASH_PATCH_ERROR_FORMAT; break;
+			}
+			break;
+
+		case STATE_ADD: {
+			uint8_t buffer[64];
+			uint32_t n = p->remaining;
+			if (n > len) {
+				n = len;
+			}
+			if (n > sizeof(buffer)) {
+				n = sizeof(buffer);
+			}
+
+			for (uint32_t i = 0;i < n;i++) {
+				buffer[i] = p->base[p->src + i] + data[i];
+			}
+
+			if (emit(p, buffer, n)) {
+				p->src += n;
+				p->remaining -= n;
+				data += n;
+				len -= n;
+
+				if (p->remaining == 0) {
+					p->res = op_done(p);
+				}
+			}
+		} break;
+
+		case STATE_INSERT: {
+			uint32_t n = p->remaining;
+			if (n > len) {
+				n = len;
+			}
+
+			if (emit(p, data, n)) {
+				p->remaining -= n;
+				data += n;
+				len -= n;
+
+				if (p->remaining == 0) {
+					p->res = op_done(p);
+				}
+			}
+		} break;
+
+		default:
+			p->res = FLASH_PATCH_ERROR_FORMAT;
+			break;
+		}
+	}
+
+	// Nothing may follow the last operation
+	if (len > 0 && p->res == FLASH_PATCH_DONE) {
+		p->res = FLASH_PATCH_ERROR_FORMAT;
+	}
+
+	return p->res;
+}
+
+/**
+ * Move an address in the base image by the relocation ranges of the patch.
+ *
+ * @param p
+ * The patch state.
+ *
+ * @param word
+ * A word from the base image.
+ *
+ * @return
+ * The word moved by the range it points into, or unchanged.
+ */
+uint32_t flash_patch_reloc_word(const flash_patch *p, uint32_t word) {
+	uint32_t offset = word - FLASH_PATCH_LINK_ADDR;
+	int lo = 0;
+	int hi = p->reloc_cnt - 1;
+
+	while (lo <= hi) {
+		int mid = (lo + hi) / 2;
+		if (offset < p->reloc_start[mid]) {
+			hi = mid - 1;
+		} else if (offset - p->reloc_start[mid] >= p->reloc_len[mid]) {
+			lo = mid + 1;
+		} else {
+			return word + p->reloc_shift[mid];
+		}
+	}
+
+	return word;
+}
+
+/**
+ * Calculate the CRC of a base image, without the hole.
+ *
+ * @param base
+ * The image.
+ *
+ * @param base_len
+ * The length of the image.
+ *
+ * @param hole_start
+ * Start of the range to leave out.
+ *
+ * @param hole_len
+ * Length of the range to leave out.
+ *
+ * @return
+ * The CRC16 as in crc.h.
+ */
+uint16_t flash_patch_base_crc(const uint8_t *base, uint32_t base_len,
+		uint32_t hole_start, uint32_t hole_len) {
+	uint16_t crc = 0;
+
+	if (hole_len == 0 || hole_start >= base_len) {
+		return crc16_update(crc, base, base_len);
+	}
+
+	crc = crc16_update(crc, base, hole_start);
+	if (hole_start + hole_len < base_len) {
+		crc = crc16_update(crc, base + hole_start + hole_len,
+				base_len - hole_start - hole_len);
+	}
+
+	return crc;
+}
+
+static FLASH_PATCH_RES header_done(flash_patch *p) {
+	int32_t ind = 0;
+	uint32_t magic = buffer_get_uint32(p->field, &ind);
+	p->base_len = buffer_get_uint32(p->field, &ind);
+	uint16_t base_crc = buffer_get_uint16(p->field, &ind);
+	p->new_len = buffer_get_uint32(p->field, &ind);
+
+	if (magic != FLASH_PATCH_MAGIC) {
+		return FLASH_PATCH_ERROR_MAGIC;
+	}
+
+	if (p->new_len > p->new_max) {
+		return FLASH_PATCH_ERROR_FORMAT;
+	}
+
+	if (p->base_len > p->base_max ||
+			flash_patch_base_crc(p->base, p->base_len, p->hole_start, p->hole_len) != base_crc) {
+		return FLASH_PATCH_ERROR_BASE;
+	}
+
+	// The size and CRC of the new image go first
+	if (!emit(p, p->field + 10, FLASH_PATCH_OUT_HEADER_LEN)) {
+		return p->res;
+	}
+
+	return op_done(p);
+}
+
+static FLASH_PATCH_RES args_done(flash_patch *p) {
+	int32_t ind = 0;
+
+	if (p->op == FLASH_PATCH_OP_RELOC) {
+		uint32_t start = buffer_get_uint32(p->field, &ind);
+		uint32_t len = buffer_get_uint32(p->field, &ind);
+		int32_t shift = buffer_get_int32(p->field, &ind);
+		int n = p->reloc_cnt;
+
+		// In order and without overlaps, for the binary search
+		if (n >= FLASH_PATCH_RELOC_MAX ||
+				(n > 0 && start < p->reloc_start[n - 1] + p->reloc_len[n - 1])) {
+			return FLASH_PATCH_ERROR_FORMAT;
+		}
+
+		p->reloc_start[n] = start;
+		p->reloc_len[n] = len;
+		p->reloc_shift[n] = shift;
+		p->reloc_cnt++;
+		return op_done(p);
+	}
+
+	if (p->op == FLASH_PATCH_OP_COPY || p->op == FLASH_PATCH_OP_ADD ||
+			p->op == FLASH_PATCH_OP_COPY_RELOC) {
+		p->src = buffer_get_uint32(p->field, &ind);
+	}
+
+	p->remaining = buffer_get_uint32(p->field, &ind);
+
+	if (p->remaining > FLASH_PATCH_OUT_HEADER_LEN + p->new_len - p->out_len) {
+		return FLASH_PATCH_ERROR_FORMAT;
+	}
+
+	switch (p->op) {
+	case FLASH_PATCH_OP_COPY:
+		if (!base_range_ok(p, p->src, p->remaining)) {
+			return FLASH_PATCH_ERROR_FORMAT;
+		}
+
+		if (!emit(p, p->base + p->src, p->remaining)) {
+			return p->res;
+		}
+
+		p->remaining = 0;
+		break;
+
+	case FLASH_PATCH_OP_COPY_RELOC: {
+		if (!base_range_ok(p, p->src, p->remaining)) {
+			return FLASH_PATCH_ERROR_FORMAT;
+		}
+
+		// Words that are aligned in the base and inside the range
+		uint8_t buffer[64];
+		uint32_t pos = p->src;
+		uint32_t end = p->src + p->remaining;
+
+		while (pos < end) {
+			uint32_t n = 0;
+
+			while (n + 4 <= sizeof(buffer) && pos < end) {
+				if ((pos & 3) == 0 && end - pos >= 4) {
+					uint32_t word;
+					memcpy(&word, p->base + pos, 4);
+					word = flash_patch_reloc_word(p, word);
+					memcpy(buffer + n, &word, 4);
+					n += 4;
+					pos += 4;
+				} else {
+					buffer[n++] = p->base[pos++];
+				}
+			}
+
+			if (!emit(p, buffer, n)) {
+				return p->res;
+			}
+		}
+
+		p->remaining = 0;
+	} break;
+
+	case FLASH_PATCH_OP_ADD:
+		if (!base_range_ok(p, p->src, p->remaining)) {
+			return FLASH_PATCH_ERROR_FORMAT;
+		}
+
+		p->state = STATE_ADD;
+		break;
+
+	case FLASH_PATCH_OP_INSERT:
+		p->state = STATE_INSERT;
+		break;
+
+	case FLASH_PATCH_OP_FILL: {
+		uint8_t buffer[64];
+		memset(buffer, p->field[ind], sizeof(buffer));
+
+		while (p->remaining > 0) {
+			uint32_t n = p->remaining > sizeof(buffer) ? sizeof(buffer) : p->remaining;
+			if (!emit(p, buffer, n)) {
+				return p->res;
+			}
+			p->remaining -= n;
+		}
+	} break;
+
+	default:
+		return FLASH_PATCH_ERROR_FORMAT;
+	}
+
+	return p->remaining == 0 ? op_done(p) : FLASH_PATCH_OK;
+}
+
+static FLASH_PATCH_RES op_done(flash_patch *p) {
+	if (p->out_len == FLASH_PATCH_OUT_HEADER_LEN + p->new_len) {
+		p->state = STATE_DONE;
+		return FLASH_PATCH_DONE;
+	}
+
+	p->state = STATE_OP;
+	return FLASH_PATCH_OK;
+}
+
+static bool emit(flash_patch *p, const uint8_t *data, uint32_t len) {
+	if (len > 0 && !p->output(data, len, p->arg)) {
+		p->res = FLASH_PATCH_ERROR_OUTPUT;
+		return false;
+	}
+
+	p->out_len += len;
+	return true;
+}
+
+static bool base_range_ok(flash_patch *p, uint32_t src, uint32_t len) {
+	if (src > p->base_len || len > p->base_len - src) {
+		return false;
+	}
+
+	// The hole differs from what the patch was made against
+	return p->hole_len == 0 || src + len <= p->hole_start ||
+			src >= p->hole_start + p->hole_len;
+}
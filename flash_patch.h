@@ -0,0 +1,114 @@
+/*
+	Copyright 2026 agent	agent@local
+
+	This file is part of the VESC firmware.
+
+	The VESC firmware is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    The VESC firmware is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+#ifndef FLASH_PATCH_H_
+#define FLASH_PATCH_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * Patch format, all numbers big endian as in buffer.h:
+ *
+ * Header:
+ * uint32 FLASH_PATCH_MAGIC
+ * uint32 Length of the base image
+ * uint16 CRC16 of the base image, without the hole
+ * uint32 Length of the new image
+ * uint16 CRC16 of the new image
+ *
+ * Followed by operations that produce the new image in order:
+ * FLASH_PATCH_OP_COPY:   uint32 src, uint32 len
+ * FLASH_PATCH_OP_ADD:    uint32 src, uint32 len, len bytes added to the base
+ * FLASH_PATCH_OP_INSERT: uint32 len, len bytes
+ * FLASH_PATCH_OP_FILL:   uint32 len, uint8 value
+ * FLASH_PATCH_OP_RELOC:  uint32 start, uint32 len, int32 shift
+ * FLASH_PATCH_OP_COPY_RELOC: uint32 src, uint32 len
+ *
+ * FLASH_PATCH_OP_RELOC adds a range of the base that has moved by shift bytes
+ * in the new image. The ranges have to be added in order. COPY_RELOC copies
+ * like COPY, and every aligned word in the copied range that is an address in
+ * one of those ranges is moved as well, which updates e.g. the literal pools
+ * when code has moved.
+ */
+
+// Settings
+#define FLASH_PATCH_MAGIC			0x56445031 // VDP1
+#define FLASH_PATCH_HEADER_LEN		16
+#define FLASH_PATCH_OUT_HEADER_LEN	6 // Size and CRC in front of the new image
+#define FLASH_PATCH_RELOC_MAX		32
+#define FLASH_PATCH_LINK_ADDR		0x08000000 // Address the images are linked at
+
+// Types
+typedef enum {
+	FLASH_PATCH_OP_COPY = 1,
+	FLASH_PATCH_OP_ADD,
+	FLASH_PATCH_OP_INSERT,
+	FLASH_PATCH_OP_FILL,
+	FLASH_PATCH_OP_RELOC,
+	FLASH_PATCH_OP_COPY_RELOC
+} FLASH_PATCH_OP;
+
+typedef enum {
+	FLASH_PATCH_OK = 0,
+	FLASH_PATCH_DONE,
+	FLASH_PATCH_ERROR_MAGIC,
+	FLASH_PATCH_ERROR_BASE,
+	FLASH_PATCH_ERROR_FORMAT,
+	FLASH_PATCH_ERROR_OUTPUT
+} FLASH_PATCH_RES;
+
+typedef struct {
+	// Configuration
+	const uint8_t *base;
+	uint32_t base_max;
+	uint32_t hole_start;
+	uint32_t hole_len;
+	uint32_t new_max;
+	bool (*output)(const uint8_t *data, uint32_t len, void *arg);
+	void *arg;
+
+	// State
+	int state;
+	uint8_t field[FLASH_PATCH_HEADER_LEN];
+	unsigned int field_pos;
+	unsigned int field_len;
+	uint8_t op;
+	uint32_t src;
+	uint32_t remaining;
+	uint32_t base_len;
+	uint32_t new_len;
+	uint32_t out_len;
+	uint32_t reloc_start[FLASH_PATCH_RELOC_MAX];
+	uint32_t reloc_len[FLASH_PATCH_RELOC_MAX];
+	int32_t reloc_shift[FLASH_PATCH_RELOC_MAX];
+	int reloc_cnt;
+	FLASH_PATCH_RES res;
+} flash_patch;
+
+// Functions
+void flash_patch_init(flash_patch *p, const uint8_t *base, uint32_t base_max,
+		uint32_t hole_start, uint32_t hole_len, uint32_t new_max,
+		bool (*output)(const uint8_t *data, uint32_t len, void *arg), void *arg);
+FLASH_PATCH_RES flash_patch_process(flash_patch *p, const uint8_t *data, uint32_t len);
+uint32_t flash_patch_reloc_word(const flash_patch *p, uint32_t word);
+uint16_t flash_patch_base_crc(const uint8_t *base, uint32_t base_len,
+		uint32_t hole_start, uint32_t hole_len);
+
+#endif /* FLASH_PATCH_H_ */
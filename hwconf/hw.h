@@ -368,6 +368,14 @@
 #define HW_CAN_DEV				CAND1
 #endif
 
+// Interrupt priority of the UART RX DMA streams, when the hardware has them
+#ifndef HW_UART_RX_DMA_IRQ_PRIO
+#define HW_UART_RX_DMA_IRQ_PRIO		12
+#endif
+#ifndef HW_UART_P_RX_DMA_IRQ_PRIO
+#define HW_UART_P_RX_DMA_IRQ_PRIO	12
+#endif
+
 // Hook to call when trying to initialize the permanent NRF failed. Can be
 // used to e.g. reconfigure pins.
 #ifndef HW_PERMANENT_NRF_FAILED_HOOK
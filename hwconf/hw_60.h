@@ -181,6 +181,8 @@
 #define HW_UART_TX_PIN			10
 #define HW_UART_RX_PORT			GPIOB
 #define HW_UART_RX_PIN			11
+#define HW_UART_RX_DMA_STREAM	STM32_DMA_STREAM(STM32_DMA_STREAM_ID(1, 1))
+#define HW_UART_RX_DMA_CHANNEL	DMA_Channel_4
 
 #if defined(HW60_IS_MK3) || defined(HW60_IS_MK4)
 // Permanent UART Peripheral (for NRF51)
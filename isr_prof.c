@@ -0,0 +1,230 @@
+/*
+	Copyright 2026 agent	agent@local
+
+	This file is part of the VESC firmware.
+
+	The VESC firmware is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    The VESC firmware is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+#include "isr_prof.h"
+#include "timer.h"
+#include "ch.h"
+#include "hal.h"
+
+#include <string.h>
+
+/*
+ * Always-on profiler for interrupt handlers. The duration of every call and
+ * the change of the period between consecutive calls (jitter) are counted in
+ * histograms with four bins per octave of timer ticks, so the memory use is
+ * fixed and adding a sample only takes a few instructions.
+ *
+ * The handlers update their statistics in place between two increments of a
+ * sequence number, and the reader copies them and checks that the number did
+ * not change, so the handlers never wait for a reader.
+ */
+
+// Settings
+#define BINS					64
+#define TICKS_PER_SECOND		1e7 // See timer.c
+
+// Private types
+typedef struct {
+	volatile bool reset;
+	uint32_t seq; // Odd while the handler updates the statistics
+	uint32_t count;
+	uint32_t last_start;
+	uint32_t last_period;
+	uint64_t period_sum;
+	uint32_t duration_max;
+	uint32_t jitter_max;
+	uint32_t duration_hist[BINS];
+	uint32_t jitter_hist[BINS];
+} isr_prof_state;
+
+// Private variables
+static volatile isr_prof_state m_state[ISR_PROF_MOTORS][ISR_PROF_NUM];
+
+static const char * const m_names[ISR_PROF_NUM] = {
+		"FOC ADC",
+		"MC timer",
+		"BLDC injected ADC"
+};
+
+// Values below 8 get one bin each, above that every octave has four bins.
+static inline int value_to_bin(uint32_t value) {
+	if (value < 8) {
+		return value;
+	}
+
+	int msb = 31 - __CLZ(value);
+	int bin = 8 + (msb - 3) * 4 + ((value >> (msb - 2)) & 3);
+
+	return bin < BINS ? bin : BINS - 1;
+}
+
+static float bin_to_value(int bin) {
+	if (bin < 8) {
+		return bin;
+	}
+
+	int octave = (bin - 8) / 4 + 3;
+	uint32_t width = 1 << (octave - 2);
+	uint32_t lower = (4 + (bin - 8) % 4) * width;
+
+	return (float)lower + (float)width / 2.0;
+}
+
+static float percentile(const uint32_t *hist, float p, uint32_t max) {
+	uint32_t total = 0;
+	for (int i = 0;i < BINS;i++) {
+		total += hist[i];
+	}
+
+	if (total == 0) {
+		return 0.0;
+	}
+
+	uint32_t target = (uint32_t)((float)total * p);
+	uint32_t sum = 0;
+	for (int i = 0;i < BINS;i++) {
+		sum += hist[i];
+		if (sum > target) {
+			float value = bin_to_value(i);
+			return value < (float)max ? value : (float)max;
+		}
+	}
+
+	return max;
+}
+
+static volatile isr_prof_state *get_state(isr_prof_id id, bool is_second_motor) {
+#ifdef HW_HAS_DUAL_MOTORS
+	return &m_state[is_second_motor ? 1 : 0][id];
+#else
+	(void)is_second_motor;
+	return &m_state[0][id];
+#endif
+}
+
+/**
+ * Add a sample. Call this at the end of the interrupt handler.
+ *
+ * @param id
+ * The handler.
+ *
+ * @param is_second_motor
+ * The motor that the handler ran for.
+ *
+ * @param t_start
+ * timer_time_now() at the start of the handler.
+ */
+void isr_prof_add(isr_prof_id id, bool is_second_motor, uint32_t t_start) {
+	uint32_t duration = timer_time_now() - t_start;
+	volatile isr_prof_state *s = get_state(id, is_second_motor);
+
+	s->seq++;
+	__DMB();
+
+	if (s->reset) {
+		uint32_t seq = s->seq;
+		memset((void*)s, 0, sizeof(isr_prof_state));
+		s->seq = seq;
+	}
+
+	s->duration_hist[value_to_bin(duration)]++;
+	if (duration > s->duration_max) {
+		s->duration_max = duration;
+	}
+
+	if (s->count > 0) {
+		uint32_t period = t_start - s->last_start;
+
+		if (s->count > 1) {
+			uint32_t jitter = period > s->last_period ?
+					period - s->last_period : s->last_period - period;
+
+			s->jitter_hist[value_to_bin(jitter)]++;
+			if (jitter > s->jitter_max) {
+				s->jitter_max = jitter;
+			}
+		}
+
+		s->period_sum += period;
+		s->last_period = period;
+	}
+
+	s->last_start = t_start;
+	s->count++;
+
+	__DMB();
+	s->seq++;
+}
+
+/*
+ * Consistent copy of the statistics of one handler. When the handler runs
+ * during the copy, the sequence number changes and the copy is repeated. The
+ * copy only takes a small part of the handler period.
+ */
+static void copy_state(volatile isr_prof_state *s, isr_prof_state *copy) {
+	for (;;) {
+		uint32_t seq = s->seq;
+
+		// Only possible when the handler runs on another core, e.g. in tests
+		if (seq & 1) {
+			continue;
+		}
+
+		__DMB();
+		memcpy(copy, (const void*)s, sizeof(isr_prof_state));
+		__DMB();
+
+		if (s->seq == seq) {
+			return;
+		}
+	}
+}
+
+void isr_prof_get_stats(isr_prof_id id, bool is_second_motor, isr_prof_stats *stats) {
+	isr_prof_state s;
+	copy_state(get_state(id, is_second_motor), &s);
+
+	const float scale = 1.0 / TICKS_PER_SECOND;
+
+	stats->count = s.count;
+	stats->duration_p50 = percentile(s.duration_hist, 0.5, s.duration_max) * scale;
+	stats->duration_p99 = percentile(s.duration_hist, 0.99, s.duration_max) * scale;
+	stats->duration_max = (float)s.duration_max * scale;
+	stats->jitter_p50 = percentile(s.jitter_hist, 0.5, s.jitter_max) * scale;
+	stats->jitter_p99 = percentile(s.jitter_hist, 0.99, s.jitter_max) * scale;
+	stats->jitter_max = (float)s.jitter_max * scale;
+	stats->period_avg = stats->count > 1 ?
+			(float)s.period_sum / (float)(stats->count - 1) * scale : 0.0;
+}
+
+const char *isr_prof_name(isr_prof_id id) {
+	return m_names[id];
+}
+
+/**
+ * Clear all statistics. The handlers do the clearing on their next call, so
+ * that no sample is mixed with the old data.
+ */
+void isr_prof_reset(void) {
+	for (int m = 0;m < ISR_PROF_MOTORS;m++) {
+		for (int i = 0;i < ISR_PROF_NUM;i++) {
+			m_state[m][i].reset = true;
+		}
+	}
+}
@@ -0,0 +1,61 @@
+/*
+	Copyright 2026 agent	agent@local
+
+	This file is part of the VESC firmware.
+
+	The VESC firmware is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    The VESC firmware is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+#ifndef ISR_PROF_H_
+#define ISR_PROF_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "hw.h"
+
+// Profiled interrupt handlers
+typedef enum {
+	ISR_PROF_FOC_ADC = 0,
+	ISR_PROF_MC_TIMER,
+	ISR_PROF_BLDC_ADC_INJ,
+	ISR_PROF_NUM
+} isr_prof_id;
+
+// Every motor has its own statistics
+#ifdef HW_HAS_DUAL_MOTORS
+#define ISR_PROF_MOTORS			2
+#else
+#define ISR_PROF_MOTORS			1
+#endif
+
+// Statistics of one handler. All times are in seconds. The percentiles come
+// from log-scale histograms and are accurate to about 12 %.
+typedef struct {
+	uint32_t count;
+	float duration_p50;
+	float duration_p99;
+	float duration_max;
+	float jitter_p50;
+	float jitter_p99;
+	float jitter_max;
+	float period_avg;
+} isr_prof_stats;
+
+// Functions
+void isr_prof_add(isr_prof_id id, bool is_second_motor, uint32_t t_start);
+void isr_prof_get_stats(isr_prof_id id, bool is_second_motor, isr_prof_stats *stats);
+const char *isr_prof_name(isr_prof_id id);
+void isr_prof_reset(void);
+
+#endif /* ISR_PROF_H_ */
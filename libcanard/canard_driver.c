@@ -318,7 +318,7 @@ static THD_FUNCTION(canard_thread, arg) {
 		canardSetLocalNodeID(&canard, conf->controller_id);
 
 		CANRxFrame *rxmsg;
-		while ((rxmsg = comm_can_get_rx_frame()) != 0) {
+		while ((rxmsg = comm_can_rx_frame_peek()) != 0) {
 			CanardCANFrame rx_frame;
 
 			if (rxmsg->IDE == CAN_IDE_EXT) {
@@ -329,6 +329,7 @@ static THD_FUNCTION(canard_thread, arg) {
 
 			rx_frame.data_len = rxmsg->DLC;
 			memcpy(rx_frame.data, rxmsg->data8, rxmsg->DLC);
+			comm_can_rx_frame_release();
 
 			canardHandleRxFrame(&canard, &rx_frame, ST2US(chVTGetSystemTimeX()));
 		}
@@ -55,6 +55,7 @@
 #endif
 #include "shutdown.h"
 #include "mempools.h"
+#include "telemetry.h"
 
 /*
  * HW resources used:
@@ -225,6 +226,7 @@ int main(void) {
 	LED_GREEN_OFF();
 
 	timer_init();
+	flash_helper_init();
 	conf_general_init();
 
 	if( flash_helper_verify_flash_memory() == FAULT_CODE_FLASH_CORRUPTION )	{
@@ -241,6 +243,7 @@ int main(void) {
 	mc_interface_init();
 
 	commands_init();
+	telemetry_init();
 
 #if COMM_USE_USB
 	comm_usb_init();
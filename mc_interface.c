@@ -39,6 +39,13 @@
 #include "app.h"
 #include "utils.h"
 #include "mempools.h"
+#include "packet.h"
+#include "sample_stream.h"
+#include "telemetry.h"
+#include "timer.h"
+#include "isr_prof.h"
+#include "minilzo.h"
+#include "seqlock.h"
 
 #include <math.h>
 #include <stdlib.h>
@@ -58,18 +65,15 @@ typedef struct {
 	unsigned int m_cycles_running;
 	bool m_lock_enabled;
 	bool m_lock_override_once;
-	float m_motor_current_sum;
-	float m_input_current_sum;
-	float m_motor_current_iterations;
-	float m_input_current_iterations;
-	float m_motor_id_sum;
-	float m_motor_iq_sum;
-	float m_motor_id_iterations;
-	float m_motor_iq_iterations;
-	float m_motor_vd_sum;
-	float m_motor_vq_sum;
-	float m_motor_vd_iterations;
-	float m_motor_vq_iterations;
+	float m_avg_isr_sum[MC_AVG_NUM];
+	float m_avg_isr_samples;
+	int64_t m_avg_sum[MC_AVG_NUM];
+	uint32_t m_avg_samples;
+	int64_t m_avg_read_sum[MC_AVG_NUM];
+	uint32_t m_avg_read_samples[MC_AVG_NUM];
+	int m_snapshot_cnt;
+	seqlock m_snapshot_lock;
+	mc_snapshot m_snapshot;
 	float m_amp_seconds;
 	float m_amp_seconds_charged;
 	float m_watt_seconds;
@@ -102,20 +106,47 @@ __attribute__((section(".ram4"))) static volatile int16_t m_curr_fir_samples[ADC
 __attribute__((section(".ram4"))) static volatile int16_t m_f_sw_samples[ADC_SAMPLE_MAX_LEN];
 __attribute__((section(".ram4"))) static volatile int8_t m_phase_samples[ADC_SAMPLE_MAX_LEN];
 
+// Channels of the sample stream, see sample_stream.h
+static const volatile int16_t *const m_sample_ch16[] = {
+		m_curr0_samples, m_curr1_samples, m_ph1_samples, m_ph2_samples,
+		m_ph3_samples, m_vzero_samples, m_curr_fir_samples, m_f_sw_samples
+};
+static const volatile uint8_t *const m_sample_ch8[] = {
+		m_status_samples, (volatile uint8_t*)m_phase_samples
+};
+static uint8_t m_sample_stream_buffer[PACKET_MAX_PL_LEN];
+
+// LZO compression of the sample stream needs LZO1X_1_MEM_COMPRESS bytes of
+// work memory, so it is only available when enabled at build time.
+#ifndef SAMPLE_STREAM_LZO
+#define SAMPLE_STREAM_LZO		0
+#endif
+
+#if SAMPLE_STREAM_LZO
+static lzo_align_t m_sample_lzo_wrkmem[(LZO1X_1_MEM_COMPRESS + sizeof(lzo_align_t) - 1) / sizeof(lzo_align_t)];
+static uint8_t m_sample_lzo_buffer[SAMPLE_STREAM_LZO_BUFFER_LEN(PACKET_MAX_PL_LEN)];
+#endif
+
 static volatile int m_sample_len;
 static volatile int m_sample_int;
 static volatile debug_sampling_mode m_sample_mode;
 static volatile debug_sampling_mode m_sample_mode_last;
+static volatile debug_sampling_format m_sample_format;
 static volatile int m_sample_now;
 static volatile int m_sample_trigger;
 static volatile float m_last_adc_duration_sample;
 static volatile bool m_sample_is_second_motor;
+static volatile bool m_sample_buffers_taken;
+static mutex_t m_sample_send_mutex;
 static volatile mc_fault_code m_fault_stop_fault;
 static volatile bool m_fault_stop_is_second_motor;
 
 // Private functions
 static void update_override_limits(volatile motor_if_state_t *motor, volatile mc_configuration *conf);
 static void run_timer_tasks(volatile motor_if_state_t *motor);
+static void update_snapshot(volatile motor_if_state_t *motor);
+static float read_reset_avg(mc_avg_value value);
+static void send_samples(void);
 static volatile motor_if_state_t *motor_now(void);
 
 // Function pointers
@@ -142,6 +173,11 @@ void mc_interface_init(void) {
 	conf_general_read_mc_configuration((mc_configuration*)&m_motor_2.m_conf, true);
 #endif
 
+	seqlock_init((seqlock*)&m_motor_1.m_snapshot_lock);
+#ifdef HW_HAS_DUAL_MOTORS
+	seqlock_init((seqlock*)&m_motor_2.m_snapshot_lock);
+#endif
+
 #ifdef HW_HAS_DUAL_MOTORS
 	m_motor_1.m_conf.motor_type = MOTOR_TYPE_FOC;
 	m_motor_2.m_conf.motor_type = MOTOR_TYPE_FOC;
@@ -154,7 +190,10 @@ void mc_interface_init(void) {
 	m_sample_trigger = 0;
 	m_sample_mode = DEBUG_SAMPLING_OFF;
 	m_sample_mode_last = DEBUG_SAMPLING_OFF;
+	m_sample_format = DEBUG_SAMPLING_FORMAT_PACKETS;
 	m_sample_is_second_motor = false;
+	m_sample_buffers_taken = false;
+	chMtxObjectInit(&m_sample_send_mutex);
 
 	// Start threads
 	chThdCreateStatic(timer_thread_wa, sizeof(timer_thread_wa), NORMALPRIO, timer_thread, NULL);
@@ -1179,26 +1218,53 @@ float mc_interface_get_last_inj_adc_isr_duration(void) {
 	return ret;
 }
 
-float mc_interface_read_reset_avg_motor_current(void) {
-	if (motor_now()->m_conf.motor_type == MOTOR_TYPE_GPD) {
-		return gpdrive_get_current_filtered();
+/**
+ * Get a consistent copy of the state of the motor. It is published by the
+ * motor interface timer every MC_INTERFACE_SNAPSHOT_INTERVAL ms, so the
+ * values in it are from the same moment and reading them has no side
+ * effects. Prefer this over calling many of the getters one by one.
+ *
+ * @param snapshot
+ * Where to copy the state of the motor selected for this thread.
+ */
+void mc_interface_get_snapshot(mc_snapshot *snapshot) {
+	volatile motor_if_state_t *motor = motor_now();
+	seqlock_read((seqlock*)&motor->m_snapshot_lock, snapshot, &motor->m_snapshot, sizeof(mc_snapshot));
+}
+
+/**
+ * Average of a motor ISR value between two snapshots. Every consumer that
+ * keeps its previous snapshot gets its own average, without affecting the
+ * others.
+ *
+ * @param now
+ * The latest snapshot.
+ *
+ * @param prev
+ * An earlier snapshot of the same motor, or NULL.
+ *
+ * @param value
+ * The value to average.
+ *
+ * @return
+ * The average since prev, or over the last snapshot interval if prev is NULL
+ * or no samples were taken since prev.
+ */
+float mc_interface_snapshot_avg(const mc_snapshot *now, const mc_snapshot *prev, mc_avg_value value) {
+	if (!prev || now->avg_samples == prev->avg_samples) {
+		return now->avg_last[value];
 	}
 
-	float res = motor_now()->m_motor_current_sum / motor_now()->m_motor_current_iterations;
-	motor_now()->m_motor_current_sum = 0.0;
-	motor_now()->m_motor_current_iterations = 0.0;
-	return res;
+	return (float)(now->avg_sum[value] - prev->avg_sum[value]) /
+			((float)(now->avg_samples - prev->avg_samples) * MC_AVG_SUM_SCALE);
 }
 
-float mc_interface_read_reset_avg_input_current(void) {
-	if (motor_now()->m_conf.motor_type == MOTOR_TYPE_GPD) {
-		return gpdrive_get_current_filtered() * gpdrive_get_modulation();
-	}
+float mc_interface_read_reset_avg_motor_current(void) {
+	return read_reset_avg(MC_AVG_CURRENT_MOTOR);
+}
 
-	float res = motor_now()->m_input_current_sum / motor_now()->m_input_current_iterations;
-	motor_now()->m_input_current_sum = 0.0;
-	motor_now()->m_input_current_iterations = 0.0;
-	return res;
+float mc_interface_read_reset_avg_input_current(void) {
+	return read_reset_avg(MC_AVG_CURRENT_IN);
 }
 
 /**
@@ -1208,10 +1274,7 @@ float mc_interface_read_reset_avg_input_current(void) {
  * The average D axis current.
  */
 float mc_interface_read_reset_avg_id(void) {
-	float res = motor_now()->m_motor_id_sum / motor_now()->m_motor_id_iterations;
-	motor_now()->m_motor_id_sum = 0.0;
-	motor_now()->m_motor_id_iterations = 0.0;
-	return DIR_MULT * res; // TODO: DIR_MULT?
+	return read_reset_avg(MC_AVG_ID);
 }
 
 /**
@@ -1221,10 +1284,7 @@ float mc_interface_read_reset_avg_id(void) {
  * The average Q axis current.
  */
 float mc_interface_read_reset_avg_iq(void) {
-	float res = motor_now()->m_motor_iq_sum / motor_now()->m_motor_iq_iterations;
-	motor_now()->m_motor_iq_sum = 0.0;
-	motor_now()->m_motor_iq_iterations = 0.0;
-	return DIR_MULT * res;
+	return read_reset_avg(MC_AVG_IQ);
 }
 
 /**
@@ -1234,10 +1294,7 @@ float mc_interface_read_reset_avg_iq(void) {
  * The average D axis voltage.
  */
 float mc_interface_read_reset_avg_vd(void) {
-	float res = motor_now()->m_motor_vd_sum / motor_now()->m_motor_vd_iterations;
-	motor_now()->m_motor_vd_sum = 0.0;
-	motor_now()->m_motor_vd_iterations = 0.0;
-	return DIR_MULT * res;
+	return read_reset_avg(MC_AVG_VD);
 }
 
 /**
@@ -1247,10 +1304,7 @@ float mc_interface_read_reset_avg_vd(void) {
  * The average Q axis voltage.
  */
 float mc_interface_read_reset_avg_vq(void) {
-	float res = motor_now()->m_motor_vq_sum / motor_now()->m_motor_vq_iterations;
-	motor_now()->m_motor_vq_sum = 0.0;
-	motor_now()->m_motor_vq_iterations = 0.0;
-	return DIR_MULT * res;
+	return read_reset_avg(MC_AVG_VQ);
 }
 
 float mc_interface_get_pid_pos_set(void) {
@@ -1284,11 +1338,22 @@ float mc_interface_get_last_sample_adc_isr_duration(void) {
 	return m_last_adc_duration_sample;
 }
 
-void mc_interface_sample_print_data(debug_sampling_mode mode, uint16_t len, uint8_t decimation) {
+void mc_interface_sample_print_data(debug_sampling_mode mode, uint16_t len, uint8_t decimation,
+		debug_sampling_format format) {
+	chMtxLock(&m_sample_send_mutex);
+
+	// A measurement is using the buffers
+	if (m_sample_buffers_taken) {
+		chMtxUnlock(&m_sample_send_mutex);
+		return;
+	}
+
 	if (len > ADC_SAMPLE_MAX_LEN) {
 		len = ADC_SAMPLE_MAX_LEN;
 	}
 
+	m_sample_format = format;
+
 	if (mode == DEBUG_SAMPLING_SEND_LAST_SAMPLES) {
 		chEvtSignal(sample_send_tp, (eventmask_t) 1);
 	} else {
@@ -1301,6 +1366,56 @@ void mc_interface_sample_print_data(debug_sampling_mode mode, uint16_t len, uint
 		m_sample_is_second_motor = motor_now() == &m_motor_2;
 #endif
 	}
+
+	chMtxUnlock(&m_sample_send_mutex);
+}
+
+/**
+ * Stop sampling and hand the int16 sample buffers over to a measurement that
+ * captures its own data, such as mcpwm_foc_measure_params. Waits for a
+ * capture that is being sent to finish. Until the buffers are given back with
+ * mc_interface_release_sample_buffers, sampling requests are ignored.
+ *
+ * @param buffers
+ * Array to store the buffer pointers to.
+ *
+ * @param num
+ * Number of buffers needed.
+ *
+ * @return
+ * The length of each buffer, or 0 if there are not num buffers or they are
+ * already taken.
+ */
+int mc_interface_take_sample_buffers(volatile int16_t **buffers, int num) {
+	if (num > (int)(sizeof(m_sample_ch16) / sizeof(m_sample_ch16[0]))) {
+		return 0;
+	}
+
+	chMtxLock(&m_sample_send_mutex);
+
+	if (m_sample_buffers_taken) {
+		chMtxUnlock(&m_sample_send_mutex);
+		return 0;
+	}
+
+	m_sample_buffers_taken = true;
+	m_sample_mode = DEBUG_SAMPLING_OFF;
+	m_sample_mode_last = DEBUG_SAMPLING_OFF;
+	chMtxUnlock(&m_sample_send_mutex);
+
+	for (int i = 0;i < num;i++) {
+		buffers[i] = (volatile int16_t*)m_sample_ch16[i];
+	}
+
+	return ADC_SAMPLE_MAX_LEN;
+}
+
+/**
+ * Give the sample buffers back after mc_interface_take_sample_buffers. They
+ * contain the data of the measurement until the next capture.
+ */
+void mc_interface_release_sample_buffers(void) {
+	m_sample_buffers_taken = false;
 }
 
 /**
@@ -1520,6 +1635,8 @@ void mc_interface_fault_stop(mc_fault_code fault, bool is_second_motor, bool is_
 }
 
 void mc_interface_mc_timer_isr(bool is_second_motor) {
+	uint32_t t_start = timer_time_now();
+
 	ledpwm_update_pwm();
 
 #ifdef HW_HAS_DUAL_MOTORS
@@ -1580,20 +1697,13 @@ void mc_interface_mc_timer_isr(bool is_second_motor) {
 		pwn_done_func();
 	}
 
-	motor->m_motor_current_sum += current_filtered;
-	motor->m_input_current_sum += current_in_filtered;
-	motor->m_motor_current_iterations++;
-	motor->m_input_current_iterations++;
-
-	motor->m_motor_id_sum += mcpwm_foc_get_id();
-	motor->m_motor_iq_sum += mcpwm_foc_get_iq();
-	motor->m_motor_id_iterations++;
-	motor->m_motor_iq_iterations++;
-
-	motor->m_motor_vd_sum += mcpwm_foc_get_vd();
-	motor->m_motor_vq_sum += mcpwm_foc_get_vq();
-	motor->m_motor_vd_iterations++;
-	motor->m_motor_vq_iterations++;
+	motor->m_avg_isr_sum[MC_AVG_CURRENT_MOTOR] += current_filtered;
+	motor->m_avg_isr_sum[MC_AVG_CURRENT_IN] += current_in_filtered;
+	motor->m_avg_isr_sum[MC_AVG_ID] += mcpwm_foc_get_id();
+	motor->m_avg_isr_sum[MC_AVG_IQ] += mcpwm_foc_get_iq();
+	motor->m_avg_isr_sum[MC_AVG_VD] += mcpwm_foc_get_vd();
+	motor->m_avg_isr_sum[MC_AVG_VQ] += mcpwm_foc_get_vq();
+	motor->m_avg_isr_samples++;
 
 	// Current fault code
 	if (conf_now->l_slow_abs_current) {
@@ -1818,6 +1928,8 @@ void mc_interface_mc_timer_isr(bool is_second_motor) {
 			m_last_adc_duration_sample = mc_interface_get_last_inj_adc_isr_duration();
 		}
 	}
+
+	isr_prof_add(ISR_PROF_MC_TIMER, is_second_motor, t_start);
 }
 
 void mc_interface_adc_inj_int_handler(void) {
@@ -2194,6 +2306,101 @@ static void run_timer_tasks(volatile motor_if_state_t *motor) {
 		}
 	}
 #endif
+
+	update_snapshot(motor);
+}
+
+/*
+ * Publish the state of the motor, see mc_interface_get_snapshot. Has to be
+ * called with the motor selected for the thread.
+ */
+static void update_snapshot(volatile motor_if_state_t *motor) {
+	motor->m_snapshot_cnt++;
+	if (motor->m_snapshot_cnt < MC_INTERFACE_SNAPSHOT_INTERVAL) {
+		return;
+	}
+	motor->m_snapshot_cnt = 0;
+
+	// Take the sums of the motor ISR since the last snapshot
+	float sum[MC_AVG_NUM];
+	float samples;
+
+	chSysLock();
+	for (int i = 0;i < MC_AVG_NUM;i++) {
+		sum[i] = motor->m_avg_isr_sum[i];
+		motor->m_avg_isr_sum[i] = 0.0;
+	}
+	samples = motor->m_avg_isr_samples;
+	motor->m_avg_isr_samples = 0.0;
+	chSysUnlock();
+
+	if (motor->m_conf.motor_type == MOTOR_TYPE_GPD) {
+		memset(sum, 0, sizeof(sum));
+		sum[MC_AVG_CURRENT_MOTOR] = gpdrive_get_current_filtered();
+		sum[MC_AVG_CURRENT_IN] = gpdrive_get_current_filtered() * gpdrive_get_modulation();
+		samples = 1.0;
+	}
+
+	for (int i = MC_AVG_ID;i <= MC_AVG_VQ;i++) {
+		sum[i] *= DIR_MULT;
+	}
+
+	mc_snapshot s;
+	s.time = chVTGetSystemTimeX();
+	s.state = mc_interface_get_state();
+	s.fault = motor->m_fault_now;
+	s.v_in = GET_INPUT_VOLTAGE();
+	s.temp_fet = mc_interface_temp_fet_filtered();
+	s.temp_motor = mc_interface_temp_motor_filtered();
+	s.temp_mos_1 = NTC_TEMP_MOS1();
+	s.temp_mos_2 = NTC_TEMP_MOS2();
+	s.temp_mos_3 = NTC_TEMP_MOS3();
+	s.duty_now = mc_interface_get_duty_cycle_now();
+	s.rpm = mc_interface_get_rpm();
+	s.current_filtered = mc_interface_get_tot_current_filtered();
+	s.current_in_filtered = mc_interface_get_tot_current_in_filtered();
+	s.amp_hours = mc_interface_get_amp_hours(false);
+	s.amp_hours_charged = mc_interface_get_amp_hours_charged(false);
+	s.watt_hours = mc_interface_get_watt_hours(false);
+	s.watt_hours_charged = mc_interface_get_watt_hours_charged(false);
+	s.tachometer = mc_interface_get_tachometer_value(false);
+	s.tachometer_abs = mc_interface_get_tachometer_abs_value(false);
+	s.position = mc_interface_get_pid_pos_now();
+
+	motor->m_avg_samples += (uint32_t)samples;
+	s.avg_samples = motor->m_avg_samples;
+
+	// The interval sums are added in fixed point, so that the running sums
+	// keep their resolution and do not need double math
+	for (int i = 0;i < MC_AVG_NUM;i++) {
+		motor->m_avg_sum[i] += (int64_t)roundf(sum[i] * MC_AVG_SUM_SCALE);
+		s.avg_sum[i] = motor->m_avg_sum[i];
+		s.avg_last[i] = samples > 0.0 ? sum[i] / samples : motor->m_snapshot.avg_last[i];
+	}
+
+	seqlock_write((seqlock*)&motor->m_snapshot_lock, &motor->m_snapshot, &s, sizeof(mc_snapshot));
+}
+
+/*
+ * The read_reset_avg getters, implemented on the snapshot. Each value keeps
+ * its own position, so reading one does not reset the others.
+ */
+static float read_reset_avg(mc_avg_value value) {
+	volatile motor_if_state_t *motor = motor_now();
+	mc_snapshot s;
+	mc_interface_get_snapshot(&s);
+
+	float res = s.avg_last[value];
+	uint32_t samples = s.avg_samples - motor->m_avg_read_samples[value];
+	if (samples > 0) {
+		res = (float)(s.avg_sum[value] - motor->m_avg_read_sum[value]) /
+				((float)samples * MC_AVG_SUM_SCALE);
+	}
+
+	motor->m_avg_read_sum[value] = s.avg_sum[value];
+	motor->m_avg_read_samples[value] = s.avg_samples;
+
+	return res;
 }
 
 static THD_FUNCTION(timer_thread, arg) {
@@ -2203,11 +2410,12 @@ static THD_FUNCTION(timer_thread, arg) {
 
 	for(;;) {
 		run_timer_tasks(&m_motor_1);
+		telemetry_sample();
 #ifdef HW_HAS_DUAL_MOTORS
 		run_timer_tasks(&m_motor_2);
 #endif
 
-		chThdSleepMilliseconds(1);
+		chThdSleepMilliseconds(1000 / MC_INTERFACE_TIMER_RATE);
 	}
 }
 
@@ -2220,54 +2428,104 @@ static THD_FUNCTION(sample_send_thread, arg) {
 	for(;;) {
 		chEvtWaitAny((eventmask_t) 1);
 
-		int len = 0;
-		int offset = 0;
+		// The buffers can be taken by a measurement, see
+		// mc_interface_take_sample_buffers
+		chMtxLock(&m_sample_send_mutex);
+		if (!m_sample_buffers_taken) {
+			send_samples();
+		}
+		chMtxUnlock(&m_sample_send_mutex);
+	}
+}
 
-		switch (m_sample_mode_last) {
-		case DEBUG_SAMPLING_NOW:
-		case DEBUG_SAMPLING_START:
-			len = m_sample_len;
-			break;
+static void send_samples(void) {
+	int len = 0;
+	int offset = 0;
 
-		case DEBUG_SAMPLING_TRIGGER_START:
-		case DEBUG_SAMPLING_TRIGGER_FAULT:
-		case DEBUG_SAMPLING_TRIGGER_START_NOSEND:
-		case DEBUG_SAMPLING_TRIGGER_FAULT_NOSEND:
-			len = ADC_SAMPLE_MAX_LEN;
-			offset = m_sample_trigger - m_sample_len;
-			break;
+	switch (m_sample_mode_last) {
+	case DEBUG_SAMPLING_NOW:
+	case DEBUG_SAMPLING_START:
+		len = m_sample_len;
+		break;
 
-		default:
-			break;
+	case DEBUG_SAMPLING_TRIGGER_START:
+	case DEBUG_SAMPLING_TRIGGER_FAULT:
+	case DEBUG_SAMPLING_TRIGGER_START_NOSEND:
+	case DEBUG_SAMPLING_TRIGGER_FAULT_NOSEND:
+		len = ADC_SAMPLE_MAX_LEN;
+		offset = m_sample_trigger - m_sample_len;
+		break;
+
+	default:
+		break;
+	}
+
+	if (m_sample_format != DEBUG_SAMPLING_FORMAT_PACKETS && len > 0) {
+		const float v_scale = V_REG / 4096.0 * ((VIN_R1 + VIN_R2) / VIN_R2);
+		const float ch16_scale[] = {
+				FAC_CURRENT, FAC_CURRENT, v_scale, v_scale, v_scale, v_scale,
+				FAC_CURRENT / 8.0, 10.0
+		};
+
+		sample_stream_src src;
+		src.ch16 = m_sample_ch16;
+		src.ch16_scale = ch16_scale;
+		src.ch16_num = sizeof(m_sample_ch16) / sizeof(m_sample_ch16[0]);
+		src.ch8 = m_sample_ch8;
+		src.ch8_num = sizeof(m_sample_ch8) / sizeof(m_sample_ch8[0]);
+		src.ring_len = ADC_SAMPLE_MAX_LEN;
+		src.offset = offset;
+		src.len = len;
+
+		void *lzo_wrkmem = 0;
+		uint8_t *lzo_buffer = 0;
+#if SAMPLE_STREAM_LZO
+		if (m_sample_format == DEBUG_SAMPLING_FORMAT_STREAM_LZO) {
+			lzo_wrkmem = m_sample_lzo_wrkmem;
+			lzo_buffer = m_sample_lzo_buffer;
 		}
+#endif
 
-		for (int i = 0;i < len;i++) {
-			uint8_t buffer[40];
-			int32_t index = 0;
-			int ind_samp = i + offset;
+		int32_t index = sample_stream_header(m_sample_stream_buffer, &src);
+		commands_send_packet(m_sample_stream_buffer, index);
 
-			while (ind_samp >= ADC_SAMPLE_MAX_LEN) {
-				ind_samp -= ADC_SAMPLE_MAX_LEN;
-			}
+		const int frame_samples = sample_stream_frame_samples(&src, PACKET_MAX_PL_LEN);
+		for (int i = 0;i < len;i += frame_samples) {
+			int num = len - i < frame_samples ? len - i : frame_samples;
+			index = sample_stream_frame(m_sample_stream_buffer, &src, i, num,
+					lzo_wrkmem, lzo_buffer);
+			commands_send_packet(m_sample_stream_buffer, index);
+		}
 
-			while (ind_samp < 0) {
-				ind_samp += ADC_SAMPLE_MAX_LEN;
-			}
+		return;
+	}
+
+	for (int i = 0;i < len;i++) {
+		uint8_t buffer[40];
+		int32_t index = 0;
+		int ind_samp = i + offset;
 
-			buffer[index++] = COMM_SAMPLE_PRINT;
-			buffer_append_float32_auto(buffer, (float)m_curr0_samples[ind_samp] * FAC_CURRENT, &index);
-			buffer_append_float32_auto(buffer, (float)m_curr1_samples[ind_samp] * FAC_CURRENT, &index);
-			buffer_append_float32_auto(buffer, ((float)m_ph1_samples[ind_samp] / 4096.0 * V_REG) * ((VIN_R1 + VIN_R2) / VIN_R2), &index);
-			buffer_append_float32_auto(buffer, ((float)m_ph2_samples[ind_samp] / 4096.0 * V_REG) * ((VIN_R1 + VIN_R2) / VIN_R2), &index);
-			buffer_append_float32_auto(buffer, ((float)m_ph3_samples[ind_samp] / 4096.0 * V_REG) * ((VIN_R1 + VIN_R2) / VIN_R2), &index);
-			buffer_append_float32_auto(buffer, ((float)m_vzero_samples[ind_samp] / 4096.0 * V_REG) * ((VIN_R1 + VIN_R2) / VIN_R2), &index);
-			buffer_append_float32_auto(buffer, (float)m_curr_fir_samples[ind_samp] / (8.0 / FAC_CURRENT), &index);
-			buffer_append_float32_auto(buffer, (float)m_f_sw_samples[ind_samp] * 10.0, &index);
-			buffer[index++] = m_status_samples[ind_samp];
-			buffer[index++] = m_phase_samples[ind_samp];
-
-			commands_send_packet(buffer, index);
+		while (ind_samp >= ADC_SAMPLE_MAX_LEN) {
+			ind_samp -= ADC_SAMPLE_MAX_LEN;
 		}
+
+		while (ind_samp < 0) {
+			ind_samp += ADC_SAMPLE_MAX_LEN;
+		}
+
+		buffer[index++] = COMM_SAMPLE_PRINT;
+		buffer_append_float32_auto(buffer, (float)m_curr0_samples[ind_samp] * FAC_CURRENT, &index);
+		buffer_append_float32_auto(buffer, (float)m_curr1_samples[ind_samp] * FAC_CURRENT, &index);
+		buffer_append_float32_auto(buffer, ((float)m_ph1_samples[ind_samp] / 4096.0 * V_REG) * ((VIN_R1 + VIN_R2) / VIN_R2), &index);
+		buffer_append_float32_auto(buffer, ((float)m_ph2_samples[ind_samp] / 4096.0 * V_REG) * ((VIN_R1 + VIN_R2) / VIN_R2), &index);
+		buffer_append_float32_auto(buffer, ((float)m_ph3_samples[ind_samp] / 4096.0 * V_REG) * ((VIN_R1 + VIN_R2) / VIN_R2), &index);
+		buffer_append_float32_auto(buffer, ((float)m_vzero_samples[ind_samp] / 4096.0 * V_REG) * ((VIN_R1 + VIN_R2) / VIN_R2), &index);
+		buffer_append_float32_auto(buffer, (float)m_curr_fir_samples[ind_samp] / (8.0 / FAC_CURRENT), &index);
+		buffer_append_float32_auto(buffer, (float)m_f_sw_samples[ind_samp] * 10.0, &index);
+		buffer[index++] = m_status_samples[ind_samp];
+		buffer[index++] = m_phase_samples[ind_samp];
+
+		commands_send_packet(buffer, index);
 	}
 }
 
@@ -23,6 +23,13 @@
 #include "conf_general.h"
 #include "hw.h"
 
+// Settings
+#define MC_INTERFACE_TIMER_RATE			1000 // Iterations per second of the timer thread
+
+#ifndef MC_INTERFACE_SNAPSHOT_INTERVAL
+#define MC_INTERFACE_SNAPSHOT_INTERVAL	1 // In timer iterations of 1 ms
+#endif
+
 // Functions
 void mc_interface_init(void);
 int mc_interface_motor_now(void);
@@ -67,6 +74,8 @@ float mc_interface_get_tot_current_in_filtered(void);
 int mc_interface_get_tachometer_value(bool reset);
 int mc_interface_get_tachometer_abs_value(bool reset);
 float mc_interface_get_last_inj_adc_isr_duration(void);
+void mc_interface_get_snapshot(mc_snapshot *snapshot);
+float mc_interface_snapshot_avg(const mc_snapshot *now, const mc_snapshot *prev, mc_avg_value value);
 float mc_interface_read_reset_avg_motor_current(void);
 float mc_interface_read_reset_avg_input_current(void);
 float mc_interface_read_reset_avg_id(void);
@@ -76,7 +85,10 @@ float mc_interface_read_reset_avg_vq(void);
 float mc_interface_get_pid_pos_set(void);
 float mc_interface_get_pid_pos_now(void);
 float mc_interface_get_last_sample_adc_isr_duration(void);
-void mc_interface_sample_print_data(debug_sampling_mode mode, uint16_t len, uint8_t decimation);
+void mc_interface_sample_print_data(debug_sampling_mode mode, uint16_t len, uint8_t decimation,
+		debug_sampling_format format);
+int mc_interface_take_sample_buffers(volatile int16_t **buffers, int num);
+void mc_interface_release_sample_buffers(void);
 float mc_interface_temp_fet_filtered(void);
 float mc_interface_temp_motor_filtered(void);
 float mc_interface_get_battery_level(float *wh_left);
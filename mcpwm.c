@@ -33,6 +33,7 @@
 #include "timeout.h"
 #include "encoder.h"
 #include "timer.h"
+#include "isr_prof.h"
 
 // Structs
 typedef struct {
@@ -1736,6 +1737,7 @@ void mcpwm_adc_inj_int_handler(void) {
 			CURR_FIR_TAPS_BITS, current_fir_index);
 
 	last_inj_adc_isr_duration = timer_seconds_elapsed_since(t_start);
+	isr_prof_add(ISR_PROF_BLDC_ADC_INJ, false, t_start);
 }
 
 /*
@@ -34,6 +34,7 @@
 #include "commands.h"
 #include "timeout.h"
 #include "timer.h"
+#include "isr_prof.h"
 #include <math.h>
 #include <string.h>
 #include <stdlib.h>
@@ -41,6 +42,32 @@
 #include "virtual_motor.h"
 #include "digital_filter.h"
 
+// Settings
+// Math kernels of the control loop, see tests/math_bench for their error and
+// speed. The budget is 2.5e-4 for the observer angle in radians and for the
+// Park transform coefficients, which is half an LSB of the 12-bit current
+// measurement at full scale. utils_fast_atan2 (1e-2 rad) and
+// utils_fast_sincos_better (1.1e-3) exceed it.
+#ifndef FOC_OBSERVER_ATAN2
+#define FOC_OBSERVER_ATAN2				utils_fast_atan2_poly
+#endif
+#ifndef FOC_PARK_SINCOS
+#define FOC_PARK_SINCOS					utils_fast_sincos_table
+#endif
+
+// Parameter identification, see mcpwm_foc_measure_params
+#define IDENT_SAMPLES_AXIS				700		// Control loop cycles of excitation per axis
+#define IDENT_SPIN_SAMPLES_MIN			100		// Minimum buffer space for the spin
+#define IDENT_SPIN_SAMPLE_TIME			0.001	// Seconds between samples during the spin
+#define IDENT_DELAY_MAX					2		// Delayed voltages in control loop cycles in the fit
+#define IDENT_ALIGN_MS					300		// Ramp up in the first half, settle in the second
+#define IDENT_CURRENT_KP				0.0005
+#define IDENT_CURRENT_KI				20.0
+#define IDENT_SPIN_CURRENT_BW			1000.0	// Current controller bandwidth in rad/s during the spin
+#define IDENT_BEMF_FRACTION_MIN			0.5		// Of the voltage at the end of the spin, else the rotor did not follow
+#define IDENT_SPIN_TIME_MAX_MS			15000
+#define IDENT_ERPM_MAX					50000.0
+
 // Private types
 typedef struct {
 	float id_target;
@@ -83,8 +110,22 @@ typedef struct {
 
 	int samples;
 	int table_fact;
+	float samples_inv;
+	// Update the bins with every sample. Otherwise they are transformed from the
+	// whole buffer in the HFI thread, which is cheaper for 8 samples.
+	bool sliding;
 	float buffer[32];
 	float buffer_current[32];
+	// DFT bins 1 and 2 of buffer, updated with every sample, see hfi_buffer_write
+	float bin1_real;
+	float bin1_imag;
+	float bin2_real;
+	float bin2_imag;
+	// The same bins summed up from scratch for the current pass over buffer
+	float sum1_real;
+	float sum1_imag;
+	float sum2_real;
+	float sum2_imag;
 	bool ready;
 	int ind;
 	bool is_samp_n;
@@ -93,10 +134,62 @@ typedef struct {
 	int est_done_cnt;
 	float observer_zero_time;
 	int flip_cnt;
+	bool flip;
 } hfi_state_t;
 
+typedef enum {
+	IDENT_OFF = 0,
+	IDENT_D,
+	IDENT_Q,
+	IDENT_SPIN
+} ident_mode_t;
+
+typedef enum {
+	IDENT_CH_ID = 0,
+	IDENT_CH_IQ,
+	IDENT_CH_VD,
+	IDENT_CH_VQ,
+	IDENT_CH_W,
+	IDENT_CHANNELS
+} ident_channel_t;
+
+// Capture state of mcpwm_foc_measure_params. The ISR writes the samples to
+// the sample buffers of mc_interface, scaled to int16.
+typedef struct {
+	ident_mode_t mode;
+	volatile int16_t *buf[IDENT_CHANNELS];
+	int len;
+	int ind;
+	int spin_start;
+	bool spin_wrapped;
+	int dec;
+	int dec_cnt;
+	uint16_t prbs;
+	float v_inj;
+	float i_scale;
+	float v_scale;
+	float w_scale;
+} ident_state_t;
+
+// Constants for the control loop that are derived from the configuration and
+// the motor temperature. The ISR only reads them, see update_derived.
+typedef struct {
+	float dt;
+	float l; // (3/2) * foc_motor_l
+	float r; // (3/2) * foc_motor_r, temperature compensated
+	float lambda;
+	float lambda_2;
+	float current_ki; // Temperature compensated
+	float sat_comp; // Per A of filtered current
+	float mod_comp_fact;
+	float hfi_dt_sw; // For the HFI buffer lag compensation
+	float temp_motor;
+} foc_derived_t;
+
 typedef struct {
 	volatile mc_configuration *m_conf;
+	foc_derived_t m_derived_buf[2];
+	volatile foc_derived_t *m_derived;
 	mc_state m_state;
 	mc_control_mode m_control_mode;
 	motor_state_t m_motor_state;
@@ -136,6 +229,7 @@ typedef struct {
 	hfi_state_t m_hfi;
 	int m_hfi_plot_en;
 	float m_hfi_plot_sample;
+	ident_state_t m_ident;
 
 	float m_phase_before;
 	float m_duty_filtered;
@@ -174,6 +268,7 @@ static volatile motor_all_state_t m_motor_1;
 static volatile motor_all_state_t m_motor_2;
 #endif
 static volatile int m_isr_motor = 0;
+static mutex_t m_derived_mutex;
 
 // Private functions
 static void do_dc_cal(void);
@@ -193,6 +288,21 @@ static float correct_hall(float angle, float dt, volatile motor_all_state_t *mot
 static void terminal_plot_hfi(int argc, const char **argv);
 static void timer_update(volatile motor_all_state_t *motor, float dt);
 static void hfi_update(volatile motor_all_state_t *motor);
+static void hfi_buffer_write(volatile motor_all_state_t *motor, float sample);
+static void hfi_buffer_next(volatile motor_all_state_t *motor);
+static void hfi_estimate_angle(volatile motor_all_state_t *motor, float real_bin2, float imag_bin2);
+static bool ident_run(volatile motor_all_state_t *motor, float current, float duty,
+		float erpm_per_sec, float *res, float *ld, float *lq, float *linkage);
+static float ident_prbs(volatile ident_state_t *ident);
+static int16_t ident_to_int16(float value);
+static void ident_capture(volatile motor_all_state_t *motor);
+static bool ident_fit_axis(volatile ident_state_t *ident, int start, int ch_i, int ch_v,
+		float dt, float *r, float *l, float *delay);
+static bool ident_fit_linkage(volatile ident_state_t *ident, float r, float l, float delay,
+		float dt, float *linkage);
+static float motor_temp(volatile motor_all_state_t *motor);
+static void compute_derived(volatile motor_all_state_t *motor, volatile foc_derived_t *d);
+static void update_derived(volatile motor_all_state_t *motor);
 
 // Threads
 static THD_WORKING_AREA(timer_thread_wa, 1024);
@@ -299,6 +409,7 @@ static void update_hfi_samples(foc_hfi_samples samples, volatile motor_all_state
 	case HFI_SAMPLES_8:
 		motor->m_hfi.samples = 8;
 		motor->m_hfi.table_fact = 4;
+		motor->m_hfi.samples_inv = 1.0 / 8.0;
 		motor->m_hfi.fft_bin0_func = utils_fft8_bin0;
 		motor->m_hfi.fft_bin1_func = utils_fft8_bin1;
 		motor->m_hfi.fft_bin2_func = utils_fft8_bin2;
@@ -307,6 +418,8 @@ static void update_hfi_samples(foc_hfi_samples samples, volatile motor_all_state
 	case HFI_SAMPLES_16:
 		motor->m_hfi.samples = 16;
 		motor->m_hfi.table_fact = 2;
+		motor->m_hfi.samples_inv = 1.0 / 16.0;
+		motor->m_hfi.sliding = true;
 		motor->m_hfi.fft_bin0_func = utils_fft16_bin0;
 		motor->m_hfi.fft_bin1_func = utils_fft16_bin1;
 		motor->m_hfi.fft_bin2_func = utils_fft16_bin2;
@@ -315,6 +428,8 @@ static void update_hfi_samples(foc_hfi_samples samples, volatile motor_all_state
 	case HFI_SAMPLES_32:
 		motor->m_hfi.samples = 32;
 		motor->m_hfi.table_fact = 1;
+		motor->m_hfi.samples_inv = 1.0 / 32.0;
+		motor->m_hfi.sliding = true;
 		motor->m_hfi.fft_bin0_func = utils_fft32_bin0;
 		motor->m_hfi.fft_bin1_func = utils_fft32_bin1;
 		motor->m_hfi.fft_bin2_func = utils_fft32_bin2;
@@ -499,8 +614,11 @@ void mcpwm_foc_init(volatile mc_configuration *conf_m1, volatile mc_configuratio
 	// Initialize variables
 	memset((void*)&m_motor_1, 0, sizeof(motor_all_state_t));
 	m_isr_motor = 0;
+	chMtxObjectInit(&m_derived_mutex);
 
 	m_motor_1.m_conf = conf_m1;
+	compute_derived(&m_motor_1, &m_motor_1.m_derived_buf[0]);
+	m_motor_1.m_derived = &m_motor_1.m_derived_buf[0];
 	m_motor_1.m_state = MC_STATE_OFF;
 	m_motor_1.m_control_mode = CONTROL_MODE_NONE;
 	m_motor_1.m_hall_dt_diff_last = 1.0;
@@ -518,6 +636,8 @@ void mcpwm_foc_init(volatile mc_configuration *conf_m1, volatile mc_configuratio
 #ifdef HW_HAS_DUAL_MOTORS
 	memset((void*)&m_motor_2, 0, sizeof(motor_all_state_t));
 	m_motor_2.m_conf = conf_m2;
+	compute_derived(&m_motor_2, &m_motor_2.m_derived_buf[0]);
+	m_motor_2.m_derived = &m_motor_2.m_derived_buf[0];
 	m_motor_2.m_state = MC_STATE_OFF;
 	m_motor_2.m_control_mode = CONTROL_MODE_NONE;
 	m_motor_2.m_hall_dt_diff_last = 1.0;
@@ -689,6 +809,13 @@ bool mcpwm_foc_init_done(void) {
 
 void mcpwm_foc_set_configuration(volatile mc_configuration *configuration) {
 	motor_now()->m_conf = configuration;
+#ifdef HW_HAS_DUAL_MOTORS
+	// The switching frequency is shared, so the other motor is affected too
+	update_derived(&m_motor_1);
+	update_derived(&m_motor_2);
+#else
+	update_derived(motor_now());
+#endif
 
 	// Below we check if anything in the configuration changed that requires stopping the motor.
 
@@ -1779,6 +1906,7 @@ float mcpwm_foc_measure_inductance(float duty, int samples, float *curr, float *
 	motor->m_conf->foc_sample_high_current = false;
 
 	update_hfi_samples(motor->m_conf->foc_hfi_samples, motor);
+	update_derived(motor);
 
 	chThdSleepMilliseconds(1);
 
@@ -1822,6 +1950,7 @@ float mcpwm_foc_measure_inductance(float duty, int samples, float *curr, float *
 			motor->m_conf->foc_sample_high_current = sample_high_current_old;
 
 			update_hfi_samples(motor->m_conf->foc_hfi_samples, motor);
+			update_derived(motor);
 
 			mc_interface_unlock();
 
@@ -1859,6 +1988,7 @@ float mcpwm_foc_measure_inductance(float duty, int samples, float *curr, float *
 	motor->m_conf->foc_sample_high_current = sample_high_current_old;
 
 	update_hfi_samples(motor->m_conf->foc_hfi_samples, motor);
+	update_derived(motor);
 
 	mc_interface_unlock();
 
@@ -1928,6 +2058,7 @@ bool mcpwm_foc_measure_res_ind(float *res, float *ind) {
 
 	motor->m_conf->foc_current_kp = 0.001;
 	motor->m_conf->foc_current_ki = 1.0;
+	update_derived(motor);
 
 	float i_last = 0.0;
 	for (float i = 2.0;i < (motor->m_conf->l_current_max / 2.0);i *= 1.5) {
@@ -1947,16 +2078,124 @@ bool mcpwm_foc_measure_res_ind(float *res, float *ind) {
 
 	*res = mcpwm_foc_measure_resistance(i_last, 200, true);
 	motor->m_conf->foc_motor_r = *res;
+	update_derived(motor);
 	*ind = mcpwm_foc_measure_inductance_current(i_last, 200, 0, 0);
 
 	motor->m_conf->foc_f_sw = f_sw_old;
 	motor->m_conf->foc_current_kp = kp_old;
 	motor->m_conf->foc_current_ki = ki_old;
 	motor->m_conf->foc_motor_r = res_old;
+	update_derived(motor);
 
 	return true;
 }
 
+/**
+ * Identify the resistance, the d and q axis inductances and the flux linkage
+ * of the motor from one designed excitation, instead of running
+ * mcpwm_foc_measure_res_ind and the open loop flux linkage measurement with
+ * their repeated steps and settling times.
+ *
+ * The rotor is first aligned with a d axis current at phase 0. Then a
+ * pseudo-random binary voltage sequence is added to the d axis voltage and
+ * after that to the q axis voltage, for IDENT_SAMPLES_AXIS control loop
+ * cycles each, while the ISR captures the dq currents and voltages into the
+ * sample buffers of mc_interface. Finally the motor is accelerated in open
+ * loop until the duty cycle reaches duty, with the end of the ramp captured
+ * at a lower rate. The least squares fits run in the calling thread after
+ * each capture, see ident_fit_axis and ident_fit_linkage.
+ *
+ * The sample buffers are taken over, so a sampling run of mc_interface
+ * that is in progress is stopped.
+ *
+ * @param current
+ * Current for the alignment and the open loop ramp.
+ *
+ * @param duty
+ * Duty cycle to ramp up to.
+ *
+ * @param erpm_per_sec
+ * Acceleration of the open loop ramp.
+ *
+ * @param res
+ * The motor resistance, like mcpwm_foc_measure_resistance.
+ *
+ * @param ld
+ * The d axis inductance in H, in the convention of foc_motor_l.
+ *
+ * @param lq
+ * The q axis inductance in H, in the convention of foc_motor_l.
+ *
+ * @param linkage
+ * The flux linkage.
+ *
+ * @return
+ * True for success, false otherwise.
+ */
+bool mcpwm_foc_measure_params(float current, float duty, float erpm_per_sec,
+		float *res, float *ld, float *lq, float *linkage) {
+	volatile motor_all_state_t *motor = motor_now();
+	volatile mc_configuration *conf = motor->m_conf;
+
+	// The current scales the captured currents, like in mcpwm_foc_measure_res_ind
+	// it must not be close to 0
+	if (fabsf(current) < 0.01) {
+		return false;
+	}
+
+	const float kp_old = conf->foc_current_kp;
+	const float ki_old = conf->foc_current_ki;
+	const mc_foc_cc_decoupling_mode dec_old = conf->foc_cc_decoupling;
+
+	// The parameters are not known yet, so use low gains and no decoupling
+	// like the other measurements. The fits use the applied voltages, so the
+	// gains only affect how well the current follows its set point.
+	conf->foc_current_kp = IDENT_CURRENT_KP;
+	conf->foc_current_ki = IDENT_CURRENT_KI;
+	conf->foc_cc_decoupling = FOC_CC_DECOUPLING_DISABLED;
+	update_derived(motor);
+
+	mc_interface_lock();
+
+	// Disable timeout
+	systime_t tout = timeout_get_timeout_msec();
+	float tout_c = timeout_get_brake_current();
+	timeout_reset();
+	timeout_configure(60000, 0.0);
+
+	// The capture goes to the sample buffers, which are not used otherwise
+	// during the measurement
+	bool result = false;
+	int len = mc_interface_take_sample_buffers((volatile int16_t**)motor->m_ident.buf, IDENT_CHANNELS);
+	if (len >= (2 * IDENT_SAMPLES_AXIS + IDENT_SPIN_SAMPLES_MIN)) {
+		motor->m_ident.len = len;
+		result = ident_run(motor, current, duty, erpm_per_sec, res, ld, lq, linkage);
+	}
+
+	motor->m_ident.mode = IDENT_OFF;
+	motor->m_id_set = 0.0;
+	motor->m_iq_set = 0.0;
+	motor->m_phase_override = false;
+	motor->m_control_mode = CONTROL_MODE_NONE;
+	motor->m_state = MC_STATE_OFF;
+	stop_pwm_hw(motor);
+
+	conf->foc_current_kp = kp_old;
+	conf->foc_current_ki = ki_old;
+	conf->foc_cc_decoupling = dec_old;
+	update_derived(motor);
+
+	if (len > 0) {
+		mc_interface_release_sample_buffers();
+	}
+
+	// Enable timeout
+	timeout_configure(tout, tout_c);
+	mc_interface_unlock();
+
+	return result;
+}
+
 /**
  * Run the motor in open loop and figure out at which angles the hall sensors are.
  *
@@ -2293,21 +2532,7 @@ void mcpwm_foc_adc_int_handler(void *p, uint32_t flags) {
 	float ib = (float)ADC_curr_norm_value[1 + norm_curr_ofs] * FAC_CURRENT;
 //	float ic = -(ia + ib);
 
-#ifdef HW_HAS_PHASE_SHUNTS
-	float dt;
-	if (conf_now->foc_sample_v0_v7) {
-		dt = 1.0 / conf_now->foc_f_sw;
-	} else {
-		dt = 1.0 / (conf_now->foc_f_sw / 2.0);
-	}
-#else
-	float dt = 1.0 / (conf_now->foc_f_sw / 2.0);
-#endif
-
-	// This has to be done for the skip function to have any chance at working with the
-	// observer and control loops.
-	// TODO: Test this.
-	dt /= (float)FOC_CONTROL_LOOP_FREQ_DIVIDER;
+	const float dt = motor_now->m_derived->dt;
 
 	UTILS_LP_FAST(motor_now->m_motor_state.v_bus, GET_INPUT_VOLTAGE(), 0.1);
 
@@ -2620,8 +2845,8 @@ void mcpwm_foc_adc_int_handler(void *p, uint32_t flags) {
 		observer_update(motor_now->m_motor_state.v_alpha, motor_now->m_motor_state.v_beta,
 						motor_now->m_motor_state.i_alpha, motor_now->m_motor_state.i_beta, dt,
 						&motor_now->m_observer_x1, &motor_now->m_observer_x2, 0, motor_now);
-		motor_now->m_phase_now_observer = utils_fast_atan2(motor_now->m_x2_prev + motor_now->m_observer_x2,
-														   motor_now->m_x1_prev + motor_now->m_observer_x1);
+		motor_now->m_phase_now_observer = FOC_OBSERVER_ATAN2(motor_now->m_x2_prev + motor_now->m_observer_x2,
+															 motor_now->m_x1_prev + motor_now->m_observer_x1);
 
 		motor_now->m_x1_prev = motor_now->m_observer_x1;
 		motor_now->m_x2_prev = motor_now->m_observer_x2;
@@ -2659,7 +2884,7 @@ void mcpwm_foc_adc_int_handler(void *p, uint32_t flags) {
 		motor_now->m_hfi.angle = motor_now->m_motor_state.phase;
 
 		float c, s;
-		utils_fast_sincos_better(motor_now->m_motor_state.phase, &s, &c);
+		FOC_PARK_SINCOS(motor_now->m_motor_state.phase, &s, &c);
 
 		// Park transform
 		float vd_tmp = c * motor_now->m_motor_state.v_alpha + s * motor_now->m_motor_state.v_beta;
@@ -2771,6 +2996,12 @@ void mcpwm_foc_adc_int_handler(void *p, uint32_t flags) {
 
 	m_isr_motor = 0;
 	m_last_adc_isr_duration = timer_seconds_elapsed_since(t_start);
+
+#ifdef HW_HAS_DUAL_MOTORS
+	isr_prof_add(ISR_PROF_FOC_ADC, is_second_motor, t_start);
+#else
+	isr_prof_add(ISR_PROF_FOC_ADC, false, t_start);
+#endif
 }
 
 // Private functions
@@ -2866,6 +3097,12 @@ static void timer_update(volatile motor_all_state_t *motor, float dt) {
 
 	// 4.0 scaling is kind of arbitrary, but it should make configs from old VESC Tools more likely to work.
 	motor->m_gamma_now = gamma_tmp * 4.0;
+
+	// Follow the motor temperature with the temperature compensation
+	if (motor->m_conf->foc_temp_comp &&
+			fabsf(motor_temp(motor) - motor->m_derived->temp_motor) >= MCPWM_FOC_TEMP_COMP_STEP) {
+		update_derived(motor);
+	}
 }
 
 static THD_FUNCTION(timer_thread, arg) {
@@ -2903,9 +3140,22 @@ static void hfi_update(volatile motor_all_state_t *motor) {
 	}
 
 	if (motor->m_hfi.ready) {
+		// The angle itself is estimated from bin 2, see hfi_estimate_angle. Bin 1 is used
+		// here to find out which of the two possible directions it is at startup.
 		float real_bin1, imag_bin1, real_bin2, imag_bin2;
-		motor->m_hfi.fft_bin1_func((float*)motor->m_hfi.buffer, &real_bin1, &imag_bin1);
-		motor->m_hfi.fft_bin2_func((float*)motor->m_hfi.buffer, &real_bin2, &imag_bin2);
+		if (motor->m_hfi.sliding) {
+			// Updated in the ISR, so copy them at once
+			utils_sys_lock_cnt();
+			real_bin1 = motor->m_hfi.bin1_real;
+			imag_bin1 = motor->m_hfi.bin1_imag;
+			real_bin2 = motor->m_hfi.bin2_real;
+			imag_bin2 = motor->m_hfi.bin2_imag;
+			utils_sys_unlock_cnt();
+		} else {
+			motor->m_hfi.fft_bin1_func((float*)motor->m_hfi.buffer, &real_bin1, &imag_bin1);
+			motor->m_hfi.fft_bin2_func((float*)motor->m_hfi.buffer, &real_bin2, &imag_bin2);
+			hfi_estimate_angle(motor, real_bin2, imag_bin2);
+		}
 
 		float mag_bin_1 = sqrtf(SQ(imag_bin1) + SQ(real_bin1));
 		float angle_bin_1 = -utils_fast_atan2(imag_bin1, real_bin1);
@@ -2914,22 +3164,7 @@ static void hfi_update(volatile motor_all_state_t *motor) {
 		utils_norm_angle_rad(&angle_bin_1);
 
 		float mag_bin_2 = sqrtf(SQ(imag_bin2) + SQ(real_bin2));
-		float angle_bin_2 = -utils_fast_atan2(imag_bin2, real_bin2) / 2.0;
-
-		// Assuming this thread is much faster than it takes to fill the HFI buffer completely,
-		// we should lag 1/2 HFI buffer behind in phase. Compensate for that here.
-		float dt_sw;
-		if (motor->m_conf->foc_sample_v0_v7) {
-			dt_sw = 1.0 / motor->m_conf->foc_f_sw;
-		} else {
-			dt_sw = 1.0 / (motor->m_conf->foc_f_sw / 2.0);
-		}
-		angle_bin_2 += motor->m_motor_state.speed_rad_s * ((float)motor->m_hfi.samples / 2.0) * dt_sw;
-
-		if (fabsf(utils_angle_difference_rad(angle_bin_2 + M_PI, motor->m_hfi.angle)) <
-				fabsf(utils_angle_difference_rad(angle_bin_2, motor->m_hfi.angle))) {
-			angle_bin_2 += M_PI;
-		}
+		float angle_bin_2 = motor->m_hfi.angle;
 
 		if (motor->m_hfi.est_done_cnt < motor->m_conf->foc_hfi_start_samples) {
 			motor->m_hfi.est_done_cnt++;
@@ -2939,14 +3174,11 @@ static void hfi_update(volatile motor_all_state_t *motor) {
 			}
 		} else {
 			if (motor->m_hfi.flip_cnt >= (motor->m_conf->foc_hfi_start_samples / 2)) {
-				angle_bin_2 += M_PI;
+				motor->m_hfi.flip = true;
 			}
 			motor->m_hfi.flip_cnt = 0;
 		}
 
-		motor->m_hfi.angle = angle_bin_2;
-		utils_norm_angle_rad((float*)&motor->m_hfi.angle);
-
 		// As angle_bin_1 is based on saturation, it is only accurate when the motor current is low. It
 		// might be possible to compensate for that, which would allow HFI on non-salient motors.
 		//			m_hfi.angle = angle_bin_1;
@@ -3009,6 +3241,561 @@ static void hfi_update(volatile motor_all_state_t *motor) {
 	}
 }
 
+/**
+ * Write an HFI sample to the current position in the buffer. With sliding
+ * bins, also update DFT bins 1 and 2 of the buffer with the difference to the
+ * sample it replaces. That takes constant time, instead of transforming the
+ * whole buffer.
+ *
+ * @param motor
+ * The motor.
+ *
+ * @param sample
+ * The inductance sample.
+ */
+static void hfi_buffer_write(volatile motor_all_state_t *motor, float sample) {
+	volatile hfi_state_t *hfi = &motor->m_hfi;
+
+	if (!hfi->sliding) {
+		hfi->buffer[hfi->ind] = sample;
+		return;
+	}
+
+	const int tab_ind = hfi->ind * hfi->table_fact;
+	const float diff = (sample - hfi->buffer[hfi->ind]) * hfi->samples_inv;
+
+	hfi->buffer[hfi->ind] = sample;
+	hfi->bin1_real += diff * utils_tab_cos_32_1[tab_ind];
+	hfi->bin1_imag -= diff * utils_tab_sin_32_1[tab_ind];
+	hfi->bin2_real += diff * utils_tab_cos_32_2[tab_ind];
+	hfi->bin2_imag -= diff * utils_tab_sin_32_2[tab_ind];
+}
+
+/**
+ * Advance to the next position in the HFI buffer. The buffer is ready after
+ * the first complete pass.
+ *
+ * @param motor
+ * The motor.
+ */
+static void hfi_buffer_next(volatile motor_all_state_t *motor) {
+	volatile hfi_state_t *hfi = &motor->m_hfi;
+
+	if (hfi->sliding) {
+		const int tab_ind = hfi->ind * hfi->table_fact;
+		const float x = hfi->buffer[hfi->ind] * hfi->samples_inv;
+
+		// Rounding errors accumulate in the bins, so they are also summed up from
+		// scratch during every pass and replaced with that sum at its end.
+		if (hfi->ind == 0) {
+			hfi->sum1_real = 0.0;
+			hfi->sum1_imag = 0.0;
+			hfi->sum2_real = 0.0;
+			hfi->sum2_imag = 0.0;
+		}
+
+		hfi->sum1_real += x * utils_tab_cos_32_1[tab_ind];
+		hfi->sum1_imag -= x * utils_tab_sin_32_1[tab_ind];
+		hfi->sum2_real += x * utils_tab_cos_32_2[tab_ind];
+		hfi->sum2_imag -= x * utils_tab_sin_32_2[tab_ind];
+	}
+
+	hfi->ind++;
+	if (hfi->ind == hfi->samples) {
+		hfi->ind = 0;
+		hfi->ready = true;
+
+		if (hfi->sliding) {
+			hfi->bin1_real = hfi->sum1_real;
+			hfi->bin1_imag = hfi->sum1_imag;
+			hfi->bin2_real = hfi->sum2_real;
+			hfi->bin2_imag = hfi->sum2_imag;
+		}
+	}
+}
+
+/**
+ * Update the HFI angle from bin 2 of the buffer. That is done after every
+ * sample in the ISR with the sliding bins, or in the HFI thread otherwise.
+ *
+ * @param motor
+ * The motor.
+ *
+ * @param real_bin2
+ * Real part of bin 2.
+ *
+ * @param imag_bin2
+ * Imaginary part of bin 2.
+ */
+static void hfi_estimate_angle(volatile motor_all_state_t *motor, float real_bin2, float imag_bin2) {
+	volatile hfi_state_t *hfi = &motor->m_hfi;
+	float angle = -utils_fast_atan2(imag_bin2, real_bin2) / 2.0;
+
+	// The bins cover the whole buffer, so they lag 1/2 buffer behind in phase.
+	// Compensate for that here.
+	angle += motor->m_motor_state.speed_rad_s * ((float)hfi->samples / 2.0) * motor->m_derived->hfi_dt_sw;
+
+	if (fabsf(utils_angle_difference_rad(angle + M_PI, hfi->angle)) <
+			fabsf(utils_angle_difference_rad(angle, hfi->angle))) {
+		angle += M_PI;
+	}
+
+	// Set by hfi_update when bin 1 disagreed with the direction at startup
+	if (hfi->flip) {
+		hfi->flip = false;
+		angle += M_PI;
+	}
+
+	utils_norm_angle_rad(&angle);
+	hfi->angle = angle;
+}
+
+/**
+ * The sequence of mcpwm_foc_measure_params, without the setup and the
+ * cleanup.
+ */
+static bool ident_run(volatile motor_all_state_t *motor, float current, float duty,
+		float erpm_per_sec, float *res, float *ld, float *lq, float *linkage) {
+	volatile ident_state_t *ident = &motor->m_ident;
+	volatile mc_configuration *conf = motor->m_conf;
+
+	// Align the rotor with the d axis
+	motor->m_phase_override = true;
+	motor->m_phase_now_override = 0.0;
+	motor->m_id_set = 0.0;
+	motor->m_iq_set = 0.0;
+	motor->m_control_mode = CONTROL_MODE_CURRENT;
+	motor->m_state = MC_STATE_RUNNING;
+
+	float vd_avg = 0.0;
+	for (int i = 0;i < IDENT_ALIGN_MS;i++) {
+		utils_step_towards((float*)&motor->m_id_set, current, current / (IDENT_ALIGN_MS / 2));
+		chThdSleepMilliseconds(1);
+
+		if (i >= (IDENT_ALIGN_MS - 20)) {
+			vd_avg += motor->m_motor_state.vd / 20.0;
+		}
+	}
+
+	const float v_bus = motor->m_motor_state.v_bus;
+	const float dt = motor->m_derived->dt;
+
+	if (mc_interface_get_fault() != FAULT_CODE_NONE) {
+		return false;
+	}
+
+	// An excitation of half the resistive voltage drop keeps the current
+	// between 0.5 and 1.5 times the set point, whatever the time constant.
+	ident->ind = 0;
+	ident->prbs = 0xACE1;
+	ident->v_inj = fmaxf(0.5 * fabsf(vd_avg), 0.01);
+	ident->i_scale = 8000.0 / fabsf(current);
+	ident->v_scale = 16000.0 / v_bus;
+	ident->w_scale = 32000.0 / (IDENT_ERPM_MAX * (2.0 * M_PI / 60.0));
+	ident->mode = IDENT_D;
+
+	for (int i = 0;i < 1000 && ident->mode != IDENT_OFF;i++) {
+		chThdSleepMilliseconds(1);
+	}
+
+	if (ident->mode != IDENT_OFF || mc_interface_get_fault() != FAULT_CODE_NONE) {
+		return false;
+	}
+
+	float r_d, l_d, r_q, l_q, delay_d, delay_q;
+	if (!ident_fit_axis(ident, 0, IDENT_CH_ID, IDENT_CH_VD, dt, &r_d, &l_d, &delay_d) ||
+			!ident_fit_axis(ident, IDENT_SAMPLES_AXIS, IDENT_CH_IQ, IDENT_CH_VQ, dt, &r_q, &l_q, &delay_q)) {
+		return false;
+	}
+
+	// Only the resistance of the d axis is used, as the d axis current holds
+	// the rotor. The excitation of the q axis makes it swing a bit, which
+	// adds some back EMF to that fit.
+
+	// With the resistance and inductance known the current controller can
+	// be tuned like conf_general_calc_apply_foc_cc_kp_ki_gain does, so that
+	// the current holds up against the back EMF during the spin.
+	conf->foc_current_kp = (l_d + l_q) / 2.0 * (2.0 / 3.0) * IDENT_SPIN_CURRENT_BW;
+	conf->foc_current_ki = r_d * (2.0 / 3.0) * IDENT_SPIN_CURRENT_BW;
+	update_derived(motor);
+
+	// Spin up in open loop. The open loop frame starts 90 degrees behind, so
+	// that the current vector stays where it is, and the PI integrators are
+	// rotated along with it.
+	ident->spin_start = 2 * IDENT_SAMPLES_AXIS;
+	ident->ind = ident->spin_start;
+	ident->spin_wrapped = false;
+	ident->dec = (int)(IDENT_SPIN_SAMPLE_TIME / dt + 0.5);
+	if (ident->dec < 1) {
+		ident->dec = 1;
+	}
+	ident->dec_cnt = 0;
+
+	utils_sys_lock_cnt();
+	const float vd_int = motor->m_motor_state.vd_int;
+	motor->m_motor_state.vd_int = -motor->m_motor_state.vq_int;
+	motor->m_motor_state.vq_int = vd_int;
+	motor->m_openloop_angle = -M_PI / 2.0;
+	motor->m_openloop_speed = 0.0;
+	motor->m_iq_set = current;
+	motor->m_id_set = 0.0;
+	motor->m_control_mode = CONTROL_MODE_OPENLOOP;
+	motor->m_phase_override = false;
+	ident->mode = IDENT_SPIN;
+	utils_sys_unlock_cnt();
+
+	float rpm_now = 0.0;
+	float duty_max = 0.0;
+	int cnt = 0;
+
+	while (fabsf(mcpwm_foc_get_duty_cycle_now()) < duty) {
+		rpm_now += erpm_per_sec / 1000.0;
+		motor->m_openloop_speed = (conf->m_invert_direction ? -rpm_now : rpm_now) * ((2.0 * M_PI) / 60.0);
+
+		chThdSleepMilliseconds(1);
+		cnt++;
+
+		const float duty_now = fabsf(mcpwm_foc_get_duty_cycle_now());
+		if (duty_now > duty_max) {
+			duty_max = duty_now;
+		}
+
+		// The motor did not follow, or lost sync
+		if (cnt >= IDENT_SPIN_TIME_MAX_MS || rpm_now >= IDENT_ERPM_MAX ||
+				(cnt > 1000 && duty_now < (duty_max * 0.7)) ||
+				mc_interface_get_fault() != FAULT_CODE_NONE) {
+			return false;
+		}
+	}
+
+	ident->mode = IDENT_OFF;
+
+	// Plus half a cycle, as each voltage is held for a whole cycle
+	const float delay = ((delay_d + delay_q) / 2.0 + 0.5) * dt;
+	if (!ident_fit_linkage(ident, r_d, (l_d + l_q) / 2.0, delay, dt, linkage)) {
+		return false;
+	}
+
+	// Same convention as mcpwm_foc_measure_resistance and foc_motor_l
+	*res = r_d * (2.0 / 3.0);
+	*ld = l_d * (2.0 / 3.0);
+	*lq = l_q * (2.0 / 3.0);
+	return true;
+}
+
+/**
+ * Next value of the excitation of mcpwm_foc_measure_params, from a 16 bit
+ * maximal length LFSR (x^16 + x^14 + x^13 + x^11 + 1). Its spectrum is flat
+ * up to about half the control loop frequency, so the fit sees both the
+ * resistance and the inductance.
+ *
+ * @param ident
+ * The identification state.
+ *
+ * @return
+ * +v_inj or -v_inj.
+ */
+static float ident_prbs(volatile ident_state_t *ident) {
+	const uint16_t lfsr = ident->prbs;
+	const uint16_t bit = (lfsr ^ (lfsr >> 2) ^ (lfsr >> 3) ^ (lfsr >> 5)) & 1;
+	ident->prbs = (lfsr >> 1) | (bit << 15);
+	return (lfsr & 1) ? ident->v_inj : -ident->v_inj;
+}
+
+static int16_t ident_to_int16(float value) {
+	utils_truncate_number(&value, -32767.0, 32767.0);
+	return (int16_t)value;
+}
+
+/**
+ * Store the dq currents and voltages of this control loop cycle, and the
+ * open loop speed, for mcpwm_foc_measure_params. Every cycle is stored at
+ * standstill. During the spin every dec'th cycle is stored in a ring after
+ * the standstill samples, so that it contains the end of the ramp.
+ *
+ * @param motor
+ * The motor.
+ */
+static void ident_capture(volatile motor_all_state_t *motor) {
+	volatile ident_state_t *ident = &motor->m_ident;
+	volatile motor_state_t *state_m = &motor->m_motor_state;
+
+	if (ident->mode == IDENT_SPIN) {
+		ident->dec_cnt++;
+		if (ident->dec_cnt < ident->dec) {
+			return;
+		}
+		ident->dec_cnt = 0;
+	}
+
+	int ind = ident->ind;
+	ident->buf[IDENT_CH_ID][ind] = ident_to_int16(state_m->id * ident->i_scale);
+	ident->buf[IDENT_CH_IQ][ind] = ident_to_int16(state_m->iq * ident->i_scale);
+	ident->buf[IDENT_CH_VD][ind] = ident_to_int16(state_m->vd * ident->v_scale);
+	ident->buf[IDENT_CH_VQ][ind] = ident_to_int16(state_m->vq * ident->v_scale);
+	ident->buf[IDENT_CH_W][ind] = ident_to_int16(motor->m_openloop_speed * ident->w_scale);
+	ind++;
+
+	switch (ident->mode) {
+	case IDENT_D:
+		if (ind >= IDENT_SAMPLES_AXIS) {
+			ident->mode = IDENT_Q;
+		}
+		break;
+
+	case IDENT_Q:
+		if (ind >= 2 * IDENT_SAMPLES_AXIS) {
+			ident->mode = IDENT_OFF;
+		}
+		break;
+
+	default:
+		if (ind >= ident->len) {
+			ind = ident->spin_start;
+			ident->spin_wrapped = true;
+		}
+		break;
+	}
+
+	ident->ind = ind;
+}
+
+/**
+ * Least squares fit of the discrete model of one axis at standstill,
+ * i[k + 1] = a * i[k] + b0 * v[k] + ... + bn * v[k - n] + c, where c takes
+ * up offsets such as the uncompensated dead time. The PWM update delay
+ * spreads each voltage over two current samples, so the delayed voltages
+ * are separate regressors and b = b0 + ... + bn. For a first order system
+ * a = exp(-R * dt / L) and b = (1 - a) / R, whatever the delay. The delay
+ * itself is the weighted mean of the delays of the regressors.
+ *
+ * @param ident
+ * The identification state with the captured samples.
+ *
+ * @param start
+ * Index of the first sample of the axis.
+ *
+ * @param ch_i
+ * Current channel.
+ *
+ * @param ch_v
+ * Voltage channel.
+ *
+ * @param dt
+ * Control loop period.
+ *
+ * @param r
+ * The resistance in the dq frame.
+ *
+ * @param l
+ * The inductance in the dq frame.
+ *
+ * @param delay
+ * The delay from the voltage to the current in control loop cycles.
+ *
+ * @return
+ * True if the fit gives a first order system, false otherwise.
+ */
+static bool ident_fit_axis(volatile ident_state_t *ident, int start, int ch_i, int ch_v,
+		float dt, float *r, float *l, float *delay) {
+	const int n = IDENT_DELAY_MAX + 2; // a and b0 to bn
+	volatile int16_t *buf_i = ident->buf[ch_i];
+	volatile int16_t *buf_v = ident->buf[ch_v];
+	const float i_fact = 1.0 / ident->i_scale;
+	const float v_fact = 1.0 / ident->v_scale;
+	const int first = start + IDENT_DELAY_MAX;
+	const int end = start + IDENT_SAMPLES_AXIS - 1;
+
+	// Means, so that the sums can be centered and c drops out
+	float avg[IDENT_DELAY_MAX + 3];
+	memset(avg, 0, sizeof(avg));
+	for (int k = first;k < end;k++) {
+		avg[0] += buf_i[k] * i_fact;
+		for (int j = 0;j <= IDENT_DELAY_MAX;j++) {
+			avg[j + 1] += buf_v[k - j] * v_fact;
+		}
+		avg[n] += buf_i[k + 1] * i_fact;
+	}
+
+	for (int j = 0;j <= n;j++) {
+		avg[j] /= (float)(end - first);
+	}
+
+	// Normal equations, with the right hand side in the last column
+	float m[IDENT_DELAY_MAX + 2][IDENT_DELAY_MAX + 3];
+	memset(m, 0, sizeof(m));
+	for (int k = first;k < end;k++) {
+		float x[IDENT_DELAY_MAX + 3];
+		x[0] = buf_i[k] * i_fact - avg[0];
+		for (int j = 0;j <= IDENT_DELAY_MAX;j++) {
+			x[j + 1] = buf_v[k - j] * v_fact - avg[j + 1];
+		}
+		x[n] = buf_i[k + 1] * i_fact - avg[n];
+
+		for (int row = 0;row < n;row++) {
+			for (int col = row;col <= n;col++) {
+				m[row][col] += x[row] * x[col];
+			}
+		}
+	}
+
+	for (int row = 1;row < n;row++) {
+		for (int col = 0;col < row;col++) {
+			m[row][col] = m[col][row];
+		}
+	}
+
+	// Gaussian elimination. The matrix is symmetric and positive definite
+	// for a persistent excitation, so no pivoting is needed.
+	for (int piv = 0;piv < n;piv++) {
+		if (m[piv][piv] <= 0.0) {
+			return false;
+		}
+
+		for (int row = piv + 1;row < n;row++) {
+			const float f = m[row][piv] / m[piv][piv];
+			for (int col = piv;col <= n;col++) {
+				m[row][col] -= f * m[piv][col];
+			}
+		}
+	}
+
+	float theta[IDENT_DELAY_MAX + 2];
+	for (int row = n - 1;row >= 0;row--) {
+		float sum = m[row][n];
+		for (int col = row + 1;col < n;col++) {
+			sum -= m[row][col] * theta[col];
+		}
+		theta[row] = sum / m[row][row];
+	}
+
+	const float a = theta[0];
+	float b = 0.0;
+	float b_delay = 0.0;
+	for (int j = 1;j < n;j++) {
+		b += theta[j];
+		b_delay += theta[j] * (float)(j - 1);
+	}
+
+	if (a <= 0.0 || a >= 1.0 || b <= 0.0) {
+		return false;
+	}
+
+	*r = (1.0 - a) / b;
+	*l = -*r * dt / logf(a);
+	*delay = b_delay / b;
+
+	return true;
+}
+
+/**
+ * Fit of the flux linkage to the samples from the spin of
+ * mcpwm_foc_measure_params. The resistive and inductive voltage drops are
+ * subtracted from the dq voltages, which leaves the back EMF. The open loop
+ * frame is not aligned with the rotor, so the magnitude of the back EMF is
+ * used, and the rotor can swing around the open loop angle, so its speed is
+ * the open loop speed plus the drift of the back EMF angle. Only the upper
+ * half of the speed range is used, where the back EMF should dominate. If
+ * it does not, the rotor did not follow the ramp and the fit fails.
+ *
+ * @param ident
+ * The identification state with the captured samples.
+ *
+ * @param r
+ * The resistance in the dq frame.
+ *
+ * @param l
+ * The inductance in the dq frame.
+ *
+ * @param delay
+ * The delay from the voltage to the current in seconds. The voltage is
+ * rotated back by the angle that the frame turns in that time.
+ *
+ * @param dt
+ * Control loop period.
+ *
+ * @param linkage
+ * The flux linkage.
+ *
+ * @return
+ * True for success, false otherwise.
+ */
+static bool ident_fit_linkage(volatile ident_state_t *ident, float r, float l, float delay,
+		float dt, float *linkage) {
+	const float i_fact = 1.0 / ident->i_scale;
+	const float v_fact = 1.0 / ident->v_scale;
+	const float w_fact = 1.0 / ident->w_scale;
+	const int start = ident->spin_start;
+	const int len = ident->spin_wrapped ? ident->len - start : ident->ind - start;
+	const int oldest = ident->spin_wrapped ? ident->ind : start;
+
+	float w_max = 0.0;
+	for (int k = start;k < start + len;k++) {
+		const float w = fabsf(ident->buf[IDENT_CH_W][k] * w_fact);
+		if (w > w_max) {
+			w_max = w;
+		}
+	}
+
+	float e_sum = 0.0;
+	float v_sum = 0.0;
+	float w_sum = 0.0;
+	float ang_prev = 0.0;
+	float ang_drift = 0.0;
+	int samples = 0;
+
+	// In chronological order, the samples above half the maximum speed are
+	// the last ones of the ramp
+	for (int j = 0;j < len;j++) {
+		int k = oldest + j;
+		if (k >= start + len) {
+			k -= len;
+		}
+
+		const float w = ident->buf[IDENT_CH_W][k] * w_fact;
+		if (fabsf(w) < 0.5 * w_max) {
+			continue;
+		}
+
+		const float id = ident->buf[IDENT_CH_ID][k] * i_fact;
+		const float iq = ident->buf[IDENT_CH_IQ][k] * i_fact;
+		const float vd_cmd = ident->buf[IDENT_CH_VD][k] * v_fact;
+		const float vq_cmd = ident->buf[IDENT_CH_VQ][k] * v_fact;
+
+		float s, c;
+		utils_fast_sincos_better(w * delay, &s, &c);
+		const float vd = c * vd_cmd + s * vq_cmd;
+		const float vq = c * vq_cmd - s * vd_cmd;
+
+		const float ed = vd - r * id + w * l * iq;
+		const float eq = vq - r * iq - w * l * id;
+		const float ang = utils_fast_atan2_poly(eq, ed);
+
+		if (samples > 0) {
+			ang_drift += utils_angle_difference_rad(ang, ang_prev);
+		}
+		ang_prev = ang;
+
+		e_sum += sqrtf(SQ(ed) + SQ(eq));
+		v_sum += sqrtf(SQ(vd) + SQ(vq));
+		w_sum += w;
+		samples++;
+	}
+
+	if (samples < IDENT_SPIN_SAMPLES_MIN / 2 || e_sum < (v_sum * IDENT_BEMF_FRACTION_MIN)) {
+		return false;
+	}
+
+	w_sum += ang_drift / ((float)ident->dec * dt);
+	if (fabsf(w_sum) < 1.0) {
+		return false;
+	}
+
+	*linkage = e_sum / fabsf(w_sum);
+
+	return true;
+}
+
 static THD_FUNCTION(hfi_thread, arg) {
 	(void)arg;
 
@@ -3068,30 +3855,94 @@ static void do_dc_cal(void) {
 	m_dccal_done = true;
 }
 
+static float motor_temp(volatile motor_all_state_t *motor) {
+#ifdef HW_HAS_DUAL_MOTORS
+	int motor_old = mc_interface_get_motor_thread();
+	mc_interface_select_motor_thread(motor == &m_motor_1 ? 1 : 2);
+	float t = mc_interface_temp_motor_filtered();
+	mc_interface_select_motor_thread(motor_old);
+	return t;
+#else
+	(void)motor;
+	return mc_interface_temp_motor_filtered();
+#endif
+}
+
+static void compute_derived(volatile motor_all_state_t *motor, volatile foc_derived_t *d) {
+	volatile mc_configuration *conf = motor->m_conf;
+
+#ifdef HW_HAS_PHASE_SHUNTS
+	if (conf->foc_sample_v0_v7) {
+		d->dt = 1.0 / conf->foc_f_sw;
+	} else {
+		d->dt = 1.0 / (conf->foc_f_sw / 2.0);
+	}
+#else
+	d->dt = 1.0 / (conf->foc_f_sw / 2.0);
+#endif
+
+	// This has to be done for the skip function to have any chance at working with the
+	// observer and control loops.
+	d->dt /= (float)FOC_CONTROL_LOOP_FREQ_DIVIDER;
+
+	d->l = (3.0 / 2.0) * conf->foc_motor_l;
+	d->r = (3.0 / 2.0) * conf->foc_motor_r;
+	d->lambda = conf->foc_motor_flux_linkage;
+	d->lambda_2 = SQ(conf->foc_motor_flux_linkage);
+	d->current_ki = conf->foc_current_ki;
+	d->sat_comp = conf->foc_sat_comp / conf->l_current_max;
+	d->mod_comp_fact = conf->foc_dt_us * 1e-6 * conf->foc_f_sw;
+
+	if (conf->foc_sample_v0_v7) {
+		d->hfi_dt_sw = 1.0 / conf->foc_f_sw;
+	} else {
+		d->hfi_dt_sw = 1.0 / (conf->foc_f_sw / 2.0);
+	}
+
+	// Temperature compensation
+	const float t = motor_temp(motor);
+	if (conf->foc_temp_comp && t > -25.0) {
+		d->r += d->r * 0.00386 * (t - conf->foc_temp_comp_base_temp);
+	}
+	if (conf->foc_temp_comp && t > -5.0) {
+		d->current_ki += d->current_ki * 0.00386 * (t - conf->foc_temp_comp_base_temp);
+	}
+	d->temp_motor = t;
+}
+
+/*
+ * Recompute the derived constants into the buffer the ISR is not using and
+ * switch to it. The ISR reads the pointer once per cycle and cannot be
+ * interrupted by a thread, so it never sees a partly written set.
+ */
+static void update_derived(volatile motor_all_state_t *motor) {
+	chMtxLock(&m_derived_mutex);
+	volatile foc_derived_t *next = motor->m_derived == &motor->m_derived_buf[0] ?
+			&motor->m_derived_buf[1] : &motor->m_derived_buf[0];
+	compute_derived(motor, next);
+	motor->m_derived = next;
+	chMtxUnlock(&m_derived_mutex);
+}
+
 // See http://cas.ensmp.fr/~praly/Telechargement/Journaux/2010-IEEE_TPEL-Lee-Hong-Nam-Ortega-Praly-Astolfi.pdf
 void observer_update(float v_alpha, float v_beta, float i_alpha, float i_beta,
 					 float dt, volatile float *x1, volatile float *x2, volatile float *phase, volatile motor_all_state_t *motor) {
 
 	volatile mc_configuration *conf_now = motor->m_conf;
+	volatile foc_derived_t *derived = motor->m_derived;
 
-	const float L = (3.0 / 2.0) * conf_now->foc_motor_l;
-	float R = (3.0 / 2.0) * conf_now->foc_motor_r;
+	const float L = derived->l;
+	float R = derived->r;
 
 	// Saturation compensation
 	const float sign = (motor->m_motor_state.iq * motor->m_motor_state.vq) >= 0.0 ? 1.0 : -1.0;
-	R -= R * sign * conf_now->foc_sat_comp * (motor->m_motor_state.i_abs_filter / conf_now->l_current_max);
-
-	// Temperature compensation
-	const float t = mc_interface_temp_motor_filtered();
-	if (conf_now->foc_temp_comp && t > -25.0) {
-		R += R * 0.00386 * (t - conf_now->foc_temp_comp_base_temp);
-	}
+	R -= R * sign * derived->sat_comp * motor->m_motor_state.i_abs_filter;
 
 	const float L_ia = L * i_alpha;
 	const float L_ib = L * i_beta;
 	const float R_ia = R * i_alpha;
 	const float R_ib = R * i_beta;
-	const float lambda_2 = SQ(conf_now->foc_motor_flux_linkage);
+	const float lambda_2 = derived->lambda_2;
 	const float gamma_half = motor->m_gamma_now * 0.5;
 
 	switch (conf_now->foc_observer_type) {
@@ -3140,7 +3991,7 @@ void observer_update(float v_alpha, float v_beta, float i_alpha, float i_beta,
 	UTILS_NAN_ZERO(*x2);
 
 	if (phase) {
-		*phase = utils_fast_atan2(*x2 - L_ib, *x1 - L_ia);
+		*phase = FOC_OBSERVER_ATAN2(*x2 - L_ib, *x1 - L_ia);
 	}
 }
 
@@ -3195,9 +4046,10 @@ static void pll_run(float phase, float dt, volatile float *phase_var,
 static void control_current(volatile motor_all_state_t *motor, float dt) {
 	volatile motor_state_t *state_m = &motor->m_motor_state;
 	volatile mc_configuration *conf_now = motor->m_conf;
+	volatile foc_derived_t *derived = motor->m_derived;
 
 	float c,s;
-	utils_fast_sincos_better(state_m->phase, &s, &c);
+	FOC_PARK_SINCOS(state_m->phase, &s, &c);
 
 	float abs_rpm = fabsf(motor->m_speed_est_fast * 60 / (2 * M_PI));
 
@@ -3226,13 +4078,7 @@ static void control_current(volatile motor_all_state_t *motor, float dt) {
 	state_m->vd = state_m->vd_int + Ierr_d * conf_now->foc_current_kp;
 	state_m->vq = state_m->vq_int + Ierr_q * conf_now->foc_current_kp;
 
-	// Temperature compensation
-	const float t = mc_interface_temp_motor_filtered();
-	float ki = conf_now->foc_current_ki;
-	if (conf_now->foc_temp_comp && t > -5.0) {
-		ki += ki * 0.00386 * (t - conf_now->foc_temp_comp_base_temp);
-	}
-
+	const float ki = derived->current_ki;
 	state_m->vd_int += Ierr_d * (ki * dt);
 	state_m->vq_int += Ierr_q * (ki * dt);
 
@@ -3244,18 +4090,18 @@ static void control_current(volatile motor_all_state_t *motor, float dt) {
 	if (motor->m_control_mode < CONTROL_MODE_HANDBRAKE && conf_now->foc_cc_decoupling != FOC_CC_DECOUPLING_DISABLED) {
 		switch (conf_now->foc_cc_decoupling) {
 		case FOC_CC_DECOUPLING_CROSS:
-			dec_vd = state_m->iq * state_m->speed_rad_s * conf_now->foc_motor_l * (3.0 / 2.0);
-			dec_vq = state_m->id * state_m->speed_rad_s * conf_now->foc_motor_l * (3.0 / 2.0);
+			dec_vd = state_m->iq * state_m->speed_rad_s * derived->l;
+			dec_vq = state_m->id * state_m->speed_rad_s * derived->l;
 			break;
 
 		case FOC_CC_DECOUPLING_BEMF:
-			dec_bemf = state_m->speed_rad_s * conf_now->foc_motor_flux_linkage;
+			dec_bemf = state_m->speed_rad_s * derived->lambda;
 			break;
 
 		case FOC_CC_DECOUPLING_CROSS_BEMF:
-			dec_vd = state_m->iq * state_m->speed_rad_s * conf_now->foc_motor_l * (3.0 / 2.0);
-			dec_vq = state_m->id * state_m->speed_rad_s * conf_now->foc_motor_l * (3.0 / 2.0);
-			dec_bemf = state_m->speed_rad_s * conf_now->foc_motor_flux_linkage;
+			dec_vd = state_m->iq * state_m->speed_rad_s * derived->l;
+			dec_vq = state_m->id * state_m->speed_rad_s * derived->l;
+			dec_bemf = state_m->speed_rad_s * derived->lambda;
 			break;
 
 		default:
@@ -3266,6 +4112,13 @@ static void control_current(volatile motor_all_state_t *motor, float dt) {
 	state_m->vd -= dec_vd;
 	state_m->vq += dec_vq + dec_bemf;
 
+	// Excitation of mcpwm_foc_measure_params
+	if (motor->m_ident.mode == IDENT_D) {
+		state_m->vd += ident_prbs(&motor->m_ident);
+	} else if (motor->m_ident.mode == IDENT_Q) {
+		state_m->vq += ident_prbs(&motor->m_ident);
+	}
+
 	float max_v_mag = (2.0 / 3.0) * max_duty * SQRT3_BY_2 * state_m->v_bus;
 
 	// Saturation
@@ -3316,7 +4169,7 @@ static void control_current(volatile motor_all_state_t *motor, float dt) {
 	const float ic_filter = -0.5 * i_alpha_filter - SQRT3_BY_2 * i_beta_filter;
 	const float mod_alpha_filter_sgn = (2.0 / 3.0) * SIGN(ia_filter) - (1.0 / 3.0) * SIGN(ib_filter) - (1.0 / 3.0) * SIGN(ic_filter);
 	const float mod_beta_filter_sgn = ONE_BY_SQRT3 * SIGN(ib_filter) - ONE_BY_SQRT3 * SIGN(ic_filter);
-	const float mod_comp_fact = conf_now->foc_dt_us * 1e-6 * conf_now->foc_f_sw;
+	const float mod_comp_fact = derived->mod_comp_fact;
 	const float mod_alpha_comp = mod_alpha_filter_sgn * mod_comp_fact;
 	const float mod_beta_comp = mod_beta_filter_sgn * mod_comp_fact;
 
@@ -3326,6 +4179,10 @@ static void control_current(volatile motor_all_state_t *motor, float dt) {
 	state_m->vd = c * motor->m_motor_state.v_alpha + s * motor->m_motor_state.v_beta;
 	state_m->vq = c * motor->m_motor_state.v_beta  - s * motor->m_motor_state.v_alpha;
 
+	if (motor->m_ident.mode != IDENT_OFF) {
+		ident_capture(motor);
+	}
+
 	// HFI
 	if (do_hfi) {
 		CURRENT_FILTER_OFF();
@@ -3351,14 +4208,13 @@ static void control_current(volatile motor_all_state_t *motor, float dt) {
 			motor->m_hfi.buffer_current[motor->m_hfi.ind] = current_sample;
 
 			if (current_sample > 0.01) {
-				motor->m_hfi.buffer[motor->m_hfi.ind] = ((hfi_voltage / 2.0 - conf_now->foc_motor_r *
-						current_sample) / (conf_now->foc_f_sw * current_sample));
+				hfi_buffer_write(motor, ((hfi_voltage / 2.0 - conf_now->foc_motor_r *
+						current_sample) / (conf_now->foc_f_sw * current_sample)));
 			}
 
-			motor->m_hfi.ind++;
-			if (motor->m_hfi.ind == motor->m_hfi.samples) {
-				motor->m_hfi.ind = 0;
-				motor->m_hfi.ready = true;
+			hfi_buffer_next(motor);
+			if (motor->m_hfi.ready && motor->m_hfi.sliding) {
+				hfi_estimate_angle(motor, motor->m_hfi.bin2_real, motor->m_hfi.bin2_imag);
 			}
 
 			mod_alpha_tmp += hfi_voltage * utils_tab_sin_32_1[motor->m_hfi.ind * motor->m_hfi.table_fact] / ((2.0 / 3.0) * state_m->v_bus);
@@ -78,6 +78,8 @@ float mcpwm_foc_measure_resistance(float current, int samples, bool stop_after);
 float mcpwm_foc_measure_inductance(float duty, int samples, float *curr, float *ld_lq_diff);
 float mcpwm_foc_measure_inductance_current(float curr_goal, int samples, float *curr, float *ld_lq_diff);
 bool mcpwm_foc_measure_res_ind(float *res, float *ind);
+bool mcpwm_foc_measure_params(float current, float duty, float erpm_per_sec,
+		float *res, float *ld, float *lq, float *linkage);
 bool mcpwm_foc_hall_detect(float current, uint8_t *hall_table);
 void mcpwm_foc_print_state(void);
 float mcpwm_foc_get_last_adc_isr_duration(void);
@@ -108,5 +110,6 @@ void mcpwm_foc_adc_int_handler(void *p, uint32_t flags);
 
 // Defines
 #define MCPWM_FOC_CURRENT_SAMP_OFFSET				(2) // Offset from timer top for ADC samples
+#define MCPWM_FOC_TEMP_COMP_STEP					(0.2) // Motor temperature change that updates the temperature compensation
 
 #endif /* MCPWM_FOC_H_ */
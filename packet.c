@@ -24,10 +24,21 @@
 /**
  * The latest update aims at achieving optimal re-synchronization in the
  * case if lost data, at the cost of some performance.
+ *
+ * Received bytes go to a circular buffer whose second half mirrors the first,
+ * so that every packet in it can be read as one block without moving data.
+ * Non-start bytes are skipped with memchr, the header of the packet at the
+ * read position is decoded only once, and the CRC is only calculated once
+ * the stop byte is in place.
+ *
+ * On the transmit side, transports that write small frames often can enable
+ * coalescing, where frames are collected in tx_buffer and sent together when
+ * packet_flush is called or the buffer is full.
  */
 
 // Defines
 #define BUFFER_LEN				(PACKET_MAX_PL_LEN + 8)
+#define COALESCE_MAX_FRAME		(BUFFER_LEN / 2)
 
 // Private types
 typedef struct {
@@ -35,9 +46,13 @@ typedef struct {
 	void(*send_func)(unsigned char *data, unsigned int len);
 	void(*process_func)(unsigned char *data, unsigned int len);
 	unsigned int rx_read_ptr;
-	unsigned int rx_write_ptr;
-	int bytes_left;
-	unsigned char rx_buffer[BUFFER_LEN];
+	unsigned int rx_len;
+	// Header of the packet at rx_read_ptr, header_len is 0 if not decoded yet
+	unsigned int header_len;
+	unsigned int payload_len;
+	unsigned char rx_buffer[2 * BUFFER_LEN];
+	bool coalesce;
+	unsigned int tx_len;
 	unsigned char tx_buffer[BUFFER_LEN];
 } PACKET_STATE_t;
 
@@ -45,8 +60,11 @@ typedef struct {
 static PACKET_STATE_t m_handler_states[PACKET_HANDLERS];
 
 // Private functions
-static int try_decode_packet(unsigned char *buffer, unsigned int in_len,
-		void(*process_func)(unsigned char *data, unsigned int len), int *bytes_left);
+static void rx_write(PACKET_STATE_t *handler, const unsigned char *data, unsigned int len);
+static void rx_consume(PACKET_STATE_t *handler, unsigned int len);
+static unsigned int find_start(const unsigned char *buffer, unsigned int len);
+static int decode_header(PACKET_STATE_t *handler);
+static void decode_packets(PACKET_STATE_t *handler);
 
 void packet_init(void (*s_func)(unsigned char *data, unsigned int len),
 		void (*p_func)(unsigned char *data, unsigned int len), int handler_num) {
@@ -57,8 +75,8 @@ void packet_init(void (*s_func)(unsigned char *data, unsigned int len),
 
 void packet_reset(int handler_num) {
 	m_handler_states[handler_num].rx_read_ptr = 0;
-	m_handler_states[handler_num].rx_write_ptr = 0;
-	m_handler_states[handler_num].bytes_left = 0;
+	m_handler_states[handler_num].rx_len = 0;
+	m_handler_states[handler_num].header_len = 0;
 }
 
 void packet_send_packet(unsigned char *data, unsigned int len, int handler_num) {
@@ -66,36 +84,108 @@ void packet_send_packet(unsigned char *data, unsigned int len, int handler_num)
 		return;
 	}
 
-	int b_ind = 0;
+	unsigned char header[4];
+	unsigned char trailer[3];
+	unsigned int h_len = 0;
 	PACKET_STATE_t *handler = &m_handler_states[handler_num];
 
 	if (len <= 255) {
-		handler->tx_buffer[b_ind++] = 2;
-		handler->tx_buffer[b_ind++] = len;
+		header[h_len++] = 2;
+		header[h_len++] = len;
 	} else if (len <= 65535) {
-		handler->tx_buffer[b_ind++] = 3;
-		handler->tx_buffer[b_ind++] = len >> 8;
-		handler->tx_buffer[b_ind++] = len & 0xFF;
+		header[h_len++] = 3;
+		header[h_len++] = len >> 8;
+		header[h_len++] = len & 0xFF;
 	} else {
-		handler->tx_buffer[b_ind++] = 4;
-		handler->tx_buffer[b_ind++] = len >> 16;
-		handler->tx_buffer[b_ind++] = (len >> 8) & 0x0F;
-		handler->tx_buffer[b_ind++] = len & 0xFF;
+		header[h_len++] = 4;
+		header[h_len++] = len >> 16;
+		header[h_len++] = (len >> 8) & 0x0F;
+		header[h_len++] = len & 0xFF;
 	}
 
-	memcpy(handler->tx_buffer + b_ind, data, len);
-	b_ind += len;
-
 	unsigned short crc = crc16(data, len);
-	handler->tx_buffer[b_ind++] = (uint8_t)(crc >> 8);
-	handler->tx_buffer[b_ind++] = (uint8_t)(crc & 0xFF);
-	handler->tx_buffer[b_ind++] = 3;
+	trailer[0] = (uint8_t)(crc >> 8);
+	trailer[1] = (uint8_t)(crc & 0xFF);
+	trailer[2] = 3;
+
+	unsigned int frame_len = h_len + len + 3;
+
+	if (handler->coalesce) {
+		// Frames that are too large to coalesce are sent after the pending ones
+		if (frame_len > COALESCE_MAX_FRAME ||
+				(handler->tx_len + frame_len) > BUFFER_LEN) {
+			packet_flush(handler_num);
+		}
+
+		if (frame_len <= COALESCE_MAX_FRAME) {
+			unsigned char *p = handler->tx_buffer + handler->tx_len;
+			memcpy(p, header, h_len);
+			memcpy(p + h_len, data, len);
+			memcpy(p + h_len + len, trailer, 3);
+			handler->tx_len += frame_len;
+			return;
+		}
+	}
 
 	if (handler->send_func) {
-		handler->send_func(handler->tx_buffer, b_ind);
+		memcpy(handler->tx_buffer, header, h_len);
+		memcpy(handler->tx_buffer + h_len, data, len);
+		memcpy(handler->tx_buffer + h_len + len, trailer, 3);
+		handler->send_func(handler->tx_buffer, frame_len);
 	}
 }
 
+/**
+ * Enable or disable coalescing of small frames. While it is enabled, frames
+ * up to half of the transmit buffer are collected and sent in one call to the
+ * send function by packet_flush, or when the next frame does not fit. Larger
+ * frames flush the pending ones and are sent directly. The transport is
+ * responsible for calling packet_flush within a bounded time, and for
+ * serializing it with packet_send_packet.
+ *
+ * @param enable
+ * Enable coalescing. Pending frames are flushed when disabling it.
+ *
+ * @param handler_num
+ * The packet handler to use.
+ */
+void packet_set_coalescing(bool enable, int handler_num) {
+	if (!enable) {
+		packet_flush(handler_num);
+	}
+
+	m_handler_states[handler_num].coalesce = enable;
+}
+
+/**
+ * Send the frames collected while coalescing.
+ *
+ * @param handler_num
+ * The packet handler to use.
+ */
+void packet_flush(int handler_num) {
+	PACKET_STATE_t *handler = &m_handler_states[handler_num];
+
+	if (handler->tx_len == 0) {
+		return;
+	}
+
+	unsigned int len = handler->tx_len;
+	handler->tx_len = 0;
+
+	if (handler->send_func) {
+		handler->send_func(handler->tx_buffer, len);
+	}
+}
+
+/**
+ * @return
+ * The number of bytes waiting for packet_flush.
+ */
+unsigned int packet_tx_pending(int handler_num) {
+	return m_handler_states[handler_num].tx_len;
+}
+
 /**
  * Call this function every millisecond. This is not strictly necessary
  * if the timeout is unimportant.
@@ -115,137 +205,147 @@ void packet_process_byte(uint8_t rx_data, int handler_num) {
 
 	handler->rx_timeout = PACKET_RX_TIMEOUT;
 
-	unsigned int data_len = handler->rx_write_ptr - handler->rx_read_ptr;
+	unsigned int pos = handler->rx_read_ptr + handler->rx_len;
+	if (pos >= BUFFER_LEN) {
+		pos -= BUFFER_LEN;
+	}
+
+	handler->rx_buffer[pos] = rx_data;
+	handler->rx_buffer[pos + BUFFER_LEN] = rx_data;
+	handler->rx_len++;
 
-	// Out of space (should not happen)
-	if (data_len >= BUFFER_LEN) {
-		handler->rx_write_ptr = 0;
-		handler->rx_read_ptr = 0;
-		handler->bytes_left = 0;
-		handler->rx_buffer[handler->rx_write_ptr++] = rx_data;
+	// Still waiting for the rest of the packet
+	if (handler->header_len != 0 &&
+			handler->rx_len < (handler->header_len + handler->payload_len + 3)) {
 		return;
 	}
 
-	// Everything has to be aligned, so shift buffer if we are out of space.
-	// (as opposed to using a circular buffer)
-	if (handler->rx_write_ptr >= BUFFER_LEN) {
-		memmove(handler->rx_buffer,
-				handler->rx_buffer + handler->rx_read_ptr,
-				data_len);
+	decode_packets(handler);
+}
+
+/**
+ * Process a block of received bytes. Every complete packet in it is passed to
+ * the process function before this returns.
+ *
+ * @param data
+ * The received bytes.
+ *
+ * @param len
+ * Number of bytes.
+ *
+ * @param handler_num
+ * The packet handler to use.
+ */
+void packet_process_bytes(const unsigned char *data, unsigned int len, int handler_num) {
+	PACKET_STATE_t *handler = &m_handler_states[handler_num];
+
+	handler->rx_timeout = PACKET_RX_TIMEOUT;
+
+	while (len > 0) {
+		unsigned int space = BUFFER_LEN - handler->rx_len;
+		unsigned int n = len < space ? len : space;
+
+		rx_write(handler, data, n);
+		data += n;
+		len -= n;
 
-		handler->rx_read_ptr = 0;
-		handler->rx_write_ptr = data_len;
+		decode_packets(handler);
 	}
+}
 
-	handler->rx_buffer[handler->rx_write_ptr++] = rx_data;
-	data_len++;
+static void rx_write(PACKET_STATE_t *handler, const unsigned char *data, unsigned int len) {
+	unsigned int pos = handler->rx_read_ptr + handler->rx_len;
+	if (pos >= BUFFER_LEN) {
+		pos -= BUFFER_LEN;
+	}
 
-	if (handler->bytes_left > 1) {
-		handler->bytes_left--;
-		return;
+	unsigned int first = BUFFER_LEN - pos;
+	if (first > len) {
+		first = len;
 	}
 
-	// Try decoding the packet at various offsets until it succeeds, or
-	// until we run out of data.
-	for (;;) {
-		int res = try_decode_packet(handler->rx_buffer + handler->rx_read_ptr,
-				data_len, handler->process_func, &handler->bytes_left);
+	memcpy(handler->rx_buffer + pos, data, first);
+	memcpy(handler->rx_buffer + pos + BUFFER_LEN, data, first);
+	memcpy(handler->rx_buffer, data + first, len - first);
+	memcpy(handler->rx_buffer + BUFFER_LEN, data + first, len - first);
 
-		// More data is needed
-		if (res == -2) {
-			break;
-		}
+	handler->rx_len += len;
+}
 
-		if (res > 0) {
-			data_len -= res;
-			handler->rx_read_ptr += res;
-		} else if (res == -1) {
-			// Something went wrong. Move pointer forward and try again.
-			handler->rx_read_ptr++;
-			data_len--;
-		}
+static void rx_consume(PACKET_STATE_t *handler, unsigned int len) {
+	handler->rx_read_ptr += len;
+	if (handler->rx_read_ptr >= BUFFER_LEN) {
+		handler->rx_read_ptr -= BUFFER_LEN;
 	}
 
-	// Nothing left, move pointers to avoid memmove
-	if (data_len == 0) {
-		handler->rx_read_ptr = 0;
-		handler->rx_write_ptr = 0;
-	}
+	handler->rx_len -= len;
+	handler->header_len = 0;
 }
 
 /**
- * Try if it is possible to decode a packet from a buffer.
- *
- * @param buffer
- * The buffer to try from
- *
- * @param in_len
- * The length of the buffer
- *
- * @param process_func
- * Call this function with the decoded packet on success. Set to null
- * to disable.
- *
- * @param bytes_left
- * This many additional bytes are required to tell more about the packet.
+ * Find the first byte that can start a packet.
  *
  * @return
- * >0: Success, number of bytes decoded from buffer (not payload length)
- * -1: Invalid structure
- * -2: OK so far, but not enough data
+ * The offset of the start byte, or len if there is none.
  */
-static int try_decode_packet(unsigned char *buffer, unsigned int in_len,
-		void(*process_func)(unsigned char *data, unsigned int len), int *bytes_left) {
-	*bytes_left = 0;
-
-	if (in_len == 0) {
-		*bytes_left = 1;
-		return -2;
+static unsigned int find_start(const unsigned char *buffer, unsigned int len) {
+	const unsigned char *end = buffer + len;
+	const unsigned char *p = memchr(buffer, 2, len);
+	if (p) {
+		end = p;
 	}
 
-	bool is_len_8b = buffer[0] == 2;
-	unsigned int data_start = buffer[0];
-
 #if PACKET_MAX_PL_LEN > 255
-	bool is_len_16b = buffer[0] == 3;
-#else
-#define is_len_16b false
+	p = memchr(buffer, 3, end - buffer);
+	if (p) {
+		end = p;
+	}
 #endif
 
 #if PACKET_MAX_PL_LEN > 65535
-	bool is_len_24b = buffer[0] == 4;
-#else
-#define is_len_24b false
+	p = memchr(buffer, 4, end - buffer);
+	if (p) {
+		end = p;
+	}
 #endif
 
-	// No valid start byte
-	if (!is_len_8b && !is_len_16b && !is_len_24b) {
-		return -1;
-	}
+	return end - buffer;
+}
+
+/**
+ * Decode the header of the packet at the read position.
+ *
+ * @return
+ * 1: Success, header_len and payload_len are set
+ * -1: Invalid header
+ * -2: Not enough data
+ */
+static int decode_header(PACKET_STATE_t *handler) {
+	unsigned char *buffer = handler->rx_buffer + handler->rx_read_ptr;
+	unsigned int header_len = buffer[0];
 
 	// Not enough data to determine length
-	if (in_len < data_start) {
-		*bytes_left = data_start - in_len;
+	if (handler->rx_len < header_len) {
 		return -2;
 	}
 
 	unsigned int len = 0;
 
-	if (is_len_8b) {
+	if (header_len == 2) {
 		len = (unsigned int)buffer[1];
 
 		// No support for zero length packets
 		if (len < 1) {
 			return -1;
 		}
-	} else if (is_len_16b) {
+	} else if (header_len == 3) {
 		len = (unsigned int)buffer[1] << 8 | (unsigned int)buffer[2];
 
 		// A shorter packet should use less length bytes
 		if (len < 255) {
 			return -1;
 		}
-	} else if (is_len_24b) {
+	} else {
 		len = (unsigned int)buffer[1] << 16 |
 				(unsigned int)buffer[2] << 8 |
 				(unsigned int)buffer[3];
@@ -261,28 +361,71 @@ static int try_decode_packet(unsigned char *buffer, unsigned int in_len,
 		return -1;
 	}
 
-	// Need more data to determine rest of packet
-	if (in_len < (len + data_start + 3)) {
-		*bytes_left = (len + data_start + 3) - in_len;
-		return -2;
-	}
+	handler->header_len = header_len;
+	handler->payload_len = len;
 
-	// Invalid stop byte
-	if (buffer[data_start + len + 2] != 3) {
-		return -1;
-	}
+	return 1;
+}
+
+/**
+ * Decode and process packets from the buffer until more data is needed. On
+ * an invalid packet the start byte is dropped and decoding resumes from the
+ * next possible start byte.
+ */
+static void decode_packets(PACKET_STATE_t *handler) {
+	for (;;) {
+		if (handler->header_len == 0) {
+			unsigned int skip = find_start(handler->rx_buffer + handler->rx_read_ptr,
+					handler->rx_len);
+			if (skip > 0) {
+				rx_consume(handler, skip);
+			}
+
+			if (handler->rx_len == 0) {
+				break;
+			}
+
+			int res = decode_header(handler);
+
+			if (res == -2) {
+				break;
+			} else if (res == -1) {
+				rx_consume(handler, 1);
+				continue;
+			}
+		}
 
-	unsigned short crc_calc = crc16(buffer + data_start, len);
-	unsigned short crc_rx = (unsigned short)buffer[data_start + len] << 8
-							| (unsigned short)buffer[data_start + len + 1];
+		unsigned int header_len = handler->header_len;
+		unsigned int len = handler->payload_len;
 
-	if (crc_calc == crc_rx) {
-		if (process_func) {
-			process_func(buffer + data_start, len);
+		// Need more data to determine rest of packet
+		if (handler->rx_len < (header_len + len + 3)) {
+			break;
 		}
 
-		return len + data_start + 3;
-	} else {
-		return -1;
+		unsigned char *buffer = handler->rx_buffer + handler->rx_read_ptr;
+
+		// Invalid stop byte
+		if (buffer[header_len + len + 2] != 3) {
+			rx_consume(handler, 1);
+			continue;
+		}
+
+		unsigned short crc_calc = crc16(buffer + header_len, len);
+		unsigned short crc_rx = (unsigned short)buffer[header_len + len] << 8
+								| (unsigned short)buffer[header_len + len + 1];
+
+		if (crc_calc != crc_rx) {
+			rx_consume(handler, 1);
+			continue;
+		}
+
+		// Consume the packet before processing it, as the process function
+		// might use this handler again.
+		rx_consume(handler, header_len + len + 3);
+
+		if (handler->process_func) {
+			handler->process_func(buffer + header_len, len);
+		}
 	}
 }
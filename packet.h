@@ -41,7 +41,11 @@ void packet_init(void (*s_func)(unsigned char *data, unsigned int len),
 		void (*p_func)(unsigned char *data, unsigned int len), int handler_num);
 void packet_reset(int handler_num);
 void packet_process_byte(uint8_t rx_data, int handler_num);
+void packet_process_bytes(const unsigned char *data, unsigned int len, int handler_num);
 void packet_timerfunc(void);
 void packet_send_packet(unsigned char *data, unsigned int len, int handler_num);
+void packet_set_coalescing(bool enable, int handler_num);
+void packet_flush(int handler_num);
+unsigned int packet_tx_pending(int handler_num);
 
 #endif /* PACKET_H_ */
@@ -0,0 +1,162 @@
+/*
+	Copyright 2026 agent	agent@local
+
+	This file is part of the VESC firmware.
+
+	The VESC firmware is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    The VESC firmware is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+#include "sample_stream.h"
+#include "datatypes.h"
+#include "buffer.h"
+#include "minilzo.h"
+
+#include <string.h>
+
+/**
+ * Get the number of samples that fit in one data frame.
+ *
+ * @param src
+ * The channels to send.
+ *
+ * @param frame_len
+ * The maximum length of a frame, usually PACKET_MAX_PL_LEN.
+ *
+ * @return
+ * The number of samples.
+ */
+int sample_stream_frame_samples(const sample_stream_src *src, int frame_len) {
+	int samples = (frame_len - SAMPLE_STREAM_FRAME_OVERHEAD) /
+			(2 * src->ch16_num + src->ch8_num);
+
+	return samples > 255 ? 255 : samples;
+}
+
+/**
+ * Write the header packet of a capture.
+ *
+ * @param buffer
+ * The buffer to write to.
+ *
+ * @param src
+ * The channels to send.
+ *
+ * @return
+ * Length of the packet.
+ */
+int32_t sample_stream_header(uint8_t *buffer, const sample_stream_src *src) {
+	int32_t ind = 0;
+
+	buffer[ind++] = COMM_SAMPLE_STREAM;
+	buffer[ind++] = SAMPLE_STREAM_HEADER;
+	buffer_append_uint16(buffer, src->len, &ind);
+	buffer[ind++] = src->ch16_num;
+	buffer[ind++] = src->ch8_num;
+
+	for (int i = 0;i < src->ch16_num;i++) {
+		buffer_append_float32_auto(buffer, src->ch16_scale[i], &ind);
+	}
+
+	return ind;
+}
+
+/**
+ * Write a data frame, packing the samples straight from the channel buffers.
+ *
+ * @param buffer
+ * The buffer to write to.
+ *
+ * @param src
+ * The channels to send.
+ *
+ * @param first
+ * The first sample to send, counted from the start of the capture.
+ *
+ * @param num
+ * The number of samples, at most sample_stream_frame_samples.
+ *
+ * @param lzo_wrkmem
+ * LZO1X_1_MEM_COMPRESS bytes of work memory for compressing the payload, or
+ * null to send it uncompressed.
+ *
+ * @param lzo_buffer
+ * SAMPLE_STREAM_LZO_BUFFER_LEN bytes for the compressed payload. Only used
+ * with lzo_wrkmem.
+ *
+ * @return
+ * Length of the packet.
+ */
+int32_t sample_stream_frame(uint8_t *buffer, const sample_stream_src *src,
+		int first, int num, void *lzo_wrkmem, uint8_t *lzo_buffer) {
+	int32_t ind = 0;
+
+	buffer[ind++] = COMM_SAMPLE_STREAM;
+	buffer[ind++] = SAMPLE_STREAM_DATA;
+	int32_t flags_ind = ind++;
+	buffer[flags_ind] = 0;
+	buffer_append_uint16(buffer, first, &ind);
+	buffer[ind++] = num;
+
+	int start = src->offset + first;
+	while (start >= src->ring_len) {
+		start -= src->ring_len;
+	}
+	while (start < 0) {
+		start += src->ring_len;
+	}
+
+	// The samples of a frame can wrap around the end of the ring once
+	int first_part = src->ring_len - start;
+	if (first_part > num) {
+		first_part = num;
+	}
+
+	const int32_t payload_ind = ind;
+
+	for (int ch = 0;ch < src->ch16_num;ch++) {
+		const volatile int16_t *samples = src->ch16[ch];
+
+		for (int i = 0;i < first_part;i++) {
+			buffer_append_int16(buffer, samples[start + i], &ind);
+		}
+		for (int i = 0;i < num - first_part;i++) {
+			buffer_append_int16(buffer, samples[i], &ind);
+		}
+	}
+
+	for (int ch = 0;ch < src->ch8_num;ch++) {
+		const volatile uint8_t *samples = src->ch8[ch];
+
+		for (int i = 0;i < first_part;i++) {
+			buffer[ind++] = samples[start + i];
+		}
+		for (int i = 0;i < num - first_part;i++) {
+			buffer[ind++] = samples[i];
+		}
+	}
+
+	if (lzo_wrkmem) {
+		lzo_uint payload_len = ind - payload_ind;
+		lzo_uint compressed_len = 0;
+
+		if (lzo1x_1_compress(buffer + payload_ind, payload_len, lzo_buffer,
+				&compressed_len, lzo_wrkmem) == LZO_E_OK && compressed_len < payload_len) {
+			memcpy(buffer + payload_ind, lzo_buffer, compressed_len);
+			buffer[flags_ind] |= SAMPLE_STREAM_FLAG_LZO;
+			ind = payload_ind + compressed_len;
+		}
+	}
+
+	return ind;
+}
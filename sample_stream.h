@@ -0,0 +1,76 @@
+/*
+	Copyright 2026 agent	agent@local
+
+	This file is part of the VESC firmware.
+
+	The VESC firmware is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    The VESC firmware is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+#ifndef SAMPLE_STREAM_H_
+#define SAMPLE_STREAM_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * COMM_SAMPLE_STREAM packets carry a capture of raw samples. A header packet
+ * with the number of samples and the scale of every int16 channel is followed
+ * by data frames with as many samples as fit in one packet:
+ *
+ * Header: COMM_SAMPLE_STREAM, SAMPLE_STREAM_HEADER, samples (uint16),
+ * int16 channels (uint8), uint8 channels (uint8), scale of every int16
+ * channel (float32_auto)
+ *
+ * Frame: COMM_SAMPLE_STREAM, SAMPLE_STREAM_DATA, flags (uint8), index of the
+ * first sample (uint16), samples (uint8), payload
+ *
+ * The payload has all samples of the first int16 channel (big endian), then
+ * the next int16 channel and so on, followed by the uint8 channels in the same
+ * way. With SAMPLE_STREAM_FLAG_LZO set the payload is LZO1X compressed.
+ */
+
+// Packet types
+#define SAMPLE_STREAM_HEADER			0
+#define SAMPLE_STREAM_DATA				1
+
+// Frame flags
+#define SAMPLE_STREAM_FLAG_LZO			0x01
+
+// Bytes in a data frame before the payload
+#define SAMPLE_STREAM_FRAME_OVERHEAD	6
+
+// Size of the buffer lzo1x_1_compress needs for the payload of a frame of the
+// given length in the worst case.
+#define SAMPLE_STREAM_LZO_BUFFER_LEN(frame_len)	((frame_len) + (frame_len) / 16 + 67)
+
+// Channels to send, all stored in circular buffers of the same length
+typedef struct {
+	const volatile int16_t *const *ch16;
+	const float *ch16_scale;
+	int ch16_num;
+	const volatile uint8_t *const *ch8;
+	int ch8_num;
+	int ring_len;
+	// Ring index of the first sample, can be out of range
+	int offset;
+	int len;
+} sample_stream_src;
+
+// Functions
+int sample_stream_frame_samples(const sample_stream_src *src, int frame_len);
+int32_t sample_stream_header(uint8_t *buffer, const sample_stream_src *src);
+int32_t sample_stream_frame(uint8_t *buffer, const sample_stream_src *src,
+		int first, int num, void *lzo_wrkmem, uint8_t *lzo_buffer);
+
+#endif /* SAMPLE_STREAM_H_ */
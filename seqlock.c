@@ -0,0 +1,97 @@
+/*
+	Copyright 2026 agent	agent@local
+
+	This file is part of the VESC firmware.
+
+	The VESC firmware is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    The VESC firmware is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+#include "seqlock.h"
+#include "ch.h"
+#include "hal.h"
+
+#include <string.h>
+
+void seqlock_init(seqlock *lock) {
+	lock->seq = 0;
+}
+
+/**
+ * Publish data. Only one thread may write to the same lock.
+ *
+ * @param lock
+ * The lock that protects dst.
+ *
+ * @param dst
+ * The published copy.
+ *
+ * @param src
+ * The new data.
+ *
+ * @param len
+ * Length of the data in bytes.
+ */
+void seqlock_write(seqlock *lock, volatile void *dst, const void *src, size_t len) {
+	// With the system locked other threads never see an odd sequence number,
+	// so a reader never has to wait for the writer. The copy is short.
+	chSysLock();
+	lock->seq++;
+	__DMB();
+	memcpy((void*)dst, src, len);
+	__DMB();
+	lock->seq++;
+	chSysUnlock();
+}
+
+/**
+ * Make a consistent copy of the published data.
+ *
+ * @param lock
+ * The lock that protects src.
+ *
+ * @param dst
+ * Where to copy the data.
+ *
+ * @param src
+ * The published copy.
+ *
+ * @param len
+ * Length of the data in bytes.
+ *
+ * @return
+ * The number of times the copy was retried because the writer published
+ * new data during it.
+ */
+int seqlock_read(seqlock *lock, void *dst, const volatile void *src, size_t len) {
+	int retries = 0;
+
+	for (;;) {
+		uint32_t seq = lock->seq;
+
+		// Only possible when the writer runs on another core, e.g. in tests
+		if (seq & 1) {
+			continue;
+		}
+
+		__DMB();
+		memcpy(dst, (const void*)src, len);
+		__DMB();
+
+		if (lock->seq == seq) {
+			return retries;
+		}
+
+		retries++;
+	}
+}
@@ -0,0 +1,43 @@
+/*
+	Copyright 2026 agent	agent@local
+
+	This file is part of the VESC firmware.
+
+	The VESC firmware is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    The VESC firmware is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+#ifndef SEQLOCK_H_
+#define SEQLOCK_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Sequence lock for data that one thread publishes and other threads copy.
+ * The writer never waits for readers, and a reader that got preempted by the
+ * writer in the middle of its copy notices it and copies again, so readers
+ * always get a consistent copy without taking a lock. Not for use from ISRs.
+ */
+
+// Types
+typedef struct {
+	volatile uint32_t seq;
+} seqlock;
+
+// Functions
+void seqlock_init(seqlock *lock);
+void seqlock_write(seqlock *lock, volatile void *dst, const void *src, size_t len);
+int seqlock_read(seqlock *lock, void *dst, const volatile void *src, size_t len);
+
+#endif /* SEQLOCK_H_ */
@@ -0,0 +1,237 @@
+/*
+	Copyright 2026 agent	agent@local
+
+	This file is part of the VESC firmware.
+
+	The VESC firmware is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    The VESC firmware is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+/*
+ * ChibiOS/RT API on top of POSIX threads, for running the firmware in the
+ * simulator. Every firmware thread is a pthread, but like on the single core
+ * target only one of them runs at a time: a thread holds the kernel lock
+ * while running and releases it when it sleeps or blocks. The system lock
+ * is a separate lock that is also held by the simulated interrupts, so
+ * chSysLock masks them like on the target. See sim_os.c.
+ */
+
+#ifndef SIM_CH_H_
+#define SIM_CH_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#include "chconf.h"
+
+// Types
+typedef uint32_t systime_t;
+typedef int32_t msg_t;
+typedef uint32_t eventmask_t;
+typedef uint32_t eventflags_t;
+typedef int32_t cnt_t;
+typedef uint32_t tprio_t;
+typedef uint32_t ucnt_t;
+typedef uint8_t tstate_t;
+typedef uint8_t trefs_t;
+typedef uint64_t stkalign_t;
+
+typedef struct ch_thread {
+	struct ch_thread *p_newer;
+	const char *p_name;
+	tprio_t p_prio;
+	tstate_t p_state;
+	trefs_t p_refs;
+	systime_t p_time;
+	struct {
+		uint32_t r13;
+	} p_ctx;
+	CH_CFG_THREAD_EXTRA_FIELDS
+	// Simulator state, protected by the system lock
+	eventmask_t p_epending;
+	bool p_terminate;
+	pthread_t sim_thread;
+	pthread_cond_t sim_cond;
+	void (*sim_func)(void *arg);
+	void *sim_arg;
+} thread_t;
+
+typedef struct {
+	thread_t *m_owner;
+} mutex_t;
+
+typedef struct event_listener {
+	struct event_listener *el_next;
+	thread_t *el_listener;
+	eventmask_t el_events;
+	eventflags_t el_flags;
+	eventflags_t el_wflags;
+} event_listener_t;
+
+typedef struct {
+	event_listener_t *es_next;
+} event_source_t;
+
+typedef void (*vtfunc_t)(void *p);
+
+typedef struct virtual_timer {
+	struct virtual_timer *vt_next;
+	systime_t vt_time;
+	vtfunc_t vt_func;
+	void *vt_par;
+	bool vt_armed;
+} virtual_timer_t;
+
+typedef struct {
+	msg_t *mb_buffer;
+	cnt_t mb_size;
+	cnt_t mb_rd;
+	cnt_t mb_cnt;
+} mailbox_t;
+
+typedef struct {
+	int dummy;
+} memory_heap_t;
+
+// Constants
+#define TRUE					1
+#define FALSE					0
+
+#define MSG_OK					(msg_t)0
+#define MSG_TIMEOUT				(msg_t)-1
+#define MSG_RESET				(msg_t)-2
+
+#define TIME_IMMEDIATE			((systime_t)0)
+#define TIME_INFINITE			((systime_t)-1)
+
+#define IDLEPRIO				1
+#define LOWPRIO					2
+#define NORMALPRIO				128
+#define HIGHPRIO				255
+
+#define ALL_EVENTS				((eventmask_t)-1)
+#define EVENT_MASK(eid)			((eventmask_t)(1 << (eid)))
+
+#define CH_STATE_CURRENT		1
+#define CH_STATE_SUSPENDED		3
+#define CH_STATE_WTMTX			6
+#define CH_STATE_SLEEPING		8
+#define CH_STATE_WTEXIT			9
+#define CH_STATE_WTOREVT		10
+#define CH_STATE_WTMSG			14
+#define CH_STATE_FINAL			15
+#define CH_STATE_NAMES													\
+	"READY", "CURRENT", "WTSTART", "SUSPENDED", "QUEUED", "WTSEM",		\
+	"WTMTX", "WTCOND", "SLEEPING", "WTEXIT", "WTOREVT", "WTANDEVT",	\
+	"SNDMSGQ", "SNDMSG", "WTMSG", "FINAL"
+
+// Time conversion
+#define S2ST(sec)				((systime_t)((uint32_t)(sec) * CH_CFG_ST_FREQUENCY))
+#define MS2ST(msec)				((systime_t)(((uint32_t)(msec) * CH_CFG_ST_FREQUENCY + 999UL) / 1000UL))
+#define US2ST(usec)				((systime_t)(((uint32_t)(usec) * CH_CFG_ST_FREQUENCY + 999999UL) / 1000000UL))
+#define ST2MS(n)				(((n) * 1000UL + CH_CFG_ST_FREQUENCY - 1UL) / CH_CFG_ST_FREQUENCY)
+#define ST2US(n)				(((n) * 1000000UL + CH_CFG_ST_FREQUENCY - 1UL) / CH_CFG_ST_FREQUENCY)
+
+// System
+void chSysInit(void);
+void chSysHalt(const char *reason);
+void chSysDisable(void);
+void chSysLock(void);
+void chSysUnlock(void);
+#define chSysLockFromISR()				chSysLock()
+#define chSysUnlockFromISR()			chSysUnlock()
+#define chSysLockFromIsr()				chSysLock()
+#define chSysUnlockFromIsr()			chSysUnlock()
+#define chSchRescheduleS()
+#define osalSysLock()					chSysLock()
+#define osalSysUnlock()					chSysUnlock()
+#define CH_IRQ_PROLOGUE()
+#define CH_IRQ_EPILOGUE()
+#define CH_IRQ_HANDLER(id)				void id(void)
+
+systime_t chVTGetSystemTimeX(void);
+#define chVTGetSystemTime()				chVTGetSystemTimeX()
+#define chVTTimeElapsedSinceX(start)	(chVTGetSystemTimeX() - (start))
+#define chVTIsSystemTimeWithinX(s, e)	((systime_t)(chVTGetSystemTimeX() - (s)) < (systime_t)((e) - (s)))
+
+// Virtual timers, run from the simulated system tick
+void chVTObjectInit(virtual_timer_t *vtp);
+void chVTSet(virtual_timer_t *vtp, systime_t delay, vtfunc_t vtfunc, void *par);
+void chVTSetI(virtual_timer_t *vtp, systime_t delay, vtfunc_t vtfunc, void *par);
+void chVTReset(virtual_timer_t *vtp);
+void chVTResetI(virtual_timer_t *vtp);
+
+// Threads
+#define THD_WORKING_AREA(s, n)			uint8_t s[(n) + 64]
+#define THD_WORKING_AREA_SIZE(n)		((n) + 64)
+#define THD_FUNCTION(tname, arg)		void tname(void *arg)
+
+thread_t *chThdCreateStatic(void *wsp, size_t size, tprio_t prio, void (*pf)(void *), void *arg);
+thread_t *chThdGetSelfX(void);
+void chThdSleep(systime_t time);
+void chThdSleepUntil(systime_t time);
+void chThdYield(void);
+void chThdTerminate(thread_t *tp);
+bool chThdShouldTerminateX(void);
+msg_t chThdWait(thread_t *tp);
+void chThdExit(msg_t msg);
+void chRegSetThreadName(const char *name);
+thread_t *chRegFirstThread(void);
+thread_t *chRegNextThread(thread_t *tp);
+#define chThdSleepSeconds(sec)			chThdSleep(S2ST(sec))
+#define chThdSleepMilliseconds(msec)	chThdSleep(MS2ST(msec))
+#define chThdSleepMicroseconds(usec)	chThdSleep(US2ST(usec))
+
+// Mutexes
+void chMtxObjectInit(mutex_t *mp);
+void chMtxLock(mutex_t *mp);
+bool chMtxTryLock(mutex_t *mp);
+void chMtxUnlock(mutex_t *mp);
+
+// Events
+#define chEvtObjectInit(esp)			((esp)->es_next = NULL)
+void chEvtRegisterMaskWithFlags(event_source_t *esp, event_listener_t *elp,
+		eventmask_t events, eventflags_t wflags);
+#define chEvtRegisterMask(esp, elp, m)	chEvtRegisterMaskWithFlags(esp, elp, m, (eventflags_t)-1)
+#define chEvtRegister(esp, elp, eid)	chEvtRegisterMask(esp, elp, EVENT_MASK(eid))
+void chEvtUnregister(event_source_t *esp, event_listener_t *elp);
+void chEvtBroadcastFlags(event_source_t *esp, eventflags_t flags);
+void chEvtBroadcastFlagsI(event_source_t *esp, eventflags_t flags);
+#define chEvtBroadcast(esp)				chEvtBroadcastFlags(esp, 0)
+#define chEvtBroadcastI(esp)			chEvtBroadcastFlagsI(esp, 0)
+eventflags_t chEvtGetAndClearFlags(event_listener_t *elp);
+void chEvtSignal(thread_t *tp, eventmask_t events);
+void chEvtSignalI(thread_t *tp, eventmask_t events);
+eventmask_t chEvtGetAndClearEvents(eventmask_t events);
+eventmask_t chEvtWaitAnyTimeout(eventmask_t events, systime_t time);
+#define chEvtWaitAny(events)			chEvtWaitAnyTimeout(events, TIME_INFINITE)
+
+// Mailboxes
+void chMBObjectInit(mailbox_t *mbp, msg_t *buf, cnt_t n);
+msg_t chMBPost(mailbox_t *mbp, msg_t msg, systime_t timeout);
+msg_t chMBPostI(mailbox_t *mbp, msg_t msg);
+msg_t chMBFetch(mailbox_t *mbp, msg_t *msgp, systime_t timeout);
+
+// Memory, everything is allocated statically in the firmware
+#define chHeapStatus(heapp, sizep)		(*(sizep) = 0, (size_t)0)
+#define chCoreGetStatusX()				((size_t)0)
+
+// Debug
+#define chDbgCheck(c)					((void)0)
+#define chDbgAssert(c, r)				((void)0)
+#define osalDbgAssert(c, r)				((void)0)
+#define osalDbgCheck(c)					((void)0)
+
+#endif /* SIM_CH_H_ */
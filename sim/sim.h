@@ -0,0 +1,49 @@
+/*
+	Copyright 2026 agent	agent@local
+
+	This file is part of the VESC firmware.
+
+	The VESC firmware is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    The VESC firmware is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+
+#ifndef SIM_H_
+#define SIM_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Settings
+#define SIM_TICK_US					100		// Simulated interrupt and system tick period
+#define SIM_ISR_CATCHUP_MAX_MS		50		// Simulated time that is dropped when the host stalls
+#define SIM_TCP_PORT_DEFAULT		65102
+#define SIM_VBUS_DEFAULT			40.0
+#define SIM_CONNECT_DELAY_MS		1500
+#define SIM_J_DEFAULT				0.0002
+
+// Functions in sim_os.c
+uint64_t sim_os_time_ns(void);
+void sim_os_sleep_until_ns(uint64_t time_ns);
+void sim_os_tick(void);
+void sim_os_block_begin(void);
+void sim_os_block_end(void);
+void sim_os_reset(const char *reason);
+
+// Functions in sim_hw.c
+void sim_hw_start(void);
+
+// Functions in sim_comm.c
+void sim_comm_init(int tcp_port, bool use_pty);
+
+#endif /* SIM_H_ */
@@ -0,0 +1,292 @@
+/*
+	Copyright 2026 agent	agent@local
+
+	This file is part of the VESC firmware.
+
+	The VESC firmware is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    The VESC firmware is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+/*
+ * The USB serial port of the firmware, backed by a TCP socket or a
+ * pseudo-tty. comm_usb.c runs unmodified on top of it, so the packet
+ * interface behaves like over USB. Only one TCP client is served at a time,
+ * a new connection replaces the old one.
+ */
+
+#include "ch.h"
+#include "hal.h"
+#include "sim.h"
+#include "comm_usb_serial.h"
+
+// After the STM32 headers, as termios.h defines register names like CR1
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <termios.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+// Private variables
+static int listen_fd = -1;
+static int client_fd = -1;
+static int old_fd = -1;
+static int pty_slave_fd = -1;
+static int connect_cnt = 0;
+static pthread_mutex_t client_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t client_cond = PTHREAD_COND_INITIALIZER;
+
+// Private functions
+static size_t sdu_write(void *instance, const uint8_t *bp, size_t n);
+static size_t sdu_read(void *instance, uint8_t *bp, size_t n);
+static msg_t sdu_put(void *instance, uint8_t b);
+static msg_t sdu_get(void *instance);
+static msg_t sdu_putt(void *instance, uint8_t b, systime_t time);
+static msg_t sdu_gett(void *instance, systime_t time);
+static size_t sdu_writet(void *instance, const uint8_t *bp, size_t n, systime_t time);
+static size_t sdu_readt(void *instance, uint8_t *bp, size_t n, systime_t time);
+static void *accept_thread(void *arg);
+static int get_client(bool wait);
+static void drop_client(int fd);
+
+static const struct SerialUSBDriverVMT sdu_vmt = {
+		sdu_write, sdu_read, sdu_put, sdu_get,
+		sdu_putt, sdu_gett, sdu_writet, sdu_readt
+};
+
+SerialUSBDriver SDU1 = {&sdu_vmt};
+
+/**
+ * Open the packet interface.
+ *
+ * @param tcp_port
+ * TCP port to listen on.
+ *
+ * @param use_pty
+ * Use a pseudo-tty instead of TCP. Its name is printed.
+ */
+void sim_comm_init(int tcp_port, bool use_pty) {
+	if (use_pty) {
+		int fd = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC);
+		if (fd < 0 || grantpt(fd) != 0 || unlockpt(fd) != 0) {
+			chSysHalt("could not open a pseudo-tty");
+		}
+
+		// Keep the slave side open in raw mode, so that clients can come and
+		// go and the line discipline leaves the packets alone.
+		pty_slave_fd = open(ptsname(fd), O_RDWR | O_NOCTTY | O_CLOEXEC);
+		struct termios tio;
+		if (pty_slave_fd < 0 || tcgetattr(pty_slave_fd, &tio) != 0) {
+			chSysHalt("could not open the pseudo-tty slave");
+		}
+		cfmakeraw(&tio);
+		tcsetattr(pty_slave_fd, TCSANOW, &tio);
+
+		printf("sim: packet interface on %s\n", ptsname(fd));
+		fflush(stdout);
+
+		client_fd = fd;
+		connect_cnt = 1;
+		return;
+	}
+
+	listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	int one = 1;
+	setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	addr.sin_port = htons(tcp_port);
+
+	if (listen_fd < 0 || bind(listen_fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 ||
+			listen(listen_fd, 1) != 0) {
+		fprintf(stderr, "sim: could not listen on TCP port %d: %s\n", tcp_port, strerror(errno));
+		exit(1);
+	}
+
+	fprintf(stderr, "sim: packet interface on TCP port %d\n", tcp_port);
+
+	pthread_t tp;
+	pthread_create(&tp, NULL, accept_thread, NULL);
+}
+
+// comm_usb_serial.c replacement
+void comm_usb_serial_init(void) {
+}
+
+int comm_usb_serial_is_active(void) {
+	return get_client(false) >= 0;
+}
+
+int comm_usb_serial_configured_cnt(void) {
+	return connect_cnt;
+}
+
+static size_t sdu_write(void *instance, const uint8_t *bp, size_t n) {
+	return sdu_writet(instance, bp, n, TIME_INFINITE);
+}
+
+static size_t sdu_read(void *instance, uint8_t *bp, size_t n) {
+	return sdu_readt(instance, bp, n, TIME_INFINITE);
+}
+
+static msg_t sdu_put(void *instance, uint8_t b) {
+	return sdu_putt(instance, b, TIME_INFINITE);
+}
+
+static msg_t sdu_get(void *instance) {
+	return sdu_gett(instance, TIME_INFINITE);
+}
+
+static msg_t sdu_putt(void *instance, uint8_t b, systime_t time) {
+	return sdu_writet(instance, &b, 1, time) == 1 ? MSG_OK : MSG_TIMEOUT;
+}
+
+static msg_t sdu_gett(void *instance, systime_t time) {
+	uint8_t b;
+	return sdu_readt(instance, &b, 1, time) == 1 ? b : MSG_TIMEOUT;
+}
+
+static size_t sdu_writet(void *instance, const uint8_t *bp, size_t n, systime_t time) {
+	(void)instance;
+	(void)time;
+
+	int fd = get_client(false);
+	if (fd < 0) {
+		return 0;
+	}
+
+	size_t written = 0;
+	sim_os_block_begin();
+	while (written < n) {
+		ssize_t res = listen_fd >= 0 ?
+				send(fd, bp + written, n - written, MSG_NOSIGNAL) :
+				write(fd, bp + written, n - written);
+		if (res <= 0) {
+			if (res < 0 && errno == EINTR) {
+				continue;
+			}
+			drop_client(fd);
+			break;
+		}
+		written += res;
+	}
+	sim_os_block_end();
+
+	return written;
+}
+
+static size_t sdu_readt(void *instance, uint8_t *bp, size_t n, systime_t time) {
+	(void)instance;
+
+	size_t read_cnt = 0;
+	sim_os_block_begin();
+	for (;;) {
+		int fd = get_client(time == TIME_INFINITE);
+		if (fd < 0) {
+			break;
+		}
+
+		struct pollfd pfd = {fd, POLLIN, 0};
+		int timeout_ms = time == TIME_INFINITE ? 100 : (int)ST2MS(time);
+		int res = poll(&pfd, 1, timeout_ms);
+		if (res == 0) {
+			if (time == TIME_INFINITE) {
+				continue;
+			}
+			break;
+		} else if (res < 0) {
+			continue;
+		}
+
+		ssize_t len = read(fd, bp, n);
+		if (len > 0) {
+			read_cnt = len;
+			break;
+		} else if (len == 0 || (errno != EINTR && errno != EAGAIN)) {
+			drop_client(fd);
+		}
+	}
+	sim_os_block_end();
+
+	return read_cnt;
+}
+
+static void *accept_thread(void *arg) {
+	(void)arg;
+
+	pthread_setname_np(pthread_self(), "tcp accept");
+
+	for (;;) {
+		int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+		if (fd < 0) {
+			continue;
+		}
+
+		int one = 1;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+		pthread_mutex_lock(&client_mutex);
+		if (client_fd >= 0) {
+			shutdown(client_fd, SHUT_RDWR);
+			old_fd = client_fd;
+		}
+		// Only closed now, so that the firmware threads never use a reused
+		// descriptor.
+		if (old_fd >= 0) {
+			close(old_fd);
+			old_fd = -1;
+		}
+		client_fd = fd;
+		connect_cnt++;
+		pthread_cond_broadcast(&client_cond);
+		pthread_mutex_unlock(&client_mutex);
+
+		fprintf(stderr, "sim: client connected\n");
+	}
+
+	return NULL;
+}
+
+static int get_client(bool wait) {
+	pthread_mutex_lock(&client_mutex);
+	while (wait && client_fd < 0) {
+		pthread_cond_wait(&client_cond, &client_mutex);
+	}
+	int fd = client_fd;
+	pthread_mutex_unlock(&client_mutex);
+	return fd;
+}
+
+static void drop_client(int fd) {
+	if (listen_fd < 0) {
+		// The pseudo-tty stays, clients just come and go
+		return;
+	}
+
+	pthread_mutex_lock(&client_mutex);
+	if (client_fd == fd) {
+		shutdown(fd, SHUT_RDWR);
+		client_fd = -1;
+		old_fd = fd;
+		fprintf(stderr, "sim: client disconnected\n");
+	}
+	pthread_mutex_unlock(&client_mutex);
+}
@@ -0,0 +1,466 @@
+/*
+	Copyright 2026 agent	agent@local
+
+	This file is part of the VESC firmware.
+
+	The VESC firmware is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    The VESC firmware is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "ch.h"
+#include "hal.h"
+#include "sim.h"
+#include "stm32f4xx_conf.h"
+#include "isr_vector_table.h"
+#include "mc_interface.h"
+#include "terminal.h"
+#include "commands.h"
+#include "hw.h"
+
+// Settings
+#define FLASH_BASE_ADDR				0x08000000
+#define FLASH_SIZE					0x00100000
+#define FLASH_APP_END				(FLASH_BASE_ADDR + 393216 - 8) // APP_MAX_SIZE in flash_helper.c
+#define SCRIPT_LINE_MAX				256
+
+// Private types
+typedef struct {
+	float load;
+	float J;
+	float vbus;
+} motor_model_t;
+
+// Private variables
+static int tcp_port = SIM_TCP_PORT_DEFAULT;
+static bool use_pty = false;
+static bool use_virtual_motor = true;
+static const char *flash_file = NULL;
+static const char *script_file = NULL;
+static int record_ms = 0;
+static motor_model_t model = {0.0, SIM_J_DEFAULT, SIM_VBUS_DEFAULT};
+static uint64_t pwm_time_cycles = 0; // Of the last PWM interrupt, in core clock cycles
+static THD_WORKING_AREA(sim_thread_wa, 4096);
+static THD_WORKING_AREA(record_thread_wa, 1024);
+
+// Private functions
+static THD_FUNCTION(sim_thread, arg);
+static THD_FUNCTION(record_thread, arg);
+static void *isr_thread(void *arg);
+static void pwm_sample_int(void);
+static uint64_t scale_time(uint64_t time, uint64_t mul, uint64_t div);
+static void map_flash_file(const char *path);
+static void connect_motor(void);
+static void run_script(const char *path);
+static void print_state(void);
+static void terminal_cmd_trigger(int argc, const char **argv);
+static void terminal_cmd_load(int argc, const char **argv);
+static void terminal_cmd_vbus(int argc, const char **argv);
+static void terminal_cmd_print(int argc, const char **argv);
+static void terminal_cmd_quit(int argc, const char **argv);
+
+// Interrupt handlers in irq_handlers.c
+void TIM2_IRQHandler(void);
+
+static void usage(const char *name) {
+	printf("Usage: %s [options]\n"
+			"  -t port   Packet interface on this TCP port (default %d)\n"
+			"  -p        Packet interface on a pseudo-tty instead of TCP\n"
+			"  -f file   Keep the flash contents, and thus the configuration, in file\n"
+			"  -s file   Run the terminal commands in file, one '<time_s> <command>' per line,\n            with the time since the start\n"
+			"  -r ms     Print the motor state as CSV to stdout every ms milliseconds\n"
+			"  -l Nm     Load torque of the virtual motor (default %.1f)\n"
+			"  -J kgm2   Inertia of the virtual motor (default %g)\n"
+			"  -v volts  Bus voltage (default %.1f)\n"
+			"  -n        Do not connect the virtual motor\n",
+			name, SIM_TCP_PORT_DEFAULT, (double)model.load, (double)model.J, (double)model.vbus);
+}
+
+// Runs after host_hal.c has mapped the hardware
+__attribute__((constructor(103)))
+static void sim_hw_args(int argc, char **argv) {
+	int opt;
+
+	while ((opt = getopt(argc, argv, "t:pf:s:r:l:J:v:nh")) != -1) {
+		switch (opt) {
+		case 't': tcp_port = atoi(optarg); break;
+		case 'p': use_pty = true; break;
+		case 'f': flash_file = optarg; break;
+		case 's': script_file = optarg; break;
+		case 'r': record_ms = atoi(optarg); break;
+		case 'l': model.load = atof(optarg); break;
+		case 'J': model.J = atof(optarg); break;
+		case 'v': model.vbus = atof(optarg); break;
+		case 'n': use_virtual_motor = false; break;
+		default:
+			usage(argv[0]);
+			exit(opt == 'h' ? 0 : 1);
+		}
+	}
+
+	if (flash_file) {
+		map_flash_file(flash_file);
+	}
+}
+
+/**
+ * Called first thing from main, before the kernel is initialized.
+ */
+void halInit(void) {
+	// The image is not in the simulated flash, so mark its CRC as computed and
+	// place a zero CRC word at the end. The checksum of the region then comes
+	// out as zero, like for a correctly flashed image.
+	volatile uint32_t *app_end = (volatile uint32_t*)FLASH_APP_END;
+	app_end[-2] = 0;
+	app_end[-1] = 0;
+
+	// The DRV8302 fault output and the I2C bus are pulled up. Nothing is
+	// connected to the bus, so the bit-banged transfers are not acknowledged.
+	GPIOC->IDR |= 1U << 12;
+#ifdef HW_I2C_SCL_PORT
+	HW_I2C_SCL_PORT->IDR |= 1U << HW_I2C_SCL_PIN;
+	HW_I2C_SDA_PORT->IDR |= 1U << HW_I2C_SDA_PIN;
+#endif
+
+	// Idle ADC readings until the virtual motor is connected
+	ADC_Value[ADC_IND_CURR1] = 2048;
+	ADC_Value[ADC_IND_CURR2] = 2048;
+#ifdef ADC_IND_CURR3
+	ADC_Value[ADC_IND_CURR3] = 2048;
+#endif
+	ADC_Value[ADC_IND_VIN_SENS] = model.vbus * VOLTAGE_TO_ADC_FACTOR;
+	ADC_Value[ADC_IND_TEMP_MOS] = 2048;
+	ADC_Value[ADC_IND_TEMP_MOTOR] = 2048;
+}
+
+/**
+ * Start the simulated interrupts, the packet interface and the simulator
+ * thread. Called from chSysInit.
+ */
+void sim_hw_start(void) {
+	pthread_t tp;
+	if (pthread_create(&tp, NULL, isr_thread, NULL) != 0) {
+		chSysHalt("could not start the interrupt thread");
+	}
+
+	sim_comm_init(tcp_port, use_pty);
+
+	chThdCreateStatic(sim_thread_wa, sizeof(sim_thread_wa), NORMALPRIO, sim_thread, NULL);
+}
+
+static THD_FUNCTION(sim_thread, arg) {
+	(void)arg;
+
+	chRegSetThreadName("sim");
+
+	terminal_register_command_callback(
+			"sim_trigger",
+			"Press (1) or release (0) the trigger.",
+			"[pressed]",
+			terminal_cmd_trigger);
+
+	terminal_register_command_callback(
+			"sim_load",
+			"Set the load torque of the virtual motor.",
+			"[Nm]",
+			terminal_cmd_load);
+
+	terminal_register_command_callback(
+			"sim_vbus",
+			"Set the bus voltage.",
+			"[volts]",
+			terminal_cmd_vbus);
+
+	terminal_register_command_callback(
+			"sim_print",
+			"Print the motor state to stdout of the simulator.",
+			0,
+			terminal_cmd_print);
+
+	terminal_register_command_callback(
+			"sim_quit",
+			"Exit the simulator.",
+			"[code]",
+			terminal_cmd_quit);
+
+	// Let the motor control finish its calibration before the virtual motor
+	// takes over the ADC.
+	chThdSleepMilliseconds(SIM_CONNECT_DELAY_MS);
+
+	if (use_virtual_motor) {
+		connect_motor();
+	}
+
+	if (record_ms > 0) {
+		chThdCreateStatic(record_thread_wa, sizeof(record_thread_wa), NORMALPRIO, record_thread, NULL);
+	}
+
+	if (script_file) {
+		run_script(script_file);
+	}
+
+	for (;;) {
+		chThdSleepMilliseconds(1000);
+	}
+}
+
+static THD_FUNCTION(record_thread, arg) {
+	(void)arg;
+
+	chRegSetThreadName("sim record");
+
+	printf("time_s,state,erpm,current,current_in,duty,v_in,temp_fet,fault\n");
+
+	systime_t time = chVTGetSystemTimeX();
+	for (;;) {
+		print_state();
+		time += MS2ST(record_ms);
+		chThdSleepUntil(time);
+	}
+}
+
+/*
+ * The motor control interrupts, at the rate the PWM timer is set up for, and
+ * the system tick. This runs next to the firmware threads and catches up with
+ * the real time every SIM_TICK_US.
+ */
+static void *isr_thread(void *arg) {
+	(void)arg;
+
+	pthread_setname_np(pthread_self(), "isr");
+
+	uint64_t next = sim_os_time_ns();
+	for (;;) {
+		next += SIM_TICK_US * 1000;
+		sim_os_sleep_until_ns(next);
+
+		uint64_t now = sim_os_time_ns();
+		if (now > next + SIM_ISR_CATCHUP_MAX_MS * 1000000ULL) {
+			next = now;
+		}
+
+		chSysLock();
+
+		// NVIC_SystemReset
+		if (SCB->AIRCR & SCB_AIRCR_SYSRESETREQ_Msk) {
+			sim_os_reset("system reset");
+		}
+
+		// The PWM timer counts up and down between 0 and ARR at the core
+		// clock, and the sample interrupt comes at both ends. The time is
+		// kept in integer cycles, so that it does not drift.
+		uint32_t top = TIM1->ARR;
+		uint64_t now_cycles = scale_time(now, SYSTEM_CORE_CLOCK, 1000000000ULL);
+		if ((TIM1->CR1 & TIM_CR1_CEN) && top > 0) {
+			uint64_t catchup_cycles = (uint64_t)SIM_ISR_CATCHUP_MAX_MS * (SYSTEM_CORE_CLOCK / 1000);
+
+			if (now_cycles - pwm_time_cycles > catchup_cycles) {
+				pwm_time_cycles = now_cycles - catchup_cycles;
+			}
+
+			while (pwm_time_cycles + top <= now_cycles) {
+				pwm_time_cycles += top;
+				// TIM5 runs at 10 MHz
+				TIM5->CNT = (uint32_t)scale_time(pwm_time_cycles, 10000000ULL, SYSTEM_CORE_CLOCK);
+				pwm_sample_int();
+			}
+		} else {
+			pwm_time_cycles = now_cycles;
+		}
+
+		// TIM5 runs at 10 MHz
+		TIM5->CNT = (uint32_t)(now / 100);
+
+		sim_os_tick();
+
+		chSysUnlock();
+	}
+
+	return NULL;
+}
+
+static void pwm_sample_int(void) {
+	TIM1->CR1 ^= TIM_CR1_DIR;
+
+	if (host_nvic_is_enabled(TIM2_IRQn)) {
+		TIM2->SR |= TIM_IT_CC2;
+		TIM2_IRQHandler();
+	}
+
+	// The ADC conversion is triggered by the timer, unless the virtual motor
+	// has taken over the sampling.
+	const stm32_dma_stream_t *adc_dma = STM32_DMA_STREAM(STM32_DMA_STREAM_ID(2, 4));
+	if ((ADC1->CR2 & ADC_CR2_EXTEN) && adc_dma->func) {
+		adc_dma->func(adc_dma->param, 0);
+	}
+}
+
+/*
+ * time * mul / div without overflowing, as long as mul * div fits.
+ */
+static uint64_t scale_time(uint64_t time, uint64_t mul, uint64_t div) {
+	return (time / div) * mul + (time % div) * mul / div;
+}
+
+static void map_flash_file(const char *path) {
+	int fd = open(path, O_RDWR | O_CREAT, 0644);
+	struct stat st;
+
+	if (fd < 0 || fstat(fd, &st) != 0) {
+		fprintf(stderr, "sim: could not open %s: %s\n", path, strerror(errno));
+		exit(1);
+	}
+
+	if (st.st_size < FLASH_SIZE) {
+		// New file, start with erased flash
+		static uint8_t erased[4096];
+		memset(erased, 0xFF, sizeof(erased));
+		for (off_t ofs = st.st_size;ofs < FLASH_SIZE;ofs += sizeof(erased)) {
+			if (pwrite(fd, erased, sizeof(erased), ofs) != sizeof(erased)) {
+				fprintf(stderr, "sim: could not write %s\n", path);
+				exit(1);
+			}
+		}
+	}
+
+	void *p = mmap((void*)FLASH_BASE_ADDR, FLASH_SIZE, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_FIXED, fd, 0);
+	if (p == MAP_FAILED) {
+		fprintf(stderr, "sim: could not map %s: %s\n", path, strerror(errno));
+		exit(1);
+	}
+
+	close(fd);
+}
+
+/*
+ * Connect the virtual motor with the parameters from the motor configuration,
+ * or update the model when it is connected already. The inductance and
+ * resistance are scaled like in tests/foc_bench.
+ */
+static void connect_motor(void) {
+	const volatile mc_configuration *conf = mc_interface_get_configuration();
+	char cmd[SCRIPT_LINE_MAX];
+
+	// ml J Ld Lq Rs lambda Vbus
+	snprintf(cmd, sizeof(cmd), "connect_virtual_motor %f %f %f %f %f %f %f",
+			(double)model.load, (double)model.J,
+			(double)(conf->foc_motor_l * (3.0 / 2.0)),
+			(double)(conf->foc_motor_l * (3.0 / 2.0)),
+			(double)(conf->foc_motor_r * (3.0 / 2.0)),
+			(double)conf->foc_motor_flux_linkage,
+			(double)model.vbus);
+	terminal_process_string(cmd);
+
+	ADC_Value[ADC_IND_VIN_SENS] = model.vbus * VOLTAGE_TO_ADC_FACTOR;
+}
+
+static void run_script(const char *path) {
+	FILE *f = fopen(path, "r");
+	if (!f) {
+		fprintf(stderr, "sim: could not open %s: %s\n", path, strerror(errno));
+		return;
+	}
+
+	char line[SCRIPT_LINE_MAX];
+	int line_num = 0;
+
+	while (fgets(line, sizeof(line), f)) {
+		line_num++;
+		line[strcspn(line, "\r\n#")] = '\0';
+
+		char *cmd = line;
+		double time = strtod(line, &cmd);
+		cmd += strspn(cmd, " \t");
+
+		if (line[strspn(line, " \t")] == '\0') {
+			continue;
+		}
+
+		if (cmd == line || cmd[0] == '\0') {
+			fprintf(stderr, "sim: %s:%d: expected '<time_s> <command>'\n", path, line_num);
+			continue;
+		}
+
+		chThdSleepUntil((systime_t)(time * CH_CFG_ST_FREQUENCY));
+		terminal_process_string(cmd);
+	}
+
+	fclose(f);
+}
+
+static void print_state(void) {
+	printf("%.3f,%d,%.1f,%.2f,%.2f,%.3f,%.2f,%.1f,%s\n",
+			(double)chVTGetSystemTimeX() / (double)CH_CFG_ST_FREQUENCY,
+			mc_interface_get_state(),
+			(double)mc_interface_get_rpm(),
+			(double)mc_interface_get_tot_current_filtered(),
+			(double)mc_interface_get_tot_current_in_filtered(),
+			(double)mc_interface_get_duty_cycle_now(),
+			(double)GET_INPUT_VOLTAGE(),
+			(double)mc_interface_temp_fet_filtered(),
+			mc_interface_fault_to_string(mc_interface_get_fault()));
+	fflush(stdout);
+}
+
+static void terminal_cmd_trigger(int argc, const char **argv) {
+	if (argc == 2) {
+		if (atoi(argv[1])) {
+			HW_ICU_GPIO->IDR |= 1U << HW_ICU_PIN;
+		} else {
+			HW_ICU_GPIO->IDR &= ~(1U << HW_ICU_PIN);
+		}
+	} else {
+		commands_printf("This command requires one argument.\n");
+	}
+}
+
+static void terminal_cmd_load(int argc, const char **argv) {
+	if (argc == 2) {
+		model.load = atof(argv[1]);
+		connect_motor();
+	} else {
+		commands_printf("This command requires one argument.\n");
+	}
+}
+
+static void terminal_cmd_vbus(int argc, const char **argv) {
+	if (argc == 2) {
+		model.vbus = atof(argv[1]);
+		connect_motor();
+	} else {
+		commands_printf("This command requires one argument.\n");
+	}
+}
+
+static void terminal_cmd_print(int argc, const char **argv) {
+	(void)argc;
+	(void)argv;
+	print_state();
+}
+
+static void terminal_cmd_quit(int argc, const char **argv) {
+	// The other threads keep running, so skip the exit handlers
+	fflush(stdout);
+	fflush(stderr);
+	_exit(argc == 2 ? atoi(argv[1]) : 0);
+}
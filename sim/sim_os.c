@@ -0,0 +1,602 @@
+/*
+	Copyright 2026 agent	agent@local
+
+	This file is part of the VESC firmware.
+
+	The VESC firmware is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    The VESC firmware is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sched.h>
+#include <limits.h>
+
+#include "ch.h"
+#include "sim.h"
+
+// Private variables
+// Held by the firmware thread that is running
+static pthread_mutex_t kernel_lock = PTHREAD_MUTEX_INITIALIZER;
+// System lock, held by chSysLock and by the simulated interrupts
+static pthread_mutex_t sys_lock = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
+// Signaled on mutex unlock, mailbox changes and thread exit
+static pthread_cond_t obj_cond;
+static pthread_condattr_t cond_attr;
+static struct timespec time_start;
+static thread_t main_thread;
+static thread_t isr_thread;
+static thread_t *reg_last = &main_thread;
+static virtual_timer_t *vt_list = NULL;
+static __thread thread_t *self = NULL;
+static char **sim_argv;
+static char sim_exe[PATH_MAX];
+
+// Private functions
+static void thread_init(thread_t *tp, const char *name, tprio_t prio);
+static void *thread_entry(void *arg);
+static bool wait_s(pthread_cond_t *cond, const struct timespec *deadline);
+static void deadline_from_now(struct timespec *ts, systime_t time);
+static void update_cpu_time(thread_t *tp);
+
+__attribute__((constructor(102)))
+static void sim_os_early_init(int argc, char **argv) {
+	(void)argc;
+	sim_argv = argv;
+	if (readlink("/proc/self/exe", sim_exe, sizeof(sim_exe) - 1) < 0) {
+		strcpy(sim_exe, argv[0]);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &time_start);
+
+	pthread_condattr_init(&cond_attr);
+	pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&obj_cond, &cond_attr);
+}
+
+// System
+void chSysInit(void) {
+	thread_init(&main_thread, "main", NORMALPRIO);
+	main_thread.sim_thread = pthread_self();
+	main_thread.p_state = CH_STATE_CURRENT;
+	self = &main_thread;
+
+	thread_init(&isr_thread, "isr", HIGHPRIO);
+
+	pthread_mutex_lock(&kernel_lock);
+	sim_hw_start();
+}
+
+void chSysHalt(const char *reason) {
+	fprintf(stderr, "sim: halted: %s\n", reason);
+	exit(1);
+}
+
+/**
+ * On the target this is only done before jumping to the bootloader, which
+ * ends with a reset.
+ */
+void chSysDisable(void) {
+	sim_os_reset("jump to bootloader");
+}
+
+void chSysLock(void) {
+	pthread_mutex_lock(&sys_lock);
+}
+
+void chSysUnlock(void) {
+	pthread_mutex_unlock(&sys_lock);
+}
+
+systime_t chVTGetSystemTimeX(void) {
+	return (systime_t)(sim_os_time_ns() / (1000000000ULL / CH_CFG_ST_FREQUENCY));
+}
+
+// Virtual timers
+void chVTObjectInit(virtual_timer_t *vtp) {
+	memset(vtp, 0, sizeof(virtual_timer_t));
+}
+
+void chVTSet(virtual_timer_t *vtp, systime_t delay, vtfunc_t vtfunc, void *par) {
+	chSysLock();
+	chVTSetI(vtp, delay, vtfunc, par);
+	chSysUnlock();
+}
+
+void chVTSetI(virtual_timer_t *vtp, systime_t delay, vtfunc_t vtfunc, void *par) {
+	chVTResetI(vtp);
+	vtp->vt_time = chVTGetSystemTimeX() + delay;
+	vtp->vt_func = vtfunc;
+	vtp->vt_par = par;
+	vtp->vt_armed = true;
+	vtp->vt_next = vt_list;
+	vt_list = vtp;
+}
+
+void chVTReset(virtual_timer_t *vtp) {
+	chSysLock();
+	chVTResetI(vtp);
+	chSysUnlock();
+}
+
+void chVTResetI(virtual_timer_t *vtp) {
+	if (!vtp->vt_armed) {
+		return;
+	}
+
+	for (virtual_timer_t **p = &vt_list;*p;p = &(*p)->vt_next) {
+		if (*p == vtp) {
+			*p = vtp->vt_next;
+			break;
+		}
+	}
+
+	vtp->vt_armed = false;
+}
+
+// Threads
+thread_t *chThdCreateStatic(void *wsp, size_t size, tprio_t prio, void (*pf)(void *), void *arg) {
+	thread_t *tp = calloc(1, sizeof(thread_t));
+	thread_init(tp, "noname", prio);
+	tp->p_ctx.r13 = (uint32_t)(uintptr_t)((uint8_t*)wsp + size);
+	tp->sim_func = pf;
+	tp->sim_arg = arg;
+
+	chSysLock();
+	reg_last->p_newer = tp;
+	reg_last = tp;
+	chSysUnlock();
+
+	if (pthread_create(&tp->sim_thread, NULL, thread_entry, tp) != 0) {
+		chSysHalt("could not create thread");
+	}
+
+	return tp;
+}
+
+thread_t *chThdGetSelfX(void) {
+	return self ? self : &isr_thread;
+}
+
+void chThdSleep(systime_t time) {
+	struct timespec ts;
+	deadline_from_now(&ts, time);
+
+	self->p_state = CH_STATE_SLEEPING;
+	pthread_mutex_unlock(&kernel_lock);
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {}
+	pthread_mutex_lock(&kernel_lock);
+	self->p_state = CH_STATE_CURRENT;
+}
+
+void chThdSleepUntil(systime_t time) {
+	systime_t diff = time - chVTGetSystemTimeX();
+	if (diff > 0 && diff < 0x80000000) {
+		chThdSleep(diff);
+	}
+}
+
+void chThdYield(void) {
+	pthread_mutex_unlock(&kernel_lock);
+	sched_yield();
+	pthread_mutex_lock(&kernel_lock);
+}
+
+void chThdTerminate(thread_t *tp) {
+	chSysLock();
+	tp->p_terminate = true;
+	chSysUnlock();
+}
+
+bool chThdShouldTerminateX(void) {
+	return self->p_terminate;
+}
+
+msg_t chThdWait(thread_t *tp) {
+	self->p_state = CH_STATE_WTEXIT;
+	pthread_mutex_unlock(&kernel_lock);
+	pthread_join(tp->sim_thread, NULL);
+	pthread_mutex_lock(&kernel_lock);
+	self->p_state = CH_STATE_CURRENT;
+
+	chSysLock();
+	for (thread_t *p = &main_thread;p;p = p->p_newer) {
+		if (p->p_newer == tp) {
+			p->p_newer = tp->p_newer;
+			if (reg_last == tp) {
+				reg_last = p;
+			}
+			break;
+		}
+	}
+	chSysUnlock();
+
+	pthread_cond_destroy(&tp->sim_cond);
+	free(tp);
+
+	return MSG_OK;
+}
+
+void chThdExit(msg_t msg) {
+	(void)msg;
+
+	chSysLock();
+	self->p_state = CH_STATE_FINAL;
+	pthread_cond_broadcast(&obj_cond);
+	chSysUnlock();
+
+	pthread_mutex_unlock(&kernel_lock);
+	pthread_exit(NULL);
+}
+
+void chRegSetThreadName(const char *name) {
+	char buf[16];
+	strncpy(buf, name, sizeof(buf) - 1);
+	buf[sizeof(buf) - 1] = '\0';
+	pthread_setname_np(pthread_self(), buf);
+	self->p_name = name;
+}
+
+thread_t *chRegFirstThread(void) {
+	update_cpu_time(&main_thread);
+	return &main_thread;
+}
+
+thread_t *chRegNextThread(thread_t *tp) {
+	chSysLock();
+	tp = tp->p_newer;
+	while (tp && tp->p_state == CH_STATE_FINAL) {
+		tp = tp->p_newer;
+	}
+	chSysUnlock();
+
+	if (tp) {
+		update_cpu_time(tp);
+	}
+
+	return tp;
+}
+
+// Mutexes
+void chMtxObjectInit(mutex_t *mp) {
+	mp->m_owner = NULL;
+}
+
+void chMtxLock(mutex_t *mp) {
+	chSysLock();
+	while (mp->m_owner) {
+		self->p_state = CH_STATE_WTMTX;
+		wait_s(&obj_cond, NULL);
+	}
+	mp->m_owner = self;
+	self->p_state = CH_STATE_CURRENT;
+	chSysUnlock();
+}
+
+bool chMtxTryLock(mutex_t *mp) {
+	bool res = false;
+
+	chSysLock();
+	if (!mp->m_owner) {
+		mp->m_owner = self;
+		res = true;
+	}
+	chSysUnlock();
+
+	return res;
+}
+
+void chMtxUnlock(mutex_t *mp) {
+	chSysLock();
+	mp->m_owner = NULL;
+	pthread_cond_broadcast(&obj_cond);
+	chSysUnlock();
+}
+
+// Events
+void chEvtRegisterMaskWithFlags(event_source_t *esp, event_listener_t *elp,
+		eventmask_t events, eventflags_t wflags) {
+	chSysLock();
+	elp->el_next = esp->es_next;
+	elp->el_listener = self;
+	elp->el_events = events;
+	elp->el_flags = 0;
+	elp->el_wflags = wflags;
+	esp->es_next = elp;
+	chSysUnlock();
+}
+
+void chEvtUnregister(event_source_t *esp, event_listener_t *elp) {
+	chSysLock();
+	for (event_listener_t **p = &esp->es_next;*p;p = &(*p)->el_next) {
+		if (*p == elp) {
+			*p = elp->el_next;
+			break;
+		}
+	}
+	chSysUnlock();
+}
+
+void chEvtBroadcastFlags(event_source_t *esp, eventflags_t flags) {
+	chSysLock();
+	chEvtBroadcastFlagsI(esp, flags);
+	chSysUnlock();
+}
+
+void chEvtBroadcastFlagsI(event_source_t *esp, eventflags_t flags) {
+	for (event_listener_t *elp = esp->es_next;elp;elp = elp->el_next) {
+		elp->el_flags |= flags;
+		if (flags == 0 || (elp->el_flags & elp->el_wflags) != 0) {
+			chEvtSignalI(elp->el_listener, elp->el_events);
+		}
+	}
+}
+
+eventflags_t chEvtGetAndClearFlags(event_listener_t *elp) {
+	chSysLock();
+	eventflags_t flags = elp->el_flags;
+	elp->el_flags = 0;
+	chSysUnlock();
+	return flags;
+}
+
+void chEvtSignal(thread_t *tp, eventmask_t events) {
+	chSysLock();
+	chEvtSignalI(tp, events);
+	chSysUnlock();
+}
+
+void chEvtSignalI(thread_t *tp, eventmask_t events) {
+	tp->p_epending |= events;
+	pthread_cond_signal(&tp->sim_cond);
+}
+
+eventmask_t chEvtGetAndClearEvents(eventmask_t events) {
+	chSysLock();
+	eventmask_t m = self->p_epending & events;
+	self->p_epending &= ~m;
+	chSysUnlock();
+	return m;
+}
+
+eventmask_t chEvtWaitAnyTimeout(eventmask_t events, systime_t time) {
+	struct timespec ts;
+	deadline_from_now(&ts, time);
+
+	chSysLock();
+	self->p_state = CH_STATE_WTOREVT;
+	while (!(self->p_epending & events)) {
+		if (time == TIME_IMMEDIATE ||
+				!wait_s(&self->sim_cond, time == TIME_INFINITE ? NULL : &ts)) {
+			break;
+		}
+	}
+	self->p_state = CH_STATE_CURRENT;
+
+	eventmask_t m = self->p_epending & events;
+	self->p_epending &= ~m;
+	chSysUnlock();
+
+	return m;
+}
+
+// Mailboxes
+void chMBObjectInit(mailbox_t *mbp, msg_t *buf, cnt_t n) {
+	mbp->mb_buffer = buf;
+	mbp->mb_size = n;
+	mbp->mb_rd = 0;
+	mbp->mb_cnt = 0;
+}
+
+msg_t chMBPost(mailbox_t *mbp, msg_t msg, systime_t timeout) {
+	struct timespec ts;
+	deadline_from_now(&ts, timeout);
+
+	chSysLock();
+	msg_t res = MSG_OK;
+	while (mbp->mb_cnt >= mbp->mb_size) {
+		if (timeout == TIME_IMMEDIATE ||
+				!wait_s(&obj_cond, timeout == TIME_INFINITE ? NULL : &ts)) {
+			res = MSG_TIMEOUT;
+			break;
+		}
+	}
+
+	if (res == MSG_OK) {
+		res = chMBPostI(mbp, msg);
+	}
+	chSysUnlock();
+
+	return res;
+}
+
+msg_t chMBPostI(mailbox_t *mbp, msg_t msg) {
+	if (mbp->mb_cnt >= mbp->mb_size) {
+		return MSG_TIMEOUT;
+	}
+
+	mbp->mb_buffer[(mbp->mb_rd + mbp->mb_cnt) % mbp->mb_size] = msg;
+	mbp->mb_cnt++;
+	pthread_cond_broadcast(&obj_cond);
+
+	return MSG_OK;
+}
+
+msg_t chMBFetch(mailbox_t *mbp, msg_t *msgp, systime_t timeout) {
+	struct timespec ts;
+	deadline_from_now(&ts, timeout);
+
+	chSysLock();
+	msg_t res = MSG_OK;
+	self->p_state = CH_STATE_WTMSG;
+	while (mbp->mb_cnt == 0) {
+		if (timeout == TIME_IMMEDIATE ||
+				!wait_s(&obj_cond, timeout == TIME_INFINITE ? NULL : &ts)) {
+			res = MSG_TIMEOUT;
+			break;
+		}
+	}
+	self->p_state = CH_STATE_CURRENT;
+
+	if (res == MSG_OK) {
+		*msgp = mbp->mb_buffer[mbp->mb_rd];
+		mbp->mb_rd = (mbp->mb_rd + 1) % mbp->mb_size;
+		mbp->mb_cnt--;
+		pthread_cond_broadcast(&obj_cond);
+	}
+	chSysUnlock();
+
+	return res;
+}
+
+// Simulator interface
+/**
+ * Time since the simulator was started.
+ *
+ * @return
+ * The time in nanoseconds.
+ */
+uint64_t sim_os_time_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)(ts.tv_sec - time_start.tv_sec) * 1000000000ULL +
+			(uint64_t)(ts.tv_nsec - time_start.tv_nsec);
+}
+
+/**
+ * Sleep until the given simulator time.
+ *
+ * @param time_ns
+ * Time in nanoseconds, as returned by sim_os_time_ns.
+ */
+void sim_os_sleep_until_ns(uint64_t time_ns) {
+	struct timespec ts;
+	uint64_t ns = (uint64_t)time_start.tv_nsec + time_ns;
+	ts.tv_sec = time_start.tv_sec + (time_t)(ns / 1000000000ULL);
+	ts.tv_nsec = (long)(ns % 1000000000ULL);
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {}
+}
+
+/**
+ * Run the virtual timers that have expired. Called from the simulated system
+ * tick with the system lock held.
+ */
+void sim_os_tick(void) {
+	systime_t now = chVTGetSystemTimeX();
+
+	for (;;) {
+		virtual_timer_t *vtp = vt_list;
+		while (vtp && (systime_t)(now - vtp->vt_time) >= 0x80000000) {
+			vtp = vtp->vt_next;
+		}
+
+		if (!vtp) {
+			break;
+		}
+
+		chVTResetI(vtp);
+		vtp->vt_func(vtp->vt_par);
+	}
+}
+
+/**
+ * Give up the kernel lock while the calling firmware thread waits for the
+ * host, e.g. in a blocking read. Other firmware threads run meanwhile.
+ */
+void sim_os_block_begin(void) {
+	pthread_mutex_unlock(&kernel_lock);
+}
+
+void sim_os_block_end(void) {
+	pthread_mutex_lock(&kernel_lock);
+}
+
+/**
+ * Restart the simulator like a reset restarts the MCU. The flash contents
+ * are kept when a flash file is used.
+ *
+ * @param reason
+ * Printed before restarting.
+ */
+void sim_os_reset(const char *reason) {
+	fprintf(stderr, "sim: reset (%s)\n", reason);
+	fflush(stdout);
+	execv(sim_exe, sim_argv);
+	chSysHalt("restart failed");
+}
+
+static void thread_init(thread_t *tp, const char *name, tprio_t prio) {
+	tp->p_name = name;
+	tp->p_prio = prio;
+	tp->p_refs = 1;
+	pthread_cond_init(&tp->sim_cond, &cond_attr);
+}
+
+static void *thread_entry(void *arg) {
+	thread_t *tp = (thread_t*)arg;
+
+	self = tp;
+	pthread_mutex_lock(&kernel_lock);
+	tp->p_state = CH_STATE_CURRENT;
+	tp->sim_func(tp->sim_arg);
+	chThdExit(MSG_OK);
+
+	return NULL;
+}
+
+/*
+ * Wait for cond with the system lock held once, giving up the kernel lock
+ * meanwhile. The kernel lock is taken before the system lock again, which is
+ * the order everywhere. Returns false on timeout.
+ */
+static bool wait_s(pthread_cond_t *cond, const struct timespec *deadline) {
+	int res;
+
+	pthread_mutex_unlock(&kernel_lock);
+	if (deadline) {
+		res = pthread_cond_timedwait(cond, &sys_lock, deadline);
+	} else {
+		res = pthread_cond_wait(cond, &sys_lock);
+	}
+	pthread_mutex_unlock(&sys_lock);
+	pthread_mutex_lock(&kernel_lock);
+	pthread_mutex_lock(&sys_lock);
+
+	return res != ETIMEDOUT;
+}
+
+static void deadline_from_now(struct timespec *ts, systime_t time) {
+	uint64_t ns = (uint64_t)time * (1000000000ULL / CH_CFG_ST_FREQUENCY);
+	clock_gettime(CLOCK_MONOTONIC, ts);
+	ts->tv_sec += ns / 1000000000ULL;
+	ts->tv_nsec += ns % 1000000000ULL;
+	if (ts->tv_nsec >= 1000000000L) {
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000L;
+	}
+}
+
+static void update_cpu_time(thread_t *tp) {
+	clockid_t cid;
+	struct timespec ts;
+
+	if (tp->p_state != CH_STATE_FINAL &&
+			pthread_getcpuclockid(tp->sim_thread, &cid) == 0 &&
+			clock_gettime(cid, &ts) == 0) {
+		tp->p_time = (systime_t)(ts.tv_sec * CH_CFG_ST_FREQUENCY +
+				ts.tv_nsec / (1000000000L / CH_CFG_ST_FREQUENCY));
+	}
+}
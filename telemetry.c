@@ -0,0 +1,305 @@
+/*
+	Copyright 2026 agent	agent@local
+
+	This file is part of the VESC firmware.
+
+	The VESC firmware is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    The VESC firmware is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+#include "telemetry.h"
+#include "ch.h"
+#include "hal.h"
+#include "datatypes.h"
+#include "mc_interface.h"
+#include "app.h"
+#include "buffer.h"
+#include "packet.h"
+
+// Defines
+#define FIELDS_ALL				(((uint32_t)1 << 21) - 1)
+#define VALUES_MAX				23 // Field 18 has three values
+#define RECORD_MAX_LEN			(5 + 5 * VALUES_MAX)
+#define RING_MASK				(TELEMETRY_RING_LEN - 1)
+
+// Private types
+typedef struct {
+	systime_t time;
+	uint32_t mask;
+	int num;
+	int32_t values[VALUES_MAX];
+} telemetry_record;
+
+// Private variables
+static telemetry_record m_ring[TELEMETRY_RING_LEN];
+static volatile unsigned int m_ring_write; // Only written by telemetry_sample
+static volatile unsigned int m_ring_read; // Only written by the telemetry thread
+static volatile uint32_t m_dropped;
+static volatile uint32_t m_mask;
+static volatile int m_interval; // In iterations of the motor interface timer
+static int m_interval_cnt;
+static mc_snapshot m_prev; // For the averages since the previous record
+static volatile bool m_prev_valid;
+static void(* volatile m_send_func)(unsigned char *data, unsigned int len) = 0;
+static uint8_t m_send_buffer[PACKET_MAX_PL_LEN];
+
+// Threads
+static THD_WORKING_AREA(telemetry_thread_wa, 512);
+static THD_FUNCTION(telemetry_thread, arg);
+
+// Private functions
+static int sample_values(uint32_t mask, const mc_snapshot *s, const mc_snapshot *prev, int32_t *values);
+static void send_records(void);
+
+void telemetry_init(void) {
+	m_ring_write = 0;
+	m_ring_read = 0;
+	m_dropped = 0;
+	m_mask = 0;
+	m_interval = 0;
+	m_interval_cnt = 0;
+	m_prev_valid = false;
+
+	chThdCreateStatic(telemetry_thread_wa, sizeof(telemetry_thread_wa), NORMALPRIO - 1, telemetry_thread, NULL);
+}
+
+/**
+ * Subscribe to telemetry, or stop it.
+ *
+ * @param mask
+ * The fields to send, same as for COMM_GET_VALUES_SELECTIVE.
+ *
+ * @param rate_hz
+ * The number of records per second. 0 stops the telemetry.
+ *
+ * @param send_func
+ * The function to send the records with.
+ *
+ * @return
+ * The record rate that will be used. The records are taken from the motor
+ * snapshots, so the interval is rounded to a whole number of snapshot
+ * intervals.
+ */
+int telemetry_subscribe(uint32_t mask, int rate_hz,
+		void(*send_func)(unsigned char *data, unsigned int len)) {
+	mask &= FIELDS_ALL;
+
+	if (rate_hz <= 0 || mask == 0) {
+		m_interval = 0;
+		return 0;
+	}
+
+	int interval = MC_INTERFACE_TIMER_RATE / rate_hz;
+	interval -= interval % MC_INTERFACE_SNAPSHOT_INTERVAL;
+	if (interval < MC_INTERFACE_SNAPSHOT_INTERVAL) {
+		interval = MC_INTERFACE_SNAPSHOT_INTERVAL;
+	}
+
+	m_send_func = send_func;
+	m_mask = mask;
+	m_prev_valid = false;
+	m_dropped = 0;
+	m_interval = interval;
+
+	return MC_INTERFACE_TIMER_RATE / interval;
+}
+
+/**
+ * Sample the subscribed fields into the ring buffer. Has to be called from
+ * the motor interface timer thread, with motor 1 selected.
+ */
+void telemetry_sample(void) {
+	int interval = m_interval;
+
+	if (interval == 0) {
+		m_interval_cnt = 0;
+		return;
+	}
+
+	m_interval_cnt++;
+	if (m_interval_cnt < interval) {
+		return;
+	}
+	m_interval_cnt = 0;
+
+	unsigned int write = m_ring_write;
+
+	// The count is sent with every packet, so the receiver knows about gaps
+	if ((write - m_ring_read) >= TELEMETRY_RING_LEN) {
+		m_dropped++;
+		return;
+	}
+
+	// The averages are since the previous record, like COMM_GET_VALUES does
+	// since the previous request
+	mc_snapshot s;
+	mc_interface_get_snapshot(&s);
+
+	telemetry_record *rec = &m_ring[write & RING_MASK];
+	rec->time = s.time;
+	rec->mask = m_mask;
+	rec->num = sample_values(rec->mask, &s, m_prev_valid ? &m_prev : 0, rec->values);
+
+	m_prev = s;
+	m_prev_valid = true;
+
+	// Make sure that the record is complete before the consumer can see it
+	__DMB();
+	m_ring_write = write + 1;
+}
+
+static int32_t quantize(float value, float scale) {
+	return (int32_t)(value * scale);
+}
+
+/*
+ * The values of COMM_GET_VALUES_SELECTIVE, from the same sources and with the
+ * same scales.
+ */
+static int sample_values(uint32_t mask, const mc_snapshot *s, const mc_snapshot *prev, int32_t *values) {
+	int n = 0;
+
+	if (mask & ((uint32_t)1 << 0)) {
+		values[n++] = quantize(s->temp_fet, 1e1);
+	}
+	if (mask & ((uint32_t)1 << 1)) {
+		values[n++] = quantize(s->temp_motor, 1e1);
+	}
+	if (mask & ((uint32_t)1 << 2)) {
+		values[n++] = quantize(mc_interface_snapshot_avg(s, prev, MC_AVG_CURRENT_MOTOR), 1e2);
+	}
+	if (mask & ((uint32_t)1 << 3)) {
+		values[n++] = quantize(mc_interface_snapshot_avg(s, prev, MC_AVG_CURRENT_IN), 1e2);
+	}
+	if (mask & ((uint32_t)1 << 4)) {
+		values[n++] = quantize(mc_interface_snapshot_avg(s, prev, MC_AVG_ID), 1e2);
+	}
+	if (mask & ((uint32_t)1 << 5)) {
+		values[n++] = quantize(mc_interface_snapshot_avg(s, prev, MC_AVG_IQ), 1e2);
+	}
+	if (mask & ((uint32_t)1 << 6)) {
+		values[n++] = quantize(s->duty_now, 1e3);
+	}
+	if (mask & ((uint32_t)1 << 7)) {
+		values[n++] = quantize(s->rpm, 1e0);
+	}
+	if (mask & ((uint32_t)1 << 8)) {
+		values[n++] = quantize(s->v_in, 1e1);
+	}
+	if (mask & ((uint32_t)1 << 9)) {
+		values[n++] = quantize(s->amp_hours, 1e4);
+	}
+	if (mask & ((uint32_t)1 << 10)) {
+		values[n++] = quantize(s->amp_hours_charged, 1e4);
+	}
+	if (mask & ((uint32_t)1 << 11)) {
+		values[n++] = quantize(s->watt_hours, 1e4);
+	}
+	if (mask & ((uint32_t)1 << 12)) {
+		values[n++] = quantize(s->watt_hours_charged, 1e4);
+	}
+	if (mask & ((uint32_t)1 << 13)) {
+		values[n++] = s->tachometer;
+	}
+	if (mask & ((uint32_t)1 << 14)) {
+		values[n++] = s->tachometer_abs;
+	}
+	if (mask & ((uint32_t)1 << 15)) {
+		values[n++] = s->fault;
+	}
+	if (mask & ((uint32_t)1 << 16)) {
+		values[n++] = quantize(s->position, 1e6);
+	}
+	if (mask & ((uint32_t)1 << 17)) {
+		values[n++] = app_get_configuration()->controller_id;
+	}
+	if (mask & ((uint32_t)1 << 18)) {
+		values[n++] = quantize(s->temp_mos_1, 1e1);
+		values[n++] = quantize(s->temp_mos_2, 1e1);
+		values[n++] = quantize(s->temp_mos_3, 1e1);
+	}
+	if (mask & ((uint32_t)1 << 19)) {
+		values[n++] = quantize(mc_interface_snapshot_avg(s, prev, MC_AVG_VD), 1e3);
+	}
+	if (mask & ((uint32_t)1 << 20)) {
+		values[n++] = quantize(mc_interface_snapshot_avg(s, prev, MC_AVG_VQ), 1e3);
+	}
+
+	return n;
+}
+
+/**
+ * Send as many records with the same mask as fit in one packet.
+ */
+static void send_records(void) {
+	unsigned int read = m_ring_read;
+	const unsigned int write = m_ring_write;
+	const telemetry_record *prev = &m_ring[read & RING_MASK];
+	const uint32_t mask = prev->mask;
+
+	int32_t ind = 0;
+	m_send_buffer[ind++] = COMM_TELEMETRY_DATA;
+	buffer_append_uint32(m_send_buffer, mask, &ind);
+	buffer_append_uint32(m_send_buffer, m_dropped, &ind);
+	int32_t count_ind = ind++;
+	buffer_append_uint32(m_send_buffer, prev->time, &ind);
+
+	for (int i = 0;i < prev->num;i++) {
+		buffer_append_var_int32(m_send_buffer, prev->values[i], &ind);
+	}
+
+	read++;
+	int count = 1;
+
+	while (read != write && count < 255 &&
+			(ind + RECORD_MAX_LEN) <= PACKET_MAX_PL_LEN) {
+		const telemetry_record *rec = &m_ring[read & RING_MASK];
+
+		if (rec->mask != mask) {
+			break;
+		}
+
+		buffer_append_var_uint32(m_send_buffer, rec->time - prev->time, &ind);
+		for (int i = 0;i < rec->num;i++) {
+			buffer_append_var_int32(m_send_buffer, rec->values[i] - prev->values[i], &ind);
+		}
+
+		prev = rec;
+		read++;
+		count++;
+	}
+
+	m_send_buffer[count_ind] = count;
+
+	// The records are copied, so their slots can be reused now
+	__DMB();
+	m_ring_read = read;
+
+	if (m_send_func) {
+		m_send_func(m_send_buffer, ind);
+	}
+}
+
+static THD_FUNCTION(telemetry_thread, arg) {
+	(void)arg;
+
+	chRegSetThreadName("Telemetry");
+
+	for(;;) {
+		while (m_ring_read != m_ring_write) {
+			send_records();
+		}
+
+		chThdSleepMilliseconds(TELEMETRY_SEND_INTERVAL_MS);
+	}
+}
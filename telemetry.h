@@ -0,0 +1,58 @@
+/*
+	Copyright 2026 agent	agent@local
+
+	This file is part of the VESC firmware.
+
+	The VESC firmware is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    The VESC firmware is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+#ifndef TELEMETRY_H_
+#define TELEMETRY_H_
+
+#include <stdint.h>
+
+/*
+ * Telemetry subscription. After COMM_TELEMETRY_SUBSCRIBE with a field mask and
+ * a rate, the fields are sampled from the motor interface timer and pushed to
+ * the subscriber as COMM_TELEMETRY_DATA packets:
+ *
+ * COMM_TELEMETRY_DATA, mask (uint32), records dropped since the subscription
+ * because the ring was full (uint32), records (uint8), time of the first
+ * record (uint32, system ticks), values of the first record, then for every
+ * further record the time since the previous record (var_uint32) followed by
+ * its values.
+ *
+ * The mask bits, sources and scales are the same as for
+ * COMM_GET_VALUES_SELECTIVE. The values are taken from the motor snapshot, and
+ * the averaged currents and voltages are over the time since the previous
+ * record. The values of the first record are var_int32, and for the further
+ * records they are var_int32 differences to the previous record.
+ */
+
+// Settings
+#ifndef TELEMETRY_RING_LEN
+#define TELEMETRY_RING_LEN			32 // Has to be a power of two
+#endif
+
+#ifndef TELEMETRY_SEND_INTERVAL_MS
+#define TELEMETRY_SEND_INTERVAL_MS	10
+#endif
+
+// Functions
+void telemetry_init(void);
+int telemetry_subscribe(uint32_t mask, int rate_hz,
+		void(*send_func)(unsigned char *data, unsigned int len));
+void telemetry_sample(void);
+
+#endif /* TELEMETRY_H_ */
@@ -37,6 +37,7 @@
 #include "comm_usb.h"
 #include "comm_usb_serial.h"
 #include "mempools.h"
+#include "isr_prof.h"
 
 #include <string.h>
 #include <stdio.h>
@@ -99,6 +100,33 @@ void terminal_process_string(char *str) {
 		commands_printf("Latest ADC duration: %.4f ms", (double)(mcpwm_get_last_adc_isr_duration() * 1000.0));
 		commands_printf("Latest injected ADC duration: %.4f ms", (double)(mc_interface_get_last_inj_adc_isr_duration() * 1000.0));
 		commands_printf("Latest sample ADC duration: %.4f ms\n", (double)(mc_interface_get_last_sample_adc_isr_duration() * 1000.0));
+	} else if (strcmp(argv[0], "isr_prof") == 0) {
+		if (argc == 2 && strcmp(argv[1], "reset") == 0) {
+			isr_prof_reset();
+			commands_printf("ISR profile reset\n");
+		} else {
+			for (int m = 0;m < ISR_PROF_MOTORS;m++) {
+				for (int i = 0;i < ISR_PROF_NUM;i++) {
+					isr_prof_stats s;
+					isr_prof_get_stats(i, m == 1, &s);
+
+					if (m == 1 && s.count == 0) {
+						continue;
+					}
+
+					commands_printf("%s%s (%u calls, period %.2f us)",
+							isr_prof_name(i), m == 1 ? ", motor 2" : "",
+							s.count, (double)(s.period_avg * 1e6));
+					commands_printf("  Duration p50 %.2f us, p99 %.2f us, max %.2f us",
+							(double)(s.duration_p50 * 1e6), (double)(s.duration_p99 * 1e6),
+							(double)(s.duration_max * 1e6));
+					commands_printf("  Jitter   p50 %.2f us, p99 %.2f us, max %.2f us",
+							(double)(s.jitter_p50 * 1e6), (double)(s.jitter_p99 * 1e6),
+							(double)(s.jitter_max * 1e6));
+				}
+			}
+			commands_printf(" ");
+		}
 	} else if (strcmp(argv[0], "kv") == 0) {
 		commands_printf("Calculated KV: %.2f rpm/volt\n", (double)mcpwm_get_kv_filtered());
 	} else if (strcmp(argv[0], "mem") == 0) {
@@ -256,18 +284,97 @@ void terminal_process_string(char *str) {
 		commands_printf("Cycle int limit running: %.2f", (double)rpm_dep.cycle_int_limit_running);
 		commands_printf("Cycle int limit max: %.2f\n", (double)rpm_dep.cycle_int_limit_max);
 	} else if (strcmp(argv[0], "can_devs") == 0) {
-		commands_printf("CAN devices seen on the bus the past second:\n");
+		commands_printf("CAN devices with status in the table:\n");
 		for (int i = 0;i < CAN_STATUS_MSGS_TO_STORE;i++) {
-			can_status_msg *msg = comm_can_get_status_msg_index(i);
-
-			if (msg->id >= 0 && UTILS_AGE_S(msg->rx_time) < 1.0) {
-				commands_printf("ID                 : %i", msg->id);
-				commands_printf("RX Time            : %i", msg->rx_time);
-				commands_printf("Age (milliseconds) : %.2f", (double)(UTILS_AGE_S(msg->rx_time) * 1000.0));
-				commands_printf("RPM                : %.2f", (double)msg->rpm);
-				commands_printf("Current            : %.2f", (double)msg->current);
-				commands_printf("Duty               : %.2f\n", (double)msg->duty);
+			can_status_node *node = comm_can_get_status_node_index(i);
+
+			if (node->id < 0) {
+				continue;
 			}
+
+			float age = UTILS_AGE_S(node->rx_time);
+			commands_printf("ID                 : %i (%s)", node->id,
+					age < (CAN_STATUS_STALE_MS / 1000.0) ? "live" : "stale");
+			commands_printf("RX Time            : %i", node->rx_time);
+			commands_printf("Age (milliseconds) : %.2f", (double)(age * 1000.0));
+
+			float rate[5];
+			for (int j = 0;j < 5;j++) {
+				rate[j] = node->rx_interval[j] > 0.0 ? 1.0 / node->rx_interval[j] : 0.0;
+			}
+			commands_printf("Rate 1-5 (Hz)      : %.1f %.1f %.1f %.1f %.1f",
+					(double)rate[0], (double)rate[1], (double)rate[2], (double)rate[3], (double)rate[4]);
+			commands_printf("Frames 1-5         : %lu %lu %lu %lu %lu",
+					node->rx_cnt[0], node->rx_cnt[1], node->rx_cnt[2], node->rx_cnt[3], node->rx_cnt[4]);
+
+			if (node->msg.id >= 0) {
+				commands_printf("RPM                : %.2f", (double)node->msg.rpm);
+				commands_printf("Current            : %.2f", (double)node->msg.current);
+				commands_printf("Duty               : %.2f", (double)node->msg.duty);
+			}
+
+			commands_printf(" ");
+		}
+
+		uint32_t rx_received, rx_dropped;
+		comm_can_get_rx_stats(&rx_received, &rx_dropped);
+		commands_printf("RX frames: %lu, dropped: %lu\n", rx_received, rx_dropped);
+	} else if (strcmp(argv[0], "can_status") == 0) {
+		if (argc >= 2) {
+			int adaptive = -1;
+			int heartbeat_ms = -1;
+			sscanf(argv[1], "%d", &adaptive);
+			if (argc >= 3) {
+				sscanf(argv[2], "%d", &heartbeat_ms);
+			}
+
+			if (adaptive == 0 || adaptive == 1) {
+				if (heartbeat_ms > CAN_STATUS_HEARTBEAT_MAX_MS) {
+					commands_printf("The heartbeat is limited to %d ms, half the stale age of "
+							"the receivers.", CAN_STATUS_HEARTBEAT_MAX_MS);
+				}
+				comm_can_set_status_adaptive(adaptive, heartbeat_ms);
+			} else {
+				commands_printf("Invalid argument(s).\n");
+			}
+		}
+
+		int heartbeat_ms = 0;
+		bool adaptive = comm_can_get_status_adaptive(&heartbeat_ms);
+		can_status_tx_stats stats[CAN_STATUS_MSG_NUM];
+		float seconds = 0.0;
+		comm_can_get_status_tx_stats(stats, &seconds);
+		float baud = (float)comm_can_baud_rate(app_get_configuration()->can_baud_rate);
+
+		if (adaptive) {
+			commands_printf("Adaptive status, heartbeat %d ms", heartbeat_ms);
+		} else {
+			commands_printf("Fixed rate status");
+		}
+
+		commands_printf("Statistics of the past %.1f s:", (double)seconds);
+
+		uint32_t bits_total = 0;
+		for (int i = 0;i < CAN_STATUS_MSG_NUM;i++) {
+			can_status_tx_stats *st = &stats[i];
+			uint32_t total = st->sent + st->skipped;
+			bits_total += st->bits;
+
+			if (total == 0 || seconds <= 0.0) {
+				continue;
+			}
+
+			commands_printf("Status %d: %.1f frames/s, %.1f %% skipped, %.2f %% bus load",
+					i + 1, (double)(st->sent / seconds),
+					(double)(100.0 * st->skipped / total),
+					(double)(baud > 0.0 ? 100.0 * st->bits / seconds / baud : 0.0));
+		}
+
+		if (seconds > 0.0 && baud > 0.0) {
+			commands_printf("Total status bus load: %.2f %%\n",
+					(double)(100.0 * bits_total / seconds / baud));
+		} else {
+			commands_printf(" ");
 		}
 	} else if (strcmp(argv[0], "foc_encoder_detect") == 0) {
 		if (argc == 2) {
@@ -491,6 +598,55 @@ void terminal_process_string(char *str) {
 		} else {
 			commands_printf("This command requires five arguments.\n");
 		}
+	} else if (strcmp(argv[0], "measure_params") == 0) {
+		if (argc == 4) {
+			float current = -1.0;
+			float duty = -1.0;
+			float erpm_per_sec = -1.0;
+			sscanf(argv[1], "%f", &current);
+			sscanf(argv[2], "%f", &duty);
+			sscanf(argv[3], "%f", &erpm_per_sec);
+
+			if (current > 0.0 && current <= mc_interface_get_configuration()->l_current_max &&
+					erpm_per_sec > 0.0 && duty > 0.02 &&
+					duty < mc_interface_get_configuration()->l_max_duty) {
+				mc_configuration *mcconf = mempools_alloc_mcconf();
+				*mcconf = *mc_interface_get_configuration();
+				mc_configuration *mcconf_old = mempools_alloc_mcconf();
+				*mcconf_old = *mc_interface_get_configuration();
+
+				mcconf->motor_type = MOTOR_TYPE_FOC;
+				mcconf->foc_sensor_mode = FOC_SENSOR_MODE_SENSORLESS;
+				mc_interface_set_configuration(mcconf);
+
+				float res, ld, lq, linkage;
+				commands_printf("Measuring motor parameters...");
+				systime_t start = chVTGetSystemTimeX();
+				bool ok = mcpwm_foc_measure_params(current, duty, erpm_per_sec, &res, &ld, &lq, &linkage);
+				float time = (float)chVTTimeElapsedSinceX(start) / (float)CH_CFG_ST_FREQUENCY;
+
+				if (ok) {
+					commands_printf(
+							"Resistance   : %.6f ohm\n"
+							"Inductance   : %.2f microhenry (Ld %.2f, Lq %.2f)\n"
+							"Flux linkage : %.7f\n"
+							"Time         : %.2f s\n",
+							(double)res, (double)((ld + lq) * 0.5e6), (double)(ld * 1e6),
+							(double)(lq * 1e6), (double)linkage, (double)time);
+				} else {
+					commands_printf("Measurement failed after %.2f s\n", (double)time);
+				}
+
+				mc_interface_set_configuration(mcconf_old);
+
+				mempools_free_mcconf(mcconf);
+				mempools_free_mcconf(mcconf_old);
+			} else {
+				commands_printf("Invalid argument(s).\n");
+			}
+		} else {
+			commands_printf("This command requires three arguments.\n");
+		}
 	} else if (strcmp(argv[0], "foc_state") == 0) {
 		mcpwm_foc_print_state();
 		commands_printf(" ");
@@ -518,6 +674,7 @@ void terminal_process_string(char *str) {
 #ifdef COMM_USE_USB
 		commands_printf("USB config events: %d", comm_usb_serial_configured_cnt());
 		commands_printf("USB write timeouts: %u", comm_usb_get_write_timeout_cnt());
+		commands_printf("USB RX buffer full: %u", comm_usb_get_rx_overflow_cnt());
 #else
 		commands_printf("USB not enabled on hardware.");
 #endif
@@ -982,6 +1139,9 @@ void terminal_process_string(char *str) {
 		commands_printf("last_adc_duration");
 		commands_printf("  The time the latest ADC interrupt consumed");
 
+		commands_printf("isr_prof [reset]");
+		commands_printf("  Duration and period jitter percentiles of the motor control interrupts");
+
 		commands_printf("kv");
 		commands_printf("  The calculated kv of the motor");
 
@@ -1018,7 +1178,14 @@ void terminal_process_string(char *str) {
 		commands_printf("  Prints some rpm-dep values");
 
 		commands_printf("can_devs");
-		commands_printf("  Prints all CAN devices seen on the bus the past second");
+		commands_printf("  Prints all CAN devices in the status table, with their state and message rates");
+
+		commands_printf("can_status [adaptive] [heartbeat_ms]");
+		commands_printf("  Prints the rate and bus load of the status messages sent from here.");
+		commands_printf("  With arguments adaptive status is enabled (1) or disabled (0) and the");
+		commands_printf("  statistics are reset. Adaptive status is only sent on changes and at");
+		commands_printf("  least every heartbeat_ms, at most %d ms.", CAN_STATUS_HEARTBEAT_MAX_MS);
+		commands_printf("  Example: can_status 1 50");
 
 		commands_printf("foc_encoder_detect [current]");
 		commands_printf("  Run the motor at 1Hz on open loop and compute encoder settings");
@@ -1045,6 +1212,11 @@ void terminal_process_string(char *str) {
 		commands_printf("  example measure_linkage 5 0.5 1000 0.076 0.000015");
 		commands_printf("  tip: measure the resistance with measure_res first");
 
+		commands_printf("measure_params [current] [duty] [erpm_per_sec]");
+		commands_printf("  Measure the resistance, Ld, Lq and the flux linkage from one excitation");
+		commands_printf("  at standstill and one openloop FOC ramp up to duty.");
+		commands_printf("  example measure_params 10 0.3 1800");
+
 		commands_printf("foc_state");
 		commands_printf("  Print some FOC state variables.");
 
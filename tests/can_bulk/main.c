@@ -0,0 +1,377 @@
+/*
+ * Loopback simulation of the windowed CAN transfers in can_bulk.c.
+ *
+ * A sender and a receiver node share a simulated 1 Mbit/s bus that delivers
+ * frames in the order they were queued and loses each frame with a given
+ * probability. The sender behaves like send_buffer_bulk in comm_can.c: it
+ * waits BULK_ACK_TIMEOUT_MS for acks after its last frame left the bus.
+ *
+ * A firmware image is sent in packets of CAN_BULK_MAX_LEN bytes, and every
+ * packet is checked on the receiver side. For comparison the old
+ * FILL_RX_BUFFER + PROCESS_RX_BUFFER transfer is run on the same bus. It
+ * cannot recover lost frames, so the packet is sent again after
+ * LEGACY_RETRY_MS, which is roughly when VESC Tool gives up waiting for a
+ * reply.
+ *
+ * Output: effective bytes/s and retransmissions for a few loss rates.
+ *
+ * Last, transfers that reuse the sender and transfer id of an earlier one
+ * are checked, as happens when the 8 bit transfer id wraps and when the
+ * sender reboots, during a transfer or after it.
+ *
+ * Usage: ./can_bulk [image size in bytes]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "can_bulk.h"
+#include "crc.h"
+
+#define BIT_RATE			1000000.0
+#define ACK_TIMEOUT_S		0.010
+#define LEGACY_RETRY_S		0.100
+#define BUS_QUEUE_LEN		1024
+#define SENDER_ID			1
+#define RECEIVER_ID			2
+#define NONCE				0x5A
+
+typedef struct {
+	uint8_t id;
+	CAN_PACKET_ID cmd;
+	uint8_t data[8];
+	uint8_t len;
+	double end;
+	bool lost;
+} bus_frame_t;
+
+typedef struct {
+	double time;
+	double bytes;
+	int packets;
+	int failed;
+	int frames;
+	int resent;
+	int timeouts;
+} sim_result_t;
+
+static bus_frame_t m_bus[BUS_QUEUE_LEN];
+static int m_bus_read = 0;
+static int m_bus_write = 0;
+static double m_bus_free = 0.0;
+static double m_now = 0.0;
+static double m_loss = 0.0;
+static double m_corrupt = 0.0;
+static uint32_t m_rand = 1;
+
+static can_bulk_tx m_tx;
+static can_bulk_rx m_rx;
+static uint8_t m_rx_buffer[CAN_BULK_MAX_LEN];
+static int m_rx_done = 0;
+static int m_rx_bad = 0;
+static const uint8_t *m_expected;
+static unsigned int m_expected_len;
+
+static double rand_uniform(void) {
+	m_rand = m_rand * 1103515245 + 12345;
+	return (double)((m_rand >> 8) & 0xFFFFFF) / (double)0x1000000;
+}
+
+static double frame_time(int len) {
+	// Extended data frame with interframe space and typical bit stuffing
+	return (double)(67 + 8 * len + (54 + 8 * len) / 5) / BIT_RATE;
+}
+
+static void bus_send(uint8_t id, CAN_PACKET_ID cmd, const uint8_t *data, uint8_t len) {
+	if (m_bus_write - m_bus_read >= BUS_QUEUE_LEN) {
+		printf("Bus queue overflow\r\n");
+		exit(1);
+	}
+
+	bus_frame_t *f = &m_bus[m_bus_write++ % BUS_QUEUE_LEN];
+	f->id = id;
+	f->cmd = cmd;
+	f->len = len;
+	memcpy(f->data, data, len);
+
+	double start = m_bus_free > m_now ? m_bus_free : m_now;
+	f->end = start + frame_time(len);
+	m_bus_free = f->end;
+
+	f->lost = rand_uniform() < m_loss;
+	if (!f->lost && rand_uniform() < m_corrupt) {
+		// Corruption that the CAN CRC does not catch, e.g. data from another
+		// transfer ending up in the receive buffer.
+		f->data[len - 1] ^= 0x10;
+	}
+}
+
+static void receiver_deliver(const bus_frame_t *f) {
+	switch (f->cmd) {
+	case CAN_PACKET_BULK_START:
+		can_bulk_rx_start(&m_rx, f->data, f->len);
+		break;
+
+	case CAN_PACKET_BULK_DATA:
+		can_bulk_rx_data(&m_rx, f->data, f->len);
+		break;
+
+	case CAN_PACKET_BULK_END:
+		if (can_bulk_rx_end(&m_rx, bus_send, RECEIVER_ID, f->data, f->len)) {
+			m_rx_done++;
+			if (m_rx.len != m_expected_len || memcmp(m_rx.buffer, m_expected, m_expected_len) != 0) {
+				m_rx_bad++;
+			}
+		}
+		break;
+
+	default:
+		break;
+	}
+}
+
+static bool send_bulk(const uint8_t *data, unsigned int len, uint8_t transfer_id,
+		uint8_t nonce, sim_result_t *res) {
+	m_expected = data;
+	m_expected_len = len;
+
+	can_bulk_tx_start(&m_tx, bus_send, SENDER_ID, RECEIVER_ID, transfer_id, nonce, 2, data, len);
+	double deadline = m_bus_free + ACK_TIMEOUT_S;
+
+	while (m_tx.state == CAN_BULK_TX_BUSY) {
+		if (m_bus_read != m_bus_write && m_bus[m_bus_read % BUS_QUEUE_LEN].end <= deadline) {
+			bus_frame_t f = m_bus[m_bus_read++ % BUS_QUEUE_LEN];
+			m_now = f.end;
+
+			if (f.lost) {
+				continue;
+			}
+
+			if (f.cmd == CAN_PACKET_BULK_ACK) {
+				can_bulk_tx_ack(&m_tx, f.data, f.len);
+				deadline = (m_bus_free > m_now ? m_bus_free : m_now) + ACK_TIMEOUT_S;
+			} else {
+				receiver_deliver(&f);
+			}
+		} else {
+			m_now = deadline;
+			can_bulk_tx_timeout(&m_tx);
+			deadline = (m_bus_free > m_now ? m_bus_free : m_now) + ACK_TIMEOUT_S;
+		}
+	}
+
+	// Let the last frames leave the bus before the next transfer
+	while (m_bus_read != m_bus_write) {
+		bus_frame_t f = m_bus[m_bus_read++ % BUS_QUEUE_LEN];
+		m_now = f.end;
+		if (!f.lost && f.cmd != CAN_PACKET_BULK_ACK) {
+			receiver_deliver(&f);
+		}
+	}
+
+	res->frames += m_tx.frames_sent;
+	res->resent += m_tx.frames_resent;
+	res->timeouts += m_tx.timeouts;
+
+	return m_tx.state == CAN_BULK_TX_DONE;
+}
+
+static bool send_legacy(unsigned int len, sim_result_t *res) {
+	bool ok = true;
+	unsigned int i = 0;
+	int frames = 0;
+
+	for (;i < len && i <= 255;i += 7) {
+		unsigned int n = len - i > 7 ? 7 : len - i;
+		frames++;
+		m_bus_free += frame_time(n + 1);
+		ok = ok && rand_uniform() >= m_loss;
+	}
+
+	for (;i < len;i += 6) {
+		unsigned int n = len - i > 6 ? 6 : len - i;
+		frames++;
+		m_bus_free += frame_time(n + 2);
+		ok = ok && rand_uniform() >= m_loss;
+	}
+
+	frames++;
+	m_bus_free += frame_time(6);
+	ok = ok && rand_uniform() >= m_loss;
+
+	res->frames += frames;
+	m_now = m_bus_free;
+
+	return ok;
+}
+
+/*
+ * The sender dies after the receiver got the first frames of a transfer.
+ * The rest of its frames never make it to the bus.
+ */
+static void send_bulk_interrupted(const uint8_t *data, unsigned int len, uint8_t transfer_id,
+		uint8_t nonce, int frames) {
+	can_bulk_tx_start(&m_tx, bus_send, SENDER_ID, RECEIVER_ID, transfer_id, nonce, 2, data, len);
+
+	for (int i = 0;i < frames && m_bus_read != m_bus_write;i++) {
+		bus_frame_t f = m_bus[m_bus_read++ % BUS_QUEUE_LEN];
+		m_now = f.end;
+		receiver_deliver(&f);
+	}
+
+	m_bus_read = m_bus_write;
+	m_bus_free = m_now;
+}
+
+static int test_id_reuse(const uint8_t *image, unsigned int image_len) {
+	const unsigned int len = CAN_BULK_MAX_LEN < image_len / 2 ? CAN_BULK_MAX_LEN : image_len / 2;
+	const uint8_t *a = image;
+	const uint8_t *b = image + image_len - len;
+	int fails = 0;
+	sim_result_t res;
+	memset(&res, 0, sizeof(res));
+
+	m_bus_read = 0;
+	m_bus_write = 0;
+	m_bus_free = 0.0;
+	m_now = 0.0;
+	m_loss = 0.0;
+	m_corrupt = 0.0;
+	m_rx_done = 0;
+	m_rx_bad = 0;
+	can_bulk_rx_init(&m_rx, m_rx_buffer);
+
+	printf("\r\nTransfers that reuse the ids of an earlier one\r\n");
+
+	// The transfer id wrapped around to the id of the previous transfer
+	send_bulk(a, len, 7, NONCE, &res);
+	bool ok = send_bulk(b, len, 7, NONCE, &res);
+	printf("  Same transfer id and nonce after a finished transfer: %s\r\n",
+			ok && m_rx_done == 2 && m_rx_bad == 0 ? "ok" : "FAIL");
+	fails += !(ok && m_rx_done == 2 && m_rx_bad == 0);
+
+	// The sender rebooted after a finished transfer and starts over with
+	// transfer id 0, with a different nonce
+	m_rx_done = 0;
+	send_bulk(a, len, 0, NONCE, &res);
+	ok = send_bulk(b, len, 0, NONCE + 1, &res);
+	printf("  Transfer id 0 after a reboot: %s\r\n",
+			ok && m_rx_done == 2 && m_rx_bad == 0 ? "ok" : "FAIL");
+	fails += !(ok && m_rx_done == 2 && m_rx_bad == 0);
+
+	// The sender rebooted in the middle of a transfer. The frames from
+	// before the reboot must not end up in the new buffer.
+	m_rx_done = 0;
+	send_bulk_interrupted(a, len, 0, NONCE + 2, CAN_BULK_WINDOW_FRAMES + 5);
+	ok = send_bulk(b, len, 0, NONCE + 3, &res);
+	printf("  Transfer id 0 after a reboot during a transfer: %s\r\n",
+			ok && m_rx_done == 1 && m_rx_bad == 0 ? "ok" : "FAIL");
+	fails += !(ok && m_rx_done == 1 && m_rx_bad == 0);
+
+	return fails;
+}
+
+static sim_result_t run(const uint8_t *image, unsigned int image_len, bool legacy) {
+	sim_result_t res;
+	memset(&res, 0, sizeof(res));
+
+	m_bus_read = 0;
+	m_bus_write = 0;
+	m_bus_free = 0.0;
+	m_now = 0.0;
+	m_rand = 1;
+	m_rx_done = 0;
+	m_rx_bad = 0;
+	can_bulk_rx_init(&m_rx, m_rx_buffer);
+
+	uint8_t transfer_id = 0;
+
+	for (unsigned int ofs = 0;ofs < image_len;ofs += CAN_BULK_MAX_LEN) {
+		unsigned int len = image_len - ofs;
+		if (len > CAN_BULK_MAX_LEN) {
+			len = CAN_BULK_MAX_LEN;
+		}
+
+		bool ok = false;
+		for (int attempt = 0;attempt < 50 && !ok;attempt++) {
+			if (legacy) {
+				ok = send_legacy(len, &res);
+			} else {
+				ok = send_bulk(image + ofs, len, transfer_id++, NONCE, &res);
+			}
+
+			if (!ok) {
+				res.failed++;
+				m_now += LEGACY_RETRY_S;
+				m_bus_free = m_now;
+			}
+		}
+
+		res.packets++;
+		if (ok) {
+			res.bytes += len;
+		}
+	}
+
+	res.time = m_now;
+	return res;
+}
+
+int main(int argc, char **argv) {
+	unsigned int image_len = 128 * 1024;
+	if (argc > 1) {
+		image_len = atoi(argv[1]);
+	}
+
+	uint8_t *image = malloc(image_len);
+	for (unsigned int i = 0;i < image_len;i++) {
+		image[i] = (i * 31 + (i >> 8)) & 0xFF;
+	}
+
+	const double loss_rates[] = {0.0, 0.001, 0.01, 0.05, 0.1};
+	int fails = 0;
+
+	printf("%u bytes in %d byte packets, %.0f kbit/s\r\n\r\n",
+			image_len, CAN_BULK_MAX_LEN, BIT_RATE / 1e3);
+	printf("Loss     Windowed (B/s)  Frames  Resent  Timeouts  Legacy (B/s)  Resends\r\n");
+
+	for (unsigned int i = 0;i < sizeof(loss_rates) / sizeof(loss_rates[0]);i++) {
+		m_loss = loss_rates[i];
+		m_corrupt = 0.0;
+
+		sim_result_t bulk = run(image, image_len, false);
+		int rx_done = m_rx_done;
+		int rx_bad = m_rx_bad;
+		sim_result_t legacy = run(image, image_len, true);
+
+		printf("%5.1f %%  %14.0f  %6d  %6d  %8d  %12.0f  %7d\r\n",
+				m_loss * 100.0, bulk.bytes / bulk.time, bulk.frames, bulk.resent,
+				bulk.timeouts, legacy.bytes / legacy.time, legacy.failed);
+
+		if (rx_bad != 0 || rx_done != bulk.packets || bulk.failed != 0) {
+			printf("FAIL: %d packets received, %d expected, %d bad, %d failed transfers\r\n",
+					rx_done, bulk.packets, rx_bad, bulk.failed);
+			fails++;
+		}
+	}
+
+	// Corrupted frames are caught by the window CRC and sent again
+	m_loss = 0.01;
+	m_corrupt = 0.002;
+	sim_result_t bulk = run(image, image_len, false);
+	printf("\r\nWith 0.2 %% undetected corruption: %.0f B/s, %d frames resent\r\n",
+			bulk.bytes / bulk.time, bulk.resent);
+	if (m_rx_bad != 0 || m_rx_done != bulk.packets) {
+		printf("FAIL: %d packets received, %d expected, %d bad\r\n",
+				m_rx_done, bulk.packets, m_rx_bad);
+		fails++;
+	}
+
+	fails += test_id_reuse(image, image_len);
+
+	free(image);
+
+	printf("\r\n%s\r\n", fails ? "FAILED" : "All tests passed");
+	return fails ? 1 : 0;
+}
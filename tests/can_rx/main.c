@@ -0,0 +1,329 @@
+/*
+ * Host test and benchmark for the CAN RX path in comm_can.c.
+ *
+ * comm_can.c is included directly so that the read thread body, the RX ring
+ * and decode_msg() can be driven from here. A bus trace is replayed at its
+ * recorded timing: frames go to the two hardware receive FIFOs, the read
+ * thread empties them into the RX ring shortly after it has been woken up and
+ * the process thread drains the ring unless it is stalled. The stalls model
+ * the process thread being blocked by a long command (e.g. a flash write
+ * started over CAN).
+ *
+ * The trace is a saturated 1 Mbit/s VESC bus: status messages from a few
+ * other nodes, current commands addressed to this node, commands for other
+ * nodes and COMM packets split over FILL_RX_BUFFER frames.
+ *
+ * Output: frames per second through read thread + decode_msg() on the host,
+ * the number of dropped frames and read thread wakeups for each scenario.
+ *
+ * Usage: ./can_rx [seconds of bus traffic]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "stubs.h"
+
+// Run one iteration of the read thread for each call.
+static int m_read_thread_iterations = 0;
+#undef chThdShouldTerminateX
+#define chThdShouldTerminateX()		(m_read_thread_iterations++ > 0)
+
+#include "../../comm_can.c"
+
+#define HW_FIFO_LEN			6
+#define READ_LATENCY_US		250
+#define OWN_ID				5
+#define TRACE_MAX			20000
+
+typedef struct {
+	uint32_t time_us;
+	CANRxFrame frame;
+} trace_frame_t;
+
+typedef struct {
+	const char *name;
+	int stall_ms;
+	int stall_period_ms;
+} rx_scenario_t;
+
+static const rx_scenario_t m_scenarios[] = {
+		{"No stalls", 0, 100},
+		{"10 ms stall every 100 ms", 10, 100},
+		{"30 ms stall every 100 ms", 30, 100},
+};
+
+static trace_frame_t m_trace[TRACE_MAX];
+static int m_trace_len = 0;
+static int m_trace_set_current = 0;
+static int m_trace_packets = 0;
+
+static CANRxFrame m_hw_fifo[HW_FIFO_LEN];
+static int m_hw_fifo_len = 0;
+static uint32_t m_hw_fifo_time = 0;
+static int m_hw_overruns = 0;
+static int m_wakeups = 0;
+static int m_decoded = 0;
+static unsigned int m_ring_peak = 0;
+
+static inline uint64_t bench_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static bool hw_receive(CANRxFrame *crfp) {
+	if (m_hw_fifo_len == 0) {
+		return false;
+	}
+
+	*crfp = m_hw_fifo[0];
+	m_hw_fifo_len--;
+	memmove(m_hw_fifo, m_hw_fifo + 1, m_hw_fifo_len * sizeof(CANRxFrame));
+	return true;
+}
+
+static uint32_t frame_bits(int dlc) {
+	// Extended data frame with interframe space and typical bit stuffing
+	return 67 + 8 * dlc + (54 + 8 * dlc) / 5;
+}
+
+static void trace_add(uint32_t *time_us, uint8_t id, CAN_PACKET_ID cmd,
+		const uint8_t *data, int len) {
+	if (m_trace_len >= TRACE_MAX) {
+		return;
+	}
+
+	trace_frame_t *t = &m_trace[m_trace_len++];
+	memset(t, 0, sizeof(trace_frame_t));
+	t->time_us = *time_us;
+	t->frame.IDE = CAN_IDE_EXT;
+	t->frame.EID = id | ((uint32_t)cmd << 8);
+	t->frame.DLC = len;
+	memcpy(t->frame.data8, data, len);
+
+	*time_us += frame_bits(len);
+}
+
+static void trace_add_packet(uint32_t *time_us, uint8_t sender, const uint8_t *pl, int len) {
+	uint8_t data[8];
+
+	for (int ofs = 0;ofs < len;ofs += 7) {
+		int n = len - ofs > 7 ? 7 : len - ofs;
+		data[0] = ofs;
+		memcpy(data + 1, pl + ofs, n);
+		trace_add(time_us, OWN_ID, CAN_PACKET_FILL_RX_BUFFER, data, n + 1);
+	}
+
+	unsigned short crc = crc16((unsigned char*)pl, len);
+	int32_t ind = 0;
+	data[ind++] = sender;
+	data[ind++] = 2;
+	data[ind++] = len >> 8;
+	data[ind++] = len & 0xFF;
+	data[ind++] = crc >> 8;
+	data[ind++] = crc & 0xFF;
+	trace_add(time_us, OWN_ID, CAN_PACKET_PROCESS_RX_BUFFER, data, ind);
+	m_trace_packets++;
+}
+
+static void trace_generate(uint32_t duration_us) {
+	uint32_t time_us = 0;
+	int cycle = 0;
+
+	m_trace_len = 0;
+	m_trace_set_current = 0;
+	m_trace_packets = 0;
+
+	while (time_us < duration_us && m_trace_len < TRACE_MAX - 64) {
+		uint8_t data[8];
+		int32_t ind;
+
+		for (uint8_t node = 10;node < 14;node++) {
+			ind = 0;
+			buffer_append_int32(data, 1000 * node + cycle, &ind);
+			buffer_append_int16(data, 10 * node, &ind);
+			buffer_append_int16(data, 500, &ind);
+			trace_add(&time_us, node, CAN_PACKET_STATUS, data, ind);
+
+			if (cycle % 2 == 0) {
+				ind = 0;
+				buffer_append_int32(data, 12000, &ind);
+				buffer_append_int32(data, 340, &ind);
+				trace_add(&time_us, node, CAN_PACKET_STATUS_2, data, ind);
+				trace_add(&time_us, node, CAN_PACKET_STATUS_3, data, ind);
+				trace_add(&time_us, node, CAN_PACKET_STATUS_4, data, ind);
+				trace_add(&time_us, node, CAN_PACKET_STATUS_5, data, ind);
+			}
+
+			ind = 0;
+			buffer_append_int32(data, 3000, &ind);
+			trace_add(&time_us, node, CAN_PACKET_SET_RPM, data, ind);
+		}
+
+		ind = 0;
+		buffer_append_int32(data, 1000 * (cycle % 20), &ind);
+		trace_add(&time_us, OWN_ID, CAN_PACKET_SET_CURRENT, data, ind);
+		m_trace_set_current++;
+
+		if (cycle % 5 == 0) {
+			uint8_t pl[40];
+			for (unsigned int i = 0;i < sizeof(pl);i++) {
+				pl[i] = cycle + i;
+			}
+			trace_add_packet(&time_us, 10, pl, sizeof(pl));
+		}
+
+		cycle++;
+	}
+}
+
+static void read_thread_run(void) {
+	m_read_thread_iterations = 0;
+	cancom_read_thread(0);
+}
+
+// Same as the loop in cancom_process_thread for CAN_MODE_VESC.
+static void process_thread_run(void) {
+	CANRxFrame *rxmsg;
+	while ((rxmsg = comm_can_rx_frame_peek()) != 0) {
+		if (rxmsg->IDE == CAN_IDE_EXT) {
+			decode_msg(rxmsg->EID, rxmsg->data8, rxmsg->DLC, false);
+		}
+
+		comm_can_rx_frame_release();
+		m_decoded++;
+	}
+}
+
+static void replay(const rx_scenario_t *s, bool measure_ring) {
+	rx_frame_read = 0;
+	rx_frame_write = 0;
+	rx_frames_received = 0;
+	rx_frames_dropped = 0;
+
+	m_hw_fifo_len = 0;
+	m_hw_overruns = 0;
+	m_wakeups = 0;
+	m_decoded = 0;
+	m_ring_peak = 0;
+	stubs_reset();
+
+	for (int i = 0;i < m_trace_len;i++) {
+		const trace_frame_t *t = &m_trace[i];
+
+		if (m_hw_fifo_len == 0) {
+			m_hw_fifo_time = t->time_us;
+		}
+
+		if (m_hw_fifo_len < HW_FIFO_LEN) {
+			m_hw_fifo[m_hw_fifo_len++] = t->frame;
+		} else {
+			m_hw_overruns++;
+		}
+
+		// The read thread gets to run some time after the first frame was
+		// received, as higher priority threads and interrupts run first.
+		if ((t->time_us - m_hw_fifo_time) >= READ_LATENCY_US || i == m_trace_len - 1) {
+			read_thread_run();
+			m_wakeups++;
+		}
+
+		if (measure_ring && (rx_frame_write - rx_frame_read) > m_ring_peak) {
+			m_ring_peak = rx_frame_write - rx_frame_read;
+		}
+
+		uint32_t time_ms = t->time_us / 1000;
+		bool stalled = s->stall_ms > 0 &&
+				(time_ms % s->stall_period_ms) >= (uint32_t)(s->stall_period_ms - s->stall_ms);
+
+		if (!stalled) {
+			process_thread_run();
+		}
+	}
+
+	process_thread_run();
+}
+
+int main(int argc, char **argv) {
+	float seconds = 2.0;
+	if (argc > 1) {
+		seconds = atof(argv[1]);
+	}
+
+	comm_can_init();
+	stubs_appconf.controller_id = OWN_ID;
+	stubs_appconf.can_mode = CAN_MODE_VESC;
+	host_set_can_hooks(hw_receive, 0);
+
+	trace_generate(seconds * 1e6);
+
+	float trace_s = (float)m_trace[m_trace_len - 1].time_us / 1e6;
+	printf("Trace: %d frames in %.3f s (%.0f frames/s at 1 Mbit/s)\r\n",
+			m_trace_len, (double)trace_s, (double)(m_trace_len / trace_s));
+
+	int fails = 0;
+
+	for (unsigned int i = 0;i < sizeof(m_scenarios) / sizeof(m_scenarios[0]);i++) {
+		const rx_scenario_t *s = &m_scenarios[i];
+		replay(s, true);
+
+		printf("\r\n%s\r\n", s->name);
+		printf("  Received     : %u\r\n", (unsigned int)rx_frames_received);
+		printf("  Dropped      : %u\r\n", (unsigned int)rx_frames_dropped);
+		printf("  HW overruns  : %d\r\n", m_hw_overruns);
+		printf("  Wakeups      : %d (%.2f frames per event)\r\n", m_wakeups,
+				(double)((float)rx_frames_received / (float)m_wakeups));
+		printf("  Ring peak    : %u / %d\r\n", m_ring_peak, RX_FRAMES_SIZE);
+
+		if ((int)rx_frames_received != m_trace_len ||
+				m_decoded != (int)(rx_frames_received - rx_frames_dropped)) {
+			printf("  FAIL: frames lost without being counted\r\n");
+			fails++;
+		}
+
+		if (s->stall_ms == 0) {
+			if (rx_frames_dropped != 0 ||
+					stubs_set_current_calls != m_trace_set_current ||
+					stubs_process_packet_calls != m_trace_packets) {
+				printf("  FAIL: decoded %d/%d current commands, %d/%d packets\r\n",
+						stubs_set_current_calls, m_trace_set_current,
+						stubs_process_packet_calls, m_trace_packets);
+				fails++;
+			}
+
+			can_status_msg *msg = comm_can_get_status_msg_id(13);
+			if (!msg || msg->current < 12.9 || msg->current > 13.1) {
+				printf("  FAIL: status of node 13 not decoded\r\n");
+				fails++;
+			}
+		} else if (s->stall_ms * m_trace_len / (trace_s * 1000) > RX_FRAMES_SIZE) {
+			if (rx_frames_dropped == 0) {
+				printf("  FAIL: ring overflow not counted\r\n");
+				fails++;
+			}
+		} else if (rx_frames_dropped != 0) {
+			printf("  FAIL: frames dropped although the ring is large enough\r\n");
+			fails++;
+		}
+	}
+
+	// Throughput on the host, without stalls and ring bookkeeping
+	int reps = 0;
+	uint64_t t_start = bench_ns();
+	uint64_t t_elapsed = 0;
+	while (t_elapsed < 500000000ULL) {
+		replay(&m_scenarios[0], false);
+		reps++;
+		t_elapsed = bench_ns() - t_start;
+	}
+
+	printf("\r\nHost throughput: %.2f Mframes/s (%.1f ns per frame)\r\n",
+			(double)reps * m_trace_len / ((double)t_elapsed / 1e3),
+			(double)t_elapsed / ((double)reps * m_trace_len));
+
+	printf("\r\n%s\r\n", fails ? "FAILED" : "All tests passed");
+	return fails ? 1 : 0;
+}
@@ -0,0 +1,161 @@
+#include <string.h>
+
+#include "stubs.h"
+#include "ch.h"
+#include "hw.h"
+#include "mc_interface.h"
+#include "commands.h"
+#include "conf_general.h"
+#include "app.h"
+#include "timeout.h"
+#include "encoder.h"
+#include "mempools.h"
+#include "canard_driver.h"
+
+volatile uint16_t ADC_Value[HW_ADC_CHANNELS + HW_ADC_CHANNELS_EXTRA];
+
+app_configuration stubs_appconf;
+int stubs_set_current_calls = 0;
+int stubs_process_packet_calls = 0;
+
+static mc_configuration m_mcconf;
+static mc_configuration m_mcconf_tmp;
+static app_configuration m_appconf_tmp;
+static uint8_t m_ts5700n8501_status[8];
+
+void stubs_reset(void) {
+	stubs_set_current_calls = 0;
+	stubs_process_packet_calls = 0;
+}
+
+// app
+const app_configuration* app_get_configuration(void) {
+	return &stubs_appconf;
+}
+
+void app_set_configuration(app_configuration *conf) {
+	stubs_appconf = *conf;
+}
+
+// commands
+void commands_process_packet(unsigned char *data, unsigned int len,
+		void(*reply_func)(unsigned char *data, unsigned int len)) {
+	(void)data;
+	(void)len;
+	(void)reply_func;
+	stubs_process_packet_calls++;
+}
+
+void commands_send_packet(unsigned char *data, unsigned int len) {
+	(void)data;
+	(void)len;
+}
+
+void commands_fwd_can_frame(int len, unsigned char *data, uint32_t id, bool is_extended) {
+	(void)len;
+	(void)data;
+	(void)id;
+	(void)is_extended;
+}
+
+// conf_general
+int conf_general_detect_apply_all_foc(float max_power_loss,
+		bool store_mcconf_on_success, bool send_mcconf_on_success) {
+	(void)max_power_loss;
+	(void)store_mcconf_on_success;
+	(void)send_mcconf_on_success;
+	return -1;
+}
+
+bool conf_general_store_app_configuration(app_configuration *conf) {
+	(void)conf;
+	return true;
+}
+
+bool conf_general_store_mc_configuration(mc_configuration *conf, bool is_motor_2) {
+	(void)conf;
+	(void)is_motor_2;
+	return true;
+}
+
+// mc_interface
+const volatile mc_configuration* mc_interface_get_configuration(void) {
+	return &m_mcconf;
+}
+
+void mc_interface_set_configuration(mc_configuration *configuration) {
+	m_mcconf = *configuration;
+}
+
+int mc_interface_get_motor_thread(void) {
+	return 1;
+}
+
+void mc_interface_select_motor_thread(int motor) {
+	(void)motor;
+}
+
+void mc_interface_set_current(float current) {
+	(void)current;
+	stubs_set_current_calls++;
+}
+
+void mc_interface_set_duty(float dutyCycle) { (void)dutyCycle; }
+void mc_interface_set_brake_current(float current) { (void)current; }
+void mc_interface_set_brake_current_rel(float val) { (void)val; }
+void mc_interface_set_current_rel(float val) { (void)val; }
+void mc_interface_set_handbrake(float current) { (void)current; }
+void mc_interface_set_handbrake_rel(float val) { (void)val; }
+void mc_interface_set_pid_pos(float pos) { (void)pos; }
+void mc_interface_set_pid_speed(float rpm) { (void)rpm; }
+
+float mc_interface_get_amp_hours(bool reset) { (void)reset; return 0.0; }
+float mc_interface_get_amp_hours_charged(bool reset) { (void)reset; return 0.0; }
+float mc_interface_get_watt_hours(bool reset) { (void)reset; return 0.0; }
+float mc_interface_get_watt_hours_charged(bool reset) { (void)reset; return 0.0; }
+int mc_interface_get_tachometer_value(bool reset) { (void)reset; return 0; }
+float mc_interface_get_duty_cycle_now(void) { return 0.0; }
+float mc_interface_get_pid_pos_now(void) { return 0.0; }
+float mc_interface_get_rpm(void) { return 0.0; }
+float mc_interface_get_tot_current_filtered(void) { return 0.0; }
+float mc_interface_get_tot_current_in_filtered(void) { return 0.0; }
+float mc_interface_temp_fet_filtered(void) { return 25.0; }
+float mc_interface_temp_motor_filtered(void) { return 25.0; }
+
+void mc_interface_get_snapshot(mc_snapshot *snapshot) {
+	memset(snapshot, 0, sizeof(mc_snapshot));
+	snapshot->temp_fet = 25.0;
+	snapshot->temp_motor = 25.0;
+}
+
+// mempools
+mc_configuration *mempools_alloc_mcconf(void) {
+	return &m_mcconf_tmp;
+}
+
+app_configuration *mempools_alloc_appconf(void) {
+	return &m_appconf_tmp;
+}
+
+void mempools_free_mcconf(mc_configuration *conf) {
+	(void)conf;
+}
+
+void mempools_free_appconf(app_configuration *conf) {
+	(void)conf;
+}
+
+// Others
+void timeout_feed_WDT(uint8_t index) {
+	(void)index;
+}
+
+void timeout_reset(void) {
+}
+
+uint8_t* encoder_ts5700n8501_get_raw_status(void) {
+	return m_ts5700n8501_status;
+}
+
+void canard_driver_init(void) {
+}
@@ -0,0 +1,17 @@
+#ifndef STUBS_H_
+#define STUBS_H_
+
+#include "datatypes.h"
+
+/*
+ * Stand-ins for the firmware modules that comm_can.c calls into. The motor
+ * and command calls only count how often they were made.
+ */
+
+extern app_configuration stubs_appconf;
+extern int stubs_set_current_calls;
+extern int stubs_process_packet_calls;
+
+void stubs_reset(void);
+
+#endif /* STUBS_H_ */
@@ -0,0 +1,444 @@
+/*
+ * Host simulation of the adaptive status mode in comm_can.c.
+ *
+ * comm_can.c is included directly so that send_status_cycle() can be driven
+ * from here. Dive traces are replayed at the status rate, once with fixed rate
+ * status and once with adaptive status. Every frame that reaches the bus is
+ * decoded again, so that the view of a receiver can be compared with the
+ * motor state: in the adaptive mode no field may be off by more than its
+ * deadband and the gap between two messages of the same kind may not exceed
+ * the heartbeat.
+ *
+ * Without arguments three synthetic dive scooter profiles are replayed: a
+ * long cruise, a reef dive with frequent throttle changes and stops, and a
+ * decompression stop with the motor mostly idle. Recorded traces can be
+ * given as CSV files with one header line and the columns
+ *
+ * time_s,erpm,current,duty,current_in,v_in,temp_fet,temp_motor
+ *
+ * Amp hours, watt hours, the tachometer and the rotor angle are integrated
+ * from them.
+ *
+ * Output: frames per second for each status message in both modes, the
+ * frames per second saved and the status bus load at 500 kbit/s.
+ *
+ * Usage: ./can_status [trace.csv ...]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "stubs.h"
+#include "../../comm_can.c"
+
+#define OWN_ID				5
+#define STATUS_RATE_HZ		50
+#define SYNTH_RATE_HZ		200
+#define ERPM_MAX			20000.0
+#define BAUD_RATE			500000.0
+
+typedef struct {
+	float time;
+	float erpm;
+	float current;
+	float duty;
+	float current_in;
+	float v_in;
+	float temp_fet;
+	float temp_motor;
+} trace_sample_t;
+
+typedef struct {
+	char name[64];
+	trace_sample_t *samples;
+	int len;
+} trace_t;
+
+typedef struct {
+	float duration;
+	float throttle;
+} segment_t;
+
+typedef struct {
+	float seconds;
+	uint32_t frames[CAN_STATUS_MSG_NUM];
+	uint32_t bits;
+	float max_gap_ms[CAN_STATUS_MSG_NUM];
+	int violations;
+} replay_result_t;
+
+// Receiver view of the status messages
+static int32_t m_rx_fields[CAN_STATUS_MSG_NUM][4];
+static bool m_rx_valid[CAN_STATUS_MSG_NUM];
+static systime_t m_rx_time[CAN_STATUS_MSG_NUM];
+static uint32_t m_rx_frames[CAN_STATUS_MSG_NUM];
+static float m_rx_max_gap_ms[CAN_STATUS_MSG_NUM];
+static int m_rx_unknown = 0;
+
+static uint32_t m_rand_state = 1;
+
+static float rand_uniform(void) {
+	m_rand_state = m_rand_state * 1664525 + 1013904223;
+	return (float)((m_rand_state >> 8) + 1) / 16777217.0;
+}
+
+static float rand_gauss(float sd) {
+	return sd * sqrtf(-2.0 * logf(rand_uniform())) * cosf(2.0 * M_PI * rand_uniform());
+}
+
+static void can_tx(const CANTxFrame *ctfp) {
+	if ((ctfp->EID & 0xFF) != OWN_ID) {
+		m_rx_unknown++;
+		return;
+	}
+
+	for (int i = 0;i < CAN_STATUS_MSG_NUM;i++) {
+		const status_msg_def *def = &status_defs[i];
+		if ((ctfp->EID >> 8) != def->cmd) {
+			continue;
+		}
+
+		int32_t ind = 0;
+		for (int j = 0;j < 4 && def->size[j] > 0;j++) {
+			if (def->size[j] == 4) {
+				m_rx_fields[i][j] = buffer_get_int32(ctfp->data8, &ind);
+			} else {
+				m_rx_fields[i][j] = buffer_get_int16(ctfp->data8, &ind);
+			}
+		}
+
+		systime_t now = chVTGetSystemTimeX();
+		if (m_rx_valid[i]) {
+			float gap = (float)ST2MS(now - m_rx_time[i]);
+			if (gap > m_rx_max_gap_ms[i]) {
+				m_rx_max_gap_ms[i] = gap;
+			}
+		}
+
+		m_rx_valid[i] = true;
+		m_rx_time[i] = now;
+		m_rx_frames[i]++;
+		return;
+	}
+
+	m_rx_unknown++;
+}
+
+static trace_t synth_trace(const char *name, const segment_t *segs, int seg_num, uint32_t seed) {
+	trace_t tr;
+	snprintf(tr.name, sizeof(tr.name), "%s", name);
+
+	float duration = 0.0;
+	for (int i = 0;i < seg_num;i++) {
+		duration += segs[i].duration;
+	}
+
+	tr.len = (int)(duration * SYNTH_RATE_HZ);
+	tr.samples = malloc(tr.len * sizeof(trace_sample_t));
+	m_rand_state = seed;
+
+	const float dt = 1.0 / SYNTH_RATE_HZ;
+	float erpm = 0.0;
+	float ah = 0.0;
+	float temp_fet = 25.0;
+	float temp_motor = 25.0;
+	float seg_end = segs[0].duration;
+	int seg = 0;
+
+	for (int i = 0;i < tr.len;i++) {
+		float t = (float)i * dt;
+		while (t >= seg_end && seg < seg_num - 1) {
+			seg++;
+			seg_end += segs[seg].duration;
+		}
+
+		// The propeller load goes with the square of the speed and the
+		// water makes the speed follow the throttle within about a second.
+		float target = segs[seg].throttle * ERPM_MAX;
+		float erpm_last = erpm;
+		erpm += (target - erpm) * dt / 0.8;
+		float accel = (erpm - erpm_last) / dt;
+		float rel = erpm / ERPM_MAX;
+		float current = 45.0 * rel * rel + 0.002 * accel;
+
+		trace_sample_t *s = &tr.samples[i];
+		s->time = t;
+		s->v_in = 50.4 - 0.1 * ah;
+		s->duty = erpm / ERPM_MAX * 0.95;
+
+		if (fabsf(erpm) < 50.0 && target == 0.0) {
+			// Released motor
+			s->erpm = 0.0;
+			s->current = 0.0;
+			s->current_in = 0.0;
+			s->duty = 0.0;
+		} else {
+			s->erpm = erpm + rand_gauss(12.0);
+			s->current = current + rand_gauss(0.2);
+			s->current_in = current * s->duty + rand_gauss(0.1);
+		}
+
+		s->v_in += -0.03 * s->current_in + rand_gauss(0.04);
+
+		temp_fet += (25.0 + 0.5 * fabsf(current) - temp_fet) * dt / 60.0;
+		temp_motor += (25.0 + 0.8 * fabsf(current) - temp_motor) * dt / 150.0;
+		s->temp_fet = temp_fet + rand_gauss(0.05);
+		s->temp_motor = temp_motor + rand_gauss(0.08);
+
+		ah += s->current_in * dt / 3600.0;
+	}
+
+	return tr;
+}
+
+static bool load_trace(const char *path, trace_t *tr) {
+	FILE *f = fopen(path, "r");
+	if (!f) {
+		return false;
+	}
+
+	snprintf(tr->name, sizeof(tr->name), "%s", path);
+	int cap = 1024;
+	tr->samples = malloc(cap * sizeof(trace_sample_t));
+	tr->len = 0;
+
+	char line[512];
+	while (fgets(line, sizeof(line), f)) {
+		trace_sample_t s;
+		if (sscanf(line, "%f,%f,%f,%f,%f,%f,%f,%f", &s.time, &s.erpm, &s.current,
+				&s.duty, &s.current_in, &s.v_in, &s.temp_fet, &s.temp_motor) != 8) {
+			continue;
+		}
+
+		if (tr->len == cap) {
+			cap *= 2;
+			tr->samples = realloc(tr->samples, cap * sizeof(trace_sample_t));
+		}
+
+		tr->samples[tr->len++] = s;
+	}
+
+	fclose(f);
+	return tr->len > 1;
+}
+
+static void replay(const trace_t *tr, bool adaptive, replay_result_t *res) {
+	memset(res, 0, sizeof(replay_result_t));
+	memset(status_tx, 0, sizeof(status_tx));
+	memset(m_rx_valid, 0, sizeof(m_rx_valid));
+	memset(m_rx_frames, 0, sizeof(m_rx_frames));
+	memset(m_rx_max_gap_ms, 0, sizeof(m_rx_max_gap_ms));
+	comm_can_set_status_adaptive(adaptive, -1);
+
+	const systime_t period = CH_CFG_ST_FREQUENCY / STATUS_RATE_HZ;
+	const float dt = 1.0 / STATUS_RATE_HZ;
+	const float t_start = tr->samples[0].time;
+	const int cycles = (int)((tr->samples[tr->len - 1].time - t_start) * STATUS_RATE_HZ);
+
+	mc_snapshot snap;
+	memset(&snap, 0, sizeof(snap));
+	double tacho = 0.0;
+	double pos = 0.0;
+	int ind = 0;
+
+	for (int k = 0;k < cycles;k++) {
+		float t = t_start + (float)k * dt;
+		while (ind < tr->len - 1 && tr->samples[ind + 1].time <= t) {
+			ind++;
+		}
+
+		const trace_sample_t *s = &tr->samples[ind];
+		snap.rpm = s->erpm;
+		snap.current_filtered = s->current;
+		snap.duty_now = s->duty;
+		snap.current_in_filtered = s->current_in;
+		snap.v_in = s->v_in;
+		snap.temp_fet = s->temp_fet;
+		snap.temp_motor = s->temp_motor;
+
+		float p = s->current_in * s->v_in;
+		if (s->current_in > 0.0) {
+			snap.amp_hours += s->current_in * dt / 3600.0;
+			snap.watt_hours += p * dt / 3600.0;
+		} else {
+			snap.amp_hours_charged -= s->current_in * dt / 3600.0;
+			snap.watt_hours_charged -= p * dt / 3600.0;
+		}
+
+		// Six tachometer counts and one turn of the rotor angle per
+		// electrical revolution
+		tacho += s->erpm / 60.0 * 6.0 * dt;
+		snap.tachometer = (int32_t)tacho;
+		pos = fmod(pos + s->erpm / 60.0 * 360.0 * dt, 360.0);
+		if (pos < 0.0) {
+			pos += 360.0;
+		}
+		snap.position = pos;
+
+		send_status_cycle(OWN_ID, status_tx[0], &snap, CAN_STATUS_MSG_NUM,
+				chVTGetSystemTimeX(), period);
+
+		for (int i = 0;i < CAN_STATUS_MSG_NUM;i++) {
+			int32_t fields[4];
+			status_fields(i, &snap, fields);
+
+			for (int j = 0;j < status_defs[i].fields;j++) {
+				int64_t diff = (int64_t)fields[j] - m_rx_fields[i][j];
+				int32_t db = adaptive ? status_defs[i].deadband[j] : 0;
+				if (!m_rx_valid[i] || diff > db || diff < -db) {
+					res->violations++;
+				}
+			}
+		}
+
+		chThdSleep(period);
+	}
+
+	res->seconds = (float)cycles * dt;
+
+	can_status_tx_stats stats[CAN_STATUS_MSG_NUM];
+	float seconds;
+	comm_can_get_status_tx_stats(stats, &seconds);
+
+	for (int i = 0;i < CAN_STATUS_MSG_NUM;i++) {
+		res->frames[i] = m_rx_frames[i];
+		res->max_gap_ms[i] = m_rx_max_gap_ms[i];
+		res->bits += stats[i].bits;
+	}
+}
+
+static int run_trace(const trace_t *tr) {
+	replay_result_t fixed, adapt;
+	replay(tr, false, &fixed);
+	replay(tr, true, &adapt);
+
+	int heartbeat_ms = 0;
+	comm_can_get_status_adaptive(&heartbeat_ms);
+
+	printf("\r\n%s (%.0f s)\r\n", tr->name, (double)fixed.seconds);
+	printf("  Message   Fixed [f/s]   Adaptive [f/s]   Saved   Max gap [ms]\r\n");
+
+	float fixed_tot = 0.0;
+	float adapt_tot = 0.0;
+	int fails = 0;
+	uint32_t cycles = (uint32_t)(fixed.seconds * STATUS_RATE_HZ + 0.5);
+
+	for (int i = 0;i < CAN_STATUS_MSG_NUM;i++) {
+		float f = fixed.frames[i] / fixed.seconds;
+		float a = adapt.frames[i] / adapt.seconds;
+		fixed_tot += f;
+		adapt_tot += a;
+		printf("  Status %d  %11.1f   %14.1f   %4.0f %%   %12.0f\r\n", i + 1,
+				(double)f, (double)a, (double)(100.0 * (f - a) / f),
+				(double)adapt.max_gap_ms[i]);
+
+		if (fixed.frames[i] != cycles) {
+			printf("  FAIL: fixed rate status %d sent %u of %u times\r\n",
+					i + 1, fixed.frames[i], cycles);
+			fails++;
+		}
+
+		if (adapt.max_gap_ms[i] > heartbeat_ms) {
+			printf("  FAIL: status %d not sent for %.0f ms\r\n",
+					i + 1, (double)adapt.max_gap_ms[i]);
+			fails++;
+		}
+	}
+
+	printf("  Total     %11.1f   %14.1f   %4.0f %%   (%.1f frames/s saved)\r\n",
+			(double)fixed_tot, (double)adapt_tot,
+			(double)(100.0 * (fixed_tot - adapt_tot) / fixed_tot),
+			(double)(fixed_tot - adapt_tot));
+	printf("  Bus load at %.0f kbit/s: %.2f %% fixed, %.2f %% adaptive\r\n",
+			BAUD_RATE / 1e3,
+			(double)(100.0 * fixed.bits / fixed.seconds / BAUD_RATE),
+			(double)(100.0 * adapt.bits / adapt.seconds / BAUD_RATE));
+
+	if (fixed.violations != 0 || adapt.violations != 0) {
+		printf("  FAIL: receiver view off by more than the deadband %d times\r\n",
+				fixed.violations + adapt.violations);
+		fails++;
+	}
+
+	if (adapt_tot >= fixed_tot) {
+		printf("  FAIL: adaptive status did not save any frames\r\n");
+		fails++;
+	}
+
+	return fails;
+}
+
+int main(int argc, char **argv) {
+	comm_can_init();
+	stubs_appconf.controller_id = OWN_ID;
+	stubs_appconf.can_mode = CAN_MODE_VESC;
+	host_set_can_hooks(0, can_tx);
+
+	printf("Status rate %d Hz, heartbeat %d ms\r\n",
+			STATUS_RATE_HZ, COMM_CAN_STATUS_HEARTBEAT_MS);
+
+	int fails = 0;
+
+	if (argc > 1) {
+		for (int i = 1;i < argc;i++) {
+			trace_t tr;
+			if (!load_trace(argv[i], &tr)) {
+				printf("Could not read %s\r\n", argv[i]);
+				fails++;
+				continue;
+			}
+
+			fails += run_trace(&tr);
+			free(tr.samples);
+		}
+	} else {
+		static const segment_t cruise[] = {
+				{5.0, 0.0}, {60.0, 0.5}, {480.0, 0.7}, {30.0, 0.0}, {60.0, 0.4}, {10.0, 0.0}
+		};
+
+		static const segment_t reef[] = {
+				{5.0, 0.0}, {20.0, 0.3}, {15.0, 0.0}, {30.0, 0.6}, {10.0, 0.2},
+				{25.0, 0.0}, {12.0, 0.45}, {40.0, 0.0}, {18.0, 0.3}, {8.0, 0.7},
+				{30.0, 0.0}, {25.0, 0.35}, {20.0, 0.0}, {15.0, 0.55}, {20.0, 0.0}
+		};
+
+		static const segment_t deco[] = {
+				{10.0, 0.0}, {3.0, 0.2}, {60.0, 0.0}, {2.0, 0.15}, {90.0, 0.0},
+				{4.0, 0.2}, {120.0, 0.0}, {3.0, 0.15}, {60.0, 0.0}
+		};
+
+		trace_t traces[3];
+		traces[0] = synth_trace("Cruise", cruise, sizeof(cruise) / sizeof(cruise[0]), 1);
+		traces[1] = synth_trace("Reef", reef, sizeof(reef) / sizeof(reef[0]), 2);
+		traces[2] = synth_trace("Deco stop", deco, sizeof(deco) / sizeof(deco[0]), 3);
+
+		for (int i = 0;i < 3;i++) {
+			fails += run_trace(&traces[i]);
+			free(traces[i].samples);
+		}
+	}
+
+	// A heartbeat beyond what the receivers accept is limited
+	int heartbeat_ms = 0;
+	comm_can_set_status_adaptive(true, 500);
+	comm_can_get_status_adaptive(&heartbeat_ms);
+	if (heartbeat_ms != CAN_STATUS_HEARTBEAT_MAX_MS) {
+		printf("\r\nFAIL: heartbeat set to %d ms\r\n", heartbeat_ms);
+		fails++;
+	}
+
+	if (m_rx_unknown != 0) {
+		printf("\r\nFAIL: %d frames that are not status messages\r\n", m_rx_unknown);
+		fails++;
+	}
+
+	if (fails == 0) {
+		printf("\r\nAll tests passed\r\n");
+	} else {
+		printf("\r\n%d test(s) FAILED\r\n", fails);
+	}
+
+	return fails == 0 ? 0 : 1;
+}
@@ -0,0 +1,377 @@
+/*
+ * Host test and benchmark for the status table in comm_can.c.
+ *
+ * comm_can.c is included directly so that decode_msg() can be fed with
+ * status frames from here. The stream is a saturated 1 Mbit/s bus with
+ * NODES nodes that send status 1 to 5 at STATUS_RATE_HZ each.
+ *
+ * The stream is checked for correct decoding and message rates, then decoded
+ * repeatedly for the benchmark. For comparison the same frames go through
+ * the old status storage, five arrays that were searched linearly for every
+ * received frame and every lookup by id. Finally the table is filled up and
+ * most nodes go silent, to check the stale state and that silent nodes are
+ * replaced by new ones.
+ *
+ * Output: ns per decoded frame and per lookup by id for both versions.
+ *
+ * Usage: ./can_status_table [benchmark rounds]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "stubs.h"
+#include "../../comm_can.c"
+
+#define OWN_ID				1
+#define NODES				24
+#define STATUS_RATE_HZ		50
+#define FRAMES_PER_CYCLE	(NODES * 5)
+
+typedef struct {
+	uint32_t eid;
+	uint8_t data[8];
+} status_frame_t;
+
+static status_frame_t m_frames[FRAMES_PER_CYCLE];
+
+// The status storage before the status table, for comparison
+static can_status_msg old_msgs[CAN_STATUS_MSGS_TO_STORE];
+static can_status_msg_2 old_msgs_2[CAN_STATUS_MSGS_TO_STORE];
+static can_status_msg_3 old_msgs_3[CAN_STATUS_MSGS_TO_STORE];
+static can_status_msg_4 old_msgs_4[CAN_STATUS_MSGS_TO_STORE];
+static can_status_msg_5 old_msgs_5[CAN_STATUS_MSGS_TO_STORE];
+
+static inline uint64_t bench_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static uint8_t node_id(int node) {
+	return 3 + node * 10;
+}
+
+static void old_init(void) {
+	for (int i = 0;i < CAN_STATUS_MSGS_TO_STORE;i++) {
+		old_msgs[i].id = -1;
+		old_msgs_2[i].id = -1;
+		old_msgs_3[i].id = -1;
+		old_msgs_4[i].id = -1;
+		old_msgs_5[i].id = -1;
+	}
+}
+
+static void old_decode(uint32_t eid, uint8_t *data8) {
+	int32_t ind = 0;
+	uint8_t id = eid & 0xFF;
+	CAN_PACKET_ID cmd = eid >> 8;
+
+	switch (cmd) {
+	case CAN_PACKET_STATUS:
+		for (int i = 0;i < CAN_STATUS_MSGS_TO_STORE;i++) {
+			can_status_msg *stat_tmp = &old_msgs[i];
+			if (stat_tmp->id == id || stat_tmp->id == -1) {
+				ind = 0;
+				stat_tmp->id = id;
+				stat_tmp->rx_time = chVTGetSystemTime();
+				stat_tmp->rpm = (float)buffer_get_int32(data8, &ind);
+				stat_tmp->current = (float)buffer_get_int16(data8, &ind) / 10.0;
+				stat_tmp->duty = (float)buffer_get_int16(data8, &ind) / 1000.0;
+				break;
+			}
+		}
+		break;
+
+	case CAN_PACKET_STATUS_2:
+		for (int i = 0;i < CAN_STATUS_MSGS_TO_STORE;i++) {
+			can_status_msg_2 *stat_tmp_2 = &old_msgs_2[i];
+			if (stat_tmp_2->id == id || stat_tmp_2->id == -1) {
+				ind = 0;
+				stat_tmp_2->id = id;
+				stat_tmp_2->rx_time = chVTGetSystemTime();
+				stat_tmp_2->amp_hours = (float)buffer_get_int32(data8, &ind) / 1e4;
+				stat_tmp_2->amp_hours_charged = (float)buffer_get_int32(data8, &ind) / 1e4;
+				break;
+			}
+		}
+		break;
+
+	case CAN_PACKET_STATUS_3:
+		for (int i = 0;i < CAN_STATUS_MSGS_TO_STORE;i++) {
+			can_status_msg_3 *stat_tmp_3 = &old_msgs_3[i];
+			if (stat_tmp_3->id == id || stat_tmp_3->id == -1) {
+				ind = 0;
+				stat_tmp_3->id = id;
+				stat_tmp_3->rx_time = chVTGetSystemTime();
+				stat_tmp_3->watt_hours = (float)buffer_get_int32(data8, &ind) / 1e4;
+				stat_tmp_3->watt_hours_charged = (float)buffer_get_int32(data8, &ind) / 1e4;
+				break;
+			}
+		}
+		break;
+
+	case CAN_PACKET_STATUS_4:
+		for (int i = 0;i < CAN_STATUS_MSGS_TO_STORE;i++) {
+			can_status_msg_4 *stat_tmp_4 = &old_msgs_4[i];
+			if (stat_tmp_4->id == id || stat_tmp_4->id == -1) {
+				ind = 0;
+				stat_tmp_4->id = id;
+				stat_tmp_4->rx_time = chVTGetSystemTime();
+				stat_tmp_4->temp_fet = (float)buffer_get_int16(data8, &ind) / 10.0;
+				stat_tmp_4->temp_motor = (float)buffer_get_int16(data8, &ind) / 10.0;
+				stat_tmp_4->current_in = (float)buffer_get_int16(data8, &ind) / 10.0;
+				stat_tmp_4->pid_pos_now = (float)buffer_get_int16(data8, &ind) / 50.0;
+				break;
+			}
+		}
+		break;
+
+	case CAN_PACKET_STATUS_5:
+		for (int i = 0;i < CAN_STATUS_MSGS_TO_STORE;i++) {
+			can_status_msg_5 *stat_tmp_5 = &old_msgs_5[i];
+			if (stat_tmp_5->id == id || stat_tmp_5->id == -1) {
+				ind = 0;
+				stat_tmp_5->id = id;
+				stat_tmp_5->rx_time = chVTGetSystemTime();
+				stat_tmp_5->tacho_value = buffer_get_int32(data8, &ind);
+				stat_tmp_5->v_in = (float)buffer_get_int16(data8, &ind) / 1e1;
+				break;
+			}
+		}
+		break;
+
+	default:
+		break;
+	}
+}
+
+static can_status_msg_5 *old_get_5_id(int id) {
+	for (int i = 0;i < CAN_STATUS_MSGS_TO_STORE;i++) {
+		if (old_msgs_5[i].id == id) {
+			return &old_msgs_5[i];
+		}
+	}
+
+	return 0;
+}
+
+static void make_frame(status_frame_t *f, uint8_t id, int msg, int cycle) {
+	mc_snapshot s;
+	memset(&s, 0, sizeof(s));
+	s.rpm = 1000.0 * id + cycle;
+	s.current_filtered = 0.1 * id;
+	s.duty_now = 0.001 * id;
+	s.amp_hours = 0.01 * cycle;
+	s.watt_hours = 0.5 * cycle;
+	s.temp_fet = 20.0 + 0.1 * id;
+	s.temp_motor = 30.0;
+	s.tachometer = id * 100 + cycle;
+	s.v_in = 40.0 + 0.1 * id;
+
+	int32_t fields[4];
+	status_fields(msg, &s, fields);
+
+	const status_msg_def *def = &status_defs[msg];
+	int32_t ind = 0;
+	for (int j = 0;j < 4 && def->size[j] > 0;j++) {
+		if (def->size[j] == 4) {
+			buffer_append_int32(f->data, fields[j], &ind);
+		} else {
+			buffer_append_int16(f->data, (int16_t)fields[j], &ind);
+		}
+	}
+
+	f->eid = id | ((uint32_t)def->cmd << 8);
+}
+
+static void make_cycle(int cycle) {
+	// Nodes send their messages at the same time, so they arrive interleaved
+	int ind = 0;
+	for (int msg = 0;msg < 5;msg++) {
+		for (int n = 0;n < NODES;n++) {
+			make_frame(&m_frames[ind++], node_id(n), msg, cycle);
+		}
+	}
+}
+
+static void send_node(uint8_t id, int cycle) {
+	for (int msg = 0;msg < 5;msg++) {
+		status_frame_t f;
+		make_frame(&f, id, msg, cycle);
+		decode_msg(f.eid, f.data, 8, false);
+	}
+}
+
+static int count_stale(void) {
+	int stale = 0;
+	for (int i = 0;i < CAN_STATUS_MSGS_TO_STORE;i++) {
+		can_status_node *node = comm_can_get_status_node_index(i);
+		if (node->id >= 0 && UTILS_AGE_S(node->rx_time) >= (CAN_STATUS_STALE_MS / 1000.0)) {
+			stale++;
+		}
+	}
+	return stale;
+}
+
+int main(int argc, char **argv) {
+	int rounds = 20000;
+	if (argc > 1) {
+		rounds = atoi(argv[1]);
+	}
+
+	comm_can_init();
+	stubs_appconf.controller_id = OWN_ID;
+	stubs_appconf.can_mode = CAN_MODE_VESC;
+
+	int fails = 0;
+	const systime_t period = CH_CFG_ST_FREQUENCY / STATUS_RATE_HZ;
+	const int cycles = 2 * STATUS_RATE_HZ;
+
+	printf("Stream: %d nodes, status 1-5 at %d Hz (%d frames/s)\r\n",
+			NODES, STATUS_RATE_HZ, FRAMES_PER_CYCLE * STATUS_RATE_HZ);
+
+	// Decoding, counters and rates
+	for (int c = 0;c < cycles;c++) {
+		make_cycle(c);
+		for (int i = 0;i < FRAMES_PER_CYCLE;i++) {
+			decode_msg(m_frames[i].eid, m_frames[i].data, 8, false);
+		}
+		chThdSleep(period);
+	}
+
+	for (int n = 0;n < NODES;n++) {
+		uint8_t id = node_id(n);
+		can_status_node *node = comm_can_get_status_node_id(id);
+		can_status_msg *msg = comm_can_get_status_msg_id(id);
+		can_status_msg_5 *msg_5 = comm_can_get_status_msg_5_id(id);
+
+		if (!node || !msg || !msg_5 || msg != &node->msg || msg_5 != &node->msg_5) {
+			printf("FAIL: node %d not found\r\n", id);
+			fails++;
+			continue;
+		}
+
+		if (msg->rpm != 1000.0 * id + cycles - 1 ||
+				msg_5->tacho_value != id * 100 + cycles - 1 ||
+				node->msg_2.id != id || node->msg_3.id != id || node->msg_4.id != id) {
+			printf("FAIL: node %d decoded wrong\r\n", id);
+			fails++;
+		}
+
+		for (int j = 0;j < 5;j++) {
+			float rate = 1.0 / node->rx_interval[j];
+			if (node->rx_cnt[j] != (uint32_t)cycles || rate < STATUS_RATE_HZ - 0.5 ||
+					rate > STATUS_RATE_HZ + 0.5) {
+				printf("FAIL: node %d status %d: %u frames at %.1f Hz\r\n",
+						id, j + 1, (unsigned int)node->rx_cnt[j], (double)rate);
+				fails++;
+			}
+		}
+	}
+
+	if (comm_can_get_status_msg_id(2) || comm_can_get_status_node_id(-1) ||
+			comm_can_get_status_node_id(256)) {
+		printf("FAIL: lookup of unknown ids\r\n");
+		fails++;
+	}
+
+	// Benchmark
+	old_init();
+	make_cycle(0);
+
+	uint64_t t_start = bench_ns();
+	for (int r = 0;r < rounds;r++) {
+		for (int i = 0;i < FRAMES_PER_CYCLE;i++) {
+			decode_msg(m_frames[i].eid, m_frames[i].data, 8, false);
+		}
+	}
+	float new_decode = (float)(bench_ns() - t_start) / ((float)rounds * FRAMES_PER_CYCLE);
+
+	t_start = bench_ns();
+	for (int r = 0;r < rounds;r++) {
+		for (int i = 0;i < FRAMES_PER_CYCLE;i++) {
+			old_decode(m_frames[i].eid, m_frames[i].data);
+		}
+	}
+	float old_decode_ns = (float)(bench_ns() - t_start) / ((float)rounds * FRAMES_PER_CYCLE);
+
+	volatile float sink = 0.0;
+	t_start = bench_ns();
+	for (int r = 0;r < rounds;r++) {
+		for (int n = 0;n < NODES;n++) {
+			sink += comm_can_get_status_msg_5_id(node_id(n))->v_in;
+		}
+	}
+	float new_lookup = (float)(bench_ns() - t_start) / ((float)rounds * NODES);
+
+	t_start = bench_ns();
+	for (int r = 0;r < rounds;r++) {
+		for (int n = 0;n < NODES;n++) {
+			sink += old_get_5_id(node_id(n))->v_in;
+		}
+	}
+	float old_lookup = (float)(bench_ns() - t_start) / ((float)rounds * NODES);
+
+	printf("\r\n                 Linear scan   Status table\r\n");
+	printf("  Decode [ns]    %11.1f   %12.1f\r\n", (double)old_decode_ns, (double)new_decode);
+	printf("  Lookup [ns]    %11.1f   %12.1f\r\n", (double)old_lookup, (double)new_lookup);
+
+	// Fill the table, then let all but the first nodes go silent
+	int extra = CAN_STATUS_MSGS_TO_STORE - NODES;
+	for (int i = 0;i < extra;i++) {
+		send_node(240 + i, 0);
+	}
+
+	send_node(250, 0);
+	if (comm_can_get_status_node_id(250)) {
+		printf("FAIL: live node replaced\r\n");
+		fails++;
+	}
+
+	const int live = 4;
+	for (int c = 0;c < (CAN_STATUS_EVICT_MS * STATUS_RATE_HZ) / 1000 + 1;c++) {
+		for (int n = 0;n < live;n++) {
+			send_node(node_id(n), c);
+		}
+		chThdSleep(period);
+	}
+
+	int stale = count_stale();
+	printf("\r\nStale nodes after %d ms: %d of %d\r\n", CAN_STATUS_EVICT_MS,
+			stale, CAN_STATUS_MSGS_TO_STORE);
+	if (stale != CAN_STATUS_MSGS_TO_STORE - live) {
+		printf("FAIL: expected %d stale nodes\r\n", CAN_STATUS_MSGS_TO_STORE - live);
+		fails++;
+	}
+
+	send_node(250, 0);
+	can_status_node *node = comm_can_get_status_node_id(250);
+	if (!node || node->rx_cnt[0] != 1 || node->msg.rpm != 250000.0) {
+		printf("FAIL: new node did not replace a stale node\r\n");
+		fails++;
+	}
+
+	int found = 0;
+	for (int n = 0;n < NODES;n++) {
+		found += comm_can_get_status_msg_id(node_id(n)) != 0;
+	}
+	for (int i = 0;i < extra;i++) {
+		found += comm_can_get_status_msg_id(240 + i) != 0;
+	}
+
+	if (found != CAN_STATUS_MSGS_TO_STORE - 1 || count_stale() != CAN_STATUS_MSGS_TO_STORE - live - 1) {
+		printf("FAIL: %d nodes left after the replacement\r\n", found);
+		fails++;
+	}
+
+	if (fails == 0) {
+		printf("\r\nAll tests passed\r\n");
+	} else {
+		printf("\r\n%d test(s) FAILED\r\n", fails);
+	}
+
+	return fails == 0 ? 0 : 1;
+}
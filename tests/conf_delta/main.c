@@ -0,0 +1,298 @@
+/*
+ * Delta encoding of mcconf and appconf, see confdelta.c.
+ *
+ * Configurations that differ from the defaults in the way they do after
+ * typical setups are sent as deltas and applied on both bases. The result
+ * must serialize to exactly the same bytes as the original. Randomized
+ * configurations check every field type, and broken deltas must be rejected
+ * without changing anything. A table compares the full and delta sizes.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "confgenerator.h"
+#include "confdelta.h"
+
+#define BUFFER_SIZE			2048
+
+typedef struct {
+	const char *name;
+	void (*change_mc)(mc_configuration *conf);
+	void (*change_app)(app_configuration *conf);
+} scenario_t;
+
+static uint8_t m_full[BUFFER_SIZE];
+static uint8_t m_full_ref[BUFFER_SIZE];
+static uint8_t m_delta[BUFFER_SIZE];
+static int m_fails = 0;
+
+static void fail(const char *name, const char *what) {
+	printf("FAIL: %s: %s\r\n", name, what);
+	m_fails++;
+}
+
+static void mc_none(mc_configuration *conf) {
+	(void)conf;
+}
+
+static void mc_motor_r(mc_configuration *conf) {
+	conf->foc_motor_r = 0.0312;
+}
+
+// Results of a FOC motor detection with hall sensors
+static void mc_detection(mc_configuration *conf) {
+	static const uint8_t hall[8] = {255, 147, 13, 180, 80, 113, 46, 255};
+
+	conf->foc_motor_r = 0.0312;
+	conf->foc_motor_l = 0.0000214;
+	conf->foc_motor_flux_linkage = 0.00731;
+	conf->foc_observer_gain = 1.87e7;
+	conf->foc_current_kp = 0.0214;
+	conf->foc_current_ki = 31.2;
+	conf->foc_sensor_mode = FOC_SENSOR_MODE_HALL;
+	memcpy(conf->foc_hall_table, hall, sizeof(hall));
+}
+
+// Detection, limits, battery and setup information
+static void mc_setup(mc_configuration *conf) {
+	mc_detection(conf);
+	conf->l_current_max = 80.0;
+	conf->l_current_min = -80.0;
+	conf->l_in_current_max = 40.0;
+	conf->l_in_current_min = -20.0;
+	conf->l_battery_cut_start = 42.0;
+	conf->l_battery_cut_end = 40.0;
+	conf->l_max_erpm = 60000.0;
+	conf->si_battery_cells = 12;
+	conf->si_motor_poles = 14;
+	conf->si_gear_ratio = 3.2;
+	conf->si_wheel_diameter = 0.083;
+}
+
+static void app_none(app_configuration *conf) {
+	(void)conf;
+}
+
+static void app_ppm(app_configuration *conf) {
+	conf->controller_id = 17;
+	conf->app_to_use = APP_PPM;
+	conf->send_can_status = CAN_STATUS_1_2_3_4;
+	conf->app_ppm_conf.ctrl_type = PPM_CTRL_TYPE_CURRENT;
+	conf->app_ppm_conf.pulse_start = 1.02;
+	conf->app_ppm_conf.pulse_end = 1.98;
+}
+
+static const scenario_t m_scenarios[] = {
+		{"Defaults", mc_none, app_none},
+		{"foc_motor_r only", mc_motor_r, app_none},
+		{"Motor detection", mc_detection, app_none},
+		{"Full setup, PPM app", mc_setup, app_ppm},
+};
+
+// Fills the configuration with random values through the full deserializer
+static void randomize_mcconf(mc_configuration *conf, unsigned int fields) {
+	int32_t len = confgenerator_serialize_mcconf(m_full, conf);
+
+	for (unsigned int i = 0;i < fields;i++) {
+		int32_t pos = 4 + rand() % (len - 4);
+		m_full[pos] = rand();
+	}
+
+	confgenerator_deserialize_mcconf(m_full, conf);
+}
+
+static void randomize_appconf(app_configuration *conf, unsigned int fields) {
+	int32_t len = confgenerator_serialize_appconf(m_full, conf);
+
+	for (unsigned int i = 0;i < fields;i++) {
+		int32_t pos = 4 + rand() % (len - 4);
+		m_full[pos] = rand();
+	}
+
+	confgenerator_deserialize_appconf(m_full, conf);
+}
+
+/*
+ * Send conf as a delta against base and apply it to target. Returns the
+ * delta length, or -1 if the result does not serialize like conf.
+ */
+static int32_t round_trip_mcconf(const mc_configuration *conf, const mc_configuration *base,
+		CONF_DELTA_BASE base_type, mc_configuration *target) {
+	int32_t delta_len = confdelta_serialize_mcconf(m_delta, BUFFER_SIZE,
+			conf, base, base_type);
+
+	if (delta_len < 0 || !confdelta_deserialize_mcconf(m_delta, delta_len, target)) {
+		return -1;
+	}
+
+	int32_t len_ref = confgenerator_serialize_mcconf(m_full_ref, conf);
+	int32_t len = confgenerator_serialize_mcconf(m_full, target);
+	return (len == len_ref && memcmp(m_full, m_full_ref, len) == 0) ? delta_len : -1;
+}
+
+static int32_t round_trip_appconf(const app_configuration *conf, const app_configuration *base,
+		CONF_DELTA_BASE base_type, app_configuration *target) {
+	int32_t delta_len = confdelta_serialize_appconf(m_delta, BUFFER_SIZE,
+			conf, base, base_type);
+
+	if (delta_len < 0 || !confdelta_deserialize_appconf(m_delta, delta_len, target)) {
+		return -1;
+	}
+
+	int32_t len_ref = confgenerator_serialize_appconf(m_full_ref, conf);
+	int32_t len = confgenerator_serialize_appconf(m_full, target);
+	return (len == len_ref && memcmp(m_full, m_full_ref, len) == 0) ? delta_len : -1;
+}
+
+static void test_scenarios(void) {
+	static mc_configuration mc_def, mc, mc_target;
+	static app_configuration app_def, app, app_target;
+
+	confgenerator_set_defaults_mcconf(&mc_def, true);
+	confgenerator_set_defaults_appconf(&app_def);
+
+	int32_t mc_full = confgenerator_serialize_mcconf(m_full, &mc_def);
+	int32_t app_full = confgenerator_serialize_appconf(m_full, &app_def);
+
+	printf("Scenario               mcconf (B)  delta (B)  appconf (B)  delta (B)  Total\r\n");
+
+	for (unsigned int i = 0;i < sizeof(m_scenarios) / sizeof(m_scenarios[0]);i++) {
+		const scenario_t *s = &m_scenarios[i];
+
+		mc = mc_def;
+		app = app_def;
+		s->change_mc(&mc);
+		s->change_app(&app);
+
+		// Against the defaults, applied to a configuration that is not
+		memset(&mc_target, 0x55, sizeof(mc_target));
+		memset(&app_target, 0x55, sizeof(app_target));
+		int32_t mc_delta = round_trip_mcconf(&mc, &mc_def, CONF_DELTA_BASE_DEFAULT, &mc_target);
+		int32_t app_delta = round_trip_appconf(&app, &app_def, CONF_DELTA_BASE_DEFAULT, &app_target);
+
+		if (mc_delta < 0) {
+			fail(s->name, "mcconf differs after applying the delta");
+		}
+
+		if (app_delta < 0) {
+			fail(s->name, "appconf differs after applying the delta");
+		}
+
+		printf("%-21s  %10d  %9d  %11d  %9d  %4.1f%%\r\n", s->name,
+				(int)mc_full, (int)mc_delta, (int)app_full, (int)app_delta,
+				100.0 * (double)(mc_delta + app_delta) / (double)(mc_full + app_full));
+
+		// Against the current configuration of the receiver
+		mc_target = mc_def;
+		mc_detection(&mc_target);
+		if (round_trip_mcconf(&mc, &mc_target, CONF_DELTA_BASE_CURRENT, &mc_target) < 0) {
+			fail(s->name, "mcconf differs after applying the delta to the current configuration");
+		}
+	}
+
+	// A one-field change is the field ID and the value
+	mc = mc_def;
+	mc_motor_r(&mc);
+	if (confdelta_serialize_mcconf(m_delta, BUFFER_SIZE, &mc, &mc_def,
+			CONF_DELTA_BASE_CURRENT) != 5 + 1 + 4) {
+		fail("foc_motor_r only", "unexpected delta length");
+	}
+
+	// Too small buffer
+	mc = mc_def;
+	mc_setup(&mc);
+	if (confdelta_serialize_mcconf(m_delta, 20, &mc, &mc_def, CONF_DELTA_BASE_DEFAULT) != -1) {
+		fail("Full setup, PPM app", "delta did not report that it does not fit");
+	}
+}
+
+static void test_random(void) {
+	static mc_configuration mc_def, mc, mc_base, mc_target;
+	static app_configuration app_def, app, app_base, app_target;
+
+	confgenerator_set_defaults_mcconf(&mc_def, true);
+	confgenerator_set_defaults_appconf(&app_def);
+
+	for (int i = 0;i < 2000;i++) {
+		unsigned int fields = rand() % 64;
+
+		mc_base = mc_def;
+		randomize_mcconf(&mc_base, rand() % 64);
+		mc = mc_base;
+		randomize_mcconf(&mc, fields);
+		mc_target = mc_base;
+
+		if (round_trip_mcconf(&mc, &mc_base, CONF_DELTA_BASE_CURRENT, &mc_target) < 0) {
+			fail("Random mcconf", "differs after applying the delta");
+			break;
+		}
+
+		app_base = app_def;
+		randomize_appconf(&app_base, rand() % 64);
+		app = app_base;
+		randomize_appconf(&app, fields);
+		app_target = app_base;
+
+		if (round_trip_appconf(&app, &app_base, CONF_DELTA_BASE_CURRENT, &app_target) < 0) {
+			fail("Random appconf", "differs after applying the delta");
+			break;
+		}
+	}
+}
+
+static void test_invalid(void) {
+	static mc_configuration mc_def, mc, mc_target, mc_before;
+
+	confgenerator_set_defaults_mcconf(&mc_def, true);
+	mc = mc_def;
+	mc_setup(&mc);
+
+	int32_t len = confdelta_serialize_mcconf(m_delta, BUFFER_SIZE, &mc, &mc_def,
+			CONF_DELTA_BASE_DEFAULT);
+
+	static uint8_t broken[BUFFER_SIZE];
+	const struct {
+		const char *name;
+		int pos;
+		int value;
+		int len_change;
+	} cases[] = {
+			{"Wrong signature", 0, 0x12, 0},
+			{"Unknown base", 4, 7, 0},
+			{"Field ID out of range", 5, 255, 0},
+			{"Field IDs out of order", 10, 0, 0},
+			{"Truncated", -1, 0, -1},
+			{"Trailing byte", -1, 0, 1},
+	};
+
+	for (unsigned int i = 0;i < sizeof(cases) / sizeof(cases[0]);i++) {
+		memcpy(broken, m_delta, len);
+		broken[len] = 0;
+		if (cases[i].pos >= 0) {
+			broken[cases[i].pos] = cases[i].value;
+		}
+
+		mc_target = mc_def;
+		mc_motor_r(&mc_target);
+		mc_before = mc_target;
+
+		if (confdelta_deserialize_mcconf(broken, len + cases[i].len_change, &mc_target)) {
+			fail(cases[i].name, "accepted");
+		} else if (memcmp(&mc_target, &mc_before, sizeof(mc_target)) != 0) {
+			fail(cases[i].name, "configuration changed");
+		}
+	}
+}
+
+int main(void) {
+	srand(1);
+
+	test_scenarios();
+	test_random();
+	test_invalid();
+
+	printf("\r\n%s\r\n", m_fails ? "FAILED" : "All tests passed");
+	return m_fails ? 1 : 0;
+}
@@ -0,0 +1,122 @@
+/*
+ * Throughput of the CRC16 variants that crc.c can be built with, see
+ * CRC16_SLICING in crc.h. The slicing variants are checked against the byte
+ * table first, including incremental updates with odd split points.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+typedef unsigned short (*crc16_update_t)(unsigned short crc,
+		const unsigned char *buf, unsigned int len);
+
+unsigned short crc16_update_s1(unsigned short crc, const unsigned char *buf, unsigned int len);
+unsigned short crc16_update_s4(unsigned short crc, const unsigned char *buf, unsigned int len);
+unsigned short crc16_update_s8(unsigned short crc, const unsigned char *buf, unsigned int len);
+unsigned short crc16_s1(unsigned char *buf, unsigned int len);
+unsigned short crc16_s4(unsigned char *buf, unsigned int len);
+unsigned short crc16_s8(unsigned char *buf, unsigned int len);
+
+static const struct {
+	const char *name;
+	crc16_update_t update;
+	unsigned short (*crc16)(unsigned char *buf, unsigned int len);
+} m_variants[] = {
+		{"byte table", crc16_update_s1, crc16_s1},
+		{"slicing-by-4", crc16_update_s4, crc16_s4},
+		{"slicing-by-8", crc16_update_s8, crc16_s8},
+};
+
+#define VARIANTS		(sizeof(m_variants) / sizeof(m_variants[0]))
+#define BUFFER_SIZE		4096
+
+static unsigned char m_buffer[BUFFER_SIZE + 8];
+static volatile unsigned short m_sink;
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+static int check(void) {
+	int errors = 0;
+
+	for (unsigned int v = 0;v < VARIANTS;v++) {
+		unsigned short crc = m_variants[v].crc16((unsigned char*)"123456789", 9);
+		if (crc != 0x31C3) {
+			printf("%s: check value 0x%04X, expected 0x31C3\n", m_variants[v].name, crc);
+			errors++;
+		}
+	}
+
+	for (int i = 0;i < 2000;i++) {
+		unsigned int len = rand() % BUFFER_SIZE;
+		unsigned int offset = rand() % 8;
+		unsigned int split = len ? rand() % len : 0;
+		unsigned char *buf = m_buffer + offset;
+		unsigned short ref = crc16_s1(buf, len);
+
+		for (unsigned int v = 1;v < VARIANTS;v++) {
+			unsigned short whole = m_variants[v].crc16(buf, len);
+			unsigned short parts = m_variants[v].update(
+					m_variants[v].update(0, buf, split), buf + split, len - split);
+
+			if (whole != ref || parts != ref) {
+				printf("%s: len %u offset %u split %u: 0x%04X 0x%04X, expected 0x%04X\n",
+						m_variants[v].name, len, offset, split, whole, parts, ref);
+				errors++;
+			}
+		}
+	}
+
+	return errors;
+}
+
+static double throughput(crc16_update_t update, unsigned int len) {
+	// Roughly 64 MB per measurement
+	unsigned int iterations = (64 * 1024 * 1024) / len;
+	unsigned short crc = 0;
+
+	double start = now();
+	for (unsigned int i = 0;i < iterations;i++) {
+		crc = update(crc, m_buffer, len);
+	}
+	double time = now() - start;
+
+	m_sink = crc;
+	return ((double)iterations * (double)len) / time / 1e6;
+}
+
+int main(void) {
+	static const unsigned int sizes[] = {8, 64, 512, 4096};
+
+	srand(4);
+	for (unsigned int i = 0;i < sizeof(m_buffer);i++) {
+		m_buffer[i] = rand();
+	}
+
+	int errors = check();
+	if (errors) {
+		printf("%d mismatches\n", errors);
+		return 1;
+	}
+
+	printf("%-14s", "MB/s");
+	for (unsigned int s = 0;s < sizeof(sizes) / sizeof(sizes[0]);s++) {
+		printf("%10u B", sizes[s]);
+	}
+	printf("\n");
+
+	for (unsigned int v = 0;v < VARIANTS;v++) {
+		printf("%-14s", m_variants[v].name);
+		for (unsigned int s = 0;s < sizeof(sizes) / sizeof(sizes[0]);s++) {
+			printf("%12.1f", throughput(m_variants[v].update, sizes[s]));
+		}
+		printf("\n");
+	}
+
+	return 0;
+}
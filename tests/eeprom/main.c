@@ -0,0 +1,373 @@
+/*
+ * Test and benchmark for the emulated EEPROM in eeprom.c, running on the
+ * flash model from tests/host.
+ *
+ * The variables are laid out like conf_general.c does. A reference model
+ * tracks the expected value of every variable through many writes and page
+ * transfers, and everything is read back both through EE_ReadVariable and
+ * with the page scan that EE_ReadVariable used before it had an index.
+ * Loading the motor and app configuration is timed both ways.
+ *
+ * Storing a configuration with EE_WriteBlock is compared to storing it word
+ * by word with EE_WriteVariable, starting from the same flash contents.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "eeprom.h"
+#include "host_flash.h"
+
+// Same layout as conf_general.c
+#define EEPROM_BASE_MCCONF		1000
+#define EEPROM_BASE_APPCONF		2000
+#define EEPROM_BASE_HW			3000
+#define EEPROM_BASE_CUSTOM		4000
+#define EEPROM_BASE_MCCONF_2	5000
+
+#define MCCONF_WORDS			(sizeof(mc_configuration) / 2)
+#define APPCONF_WORDS			(sizeof(app_configuration) / 2)
+#define MODEL_SIZE				6000
+
+uint16_t VirtAddVarTab[NB_OF_VAR];
+
+typedef struct {
+	uint32_t programs;
+	uint32_t erases;
+	uint16_t programmed;
+	double us;
+} store_result_t;
+
+static int32_t m_model[MODEL_SIZE];
+static uint8_t m_snapshot[2 * PAGE_SIZE];
+static int m_fails = 0;
+static int m_transfers = 0;
+
+uint8_t* flash_helper_get_sector_address(uint32_t fsector) {
+	return host_flash_sector_address(fsector);
+}
+
+static uint64_t time_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static void check(bool ok, const char *what) {
+	if (!ok) {
+		printf("FAIL: %s\r\n", what);
+		m_fails++;
+	}
+}
+
+/*
+ * The backwards scan of the valid page that EE_ReadVariable did for every
+ * read before the index.
+ */
+static uint16_t read_scan(uint16_t virt, uint16_t *data) {
+	uint32_t start;
+
+	if (*(uint16_t*)(uintptr_t)PAGE0_BASE_ADDRESS == VALID_PAGE) {
+		start = PAGE0_BASE_ADDRESS;
+	} else if (*(uint16_t*)(uintptr_t)PAGE1_BASE_ADDRESS == VALID_PAGE) {
+		start = PAGE1_BASE_ADDRESS;
+	} else {
+		return NO_VALID_PAGE;
+	}
+
+	for (uint32_t addr = start + PAGE_SIZE - 2;addr > start + 2;addr -= 4) {
+		if (*(uint16_t*)(uintptr_t)addr == virt) {
+			*data = *(uint16_t*)(uintptr_t)(addr - 2);
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+static void setup_var_tab(void) {
+	memset(VirtAddVarTab, 0, sizeof(VirtAddVarTab));
+
+	int ind = 0;
+	for (unsigned int i = 0;i < MCCONF_WORDS;i++) {
+		VirtAddVarTab[ind++] = EEPROM_BASE_MCCONF + i;
+	}
+
+	for (unsigned int i = 0;i < APPCONF_WORDS;i++) {
+		VirtAddVarTab[ind++] = EEPROM_BASE_APPCONF + i;
+	}
+
+	for (unsigned int i = 0;i < (EEPROM_VARS_HW * 2);i++) {
+		VirtAddVarTab[ind++] = EEPROM_BASE_HW + i;
+	}
+
+	for (unsigned int i = 0;i < (EEPROM_VARS_CUSTOM * 2);i++) {
+		VirtAddVarTab[ind++] = EEPROM_BASE_CUSTOM + i;
+	}
+}
+
+static void check_transfer(uint16_t page0_before) {
+	// The second motor configuration is not in VirtAddVarTab, so it is lost
+	// at page transfers.
+	if (*(uint16_t*)(uintptr_t)PAGE0_BASE_ADDRESS != page0_before) {
+		m_transfers++;
+		for (int i = EEPROM_BASE_MCCONF_2;i < MODEL_SIZE;i++) {
+			m_model[i] = -1;
+		}
+	}
+}
+
+static void write_var(uint16_t virt, uint16_t data) {
+	uint16_t page0 = *(uint16_t*)(uintptr_t)PAGE0_BASE_ADDRESS;
+	uint16_t res = EE_WriteVariable(virt, data);
+	check(res == FLASH_COMPLETE, "EE_WriteVariable");
+	check_transfer(page0);
+	m_model[virt] = data;
+}
+
+static void write_range(uint16_t base, unsigned int words, int changes) {
+	for (unsigned int i = 0;i < words;i++) {
+		if (changes < 0 || (rand() % 100) < changes) {
+			write_var(base + i, rand());
+		}
+	}
+}
+
+/*
+ * Write random custom variables until only margin bytes are left in the
+ * valid page.
+ */
+static void fill_page(unsigned int margin) {
+	for (;;) {
+		uint32_t start = *(uint16_t*)(uintptr_t)PAGE0_BASE_ADDRESS == VALID_PAGE ?
+				PAGE0_BASE_ADDRESS : PAGE1_BASE_ADDRESS;
+		if (*(uint32_t*)(uintptr_t)(start + PAGE_SIZE - margin) != 0xFFFFFFFF) {
+			break;
+		}
+		write_var(EEPROM_BASE_CUSTOM + (rand() % (EEPROM_VARS_CUSTOM * 2)), rand());
+	}
+}
+
+static void verify_all(const char *when) {
+	int mismatch = 0;
+
+	for (int virt = 0;virt < MODEL_SIZE;virt++) {
+		uint16_t d_index = 0, d_scan = 0;
+		uint16_t r_index = EE_ReadVariable(virt, &d_index);
+		uint16_t r_scan = read_scan(virt, &d_scan);
+
+		if (r_index != r_scan || (r_index == 0 && d_index != d_scan)) {
+			mismatch++;
+		} else if (m_model[virt] < 0) {
+			mismatch += r_index != 1;
+		} else {
+			mismatch += r_index != 0 || d_index != m_model[virt];
+		}
+	}
+
+	if (mismatch) {
+		printf("FAIL: %d mismatching variables %s\r\n", mismatch, when);
+		m_fails++;
+	}
+}
+
+static void load_config(uint16_t (*read)(uint16_t, uint16_t*), uint16_t *buf) {
+	for (unsigned int i = 0;i < MCCONF_WORDS;i++) {
+		read(EEPROM_BASE_MCCONF + i, &buf[i]);
+	}
+
+	for (unsigned int i = 0;i < APPCONF_WORDS;i++) {
+		read(EEPROM_BASE_APPCONF + i, &buf[MCCONF_WORDS + i]);
+	}
+}
+
+static double time_config_load(uint16_t (*read)(uint16_t, uint16_t*), int rounds) {
+	static uint16_t buf[MCCONF_WORDS + APPCONF_WORDS];
+	uint64_t start = time_ns();
+	for (int i = 0;i < rounds;i++) {
+		load_config(read, buf);
+	}
+	return (double)(time_ns() - start) / (double)rounds;
+}
+
+static void benchmark(const char *state) {
+	static uint16_t buf_index[MCCONF_WORDS + APPCONF_WORDS];
+	static uint16_t buf_scan[MCCONF_WORDS + APPCONF_WORDS];
+
+	load_config(EE_ReadVariable, buf_index);
+	load_config(read_scan, buf_scan);
+	check(memcmp(buf_index, buf_scan, sizeof(buf_index)) == 0, "config load");
+
+	uint64_t start = time_ns();
+	EE_Init();
+	double t_init = (double)(time_ns() - start);
+
+	double t_scan = time_config_load(read_scan, 20);
+	double t_index = time_config_load(EE_ReadVariable, 200);
+
+	printf("Config load, %s (%u words):\r\n", state,
+			(unsigned int)(MCCONF_WORDS + APPCONF_WORDS));
+	printf("  Page scan:   %10.1f us\r\n", t_scan / 1000.0);
+	printf("  Index:       %10.1f us (EE_Init %.1f us)\r\n", t_index / 1000.0, t_init / 1000.0);
+	printf("  Speedup:     %10.1fx\r\n", t_scan / t_index);
+}
+
+/*
+ * Store words starting at base, either with EE_WriteBlock or word by word.
+ */
+static void store(bool block, uint16_t base, const uint16_t *data, unsigned int words,
+		store_result_t *res) {
+	uint16_t page0 = *(uint16_t*)(uintptr_t)PAGE0_BASE_ADDRESS;
+	uint16_t status = FLASH_COMPLETE;
+
+	host_flash_reset_stats();
+	res->programmed = 0;
+	uint64_t start = time_ns();
+
+	if (block) {
+		status = EE_WriteBlock(base, data, words, &res->programmed);
+	} else {
+		for (unsigned int i = 0;i < words && status == FLASH_COMPLETE;i++) {
+			status = EE_WriteVariable(base + i, data[i]);
+		}
+	}
+
+	res->us = (double)(time_ns() - start) / 1000.0;
+	res->programs = host_flash_stats.programs;
+	res->erases = host_flash_stats.erases;
+
+	check(status == FLASH_COMPLETE, block ? "EE_WriteBlock" : "EE_WriteVariable loop");
+	check(host_flash_stats.bad_programs == 0, "programming of non-erased flash");
+
+	check_transfer(page0);
+	for (unsigned int i = 0;i < words;i++) {
+		m_model[base + i] = data[i];
+	}
+}
+
+/*
+ * Change the given percentage of the words stored at base and store them
+ * both ways from the same starting point.
+ */
+static void compare_store(const char *name, uint16_t base, unsigned int words, int changes) {
+	static uint16_t data[MCCONF_WORDS + APPCONF_WORDS];
+	store_result_t res_word, res_block;
+	int changed = 0;
+
+	for (unsigned int i = 0;i < words;i++) {
+		data[i] = m_model[base + i];
+		if ((rand() % 100) < changes) {
+			data[i] ^= 1 + (rand() % 0xFFFF);
+			changed++;
+		}
+	}
+
+	int transfers_before = m_transfers;
+	memcpy(m_snapshot, (void*)(uintptr_t)EEPROM_START_ADDRESS, sizeof(m_snapshot));
+	store(false, base, data, words, &res_word);
+	verify_all("after word by word store");
+
+	memcpy((void*)(uintptr_t)EEPROM_START_ADDRESS, m_snapshot, sizeof(m_snapshot));
+	m_transfers = transfers_before;
+	check(EE_Init() == FLASH_COMPLETE, "EE_Init after restoring flash");
+	store(true, base, data, words, &res_block);
+	verify_all("after block store");
+
+	printf("Store %s, %d of %u words changed:\r\n", name, changed, words);
+	printf("  Word by word: %5u programs, %u erases, %8.1f us\r\n",
+			(unsigned int)res_word.programs, (unsigned int)res_word.erases, res_word.us);
+	printf("  Block:        %5u programs, %u erases, %8.1f us, %u variables programmed\r\n",
+			(unsigned int)res_block.programs, (unsigned int)res_block.erases, res_block.us,
+			res_block.programmed);
+
+	check(res_block.erases <= 1, "at most one compaction");
+	if (res_block.erases == 0) {
+		check(res_block.programmed == changed, "only changed words programmed");
+		check(res_block.programs == 2 * (uint32_t)changed, "two programs per variable");
+	}
+
+	// Storing the same data again should not touch the flash
+	store(true, base, data, words, &res_block);
+	check(res_block.programs == 0 && res_block.programmed == 0, "store of unchanged block");
+}
+
+int main(void) {
+	srand(42);
+	setup_var_tab();
+	for (int i = 0;i < MODEL_SIZE;i++) {
+		m_model[i] = -1;
+	}
+
+	host_flash_erase_all();
+	FLASH_Unlock();
+
+	// First boot formats the EEPROM
+	check(EE_Init() == FLASH_COMPLETE, "EE_Init on erased flash");
+	verify_all("after format");
+
+	// Store everything once, like the first configuration write
+	write_range(EEPROM_BASE_MCCONF, MCCONF_WORDS, -1);
+	write_range(EEPROM_BASE_APPCONF, APPCONF_WORDS, -1);
+	write_range(EEPROM_BASE_HW, EEPROM_VARS_HW * 2, -1);
+	verify_all("after first store");
+	benchmark("fresh page");
+
+	// Many partial updates, going through several page transfers
+	for (int round = 0;round < 150;round++) {
+		write_range(EEPROM_BASE_MCCONF, MCCONF_WORDS, 10);
+		write_range(EEPROM_BASE_APPCONF, APPCONF_WORDS, 10);
+		write_range(EEPROM_BASE_CUSTOM, EEPROM_VARS_CUSTOM * 2, 5);
+
+		check(host_flash_stats.bad_programs == 0, "programming of non-erased flash");
+
+		// Writing the same value should not use flash
+		host_flash_reset_stats();
+		write_var(EEPROM_BASE_MCCONF, m_model[EEPROM_BASE_MCCONF]);
+		check(host_flash_stats.programs == 0, "rewrite of same value");
+
+		write_range(EEPROM_BASE_MCCONF_2, 8, 50);
+		verify_all("after update round");
+
+		// Reboot every now and then
+		if ((round % 7) == 0) {
+			check(EE_Init() == FLASH_COMPLETE, "EE_Init on reboot");
+			verify_all("after reboot");
+		}
+	}
+
+	printf("Page transfers: %d\r\n", m_transfers);
+	check(m_transfers >= 2, "page transfers happened");
+
+	// Fill the page as much as possible without transferring, to measure the
+	// worst case of the scan.
+	fill_page(64);
+	verify_all("with full page");
+	benchmark("full page");
+
+	// Power loss after the data half of an entry was written, before its
+	// virtual address. The entry must be ignored and skipped.
+	host_flash_fail_after(1, FLASH_ERROR_PROGRAM);
+	uint16_t virt = EEPROM_BASE_APPCONF + 3;
+	EE_WriteVariable(virt, m_model[virt] ^ 0x5A5A);
+	check(EE_Init() == FLASH_COMPLETE, "EE_Init after power loss");
+	verify_all("after interrupted write");
+	write_var(virt, m_model[virt] ^ 0xA5A5);
+	verify_all("after write following interrupted write");
+
+	// Block stores with room in the page and with a nearly full page, where
+	// the block has to be written during a page transfer.
+	compare_store("mcconf", EEPROM_BASE_MCCONF, MCCONF_WORDS, 5);
+	compare_store("appconf", EEPROM_BASE_APPCONF, APPCONF_WORDS, 20);
+	fill_page(200);
+	compare_store("appconf in full page", EEPROM_BASE_APPCONF, APPCONF_WORDS, 30);
+
+	if (m_fails) {
+		printf("%d checks failed\r\n", m_fails);
+		return 1;
+	}
+
+	printf("All tests passed\r\n");
+	return 0;
+}
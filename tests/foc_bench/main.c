@@ -0,0 +1,354 @@
+/*
+ * Host benchmark for the FOC interrupt handler.
+ *
+ * mcpwm_foc.c is included directly so that its private functions can be
+ * timed one by one. The handler is driven by the virtual motor from
+ * virtual_motor.c, exactly as on the hardware when the virtual motor is
+ * connected, with all STM32 registers backed by host memory.
+ *
+ * Output: ns (and TSC cycles on x86) per ISR call for a few typical
+ * operating points, followed by a per-function breakdown obtained by
+ * replaying inputs recorded from the closed loop run. The breakdown includes
+ * computing the constants that are derived from the configuration and the
+ * motor temperature, which the ISR did on every cycle before they were
+ * cached.
+ *
+ * Usage: ./foc_bench [PWM periods per scenario]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define BENCH_HAS_TSC		1
+#else
+#define BENCH_HAS_TSC		0
+#endif
+
+#include "stubs.h"
+#include "confgenerator.h"
+
+// The ISR is renamed so that the version called by the virtual motor can be
+// wrapped with a timer below.
+#define mcpwm_foc_adc_int_handler	foc_isr_under_test
+#include "../../mcpwm_foc.c"
+#undef mcpwm_foc_adc_int_handler
+
+#define TRACE_LEN			4096
+
+typedef struct {
+	const char *name;
+	mc_foc_sensor_mode sensor_mode;
+	mc_foc_observer_type observer_type;
+	float current;
+	float load;
+	float saliency;
+} bench_scenario_t;
+
+typedef struct {
+	float v_alpha;
+	float v_beta;
+	float i_alpha;
+	float i_beta;
+	float phase;
+	float mod_alpha;
+	float mod_beta;
+	float iq_target;
+} bench_trace_t;
+
+typedef struct {
+	uint64_t ns;
+	uint64_t cycles;
+	uint64_t calls;
+} bench_timing_t;
+
+static const bench_scenario_t m_scenarios[] = {
+		{"Sensorless, Ortega original, 10 A", FOC_SENSOR_MODE_SENSORLESS, FOC_OBSERVER_ORTEGA_ORIGINAL, 10.0, 0.12, 1.0},
+		{"Sensorless, Ortega iterative, 10 A", FOC_SENSOR_MODE_SENSORLESS, FOC_OBSERVER_ORTEGA_ITERATIVE, 10.0, 0.12, 1.0},
+		{"Sensorless, Ortega original, 4 A, salient", FOC_SENSOR_MODE_SENSORLESS, FOC_OBSERVER_ORTEGA_ORIGINAL, 4.0, 0.03, 1.3},
+};
+
+static bench_timing_t m_isr_timing;
+static bench_trace_t m_trace[TRACE_LEN];
+static int m_trace_len = 0;
+static volatile float m_sink;
+
+static inline uint64_t bench_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static inline uint64_t bench_cycles(void) {
+#if BENCH_HAS_TSC
+	return __rdtsc();
+#else
+	return 0;
+#endif
+}
+
+void mcpwm_foc_adc_int_handler(void *p, uint32_t flags);
+void mcpwm_foc_adc_int_handler(void *p, uint32_t flags) {
+	// Only the calls that run the control loop are timed
+	if (!(TIM1->CR1 & TIM_CR1_DIR)) {
+		foc_isr_under_test(p, flags);
+		return;
+	}
+
+	uint64_t c0 = bench_cycles();
+	uint64_t t0 = bench_ns();
+	foc_isr_under_test(p, flags);
+	uint64_t t1 = bench_ns();
+	uint64_t c1 = bench_cycles();
+
+	m_isr_timing.ns += t1 - t0;
+	m_isr_timing.cycles += c1 - c0;
+	m_isr_timing.calls++;
+
+	if (m_trace_len < TRACE_LEN && m_motor_1.m_state == MC_STATE_RUNNING) {
+		volatile motor_state_t *s = &m_motor_1.m_motor_state;
+		bench_trace_t *t = &m_trace[m_trace_len++];
+		t->v_alpha = s->v_alpha;
+		t->v_beta = s->v_beta;
+		t->i_alpha = s->i_alpha;
+		t->i_beta = s->i_beta;
+		t->phase = s->phase;
+		t->mod_alpha = s->v_alpha / ((2.0 / 3.0) * s->v_bus);
+		t->mod_beta = s->v_beta / ((2.0 / 3.0) * s->v_bus);
+		t->iq_target = s->iq_target;
+	}
+}
+
+/*
+ * Does what mcpwm_foc_init does, minus the ADC/DMA setup and the current
+ * offset calibration, which would wait for interrupts that never come.
+ */
+static void bench_init(mc_configuration *conf) {
+	memset((void*)&m_motor_1, 0, sizeof(motor_all_state_t));
+	m_isr_motor = 0;
+	m_motor_1.m_conf = conf;
+	chMtxObjectInit(&m_derived_mutex);
+	update_derived(&m_motor_1);
+	m_motor_1.m_state = MC_STATE_OFF;
+	m_motor_1.m_control_mode = CONTROL_MODE_NONE;
+	m_motor_1.m_hall_dt_diff_last = 1.0;
+	m_motor_1.m_curr_ofs[0] = 2048;
+	m_motor_1.m_curr_ofs[1] = 2048;
+	m_motor_1.m_curr_ofs[2] = 2048;
+	update_hfi_samples(conf->foc_hfi_samples, &m_motor_1);
+
+	timer_reinit((int)conf->foc_f_sw);
+
+	m_dccal_done = true;
+	m_init_done = true;
+}
+
+static void bench_connect_motor(const mc_configuration *conf, float load, float saliency) {
+	char args[7][32];
+	const char *argv[8];
+
+	// ml J Ld Lq Rs lambda Vbus
+	snprintf(args[0], 32, "%f", (double)load);
+	snprintf(args[1], 32, "%f", 0.0002);
+	snprintf(args[2], 32, "%f", (double)(conf->foc_motor_l * (3.0 / 2.0)));
+	snprintf(args[3], 32, "%f", (double)(conf->foc_motor_l * (3.0 / 2.0) * saliency));
+	snprintf(args[4], 32, "%f", (double)(conf->foc_motor_r * (3.0 / 2.0)));
+	snprintf(args[5], 32, "%f", (double)conf->foc_motor_flux_linkage);
+	snprintf(args[6], 32, "%f", 30.0);
+
+	argv[0] = "connect_virtual_motor";
+	for (int i = 0;i < 7;i++) {
+		argv[i + 1] = args[i];
+	}
+
+	stubs_terminal_run(8, argv);
+}
+
+static void bench_disconnect_motor(void) {
+	const char *argv[] = {"disconnect_virtual_motor"};
+	stubs_terminal_run(1, argv);
+}
+
+/*
+ * Run the closed loop for the given number of PWM periods, including the
+ * 1 kHz timer thread and the HFI thread at their nominal rates. The sample
+ * interrupt comes twice per period and the control loop only runs on the
+ * one where TIM1 is counting down (V0), as on the hardware.
+ */
+static void bench_run(int periods) {
+	const float f_sample = 1.0 / mcpwm_foc_get_ts();
+	const int timer_div = (int)(f_sample / 1000.0);
+	const int hfi_div = (int)(f_sample / 2000.0);
+
+	for (int i = 0;i < 2 * periods;i++) {
+		TIM1->CR1 ^= TIM_CR1_DIR;
+		mcpwm_foc_tim_sample_int_handler();
+
+		if ((i % timer_div) == 0) {
+			timer_update(&m_motor_1, 0.001);
+			run_pid_control_speed(0.001, &m_motor_1);
+		}
+
+		if ((i % hfi_div) == 0) {
+			hfi_update(&m_motor_1);
+		}
+	}
+}
+
+static void print_timing(const char *name, uint64_t ns, uint64_t cycles, uint64_t calls) {
+	printf("  %-24s %8.1f ns", name, (double)ns / (double)calls);
+#if BENCH_HAS_TSC
+	printf(" %8.1f cycles", (double)cycles / (double)calls);
+#else
+	(void)cycles;
+#endif
+	printf("\r\n");
+}
+
+static void bench_functions(volatile motor_all_state_t *motor, int rounds) {
+	const float dt = 2.0 * mcpwm_foc_get_ts();
+	uint64_t t0, c0;
+
+	if (m_trace_len == 0) {
+		return;
+	}
+
+	// observer_update
+	float x1 = motor->m_observer_x1;
+	float x2 = motor->m_observer_x2;
+	float phase = 0.0;
+	c0 = bench_cycles();
+	t0 = bench_ns();
+	for (int r = 0;r < rounds;r++) {
+		for (int i = 0;i < m_trace_len;i++) {
+			bench_trace_t *t = &m_trace[i];
+			observer_update(t->v_alpha, t->v_beta, t->i_alpha, t->i_beta, dt,
+					&x1, &x2, &phase, motor);
+		}
+	}
+	print_timing("observer_update", bench_ns() - t0, bench_cycles() - c0, (uint64_t)rounds * m_trace_len);
+	m_sink = phase;
+
+	// pll_run
+	float pll_phase = 0.0;
+	float pll_speed = 0.0;
+	c0 = bench_cycles();
+	t0 = bench_ns();
+	for (int r = 0;r < rounds;r++) {
+		for (int i = 0;i < m_trace_len;i++) {
+			pll_run(m_trace[i].phase, dt, &pll_phase, &pll_speed, motor->m_conf);
+		}
+	}
+	print_timing("pll_run", bench_ns() - t0, bench_cycles() - c0, (uint64_t)rounds * m_trace_len);
+	m_sink = pll_speed;
+
+	// svm
+	uint32_t duty1, duty2, duty3, sector;
+	uint32_t duty_sum = 0;
+	c0 = bench_cycles();
+	t0 = bench_ns();
+	for (int r = 0;r < rounds;r++) {
+		for (int i = 0;i < m_trace_len;i++) {
+			svm(-m_trace[i].mod_alpha, -m_trace[i].mod_beta, TIM1->ARR,
+					&duty1, &duty2, &duty3, &sector);
+			duty_sum += duty1 + duty2 + duty3 + sector;
+		}
+	}
+	print_timing("svm", bench_ns() - t0, bench_cycles() - c0, (uint64_t)rounds * m_trace_len);
+	m_sink = duty_sum;
+
+	// control_current
+	c0 = bench_cycles();
+	t0 = bench_ns();
+	for (int r = 0;r < rounds;r++) {
+		for (int i = 0;i < m_trace_len;i++) {
+			bench_trace_t *t = &m_trace[i];
+			motor->m_motor_state.phase = t->phase;
+			motor->m_motor_state.i_alpha = t->i_alpha;
+			motor->m_motor_state.i_beta = t->i_beta;
+			motor->m_motor_state.iq_target = t->iq_target;
+			control_current(motor, dt);
+		}
+	}
+	print_timing("control_current", bench_ns() - t0, bench_cycles() - c0, (uint64_t)rounds * m_trace_len);
+
+	// compute_derived
+	foc_derived_t derived;
+	c0 = bench_cycles();
+	t0 = bench_ns();
+	for (int r = 0;r < rounds;r++) {
+		for (int i = 0;i < m_trace_len;i++) {
+			compute_derived(motor, &derived);
+		}
+	}
+	print_timing("compute_derived", bench_ns() - t0, bench_cycles() - c0, (uint64_t)rounds * m_trace_len);
+	m_sink = derived.r;
+}
+
+int main(int argc, char **argv) {
+	int periods = 250000;
+	if (argc > 1) {
+		periods = atoi(argv[1]);
+	}
+
+	for (unsigned int s = 0;s < sizeof(m_scenarios) / sizeof(m_scenarios[0]);s++) {
+		const bench_scenario_t *sc = &m_scenarios[s];
+
+		confgenerator_set_defaults_mcconf(&stubs_mcconf, true);
+		stubs_mcconf.foc_sensor_mode = sc->sensor_mode;
+		stubs_mcconf.foc_observer_type = sc->observer_type;
+
+		// The virtual motor uses the same angle for the electrical and the
+		// mechanical rotor position, which is only consistent for one pole pair.
+		stubs_mcconf.si_motor_poles = 2;
+
+		// Normally derived from the temperature and voltage limits by mc_interface
+		stubs_mcconf.lo_current_max = stubs_mcconf.l_current_max;
+		stubs_mcconf.lo_current_min = stubs_mcconf.l_current_min;
+		stubs_mcconf.lo_in_current_max = stubs_mcconf.l_in_current_max;
+		stubs_mcconf.lo_in_current_min = stubs_mcconf.l_in_current_min;
+		stubs_mcconf.lo_current_motor_max_now = stubs_mcconf.l_current_max;
+		stubs_mcconf.lo_current_motor_min_now = stubs_mcconf.l_current_min;
+
+		bench_init(&stubs_mcconf);
+		virtual_motor_init();
+		bench_connect_motor(&stubs_mcconf, sc->load, sc->saliency);
+		mcpwm_foc_set_current(sc->current);
+
+		memset(&m_isr_timing, 0, sizeof(m_isr_timing));
+		m_trace_len = 0;
+
+		// Let the observer and the speed settle before recording
+		bench_run(periods / 5);
+		memset(&m_isr_timing, 0, sizeof(m_isr_timing));
+		m_trace_len = 0;
+		stubs_mc_timer_isr_calls = 0;
+
+		float angle_err_max = 0.0;
+		for (int i = 0;i < 4;i++) {
+			bench_run(periods / 5);
+			float err = utils_angle_difference(virtual_motor_get_angle_deg(),
+					m_motor_1.m_motor_state.phase * (180.0 / M_PI));
+			if (fabsf(err) > angle_err_max) {
+				angle_err_max = fabsf(err);
+			}
+		}
+
+		printf("%s\r\n", sc->name);
+		printf("  ERPM: %.0f, iq: %.2f A, observer error: %.1f deg\r\n",
+				(double)(m_motor_1.m_pll_speed * (60.0 / (2.0 * M_PI))),
+				(double)m_motor_1.m_motor_state.iq_filter,
+				(double)angle_err_max);
+		print_timing("ISR total", m_isr_timing.ns, m_isr_timing.cycles, m_isr_timing.calls);
+		bench_functions(&m_motor_1, 50);
+		printf("\r\n");
+
+		mcpwm_foc_set_current(0.0);
+		bench_disconnect_motor();
+	}
+
+	return 0;
+}
@@ -0,0 +1,173 @@
+#include <string.h>
+#include <stdio.h>
+#include <stdarg.h>
+
+#include "stubs.h"
+#include "mc_interface.h"
+#include "commands.h"
+#include "terminal.h"
+#include "encoder.h"
+#include "timeout.h"
+#include "hw.h"
+
+#define STUBS_MAX_COMMANDS		8
+#define STUBS_SAMPLE_LEN		2000
+#define STUBS_SAMPLE_BUFFERS	8
+
+typedef struct {
+	const char *command;
+	void(*cbf)(int argc, const char **argv);
+} stubs_command_t;
+
+volatile uint16_t ADC_Value[HW_ADC_CHANNELS + HW_ADC_CHANNELS_EXTRA];
+volatile int ADC_curr_norm_value[6];
+
+mc_configuration stubs_mcconf;
+float stubs_temp_motor = 25.0;
+int stubs_mc_timer_isr_calls = 0;
+
+static stubs_command_t m_commands[STUBS_MAX_COMMANDS];
+static volatile int16_t m_samples[STUBS_SAMPLE_BUFFERS][STUBS_SAMPLE_LEN];
+static int m_command_cnt = 0;
+
+bool stubs_terminal_run(int argc, const char **argv) {
+	for (int i = 0;i < m_command_cnt;i++) {
+		if (strcmp(m_commands[i].command, argv[0]) == 0) {
+			m_commands[i].cbf(argc, argv);
+			return true;
+		}
+	}
+
+	return false;
+}
+
+// mc_interface
+const volatile mc_configuration* mc_interface_get_configuration(void) {
+	return &stubs_mcconf;
+}
+
+void mc_interface_lock(void) {}
+void mc_interface_unlock(void) {}
+
+mc_fault_code mc_interface_get_fault(void) {
+	return FAULT_CODE_NONE;
+}
+
+float mc_interface_temp_motor_filtered(void) {
+	return stubs_temp_motor;
+}
+
+void mc_interface_fault_stop(mc_fault_code fault, bool is_second_motor, bool is_isr) {
+	(void)is_second_motor;
+	(void)is_isr;
+	printf("Fault: %d\r\n", fault);
+}
+
+void mc_interface_mc_timer_isr(bool is_second_motor) {
+	(void)is_second_motor;
+	stubs_mc_timer_isr_calls++;
+}
+
+int mc_interface_take_sample_buffers(volatile int16_t **buffers, int num) {
+	if (num > STUBS_SAMPLE_BUFFERS) {
+		return 0;
+	}
+
+	for (int i = 0;i < num;i++) {
+		buffers[i] = m_samples[i];
+	}
+
+	return STUBS_SAMPLE_LEN;
+}
+
+void mc_interface_release_sample_buffers(void) {
+}
+
+// commands
+void commands_printf(const char* format, ...) {
+	(void)format;
+}
+
+void commands_init_plot(char *namex, char *namey) {
+	(void)namex;
+	(void)namey;
+}
+
+void commands_plot_add_graph(char *name) {
+	(void)name;
+}
+
+void commands_plot_set_graph(int graph) {
+	(void)graph;
+}
+
+void commands_send_plot_points(float x, float y) {
+	(void)x;
+	(void)y;
+}
+
+// terminal
+void terminal_register_command_callback(
+		const char* command,
+		const char *help,
+		const char *arg_names,
+		void(*cbf)(int argc, const char **argv)) {
+	(void)help;
+	(void)arg_names;
+
+	if (m_command_cnt < STUBS_MAX_COMMANDS) {
+		m_commands[m_command_cnt].command = command;
+		m_commands[m_command_cnt].cbf = cbf;
+		m_command_cnt++;
+	}
+}
+
+// encoder
+bool encoder_is_configured(void) {
+	return false;
+}
+
+float encoder_read_deg(void) {
+	return 0.0;
+}
+
+float encoder_read_deg_multiturn(void) {
+	return 0.0;
+}
+
+bool encoder_index_found(void) {
+	return false;
+}
+
+// timeout
+void timeout_configure(systime_t timeout, float brake_current) {
+	(void)timeout;
+	(void)brake_current;
+}
+
+void timeout_reset(void) {}
+
+systime_t timeout_get_timeout_msec(void) {
+	return 0;
+}
+
+bool timeout_had_IWDG_reset(void) {
+	return false;
+}
+
+void timeout_feed_WDT(uint8_t index) {
+	(void)index;
+}
+
+float timeout_get_brake_current(void) {
+	return 0.0;
+}
+
+// conf_general and hw
+uint8_t conf_general_calculate_deadtime(float deadtime_ns, float core_clock_freq) {
+	(void)deadtime_ns;
+	(void)core_clock_freq;
+	return 0;
+}
+
+void hw_setup_adc_channels(void) {}
@@ -0,0 +1,18 @@
+#ifndef STUBS_H_
+#define STUBS_H_
+
+#include <stdbool.h>
+#include "datatypes.h"
+
+/*
+ * Stand-ins for the firmware modules that mcpwm_foc.c calls into but that
+ * are not part of the benchmark (mc_interface, encoder, terminal, ...).
+ */
+
+extern mc_configuration stubs_mcconf;
+extern float stubs_temp_motor;
+extern int stubs_mc_timer_isr_calls;
+
+bool stubs_terminal_run(int argc, const char **argv);
+
+#endif /* STUBS_H_ */
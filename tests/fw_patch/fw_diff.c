@@ -0,0 +1,437 @@
+/*
+ * Patch generator for flash_patch.c.
+ *
+ * Works like bsdiff without the suffix array: for every position of the new
+ * image the longest exact match in the base is looked up through a hash of
+ * the next MATCH_SEED bytes. A match is then extended as long as more than
+ * half of the bytes at the same offset agree, which is what happens when code
+ * moves and the addresses in it change.
+ *
+ * The long regions found that way tell where the code of the base has moved
+ * to, and are sent as relocation ranges. Inside every region the runs that
+ * are equal to the base, with the addresses in it relocated, are copied and
+ * the rest is sent as differences to the base, which are mostly zeros and
+ * compress well. Bytes without a match are inserted, and runs of the same
+ * byte, e.g. padding, are filled.
+ */
+
+#include "fw_diff.h"
+#include "flash_patch.h"
+#include "buffer.h"
+#include "crc.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+#define HASH_BITS			18
+#define MATCH_SEED			8
+#define MATCH_MIN			16
+#define CHAIN_MAX			64
+#define COPY_MIN			24
+#define FILL_MIN			32
+#define MISMATCH_MAX		256
+#define RELOC_REGION_MIN	512
+
+typedef struct {
+	uint32_t pos;
+	uint32_t len;
+	int64_t d; // Offset from the image to the base
+} region_t;
+
+typedef struct {
+	const uint8_t *base;
+	uint32_t base_len;
+	uint32_t hole_start;
+	uint32_t hole_len;
+	const uint8_t *image;
+	uint32_t image_len;
+	uint8_t *patch;
+	uint32_t patch_max;
+	uint32_t patch_len;
+	bool overflow;
+	flash_patch reloc;
+	region_t *regions;
+	int region_cnt;
+} diff_state;
+
+static uint32_t hash(const uint8_t *d) {
+	uint32_t a, b;
+	memcpy(&a, d, 4);
+	memcpy(&b, d + 4, 4);
+	return ((a * 2654435761u) ^ (b * 2246822519u)) >> (32 - HASH_BITS);
+}
+
+static bool base_ok(diff_state *s, int64_t pos) {
+	return pos >= 0 && pos < s->base_len &&
+			(s->hole_len == 0 || pos < s->hole_start || pos >= s->hole_start + s->hole_len);
+}
+
+static void put(diff_state *s, const uint8_t *data, uint32_t len) {
+	if (s->patch_len + len > s->patch_max) {
+		s->overflow = true;
+		return;
+	}
+
+	memcpy(s->patch + s->patch_len, data, len);
+	s->patch_len += len;
+}
+
+static void put_op(diff_state *s, uint8_t op, uint32_t src, uint32_t len) {
+	uint8_t buffer[9];
+	int32_t ind = 0;
+	buffer[ind++] = op;
+	if (op != FLASH_PATCH_OP_INSERT && op != FLASH_PATCH_OP_FILL) {
+		buffer_append_uint32(buffer, src, &ind);
+	}
+	buffer_append_uint32(buffer, len, &ind);
+	put(s, buffer, ind);
+}
+
+static uint32_t run_len(const uint8_t *d, uint32_t len, uint32_t max) {
+	uint32_t run = 1;
+	while (run < len && run < max && d[run] == d[0]) {
+		run++;
+	}
+	return run;
+}
+
+// Longest exact match for the image at pos in the base
+static uint32_t find_match(diff_state *s, const int32_t *head, const int32_t *next,
+		uint32_t pos, uint32_t *src) {
+	uint32_t best_len = 0;
+
+	if (pos + MATCH_SEED > s->image_len) {
+		return 0;
+	}
+
+	int32_t c = head[hash(s->image + pos)];
+	int chain = 0;
+
+	while (c >= 0 && chain++ < CHAIN_MAX) {
+		uint32_t len = 0;
+		while (pos + len < s->image_len && base_ok(s, (int64_t)c + len) &&
+				s->image[pos + len] == s->base[c + len]) {
+			len++;
+		}
+
+		if (len > best_len) {
+			best_len = len;
+			*src = c;
+		}
+
+		c = next[c];
+	}
+
+	return best_len;
+}
+
+// Number of bytes of the image at pos that are equal to the base at pos + d
+static uint32_t count_equal(diff_state *s, uint32_t pos, uint32_t len, int64_t d) {
+	uint32_t n = 0;
+	for (uint32_t i = 0;i < len;i++) {
+		if (base_ok(s, pos + i + d) && s->image[pos + i] == s->base[pos + i + d]) {
+			n++;
+		}
+	}
+	return n;
+}
+
+/*
+ * Find the regions of the image that line up with the base.
+ */
+static void find_regions(diff_state *s) {
+	int32_t *head = malloc(sizeof(int32_t) << HASH_BITS);
+	int32_t *next = malloc(sizeof(int32_t) * (s->base_len + 1));
+	memset(head, 0xFF, sizeof(int32_t) << HASH_BITS);
+
+	for (uint32_t i = 0;i + MATCH_SEED <= s->base_len;i++) {
+		if (!base_ok(s, i) || !base_ok(s, i + MATCH_SEED - 1)) {
+			continue;
+		}
+
+		uint32_t h = hash(s->base + i);
+		next[i] = head[h];
+		head[h] = i;
+	}
+
+	int regions_max = 1024;
+	s->regions = malloc(sizeof(region_t) * regions_max);
+	s->region_cnt = 0;
+
+	const uint8_t *image = s->image;
+	uint32_t pos = 0;
+
+	while (pos < s->image_len) {
+		// Runs of the same byte are filled instead
+		uint32_t run = run_len(image + pos, s->image_len - pos, 0xFFFFFFFF);
+		if (run >= FILL_MIN) {
+			pos += run;
+			continue;
+		}
+
+		uint32_t src = 0;
+		uint32_t match_len = find_match(s, head, next, pos, &src);
+
+		if (match_len < MATCH_MIN) {
+			pos++;
+			continue;
+		}
+
+		// Extend while more than half of the bytes agree, and until an exact
+		// match at another offset is clearly better
+		int64_t d = (int64_t)src - pos;
+		int64_t score = 0;
+		int64_t best_score = 0;
+		uint32_t region_len = 0;
+		uint32_t mismatches = 0;
+
+		for (uint32_t i = 0;pos + i < s->image_len && base_ok(s, pos + i + d);i++) {
+			if (image[pos + i] == s->base[pos + i + d]) {
+				score++;
+				mismatches = 0;
+			} else {
+				if (++mismatches > MISMATCH_MAX) {
+					break;
+				}
+
+				uint32_t src_other = 0;
+				uint32_t len = find_match(s, head, next, pos + i, &src_other);
+				if (len >= MATCH_MIN && count_equal(s, pos + i, len, d) + MATCH_SEED < len) {
+					break;
+				}
+			}
+
+			if (2 * score - (int64_t)(i + 1) > best_score) {
+				best_score = 2 * score - (i + 1);
+				region_len = i + 1;
+			}
+		}
+
+		if (s->region_cnt == regions_max) {
+			regions_max *= 2;
+			s->regions = realloc(s->regions, sizeof(region_t) * regions_max);
+		}
+
+		region_t *r = &s->regions[s->region_cnt++];
+		r->pos = pos;
+		r->len = region_len;
+		r->d = d;
+		pos += region_len;
+	}
+
+	free(head);
+	free(next);
+}
+
+static int cmp_len_desc(const void *a, const void *b) {
+	const region_t *ra = a, *rb = b;
+	return ra->len < rb->len ? 1 : (ra->len > rb->len ? -1 : 0);
+}
+
+static int cmp_base_pos(const void *a, const void *b) {
+	const region_t *ra = a, *rb = b;
+	int64_t pa = ra->pos + ra->d, pb = rb->pos + rb->d;
+	return pa < pb ? -1 : (pa > pb ? 1 : 0);
+}
+
+/*
+ * The longest regions of code that moved become the relocation ranges.
+ */
+static void make_reloc(diff_state *s) {
+	region_t *moved = malloc(sizeof(region_t) * (s->region_cnt + 1));
+	int n = 0;
+
+	for (int i = 0;i < s->region_cnt;i++) {
+		if (s->regions[i].d != 0 && s->regions[i].len >= RELOC_REGION_MIN) {
+			moved[n++] = s->regions[i];
+		}
+	}
+
+	qsort(moved, n, sizeof(region_t), cmp_len_desc);
+	if (n > FLASH_PATCH_RELOC_MAX) {
+		n = FLASH_PATCH_RELOC_MAX;
+	}
+	qsort(moved, n, sizeof(region_t), cmp_base_pos);
+
+	s->reloc.reloc_cnt = 0;
+	uint32_t prev_end = 0;
+
+	for (int i = 0;i < n;i++) {
+		// The ends of the regions are fuzzy and can overlap a bit
+		uint32_t start = moved[i].pos + moved[i].d;
+		uint32_t len = moved[i].len;
+		if (start < prev_end) {
+			if (start + len <= prev_end + RELOC_REGION_MIN) {
+				continue;
+			}
+			len -= prev_end - start;
+			start = prev_end;
+		}
+
+		int c = s->reloc.reloc_cnt++;
+		s->reloc.reloc_start[c] = start;
+		s->reloc.reloc_len[c] = len;
+		s->reloc.reloc_shift[c] = (int32_t)(-moved[i].d);
+		prev_end = start + len;
+
+		uint8_t buffer[13];
+		int32_t ind = 0;
+		buffer[ind++] = FLASH_PATCH_OP_RELOC;
+		buffer_append_uint32(buffer, start, &ind);
+		buffer_append_uint32(buffer, len, &ind);
+		buffer_append_int32(buffer, s->reloc.reloc_shift[c], &ind);
+		put(s, buffer, ind);
+	}
+
+	free(moved);
+}
+
+static void emit_insert(diff_state *s, uint32_t start, uint32_t end) {
+	while (start < end) {
+		uint32_t run = run_len(s->image + start, end - start, 0xFFFFFFFF);
+
+		if (run >= FILL_MIN) {
+			put_op(s, FLASH_PATCH_OP_FILL, 0, run);
+			put(s, s->image + start, 1);
+			start += run;
+			continue;
+		}
+
+		// Insert up to the next run
+		uint32_t i = start;
+		while (i < end) {
+			uint32_t r = run_len(s->image + i, end - i, FILL_MIN);
+			if (r >= FILL_MIN) {
+				break;
+			}
+			i += r;
+		}
+
+		put_op(s, FLASH_PATCH_OP_INSERT, 0, i - start);
+		put(s, s->image + start, i - start);
+		start = i;
+	}
+}
+
+static void emit_add(diff_state *s, uint32_t start, uint32_t end, int64_t d) {
+	if (end <= start) {
+		return;
+	}
+
+	put_op(s, FLASH_PATCH_OP_ADD, start + d, end - start);
+
+	for (uint32_t i = start;i < end;i++) {
+		uint8_t delta = s->image[i] - s->base[i + d];
+		put(s, &delta, 1);
+	}
+}
+
+// Base byte with the aligned words inside [rs, re) relocated
+static uint8_t reloc_byte(diff_state *s, uint32_t pos, uint32_t rs, uint32_t re) {
+	uint32_t w = pos & ~3;
+	if (w < rs || w + 4 > re) {
+		return s->base[pos];
+	}
+
+	uint32_t word;
+	memcpy(&word, s->base + w, 4);
+	word = flash_patch_reloc_word(&s->reloc, word);
+	return ((uint8_t*)&word)[pos - w];
+}
+
+// Region [start, end) of the image that lines up with the base at start + d
+static void emit_region(diff_state *s, uint32_t start, uint32_t end, int64_t d) {
+	uint32_t rs = start + d;
+	uint32_t re = end + d;
+	uint32_t pos = start;
+	uint32_t add_start = start;
+
+	while (pos < end) {
+		uint32_t run = 0;
+		while (pos + run < end && s->image[pos + run] == reloc_byte(s, pos + run + d, rs, re)) {
+			run++;
+		}
+
+		if (run >= COPY_MIN) {
+			if (memcmp(s->image + pos, s->base + pos + d, run) == 0) {
+				emit_add(s, add_start, pos, d);
+				put_op(s, FLASH_PATCH_OP_COPY, pos + d, run);
+				pos += run;
+				add_start = pos;
+				continue;
+			}
+
+			// Whole words in the base, so that they are relocated the same way
+			uint32_t a = pos;
+			uint32_t b = pos + run;
+			while ((a + d) & 3) {
+				a++;
+			}
+			while ((b + d) & 3) {
+				b--;
+			}
+
+			if (b > a && b - a >= COPY_MIN) {
+				emit_add(s, add_start, a, d);
+				put_op(s, FLASH_PATCH_OP_COPY_RELOC, a + d, b - a);
+				pos = b;
+				add_start = b;
+				continue;
+			}
+		}
+
+		pos += run > 0 ? run : 1;
+	}
+
+	emit_add(s, add_start, end, d);
+}
+
+/*
+ * Make a patch that turns base into image.
+ *
+ * base_len must not be longer than what the firmware passes as base_max to
+ * flash_patch_init, and the hole has to be the same.
+ *
+ * Returns the length of the patch, or 0 if it does not fit in patch_max.
+ */
+uint32_t fw_diff(const uint8_t *base, uint32_t base_len,
+		uint32_t hole_start, uint32_t hole_len,
+		const uint8_t *image, uint32_t image_len,
+		uint8_t *patch, uint32_t patch_max) {
+	diff_state s;
+	memset(&s, 0, sizeof(s));
+	s.base = base;
+	s.base_len = base_len;
+	s.hole_start = hole_start;
+	s.hole_len = hole_len;
+	s.image = image;
+	s.image_len = image_len;
+	s.patch = patch;
+	s.patch_max = patch_max;
+
+	uint8_t header[FLASH_PATCH_HEADER_LEN];
+	int32_t ind = 0;
+	buffer_append_uint32(header, FLASH_PATCH_MAGIC, &ind);
+	buffer_append_uint32(header, base_len, &ind);
+	buffer_append_uint16(header, flash_patch_base_crc(base, base_len, hole_start, hole_len), &ind);
+	buffer_append_uint32(header, image_len, &ind);
+	buffer_append_uint16(header, crc16((unsigned char*)image, image_len), &ind);
+	put(&s, header, ind);
+
+	find_regions(&s);
+	make_reloc(&s);
+
+	uint32_t pos = 0;
+	for (int i = 0;i < s.region_cnt;i++) {
+		region_t *r = &s.regions[i];
+		emit_insert(&s, pos, r->pos);
+		emit_region(&s, r->pos, r->pos + r->len, r->d);
+		pos = r->pos + r->len;
+	}
+	emit_insert(&s, pos, image_len);
+
+	free(s.regions);
+
+	return s.overflow ? 0 : s.patch_len;
+}
@@ -0,0 +1,15 @@
+/*
+ * Patch generator for flash_patch.c, see fw_diff.c.
+ */
+
+#ifndef FW_DIFF_H_
+#define FW_DIFF_H_
+
+#include <stdint.h>
+
+uint32_t fw_diff(const uint8_t *base, uint32_t base_len,
+		uint32_t hole_start, uint32_t hole_len,
+		const uint8_t *image, uint32_t image_len,
+		uint8_t *patch, uint32_t patch_max);
+
+#endif /* FW_DIFF_H_ */
@@ -0,0 +1,513 @@
+/*
+ * Host tool and test for delta firmware updates with flash_patch.c.
+ *
+ * Tool:
+ * ./fw_patch diff old.bin new.bin out.patch
+ * ./fw_patch apply old.bin in.patch out.bin
+ *
+ * Without arguments pairs of synthetic builds are made, with modules of
+ * code-like data and literal pools with absolute addresses into the other
+ * modules, so that a module that grows moves all later code and changes the
+ * addresses that point to it. For every pair the patch is made, applied on
+ * the host, and then applied by flash_helper.c to the flash model with the
+ * old build as the running image, sent in LZO compressed chunks the way
+ * COMM_WRITE_NEW_APP_PATCH receives them. The new app area is verified like
+ * before the bootloader jump.
+ *
+ * Output: the bytes sent for a full LZO update and for the patch, their
+ * ratio and the transfer time at 115200 baud, e.g. over BLE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hal.h"
+#include "host_flash.h"
+#include "minilzo.h"
+#include "fw_diff.h"
+
+// Firmware stubs
+#define chSysDisable()
+
+void mc_interface_unlock(void) {
+}
+
+void mc_interface_release_motor(void) {
+}
+
+void timeout_configure_IWDT(void) {
+}
+
+void timeout_configure_IWDT_slowest(void) {
+}
+
+void utils_sys_lock_cnt(void) {
+}
+
+void utils_sys_unlock_cnt(void) {
+}
+
+#include "../../flash_helper.c"
+
+#define CHUNK_LEN			384
+#define PACKET_OVERHEAD		(1 + 4 + 2 + 5) // Command, offset, LZO length, framing
+#define IMAGE_MAX			(APP_MAX_SIZE - 8)
+#define PATCH_MAX			(2 * IMAGE_MAX)
+#define HOLE_START			(ADDR_FLASH_SECTOR_1 - ADDR_FLASH_SECTOR_0)
+#define HOLE_LEN			EEPROM_EMULATION_SIZE
+#define BAUD_BYTES_PER_S	11520.0
+
+// Synthetic builds
+#define MODULES_MAX			64
+#define MODULES_FIRST		48 // Modules in the first build
+#define BLOCK_LEN			64
+
+typedef struct {
+	uint32_t id;
+	uint32_t size;
+	uint32_t seed;
+	uint32_t edit_start;
+	uint32_t edit_len;
+	uint32_t edit_seed;
+} module_t;
+
+typedef struct {
+	module_t mod[MODULES_MAX];
+	int n;
+	uint32_t version;
+} build_t;
+
+typedef struct {
+	const char *name;
+	void (*change)(build_t *b);
+} scenario_t;
+
+static lzo_align_t m_wrkmem[(LZO1X_1_MEM_COMPRESS + sizeof(lzo_align_t) - 1) / sizeof(lzo_align_t)];
+
+static uint32_t rnd(uint32_t *x) {
+	*x ^= *x << 13;
+	*x ^= *x >> 17;
+	*x ^= *x << 5;
+	return *x;
+}
+
+static void make_build(build_t *b, uint32_t seed) {
+	uint32_t x = seed;
+	b->n = MODULES_FIRST;
+	b->version = 1;
+	for (int i = 0;i < b->n;i++) {
+		b->mod[i].id = i;
+		b->mod[i].size = 2048 + (rnd(&x) % 9728);
+		b->mod[i].seed = rnd(&x);
+		b->mod[i].edit_len = 0;
+	}
+}
+
+/*
+ * Module 0 starts after the vector table and the rest after the hole. Each
+ * module is code in blocks that only depend on the module seed, so that an
+ * edit only changes its own blocks, followed by a literal pool.
+ */
+static uint32_t link_build(const build_t *b, uint8_t *out) {
+	uint32_t start[MODULES_MAX];
+	int index[MODULES_MAX];
+	uint32_t pos = 0x188;
+
+	for (int i = 0;i < b->n;i++) {
+		if (i == 1) {
+			pos = HOLE_START + HOLE_LEN;
+		}
+		start[i] = pos;
+		index[b->mod[i].id] = i;
+		pos += (b->mod[i].size + 3) & ~3;
+	}
+
+	uint32_t len = pos;
+	if (len > IMAGE_MAX) {
+		len = IMAGE_MAX;
+	}
+
+	memset(out, 0, len);
+
+	// Vector table
+	for (int i = 0;i < 0x188 / 4;i++) {
+		uint32_t a = ADDR_FLASH_SECTOR_0 + start[i % b->n] + 1;
+		memcpy(out + i * 4, &a, 4);
+	}
+
+	for (int i = 0;i < b->n;i++) {
+		const module_t *m = &b->mod[i];
+		uint32_t code_len = (m->size * 3 / 4) & ~1;
+		uint8_t *p = out + start[i];
+
+		if (start[i] + m->size > len) {
+			break;
+		}
+
+		for (uint32_t j = 0;j < code_len;j += 2) {
+			uint32_t block = j / BLOCK_LEN;
+			bool edited = j >= m->edit_start && j < m->edit_start + m->edit_len;
+			uint32_t x = (edited ? m->edit_seed : m->seed) * 2654435761u + block * 40503u + (j % BLOCK_LEN) * 977u + 1;
+			rnd(&x);
+			rnd(&x);
+
+			// A few common opcodes with small immediates
+			static const uint8_t ops[] = {0x68, 0x60, 0x46, 0x20, 0x21, 0xB5, 0xBD, 0xF0,
+					0xF8, 0xD0, 0xD1, 0xE7, 0x4B, 0x18, 0x1C, 0xEE};
+			uint32_t r = rnd(&x);
+			p[j] = (r >> 8) & 0x1F;
+			p[j + 1] = ops[(r >> 16) % (r & 1 ? 4 : 16)];
+		}
+
+		// Version string in module 1
+		if (i == 1) {
+			snprintf((char*)p, 32, "VESC 5.01 build %u", (unsigned int)b->version);
+		}
+
+		for (uint32_t j = code_len;j + 4 <= m->size;j += 4) {
+			// Modules are referred to by id, so that the pools only change when they move
+			int k = index[(m->seed + j * 7) % MODULES_FIRST];
+			uint32_t a = ADDR_FLASH_SECTOR_0 + start[k] + (((j * 52) % b->mod[k].size) & ~1) + 1;
+			memcpy(p + j, &a, 4);
+		}
+	}
+
+	return len;
+}
+
+static void change_none(build_t *b) {
+	(void)b;
+}
+
+static void change_bugfix(build_t *b) {
+	b->version++;
+	b->mod[20].edit_start = 1024;
+	b->mod[20].edit_len = 64;
+	b->mod[20].edit_seed = 77;
+}
+
+static void change_release(build_t *b) {
+	b->version++;
+
+	// Edits in a few modules, one grows and a new one is added
+	b->mod[7].edit_start = 512;
+	b->mod[7].edit_len = 1024;
+	b->mod[7].edit_seed = 1;
+	b->mod[20].edit_start = 256;
+	b->mod[20].edit_len = 2048;
+	b->mod[20].edit_seed = 2;
+	b->mod[20].size += 1200;
+	b->mod[33].edit_start = 0;
+	b->mod[33].edit_len = 512;
+	b->mod[33].edit_seed = 3;
+
+	memmove(&b->mod[41], &b->mod[40], sizeof(module_t) * (b->n - 40));
+	b->n++;
+	b->mod[40].id = MODULES_FIRST;
+	b->mod[40].size = 3072;
+	b->mod[40].seed = 12345;
+	b->mod[40].edit_len = 0;
+}
+
+static void change_unrelated(build_t *b) {
+	make_build(b, 987654321);
+}
+
+static const scenario_t m_scenarios[] = {
+		{"Same build", change_none},
+		{"Bug fix in one module", change_bugfix},
+		{"Release, code moved", change_release},
+		{"Unrelated image", change_unrelated},
+};
+
+// Bytes sent when the data is sent in LZO chunks like VESC Tool does
+static uint32_t lzo_transfer_bytes(const uint8_t *data, uint32_t len) {
+	static uint8_t out[CHUNK_LEN + CHUNK_LEN / 16 + 64 + 3];
+	uint32_t total = 0;
+
+	for (uint32_t pos = 0;pos < len;pos += CHUNK_LEN) {
+		uint32_t n = len - pos > CHUNK_LEN ? CHUNK_LEN : len - pos;
+		lzo_uint comp_len = 0;
+		lzo1x_1_compress(data + pos, n, out, &comp_len, m_wrkmem);
+		total += (comp_len < n ? comp_len : n) + PACKET_OVERHEAD;
+	}
+
+	return total;
+}
+
+// Applying on the host
+typedef struct {
+	uint8_t *data;
+	uint32_t len;
+	uint32_t max;
+} mem_out_t;
+
+static bool mem_output(const uint8_t *data, uint32_t len, void *arg) {
+	mem_out_t *o = (mem_out_t*)arg;
+	if (o->len + len > o->max) {
+		return false;
+	}
+	memcpy(o->data + o->len, data, len);
+	o->len += len;
+	return true;
+}
+
+static FLASH_PATCH_RES apply_host(const uint8_t *base, const uint8_t *patch, uint32_t patch_len,
+		uint8_t *out, uint32_t *out_len) {
+	flash_patch p;
+	mem_out_t o = {out, 0, IMAGE_MAX + FLASH_PATCH_OUT_HEADER_LEN};
+	flash_patch_init(&p, base, IMAGE_MAX, HOLE_START, HOLE_LEN, IMAGE_MAX, mem_output, &o);
+
+	// In uneven pieces
+	FLASH_PATCH_RES res = FLASH_PATCH_OK;
+	for (uint32_t pos = 0;pos < patch_len && res == FLASH_PATCH_OK;) {
+		uint32_t n = 1 + (pos * 7) % 300;
+		if (n > patch_len - pos) {
+			n = patch_len - pos;
+		}
+		res = flash_patch_process(&p, patch + pos, n);
+		pos += n;
+	}
+
+	*out_len = o.len;
+	return res;
+}
+
+// Applying on the flash model through flash_helper.c
+static void sleep_hook(systime_t ticks) {
+	(void)ticks;
+	new_app_write_queued();
+}
+
+static void load_running_image(const uint8_t *image, uint32_t len) {
+	host_flash_erase_all();
+	memcpy((uint8_t*)ADDR_FLASH_SECTOR_0, image, len);
+
+	// The emulated EEPROM holds configurations, not what the build has
+	for (uint32_t i = 0;i < HOLE_LEN;i++) {
+		((uint8_t*)ADDR_FLASH_SECTOR_0)[HOLE_START + i] = i * 13 + 5;
+	}
+}
+
+static uint16_t send_patch_chunk(const uint8_t *patch, uint32_t offset, uint32_t len) {
+	static uint8_t comp[CHUNK_LEN + CHUNK_LEN / 16 + 64 + 3];
+	static uint8_t decomp[PACKET_MAX_PL_LEN];
+
+	lzo_uint comp_len = 0;
+	lzo1x_1_compress(patch + offset, len, comp, &comp_len, m_wrkmem);
+
+	// As in commands.c
+	lzo_uint decompressed_len = len;
+	if (lzo1x_decompress_safe(comp, comp_len, decomp, &decompressed_len, NULL) != LZO_E_OK) {
+		return FLASH_ERROR_OPERATION;
+	}
+
+	return flash_helper_write_new_app_patch(offset, decomp, decompressed_len);
+}
+
+static uint16_t apply_firmware(const uint8_t *patch, uint32_t patch_len, uint32_t new_len,
+		int retransmit_chunk) {
+	flash_helper_erase_new_app(new_len + NEW_APP_HEADER_LEN);
+
+	uint16_t res = FLASH_COMPLETE;
+	int chunk = 0;
+
+	for (uint32_t pos = 0;pos < patch_len;pos += CHUNK_LEN) {
+		uint32_t n = patch_len - pos > CHUNK_LEN ? CHUNK_LEN : patch_len - pos;
+		res = send_patch_chunk(patch, pos, n);
+		if (res != FLASH_COMPLETE) {
+			break;
+		}
+
+		// A lost reply makes VESC Tool send the chunk again
+		if (chunk++ == retransmit_chunk) {
+			res = send_patch_chunk(patch, pos, n);
+			if (res != FLASH_COMPLETE) {
+				break;
+			}
+		}
+	}
+
+	return res;
+}
+
+static bool new_app_matches(const uint8_t *image, uint32_t len) {
+	const uint8_t *new_app = (const uint8_t*)ADDR_FLASH_SECTOR_8;
+	int32_t ind = 0;
+	return buffer_get_uint32(new_app, &ind) == len &&
+			memcmp(new_app + NEW_APP_HEADER_LEN, image, len) == 0;
+}
+
+static int run_tests(void) {
+	uint8_t *old_image = malloc(IMAGE_MAX);
+	uint8_t *new_image = malloc(IMAGE_MAX);
+	uint8_t *patch = malloc(PATCH_MAX);
+	uint8_t *out = malloc(IMAGE_MAX + FLASH_PATCH_OUT_HEADER_LEN);
+	int fails = 0;
+
+	printf("Scenario                Image (B)  Full LZO (B)  Patch (B)  Patch LZO (B)  Ratio  Full (s)  Patch (s)\r\n");
+
+	for (unsigned int i = 0;i < sizeof(m_scenarios) / sizeof(m_scenarios[0]);i++) {
+		build_t b;
+		make_build(&b, 42);
+		uint32_t old_len = link_build(&b, old_image);
+		m_scenarios[i].change(&b);
+		uint32_t new_len = link_build(&b, new_image);
+
+		uint32_t patch_len = fw_diff(old_image, old_len, HOLE_START, HOLE_LEN,
+				new_image, new_len, patch, PATCH_MAX);
+
+		// The full update sends the header too
+		memcpy(out + NEW_APP_HEADER_LEN, new_image, new_len);
+		uint32_t full = lzo_transfer_bytes(out, new_len + NEW_APP_HEADER_LEN);
+		uint32_t patch_lzo = lzo_transfer_bytes(patch, patch_len);
+
+		printf("%-22s  %9u  %12u  %9u  %13u  %4.1f%%  %8.1f  %9.1f\r\n", m_scenarios[i].name,
+				(unsigned int)new_len, (unsigned int)full, (unsigned int)patch_len,
+				(unsigned int)patch_lzo, 100.0 * (double)patch_lzo / (double)full,
+				full / BAUD_BYTES_PER_S, patch_lzo / BAUD_BYTES_PER_S);
+
+		// On the host
+		uint32_t out_len = 0;
+		FLASH_PATCH_RES pres = apply_host(old_image, patch, patch_len, out, &out_len);
+		if (patch_len == 0 || pres != FLASH_PATCH_DONE || out_len != new_len + FLASH_PATCH_OUT_HEADER_LEN ||
+				memcmp(out + FLASH_PATCH_OUT_HEADER_LEN, new_image, new_len) != 0) {
+			printf("FAIL: host apply, result %d\r\n", pres);
+			fails++;
+		}
+
+		// On the flash model, with one chunk sent twice
+		load_running_image(old_image, old_len);
+		uint16_t res = apply_firmware(patch, patch_len, new_len, 3);
+		if (res != FLASH_COMPLETE || flash_helper_verify_new_app() != FAULT_CODE_NONE ||
+				!new_app_matches(new_image, new_len) || host_flash_stats.bad_programs != 0) {
+			printf("FAIL: firmware apply, result %d\r\n", res);
+			fails++;
+		}
+
+		if (m_scenarios[i].change != change_release) {
+			continue;
+		}
+
+		// A running image that is not the base has to be refused
+		load_running_image(old_image, old_len);
+		((uint8_t*)ADDR_FLASH_SECTOR_0)[HOLE_START + HOLE_LEN + 100] ^= 0x10;
+		if (apply_firmware(patch, patch_len, new_len, -1) == FLASH_COMPLETE) {
+			printf("FAIL: wrong base not detected\r\n");
+			fails++;
+		}
+
+		// A corrupted patch has to fail the verification
+		load_running_image(old_image, old_len);
+		patch[patch_len - 1] ^= 0x01;
+		res = apply_firmware(patch, patch_len, new_len, -1);
+		patch[patch_len - 1] ^= 0x01;
+		if (res == FLASH_COMPLETE || flash_helper_verify_new_app() == FAULT_CODE_NONE) {
+			printf("FAIL: corrupted patch not detected\r\n");
+			fails++;
+		}
+
+		// A gap in the patch has to be refused
+		load_running_image(old_image, old_len);
+		flash_helper_erase_new_app(new_len + NEW_APP_HEADER_LEN);
+		send_patch_chunk(patch, 0, CHUNK_LEN);
+		if (send_patch_chunk(patch, 2 * CHUNK_LEN, CHUNK_LEN) == FLASH_COMPLETE) {
+			printf("FAIL: gap in the patch not detected\r\n");
+			fails++;
+		}
+	}
+
+	free(old_image);
+	free(new_image);
+	free(patch);
+	free(out);
+
+	printf("\r\n%s\r\n", fails ? "FAILED" : "All tests passed");
+	return fails ? 1 : 0;
+}
+
+static uint8_t *read_file(const char *path, uint32_t max, uint32_t *len) {
+	FILE *f = fopen(path, "rb");
+	if (!f) {
+		fprintf(stderr, "Could not open %s\r\n", path);
+		return 0;
+	}
+
+	uint8_t *data = malloc(max);
+	*len = fread(data, 1, max, f);
+	fclose(f);
+	return data;
+}
+
+static bool write_file(const char *path, const uint8_t *data, uint32_t len) {
+	FILE *f = fopen(path, "wb");
+	if (!f || fwrite(data, 1, len, f) != len) {
+		fprintf(stderr, "Could not write %s\r\n", path);
+		if (f) {
+			fclose(f);
+		}
+		return false;
+	}
+	fclose(f);
+	return true;
+}
+
+int main(int argc, char **argv) {
+	lzo_init();
+	host_set_sleep_hook(sleep_hook);
+
+	if (argc == 1) {
+		return run_tests();
+	}
+
+	if (argc != 5 || (strcmp(argv[1], "diff") != 0 && strcmp(argv[1], "apply") != 0)) {
+		fprintf(stderr, "Usage: %s diff old.bin new.bin out.patch\r\n"
+				"       %s apply old.bin in.patch out.bin\r\n", argv[0], argv[0]);
+		return 1;
+	}
+
+	// The running image has the CRC info after IMAGE_MAX, which is not part
+	// of the base.
+	uint32_t old_len, in_len;
+	uint8_t *old_image = read_file(argv[2], IMAGE_MAX, &old_len);
+	uint8_t *in = read_file(argv[3], PATCH_MAX, &in_len);
+	if (!old_image || !in) {
+		return 1;
+	}
+
+	int ret = 0;
+
+	if (strcmp(argv[1], "diff") == 0) {
+		uint8_t *patch = malloc(PATCH_MAX);
+		uint32_t patch_len = fw_diff(old_image, old_len, HOLE_START, HOLE_LEN, in, in_len,
+				patch, PATCH_MAX);
+		if (patch_len == 0 || !write_file(argv[4], patch, patch_len)) {
+			ret = 1;
+		} else {
+			memmove(in + NEW_APP_HEADER_LEN, in, in_len < IMAGE_MAX ? in_len : IMAGE_MAX);
+			uint32_t full = lzo_transfer_bytes(in, in_len + NEW_APP_HEADER_LEN);
+			uint32_t patch_lzo = lzo_transfer_bytes(patch, patch_len);
+			printf("Full update: %u bytes, patch: %u bytes (%.1f%%)\r\n",
+					(unsigned int)full, (unsigned int)patch_lzo,
+					100.0 * (double)patch_lzo / (double)full);
+		}
+		free(patch);
+	} else {
+		uint8_t *out = malloc(IMAGE_MAX + FLASH_PATCH_OUT_HEADER_LEN);
+		uint32_t out_len = 0;
+		FLASH_PATCH_RES res = apply_host(old_image, in, in_len, out, &out_len);
+		if (res != FLASH_PATCH_DONE) {
+			fprintf(stderr, "Patch failed: %d\r\n", res);
+			ret = 1;
+		} else if (!write_file(argv[4], out + FLASH_PATCH_OUT_HEADER_LEN,
+				out_len - FLASH_PATCH_OUT_HEADER_LEN)) {
+			ret = 1;
+		}
+		free(out);
+	}
+
+	free(old_image);
+	free(in);
+	return ret;
+}
@@ -0,0 +1,381 @@
+/*
+ * Test and benchmark for the firmware update write path in flash_helper.c,
+ * running on the flash model from tests/host.
+ *
+ * A firmware image of about 380 KB is uploaded the way VESC Tool does it:
+ * erase, then chunks of 384 bytes with the size and CRC header in front,
+ * each compressed with LZO when that makes it smaller, and every chunk is
+ * only sent after the reply to the previous one has arrived. The chunks go
+ * through the same steps as COMM_WRITE_NEW_APP_DATA(_LZO) in commands.c and
+ * the write thread is run from the sleep hook, so the pipeline fills up the
+ * same way as on the hardware. The new app area is then compared to the
+ * image, and corrupted images and failing program operations have to be
+ * reported, also when they are in the last chunk and when the chunks did
+ * not arrive in order.
+ *
+ * End-to-end update time is estimated from the flash operations counted by
+ * the flash model and a model of each transport, for the previous write path
+ * that programmed one byte per operation before replying, and for the
+ * pipelined one. Programming stalls instruction fetches from flash, so the
+ * CPU work of decoding and decompressing is not overlapped with it, only the
+ * transfer on the link is.
+ *
+ * Usage: ./test [image bytes]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "hal.h"
+#include "host_flash.h"
+#include "minilzo.h"
+
+// Firmware stubs
+#define chSysDisable()
+
+void mc_interface_unlock(void) {
+}
+
+void mc_interface_release_motor(void) {
+}
+
+void timeout_configure_IWDT(void) {
+}
+
+void timeout_configure_IWDT_slowest(void) {
+}
+
+static int m_sys_lock_cnt = 0;
+
+void utils_sys_lock_cnt(void) {
+	m_sys_lock_cnt++;
+}
+
+void utils_sys_unlock_cnt(void) {
+	m_sys_lock_cnt--;
+}
+
+#include "../../flash_helper.c"
+
+#define CHUNK_LEN			384
+#define IMAGE_MAX			(3 * 128 * 1024 - NEW_APP_HEADER_LEN)
+
+// Flash timing, typical values from the STM32F405 datasheet at 2.7 - 3.6 V
+#define T_PROGRAM_US		16.0
+#define T_ERASE_128K_MS		1000.0
+// Decompression and packet decoding on the STM32F4 at 168 MHz
+#define CPU_BYTES_PER_US	8.0
+
+typedef struct {
+	const char *name;
+	double bytes_per_us;
+	// Turnaround time for one request and reply, without the data
+	double rtt_us;
+} transport_t;
+
+static const transport_t m_transports[] = {
+		{"USB", 0.8, 1000.0},
+		{"UART 115200", 0.01152, 500.0},
+		{"CAN-forwarded", 0.04, 2000.0},
+};
+
+typedef struct {
+	int chunks;
+	uint32_t raw_bytes;
+	uint32_t wire_bytes;
+	uint32_t programs;
+	uint16_t final_res;
+	bool ok_replies;
+} upload_result_t;
+
+static uint8_t *m_image;
+static uint32_t m_image_len;
+
+// Per chunk, for the timing model
+static uint32_t *m_chunk_wire;
+static uint32_t *m_chunk_raw;
+static uint32_t *m_chunk_programs;
+
+static unsigned int m_writer_runs = 0;
+
+static void sleep_hook(systime_t ticks) {
+	(void)ticks;
+
+	// The write thread gets to run while the communication thread sleeps
+	new_app_write_queued();
+	m_writer_runs++;
+}
+
+// Program operations for a chunk, like flash_helper_write_new_app_data does them
+static uint32_t chunk_programs(uint32_t offset, uint32_t len) {
+	uint32_t ops = 0;
+	while (len > 0) {
+		uint32_t step = ((offset & 3) == 0 && len >= 4) ? 4 : 1;
+		offset += step;
+		len -= step;
+		ops++;
+	}
+	return ops;
+}
+
+static void make_image(uint32_t len) {
+	m_image_len = len + NEW_APP_HEADER_LEN;
+
+	// Something that compresses about like code: repeated instruction
+	// patterns with changing immediates and some constant tables.
+	uint32_t x = 12345;
+	for (uint32_t i = NEW_APP_HEADER_LEN;i < m_image_len;i++) {
+		x = x * 1103515245 + 12345;
+		uint32_t j = i - NEW_APP_HEADER_LEN;
+		if ((j / 4096) % 5 == 4) {
+			m_image[i] = j / 64;
+		} else {
+			m_image[i] = (j % 8) < 4 ? (x >> 24) & 0x1F : 0xF0 | (j % 4);
+		}
+	}
+
+	int32_t ind = 0;
+	buffer_append_uint32(m_image, len, &ind);
+	buffer_append_uint16(m_image, crc16(m_image + NEW_APP_HEADER_LEN, len), &ind);
+}
+
+/*
+ * Upload the image, as VESC Tool and then commands.c handle it. With swap the
+ * second and third chunk are sent in the opposite order.
+ */
+static upload_result_t upload(bool corrupt_crc, int fail_after, bool swap) {
+	upload_result_t res;
+	memset(&res, 0, sizeof(res));
+	res.ok_replies = true;
+
+	static lzo_align_t wrkmem[(LZO1X_1_MEM_COMPRESS + sizeof(lzo_align_t) - 1) / sizeof(lzo_align_t)];
+	static uint8_t packet[PACKET_MAX_PL_LEN];
+
+	host_flash_erase_all();
+	host_flash_reset_stats();
+	flash_helper_erase_new_app(m_image_len);
+	host_flash_reset_stats();
+
+	if (fail_after >= 0) {
+		host_flash_fail_after(fail_after, FLASH_ERROR_PROGRAM);
+	}
+
+	if (corrupt_crc) {
+		m_image[5] ^= 0x01;
+	}
+
+	for (uint32_t chunk_offset = 0;chunk_offset < m_image_len;chunk_offset += CHUNK_LEN) {
+		uint32_t offset = chunk_offset;
+		if (swap && offset == CHUNK_LEN) {
+			offset = 2 * CHUNK_LEN;
+		} else if (swap && offset == 2 * CHUNK_LEN) {
+			offset = CHUNK_LEN;
+		}
+
+		uint32_t len = m_image_len - offset;
+		if (len > CHUNK_LEN) {
+			len = CHUNK_LEN;
+		}
+
+		// VESC Tool
+		int32_t ind = 0;
+		buffer_append_uint32(packet, offset, &ind);
+
+		lzo_uint comp_len = 0;
+		lzo1x_1_compress(m_image + offset, len, packet + 6, &comp_len, wrkmem);
+		bool lzo = comp_len < len;
+
+		if (lzo) {
+			buffer_append_uint16(packet, len, &ind);
+			ind += comp_len;
+		} else {
+			memcpy(packet + ind, m_image + offset, len);
+			ind += len;
+		}
+
+		unsigned int packet_len = ind;
+
+		// Firmware, as in commands.c
+		ind = 0;
+		uint32_t new_app_offset = buffer_get_uint32(packet, &ind);
+		uint8_t *new_app_buffer = flash_helper_new_app_buffer_get();
+		uint32_t new_app_len = 0;
+
+		if (lzo) {
+			lzo_uint decompressed_len = buffer_get_uint16(packet, &ind);
+			if (lzo1x_decompress_safe(packet + ind, packet_len - ind, new_app_buffer,
+					&decompressed_len, NULL) == LZO_E_OK) {
+				new_app_len = decompressed_len;
+			}
+		} else {
+			new_app_len = packet_len - ind;
+			memcpy(new_app_buffer, packet + ind, new_app_len);
+		}
+
+		uint16_t flash_res = flash_helper_new_app_buffer_commit(new_app_offset, new_app_len);
+
+		if (offset + len < m_image_len && flash_res != FLASH_COMPLETE && fail_after < 0) {
+			res.ok_replies = false;
+		}
+
+		m_chunk_wire[res.chunks] = packet_len + 1 + 5;
+		m_chunk_raw[res.chunks] = len;
+		m_chunk_programs[res.chunks] = chunk_programs(offset, len);
+		res.wire_bytes += packet_len + 1 + 5;
+		res.raw_bytes += len;
+		res.chunks++;
+		res.final_res = flash_res;
+	}
+
+	flash_helper_new_app_wait();
+	res.programs = host_flash_stats.programs;
+
+	if (corrupt_crc) {
+		m_image[5] ^= 0x01;
+	}
+
+	host_flash_fail_after(-1, FLASH_COMPLETE);
+	return res;
+}
+
+/*
+ * Upload time in ms. In the previous write path every chunk was programmed
+ * one byte per operation before the reply was sent. Now the reply is sent
+ * when the chunk is queued, and the link carries the next chunk while the
+ * previous ones are programmed.
+ */
+static double upload_time_ms(const transport_t *t, int chunks, bool pipelined) {
+	const double reply_us = 10.0 / t->bytes_per_us;
+	double erase_us = T_ERASE_128K_MS * 1000.0 * 3.0;
+	double host_t = 0.0;		// When VESC Tool sends the next chunk
+	double cpu_free = 0.0;		// When the CPU is done with all earlier work
+	double done[2] = {0.0, 0.0};	// When the buffers are programmed
+
+	for (int i = 0;i < chunks;i++) {
+		double arrival = host_t + m_chunk_wire[i] / t->bytes_per_us + t->rtt_us / 2.0;
+		double decode_us = m_chunk_raw[i] / CPU_BYTES_PER_US;
+
+		if (pipelined) {
+			double program_us = m_chunk_programs[i] * T_PROGRAM_US;
+			double start = fmax(arrival, fmax(cpu_free, done[i % 2]));
+			double queued = start + decode_us;
+			host_t = queued + reply_us + t->rtt_us / 2.0;
+			cpu_free = queued + program_us;
+			done[i % 2] = cpu_free;
+		} else {
+			double program_us = m_chunk_raw[i] * T_PROGRAM_US;
+			double start = fmax(arrival, cpu_free);
+			cpu_free = start + decode_us + program_us;
+			host_t = cpu_free + reply_us + t->rtt_us / 2.0;
+		}
+	}
+
+	return (erase_us + fmax(host_t, cpu_free)) / 1000.0;
+}
+
+int main(int argc, char **argv) {
+	uint32_t image_len = 380 * 1024;
+	if (argc > 1) {
+		image_len = atoi(argv[1]);
+	}
+
+	if (image_len > IMAGE_MAX) {
+		image_len = IMAGE_MAX;
+	}
+
+	int max_chunks = IMAGE_MAX / CHUNK_LEN + 2;
+	m_image = malloc(IMAGE_MAX + NEW_APP_HEADER_LEN);
+	m_chunk_wire = calloc(max_chunks, sizeof(uint32_t));
+	m_chunk_raw = calloc(max_chunks, sizeof(uint32_t));
+	m_chunk_programs = calloc(max_chunks, sizeof(uint32_t));
+
+	lzo_init();
+	host_set_sleep_hook(sleep_hook);
+	make_image(image_len);
+
+	int fails = 0;
+
+	upload_result_t r = upload(false, -1, false);
+	uint8_t *new_app = host_flash_sector_address(flash_sector[NEW_APP_BASE]);
+
+	printf("Image: %u bytes, %d chunks, %u bytes on the link (LZO)\r\n",
+			(unsigned int)m_image_len, r.chunks, (unsigned int)r.wire_bytes);
+	printf("Program operations: %u, previously %u\r\n",
+			(unsigned int)r.programs, (unsigned int)r.raw_bytes);
+	printf("Write thread runs: %u, locked slices left: %d\r\n\r\n", m_writer_runs, m_sys_lock_cnt);
+
+	if (r.final_res != FLASH_COMPLETE || !r.ok_replies ||
+			memcmp(new_app, m_image, m_image_len) != 0 ||
+			host_flash_stats.bad_programs != 0 || m_sys_lock_cnt != 0) {
+		printf("FAIL: image not written correctly (res %d, bad programs %u)\r\n",
+				r.final_res, (unsigned int)host_flash_stats.bad_programs);
+		fails++;
+	}
+
+	printf("Transport       Previous (s)  Pipelined (s)  Speedup\r\n");
+	for (unsigned int i = 0;i < sizeof(m_transports) / sizeof(m_transports[0]);i++) {
+		double t_old = upload_time_ms(&m_transports[i], r.chunks, false);
+		double t_new = upload_time_ms(&m_transports[i], r.chunks, true);
+		printf("%-14s  %12.2f  %13.2f  %6.2fx\r\n", m_transports[i].name,
+				t_old / 1000.0, t_new / 1000.0, t_old / t_new);
+	}
+	printf("\r\n");
+
+	// A header CRC that does not match has to fail the last chunk
+	r = upload(true, -1, false);
+	if (r.final_res == FLASH_COMPLETE) {
+		printf("FAIL: CRC mismatch not reported\r\n");
+		fails++;
+	}
+
+	// A failing program operation has to be reported by a later reply
+	r = upload(false, 5000, false);
+	if (r.final_res == FLASH_COMPLETE) {
+		printf("FAIL: program error not reported\r\n");
+		fails++;
+	}
+
+	// The reply to the last chunk has to report the error in that chunk
+	uint32_t programs = r.programs;
+	r = upload(false, programs - 1, false);
+	if (r.final_res == FLASH_COMPLETE) {
+		printf("FAIL: program error in the last chunk not reported\r\n");
+		fails++;
+	}
+
+	// Out of order the image is verified in flash instead
+	r = upload(false, -1, true);
+	if (r.final_res != FLASH_COMPLETE || memcmp(new_app, m_image, m_image_len) != 0) {
+		printf("FAIL: upload out of order failed\r\n");
+		fails++;
+	}
+
+	r = upload(false, programs - 1, true);
+	if (r.final_res == FLASH_COMPLETE) {
+		printf("FAIL: program error in the last chunk not reported out of order\r\n");
+		fails++;
+	}
+
+	r = upload(true, -1, true);
+	if (r.final_res == FLASH_COMPLETE) {
+		printf("FAIL: CRC mismatch not reported out of order\r\n");
+		fails++;
+	}
+
+	// Reusing the erased area has to start a new CRC
+	r = upload(false, -1, false);
+	if (r.final_res != FLASH_COMPLETE || memcmp(new_app, m_image, m_image_len) != 0) {
+		printf("FAIL: second upload failed\r\n");
+		fails++;
+	}
+
+	free(m_image);
+	free(m_chunk_wire);
+	free(m_chunk_raw);
+	free(m_chunk_programs);
+
+	printf("%s\r\n", fails ? "FAILED" : "All tests passed");
+	return fails ? 1 : 0;
+}
@@ -0,0 +1,371 @@
+/*
+ * Host benchmark for the HFI angle estimator.
+ *
+ * mcpwm_foc.c is included directly, as in foc_bench, and drives the virtual
+ * motor in HFI mode with a salient rotor. virtual_motor.c is included too, so
+ * that the rotor can be turned at a constant low speed regardless of how well
+ * the estimate tracks it. For 16 and 32 samples, the firmware estimates the
+ * angle with the sliding DFT bins that are updated with every HFI sample in
+ * the ISR. For 8 samples it keeps the batch version, as that costs less
+ * there: bins 1 and 2 transformed from the whole HFI buffer in the HFI thread
+ * every 500 us. The batch version also runs next to the firmware here, with
+ * the same lag compensation and without the startup direction detection.
+ * Both read the same buffer and are compared with the rotor angle of the
+ * virtual motor after every control loop cycle. HFI cannot tell the rotor
+ * direction apart, the error is taken modulo 180 degrees.
+ *
+ * Output for 8, 16 and 32 samples per HFI period, and for 8 samples with the
+ * sliding bins forced on:
+ * - Mean and maximum angle error.
+ * - Mean and maximum age of the estimate, the time since it was updated.
+ * - CPU cost per update and per second, timed by replaying the buffer.
+ *
+ * Usage: ./hfi_bench [PWM periods per scenario]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "stubs.h"
+#include "confgenerator.h"
+
+// The ISR is renamed so that the estimates can be compared after every call
+#define mcpwm_foc_adc_int_handler	foc_isr_under_test
+#include "../../mcpwm_foc.c"
+#undef mcpwm_foc_adc_int_handler
+
+void mcpwm_foc_adc_int_handler(void *p, uint32_t flags);
+#include "../../virtual_motor.c"
+
+#define HFI_THREAD_INTERVAL		0.0005
+#define BENCH_ERPM				800.0
+#define BENCH_CURRENT			2.0
+#define BENCH_COST_ROUNDS		200000
+
+typedef struct {
+	const char *name;
+	foc_hfi_samples samples;
+	bool force_sliding;
+} bench_scenario_t;
+
+typedef struct {
+	double err_abs_sum;
+	float err_abs_max;
+	float last;
+	uint64_t age;
+	uint64_t age_sum;
+	uint64_t age_max;
+	uint64_t cycles;
+	uint64_t updates;
+} bench_est_t;
+
+static const bench_scenario_t m_scenarios[] = {
+		{"HFI, 8 samples", HFI_SAMPLES_8, false},
+		{"HFI, 8 samples, sliding", HFI_SAMPLES_8, true},
+		{"HFI, 16 samples", HFI_SAMPLES_16, false},
+		{"HFI, 32 samples", HFI_SAMPLES_32, false},
+};
+
+static bench_est_t m_firmware;
+static bench_est_t m_batch;
+static float m_batch_angle;
+static bool m_record = false;
+static float m_v_alpha;
+static float m_v_beta;
+static volatile float m_sink;
+
+static inline uint64_t bench_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static void est_add(bench_est_t *est, float angle, float angle_true) {
+	if (angle != est->last) {
+		est->updates++;
+		est->last = angle;
+		est->age = 0;
+	} else {
+		est->age++;
+	}
+
+	est->age_sum += est->age;
+	if (est->age > est->age_max) {
+		est->age_max = est->age;
+	}
+
+	float err = utils_angle_difference_rad(2.0 * angle, 2.0 * angle_true) / 2.0;
+	est->err_abs_sum += fabsf(err);
+	if (fabsf(err) > est->err_abs_max) {
+		est->err_abs_max = fabsf(err);
+	}
+	est->cycles++;
+}
+
+void mcpwm_foc_adc_int_handler(void *p, uint32_t flags) {
+	foc_isr_under_test(p, flags);
+
+	// Only after the calls that run the control loop
+	if (!(TIM1->CR1 & TIM_CR1_DIR) || !m_record || !m_motor_1.m_hfi.ready) {
+		return;
+	}
+
+	est_add(&m_firmware, m_motor_1.m_hfi.angle, virtual_motor.phi);
+	est_add(&m_batch, m_batch_angle, virtual_motor.phi);
+}
+
+/*
+ * The batch angle estimation from hfi_update, without the startup direction
+ * detection.
+ */
+static void batch_update(volatile motor_all_state_t *motor) {
+	if (!motor->m_hfi.ready) {
+		m_batch_angle = motor->m_hfi.angle;
+		return;
+	}
+
+	float real_bin1, imag_bin1, real_bin2, imag_bin2;
+	motor->m_hfi.fft_bin1_func((float*)motor->m_hfi.buffer, &real_bin1, &imag_bin1);
+	motor->m_hfi.fft_bin2_func((float*)motor->m_hfi.buffer, &real_bin2, &imag_bin2);
+	m_sink = real_bin1 + imag_bin1;
+
+	float angle_bin_2 = -utils_fast_atan2(imag_bin2, real_bin2) / 2.0;
+
+	float dt_sw;
+	if (motor->m_conf->foc_sample_v0_v7) {
+		dt_sw = 1.0 / motor->m_conf->foc_f_sw;
+	} else {
+		dt_sw = 1.0 / (motor->m_conf->foc_f_sw / 2.0);
+	}
+	angle_bin_2 += motor->m_motor_state.speed_rad_s * ((float)motor->m_hfi.samples / 2.0) * dt_sw;
+
+	if (fabsf(utils_angle_difference_rad(angle_bin_2 + M_PI, m_batch_angle)) <
+			fabsf(utils_angle_difference_rad(angle_bin_2, m_batch_angle))) {
+		angle_bin_2 += M_PI;
+	}
+
+	utils_norm_angle_rad(&angle_bin_2);
+	m_batch_angle = angle_bin_2;
+}
+
+/*
+ * Does what mcpwm_foc_init does, minus the ADC/DMA setup and the current
+ * offset calibration, which would wait for interrupts that never come.
+ */
+static void bench_init(mc_configuration *conf) {
+	memset((void*)&m_motor_1, 0, sizeof(motor_all_state_t));
+	m_isr_motor = 0;
+	m_motor_1.m_conf = conf;
+	chMtxObjectInit(&m_derived_mutex);
+	update_derived(&m_motor_1);
+	m_motor_1.m_state = MC_STATE_OFF;
+	m_motor_1.m_control_mode = CONTROL_MODE_NONE;
+	m_motor_1.m_hall_dt_diff_last = 1.0;
+	m_motor_1.m_curr_ofs[0] = 2048;
+	m_motor_1.m_curr_ofs[1] = 2048;
+	m_motor_1.m_curr_ofs[2] = 2048;
+	update_hfi_samples(conf->foc_hfi_samples, &m_motor_1);
+
+	timer_reinit((int)conf->foc_f_sw);
+
+	m_dccal_done = true;
+	m_init_done = true;
+}
+
+/*
+ * Connect the virtual motor with an inertia that is large enough to keep the
+ * speed constant.
+ */
+static void bench_connect_motor(const mc_configuration *conf, float erpm, float saliency) {
+	char args[7][32];
+	const char *argv[8];
+
+	// ml J Ld Lq Rs lambda Vbus
+	snprintf(args[0], 32, "%f", 0.0);
+	snprintf(args[1], 32, "%f", 1e6);
+	snprintf(args[2], 32, "%f", (double)(conf->foc_motor_l * (3.0 / 2.0)));
+	snprintf(args[3], 32, "%f", (double)(conf->foc_motor_l * (3.0 / 2.0) * saliency));
+	snprintf(args[4], 32, "%f", (double)(conf->foc_motor_r * (3.0 / 2.0)));
+	snprintf(args[5], 32, "%f", (double)conf->foc_motor_flux_linkage);
+	snprintf(args[6], 32, "%f", 30.0);
+
+	argv[0] = "connect_virtual_motor";
+	for (int i = 0;i < 7;i++) {
+		argv[i + 1] = args[i];
+	}
+
+	stubs_terminal_run(8, argv);
+	virtual_motor.we = erpm * (2.0 * M_PI / 60.0);
+}
+
+static void bench_disconnect_motor(void) {
+	const char *argv[] = {"disconnect_virtual_motor"};
+	stubs_terminal_run(1, argv);
+}
+
+/*
+ * The voltage vector that the PWM timer outputs. mcpwm_foc_tim_sample_int_handler
+ * passes the voltage from the motor state to the virtual motor instead, which
+ * does not include the HFI injection.
+ */
+static void bench_pwm_voltage(float *v_alpha, float *v_beta) {
+	const float arr = (float)TIM1->ARR;
+	const float v_bus = m_motor_1.m_motor_state.v_bus;
+
+	// See TIMER_UPDATE_DUTY_M1
+	float va = ((float)TIM1->CCR1 / arr - 0.5) * v_bus;
+	float vb = ((float)TIM1->CCR3 / arr - 0.5) * v_bus;
+	float vc = ((float)TIM1->CCR2 / arr - 0.5) * v_bus;
+
+	*v_alpha = (2.0 / 3.0) * (va - 0.5 * (vb + vc));
+	*v_beta = ONE_BY_SQRT3 * (vb - vc);
+}
+
+/*
+ * Run the closed loop for the given number of PWM periods, with the 1 kHz
+ * timer thread and the HFI thread at their nominal rates. The batch
+ * estimator runs right after the HFI thread.
+ */
+static void bench_run(int periods) {
+	const float f_sample = 1.0 / mcpwm_foc_get_ts();
+	const int timer_div = (int)(f_sample / 1000.0);
+	const int hfi_div = (int)(f_sample * HFI_THREAD_INTERVAL);
+
+	for (int i = 0;i < 2 * periods;i++) {
+		TIM1->CR1 ^= TIM_CR1_DIR;
+
+		// The ISR runs in the half period after the current samples it uses
+		// and the duty cycles it writes are loaded at the end of that half
+		// period, so they are output in the one after.
+		float v_alpha, v_beta;
+		bench_pwm_voltage(&v_alpha, &v_beta);
+		virtual_motor_int_handler(m_v_alpha, m_v_beta);
+		m_v_alpha = v_alpha;
+		m_v_beta = v_beta;
+
+		if ((i % timer_div) == 0) {
+			timer_update(&m_motor_1, 0.001);
+			run_pid_control_speed(0.001, &m_motor_1);
+		}
+
+		if ((i % hfi_div) == 0) {
+			hfi_update(&m_motor_1);
+			batch_update(&m_motor_1);
+		}
+	}
+}
+
+static void print_est(const char *name, const bench_est_t *est, float dt) {
+	printf("  %-8s error mean %5.2f deg, max %5.2f deg, age mean %6.1f us, max %6.1f us\r\n",
+			name,
+			est->err_abs_sum / (double)est->cycles * (180.0 / M_PI),
+			(double)est->err_abs_max * (180.0 / M_PI),
+			(double)est->age_sum / (double)est->cycles * (double)dt * 1e6,
+			(double)est->age_max * (double)dt * 1e6);
+}
+
+/*
+ * Time both estimators by replaying the samples in the buffer. The sliding
+ * version runs once per HFI sample, the batch version once per HFI thread
+ * iteration. The sliding version is timed with the bins forced on, also
+ * where the firmware does not use them.
+ */
+static void bench_cost(volatile motor_all_state_t *motor, float dt) {
+	const int samples = motor->m_hfi.samples;
+	const bool sliding = motor->m_hfi.sliding;
+	float buffer[32];
+	memcpy(buffer, (float*)motor->m_hfi.buffer, sizeof(buffer));
+
+	motor->m_hfi.sliding = true;
+	uint64_t t0 = bench_ns();
+	for (int i = 0;i < BENCH_COST_ROUNDS;i++) {
+		// Sample the buffer in a different order than it is written, so
+		// that the value changes
+		hfi_buffer_write(motor, buffer[(i * 3) % samples]);
+		hfi_buffer_next(motor);
+		hfi_estimate_angle(motor, motor->m_hfi.bin2_real, motor->m_hfi.bin2_imag);
+	}
+	double ns_sliding = (double)(bench_ns() - t0) / BENCH_COST_ROUNDS;
+	m_sink = motor->m_hfi.angle;
+	motor->m_hfi.sliding = sliding;
+
+	t0 = bench_ns();
+	for (int i = 0;i < BENCH_COST_ROUNDS;i++) {
+		batch_update(motor);
+	}
+	double ns_batch = (double)(bench_ns() - t0) / BENCH_COST_ROUNDS;
+	m_sink = m_batch_angle;
+
+	// An HFI sample is taken every second control loop cycle
+	const double rate_sliding = 1.0 / (2.0 * (double)dt);
+	const double rate_batch = 1.0 / HFI_THREAD_INTERVAL;
+
+	printf("  %-8s %8.1f ns per update, %8.1f us per second\r\n",
+			"sliding", ns_sliding, ns_sliding * rate_sliding * 1e-3);
+	printf("  %-8s %8.1f ns per update, %8.1f us per second\r\n",
+			"batch", ns_batch, ns_batch * rate_batch * 1e-3);
+}
+
+int main(int argc, char **argv) {
+	int periods = 100000;
+	if (argc > 1) {
+		periods = atoi(argv[1]);
+	}
+
+	for (unsigned int s = 0;s < sizeof(m_scenarios) / sizeof(m_scenarios[0]);s++) {
+		const bench_scenario_t *sc = &m_scenarios[s];
+
+		confgenerator_set_defaults_mcconf(&stubs_mcconf, true);
+		stubs_mcconf.foc_sensor_mode = FOC_SENSOR_MODE_HFI;
+		stubs_mcconf.foc_hfi_samples = sc->samples;
+
+		// The virtual motor uses the same angle for the electrical and the
+		// mechanical rotor position, which is only consistent for one pole pair.
+		stubs_mcconf.si_motor_poles = 2;
+
+		// Normally derived from the temperature and voltage limits by mc_interface
+		stubs_mcconf.lo_current_max = stubs_mcconf.l_current_max;
+		stubs_mcconf.lo_current_min = stubs_mcconf.l_current_min;
+		stubs_mcconf.lo_in_current_max = stubs_mcconf.l_in_current_max;
+		stubs_mcconf.lo_in_current_min = stubs_mcconf.l_in_current_min;
+		stubs_mcconf.lo_current_motor_max_now = stubs_mcconf.l_current_max;
+		stubs_mcconf.lo_current_motor_min_now = stubs_mcconf.l_current_min;
+
+		bench_init(&stubs_mcconf);
+		if (sc->force_sliding) {
+			m_motor_1.m_hfi.sliding = true;
+		}
+		virtual_motor_init();
+		bench_connect_motor(&stubs_mcconf, BENCH_ERPM, 1.5);
+		mcpwm_foc_set_current(BENCH_CURRENT);
+
+		memset(&m_firmware, 0, sizeof(m_firmware));
+		memset(&m_batch, 0, sizeof(m_batch));
+		m_record = false;
+
+		// Let the speed settle and the startup direction detection finish
+		bench_run(periods / 2);
+		m_record = true;
+		bench_run(periods);
+		m_record = false;
+
+		const float dt = m_motor_1.m_derived->dt;
+		const float speed = virtual_motor.we;
+
+		printf("%s\r\n", sc->name);
+		printf("  ERPM: %.0f, estimated ERPM: %.0f\r\n",
+				(double)(speed * (60.0 / (2.0 * M_PI))),
+				(double)(m_motor_1.m_pll_speed * (60.0 / (2.0 * M_PI))));
+		print_est(m_motor_1.m_hfi.sliding ? "sliding" : "firmware", &m_firmware, dt);
+		print_est("batch", &m_batch, dt);
+		bench_cost(&m_motor_1, dt);
+		printf("\r\n");
+
+		mcpwm_foc_set_current(0.0);
+		bench_disconnect_motor();
+	}
+
+	return 0;
+}
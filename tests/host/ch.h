@@ -0,0 +1,192 @@
+/*
+ * Minimal single-threaded stand-in for the ChibiOS/RT API, used to build
+ * firmware modules for host-side tests and benchmarks. Threads are never
+ * started, locks are no-ops and sleeping only advances a simulated system
+ * time, so the code under test runs deterministically from main().
+ */
+
+#ifndef HOST_CH_H_
+#define HOST_CH_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "chconf.h"
+
+// Types
+typedef uint32_t systime_t;
+typedef int32_t msg_t;
+typedef uint32_t eventmask_t;
+typedef uint32_t eventflags_t;
+typedef int32_t cnt_t;
+typedef uint32_t tprio_t;
+typedef uint32_t ucnt_t;
+
+typedef struct {
+	const char *name;
+	void *arg;
+} thread_t;
+
+typedef struct {
+	int cnt;
+} mutex_t;
+
+typedef struct {
+	cnt_t cnt;
+} semaphore_t;
+
+typedef struct {
+	semaphore_t bs_sem;
+} binary_semaphore_t;
+
+typedef struct {
+	int dummy;
+} event_source_t;
+
+typedef struct {
+	int dummy;
+} event_listener_t;
+
+typedef struct {
+	int dummy;
+} virtual_timer_t;
+
+typedef void (*vtfunc_t)(void *p);
+
+typedef struct {
+	int dummy;
+} memory_heap_t;
+
+typedef struct {
+	int dummy;
+} memory_pool_t;
+
+// Constants
+#define TRUE					1
+#define FALSE					0
+
+#define MSG_OK					(msg_t)0
+#define MSG_TIMEOUT				(msg_t)-1
+#define MSG_RESET				(msg_t)-2
+
+#define TIME_IMMEDIATE			((systime_t)0)
+#define TIME_INFINITE			((systime_t)-1)
+
+#define IDLEPRIO				1
+#define LOWPRIO					2
+#define NORMALPRIO				128
+#define HIGHPRIO				255
+
+#define ALL_EVENTS				((eventmask_t)-1)
+#define EVENT_MASK(eid)			((eventmask_t)(1 << (eid)))
+
+// Time conversion
+#define S2ST(sec)				((systime_t)((uint32_t)(sec) * CH_CFG_ST_FREQUENCY))
+#define MS2ST(msec)				((systime_t)(((uint32_t)(msec) * CH_CFG_ST_FREQUENCY + 999UL) / 1000UL))
+#define US2ST(usec)				((systime_t)(((uint32_t)(usec) * CH_CFG_ST_FREQUENCY + 999999UL) / 1000000UL))
+#define ST2MS(n)				(((n) * 1000UL + CH_CFG_ST_FREQUENCY - 1UL) / CH_CFG_ST_FREQUENCY)
+#define ST2US(n)				(((n) * 1000000UL + CH_CFG_ST_FREQUENCY - 1UL) / CH_CFG_ST_FREQUENCY)
+
+// Threads
+#define THD_WORKING_AREA(s, n)	uint8_t s[(n) + 64]
+#define THD_FUNCTION(tname, arg)	void tname(void *arg)
+#define chRegSetThreadName(name)	((void)(name))
+#define chThdShouldTerminateX()		false
+
+thread_t *chThdCreateStatic(void *wsp, size_t size, tprio_t prio, void (*pf)(void *), void *arg);
+thread_t *chThdGetSelfX(void);
+void chThdSleep(systime_t time);
+#define chThdSleepSeconds(sec)			chThdSleep(S2ST(sec))
+#define chThdSleepMilliseconds(msec)	chThdSleep(MS2ST(msec))
+#define chThdSleepMicroseconds(usec)	chThdSleep(US2ST(usec))
+#define chThdSleepUntil(time)			chThdSleep((time) - chVTGetSystemTimeX())
+#define chThdYield()
+#define chThdTerminate(tp)				((void)(tp))
+#define chThdWait(tp)					((msg_t)0)
+#define chThdExit(msg)					return
+
+// System
+systime_t chVTGetSystemTimeX(void);
+#define chVTGetSystemTime()				chVTGetSystemTimeX()
+#define chVTTimeElapsedSinceX(start)	(chVTGetSystemTimeX() - (start))
+#define chVTIsSystemTimeWithinX(s, e)	((systime_t)(chVTGetSystemTimeX() - (s)) < (systime_t)((e) - (s)))
+#define chVTObjectInit(vtp)				((void)(vtp))
+#define chVTSet(vtp, d, f, p)			((void)(vtp))
+#define chVTSetI(vtp, d, f, p)			((void)(vtp))
+#define chVTReset(vtp)					((void)(vtp))
+#define chVTResetI(vtp)					((void)(vtp))
+
+#define chSysLock()
+#define chSysUnlock()
+#define chSysLockFromISR()
+#define chSysUnlockFromISR()
+#define chSysHalt(reason)				host_halt(reason)
+#define chSysGetStatusAndLockX()		((uint32_t)0)
+#define chSysRestoreStatusX(sts)		((void)(sts))
+#define chSchRescheduleS()
+#define osalSysLock()
+#define osalSysUnlock()
+#define CH_IRQ_PROLOGUE()
+#define CH_IRQ_EPILOGUE()
+#define CH_IRQ_HANDLER(id)				void id(void)
+
+// Mutexes and semaphores
+#define chMtxObjectInit(mp)				((mp)->cnt = 0)
+#define chMtxLock(mp)					((mp)->cnt++)
+#define chMtxTryLock(mp)				((mp)->cnt++, true)
+#define chMtxUnlock(mp)					((mp)->cnt--)
+#define chMtxUnlockAll()
+
+#define chSemObjectInit(sp, n)			((sp)->cnt = (n))
+#define chSemWait(sp)					((sp)->cnt--, MSG_OK)
+#define chSemWaitTimeout(sp, t)			((sp)->cnt--, MSG_OK)
+#define chSemSignal(sp)					((sp)->cnt++)
+#define chSemSignalI(sp)				((sp)->cnt++)
+#define chSemReset(sp, n)				((sp)->cnt = (n))
+
+#define chBSemObjectInit(bsp, taken)	((bsp)->bs_sem.cnt = (taken) ? 0 : 1)
+#define chBSemWait(bsp)					((bsp)->bs_sem.cnt = 0, MSG_OK)
+#define chBSemWaitTimeout(bsp, t)		((bsp)->bs_sem.cnt = 0, MSG_OK)
+#define chBSemSignal(bsp)				((bsp)->bs_sem.cnt = 1)
+#define chBSemSignalI(bsp)				((bsp)->bs_sem.cnt = 1)
+#define chBSemReset(bsp, taken)			((bsp)->bs_sem.cnt = (taken) ? 0 : 1)
+
+// Events
+#define chEvtObjectInit(esp)			((void)(esp))
+#define chEvtRegister(esp, elp, eid)	((void)(esp), (void)(elp))
+#define chEvtRegisterMask(esp, elp, m)	((void)(esp))
+#define chEvtUnregister(esp, elp)		((void)(esp), (void)(elp))
+#define chEvtBroadcast(esp)				((void)(esp))
+#define chEvtBroadcastI(esp)			((void)(esp))
+#define chEvtBroadcastFlags(esp, f)		((void)(esp))
+#define chEvtBroadcastFlagsI(esp, f)	((void)(esp))
+#define chEvtSignal(tp, m)				((void)(tp))
+#define chEvtSignalI(tp, m)				((void)(tp))
+#define chEvtGetAndClearFlags(elp)		((eventflags_t)0)
+
+static inline eventmask_t chEvtWaitAny(eventmask_t m) {
+	return m;
+}
+
+static inline eventmask_t chEvtWaitAnyTimeout(eventmask_t m, systime_t t) {
+	(void)t;
+	return m;
+}
+
+static inline eventmask_t chEvtGetAndClearEvents(eventmask_t m) {
+	(void)m;
+	return 0;
+}
+
+// Debug
+#define chDbgCheck(c)					((void)0)
+#define chDbgAssert(c, r)				((void)0)
+#define osalDbgAssert(c, r)				((void)0)
+#define osalDbgCheck(c)					((void)0)
+
+// Host helpers
+void host_halt(const char *reason);
+void host_set_sleep_hook(void (*hook)(systime_t ticks));
+
+#endif /* HOST_CH_H_ */
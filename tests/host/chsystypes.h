@@ -0,0 +1 @@
+#include <ch.h>
@@ -0,0 +1,9 @@
+/*
+ * The Cortex-M4 SIMD intrinsics are not used by the firmware, so the host
+ * build does not provide them.
+ */
+
+#ifndef __CORE_CM4_SIMD_H
+#define __CORE_CM4_SIMD_H
+
+#endif /* __CORE_CM4_SIMD_H */
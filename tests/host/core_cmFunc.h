@@ -0,0 +1,38 @@
+/*
+ * Host replacement for the CMSIS core register access functions. Interrupts
+ * do not exist on the host, so these only keep track of the values written.
+ */
+
+#ifndef __CORE_CMFUNC_H
+#define __CORE_CMFUNC_H
+
+#include <stdint.h>
+
+extern volatile uint32_t host_primask;
+extern volatile uint32_t host_basepri;
+
+static inline void __enable_irq(void) { host_primask = 0; }
+static inline void __disable_irq(void) { host_primask = 1; }
+static inline void __enable_fault_irq(void) {}
+static inline void __disable_fault_irq(void) {}
+
+static inline uint32_t __get_PRIMASK(void) { return host_primask; }
+static inline void __set_PRIMASK(uint32_t priMask) { host_primask = priMask; }
+static inline uint32_t __get_BASEPRI(void) { return host_basepri; }
+static inline void __set_BASEPRI(uint32_t value) { host_basepri = value; }
+
+static inline uint32_t __get_CONTROL(void) { return 0; }
+static inline void __set_CONTROL(uint32_t control) { (void)control; }
+static inline uint32_t __get_IPSR(void) { return 0; }
+static inline uint32_t __get_APSR(void) { return 0; }
+static inline uint32_t __get_xPSR(void) { return 0; }
+static inline uint32_t __get_PSP(void) { return 0; }
+static inline void __set_PSP(uint32_t topOfProcStack) { (void)topOfProcStack; }
+static inline uint32_t __get_MSP(void) { return 0; }
+static inline void __set_MSP(uint32_t topOfMainStack) { (void)topOfMainStack; }
+static inline uint32_t __get_FAULTMASK(void) { return 0; }
+static inline void __set_FAULTMASK(uint32_t faultMask) { (void)faultMask; }
+static inline uint32_t __get_FPSCR(void) { return 0; }
+static inline void __set_FPSCR(uint32_t fpscr) { (void)fpscr; }
+
+#endif /* __CORE_CMFUNC_H */
@@ -0,0 +1,52 @@
+/*
+ * Host replacement for the CMSIS core instruction intrinsics. Picked up
+ * instead of the ARM version because the host include directory comes
+ * first in the search path.
+ */
+
+#ifndef __CORE_CMINSTR_H
+#define __CORE_CMINSTR_H
+
+#include <stdint.h>
+
+static inline void __NOP(void) {}
+static inline void __WFI(void) {}
+static inline void __WFE(void) {}
+static inline void __SEV(void) {}
+static inline void __ISB(void) { __sync_synchronize(); }
+static inline void __DSB(void) { __sync_synchronize(); }
+static inline void __DMB(void) { __sync_synchronize(); }
+
+static inline uint32_t __REV(uint32_t value) {
+	return __builtin_bswap32(value);
+}
+
+static inline uint32_t __REV16(uint32_t value) {
+	return ((value & 0xFF00FF00UL) >> 8) | ((value & 0x00FF00FFUL) << 8);
+}
+
+static inline int32_t __REVSH(int32_t value) {
+	return (int16_t)__builtin_bswap16((uint16_t)value);
+}
+
+static inline uint32_t __ROR(uint32_t op1, uint32_t op2) {
+	op2 &= 31;
+	return op2 ? (op1 >> op2) | (op1 << (32 - op2)) : op1;
+}
+
+static inline uint32_t __RBIT(uint32_t value) {
+	uint32_t result = 0;
+	for (int i = 0;i < 32;i++) {
+		result = (result << 1) | (value & 1);
+		value >>= 1;
+	}
+	return result;
+}
+
+static inline uint8_t __CLZ(uint32_t value) {
+	return value ? (uint8_t)__builtin_clz(value) : 32;
+}
+
+#define __BKPT(value)
+
+#endif /* __CORE_CMINSTR_H */
@@ -0,0 +1,157 @@
+/*
+ * Flash model replacing stm32f4xx_flash.c in host builds.
+ *
+ * The flash array itself is the host memory mapped at 0x08000000 by host.c.
+ * Programming can only clear bits, like on the real NOR flash, and erasing
+ * sets a whole sector to 0xFF. Every operation is counted so that tests can
+ * report how much flash wear and time a piece of code causes. Link this
+ * instead of stm32f4xx_flash.c, e.g.
+ * $(filter-out %stm32f4xx_flash.c,$(STM32SRC)) $(HOSTFLASHSRC)
+ */
+
+#include <string.h>
+
+#include "host_flash.h"
+
+host_flash_stats_t host_flash_stats;
+
+static const uint32_t m_sector_addr[HOST_FLASH_SECTORS + 1] = {
+		0x08000000, 0x08004000, 0x08008000, 0x0800C000,
+		0x08010000, 0x08020000, 0x08040000, 0x08060000,
+		0x08080000, 0x080A0000, 0x080C0000, 0x080E0000,
+		0x08100000
+};
+
+static bool m_locked = true;
+static FLASH_Status m_fail_status = FLASH_COMPLETE;
+static int m_fail_after = -1;
+
+static FLASH_Status check_fail(void) {
+	if (m_fail_after >= 0) {
+		if (m_fail_after == 0) {
+			m_fail_after = -1;
+			return m_fail_status;
+		}
+		m_fail_after--;
+	}
+
+	return FLASH_COMPLETE;
+}
+
+static FLASH_Status program(uint32_t address, const void *data, unsigned int len) {
+	if (m_locked) {
+		return FLASH_ERROR_WRP;
+	}
+
+	if (address < m_sector_addr[0] ||
+			(address + len) > m_sector_addr[HOST_FLASH_SECTORS] ||
+			(address % len) != 0) {
+		return FLASH_ERROR_PGA;
+	}
+
+	FLASH_Status res = check_fail();
+	if (res != FLASH_COMPLETE) {
+		return res;
+	}
+
+	uint8_t *dst = (uint8_t*)(uintptr_t)address;
+	const uint8_t *src = (const uint8_t*)data;
+	for (unsigned int i = 0;i < len;i++) {
+		if ((dst[i] & src[i]) != src[i]) {
+			host_flash_stats.bad_programs++;
+		}
+		dst[i] &= src[i];
+	}
+
+	host_flash_stats.programs++;
+	host_flash_stats.bytes_programmed += len;
+
+	return FLASH_COMPLETE;
+}
+
+uint8_t *host_flash_sector_address(uint32_t sector) {
+	unsigned int ind = sector >> 3;
+	if (ind >= HOST_FLASH_SECTORS) {
+		return 0;
+	}
+
+	return (uint8_t*)(uintptr_t)m_sector_addr[ind];
+}
+
+uint32_t host_flash_sector_size(uint32_t sector) {
+	unsigned int ind = sector >> 3;
+	if (ind >= HOST_FLASH_SECTORS) {
+		return 0;
+	}
+
+	return m_sector_addr[ind + 1] - m_sector_addr[ind];
+}
+
+void host_flash_erase_all(void) {
+	memset((void*)(uintptr_t)m_sector_addr[0], 0xFF,
+			m_sector_addr[HOST_FLASH_SECTORS] - m_sector_addr[0]);
+}
+
+void host_flash_reset_stats(void) {
+	memset(&host_flash_stats, 0, sizeof(host_flash_stats));
+}
+
+void host_flash_fail_after(int operations, FLASH_Status status) {
+	m_fail_after = operations;
+	m_fail_status = status;
+}
+
+void FLASH_Unlock(void) {
+	m_locked = false;
+}
+
+void FLASH_Lock(void) {
+	m_locked = true;
+}
+
+void FLASH_ClearFlag(uint32_t FLASH_FLAG) {
+	(void)FLASH_FLAG;
+}
+
+FLASH_Status FLASH_GetStatus(void) {
+	return FLASH_COMPLETE;
+}
+
+FLASH_Status FLASH_WaitForLastOperation(void) {
+	return FLASH_COMPLETE;
+}
+
+FLASH_Status FLASH_EraseSector(uint32_t FLASH_Sector, uint8_t VoltageRange) {
+	(void)VoltageRange;
+
+	if (m_locked) {
+		return FLASH_ERROR_WRP;
+	}
+
+	uint8_t *addr = host_flash_sector_address(FLASH_Sector);
+	if (!addr) {
+		return FLASH_ERROR_OPERATION;
+	}
+
+	FLASH_Status res = check_fail();
+	if (res != FLASH_COMPLETE) {
+		return res;
+	}
+
+	memset(addr, 0xFF, host_flash_sector_size(FLASH_Sector));
+	host_flash_stats.erases++;
+
+	return FLASH_COMPLETE;
+}
+
+FLASH_Status FLASH_ProgramWord(uint32_t Address, uint32_t Data) {
+	return program(Address, &Data, 4);
+}
+
+FLASH_Status FLASH_ProgramHalfWord(uint32_t Address, uint16_t Data) {
+	return program(Address, &Data, 2);
+}
+
+FLASH_Status FLASH_ProgramByte(uint32_t Address, uint8_t Data) {
+	return program(Address, &Data, 1);
+}
@@ -0,0 +1,344 @@
+/*
+ * Minimal stand-in for the ChibiOS HAL, used together with ch.h from this
+ * directory. The STM32 peripheral register blocks are backed by host memory
+ * (see host_hal.c), so GPIO operations simply update the port registers.
+ */
+
+#ifndef HOST_HAL_H_
+#define HOST_HAL_H_
+
+#include <ch.h>
+#include "stm32f4xx.h"
+
+// Initialization, only used by the simulator which provides it
+void halInit(void);
+
+// PAL
+typedef GPIO_TypeDef stm32_gpio_t;
+typedef GPIO_TypeDef *ioportid_t;
+typedef uint32_t ioportmask_t;
+typedef uint32_t iomode_t;
+
+#define PAL_LOW							0
+#define PAL_HIGH						1
+
+#define PAL_MODE_RESET					0
+#define PAL_MODE_UNCONNECTED			0
+#define PAL_MODE_INPUT					0
+#define PAL_MODE_INPUT_PULLUP			(1 << 5)
+#define PAL_MODE_INPUT_PULLDOWN			(2 << 5)
+#define PAL_MODE_INPUT_ANALOG			3
+#define PAL_MODE_OUTPUT_PUSHPULL		1
+#define PAL_MODE_OUTPUT_OPENDRAIN		(1 | (1 << 2))
+#define PAL_MODE_ALTERNATE(n)			(2 | ((n) << 7))
+
+#define PAL_STM32_OTYPE_PUSHPULL		0
+#define PAL_STM32_OTYPE_OPENDRAIN		(1 << 2)
+#define PAL_STM32_OSPEED_LOWEST			0
+#define PAL_STM32_OSPEED_MID1			(1 << 3)
+#define PAL_STM32_OSPEED_MID2			(2 << 3)
+#define PAL_STM32_OSPEED_HIGHEST		(3 << 3)
+#define PAL_STM32_PUDR_FLOATING			0
+#define PAL_STM32_PUDR_PULLUP			(1 << 5)
+#define PAL_STM32_PUDR_PULLDOWN			(2 << 5)
+
+#define palSetPad(port, pad)			((port)->ODR |= (1U << (pad)))
+#define palClearPad(port, pad)			((port)->ODR &= ~(1U << (pad)))
+#define palTogglePad(port, pad)			((port)->ODR ^= (1U << (pad)))
+#define palReadPad(port, pad)			(((port)->IDR >> (pad)) & 1U)
+#define palWritePad(port, pad, bit)		((bit) ? palSetPad(port, pad) : palClearPad(port, pad))
+#define palSetPadMode(port, pad, mode)	((void)(port), (void)(pad), (void)(mode))
+
+// NVIC, the enable state is kept in the NVIC registers
+#define nvicEnableVector(n, prio)		((void)(prio), NVIC->ISER[(n) >> 5] |= (1U << ((n) & 0x1F)))
+#define nvicDisableVector(n)			(NVIC->ISER[(n) >> 5] &= ~(1U << ((n) & 0x1F)))
+#define host_nvic_is_enabled(n)			((NVIC->ISER[(n) >> 5] >> ((n) & 0x1F)) & 1U)
+
+// DMA
+typedef void (*stm32_dmaisr_t)(void *p, uint32_t flags);
+
+typedef struct {
+	DMA_Stream_TypeDef *stream;
+	uint8_t selfindex;
+	// Interrupt handler registered with dmaStreamAllocate
+	stm32_dmaisr_t func;
+	void *param;
+} stm32_dma_stream_t;
+
+extern stm32_dma_stream_t host_dma_streams[16];
+
+#define STM32_DMA_STREAM_ID(dma, stream)	((((dma) - 1) * 8) + (stream))
+#define STM32_DMA_STREAM(id)				(&host_dma_streams[id])
+
+static inline bool dmaStreamAllocate(const stm32_dma_stream_t *dmastp, uint32_t priority,
+		stm32_dmaisr_t func, void *param) {
+	(void)priority;
+	((stm32_dma_stream_t*)dmastp)->func = func;
+	((stm32_dma_stream_t*)dmastp)->param = param;
+	return false;
+}
+
+static inline void dmaStreamRelease(const stm32_dma_stream_t *dmastp) {
+	((stm32_dma_stream_t*)dmastp)->func = 0;
+}
+
+// CAN
+#undef CAN_BTR_BRP
+#undef CAN_BTR_TS1
+#undef CAN_BTR_TS2
+#undef CAN_BTR_SJW
+
+#define CAN_BTR_BRP(n)					(n)
+#define CAN_BTR_TS1(n)					((n) << 16)
+#define CAN_BTR_TS2(n)					((n) << 20)
+#define CAN_BTR_SJW(n)					((n) << 24)
+
+#define CAN_IDE_STD						0
+#define CAN_IDE_EXT						1
+#define CAN_RTR_DATA					0
+#define CAN_RTR_REMOTE					1
+#define CAN_ANY_MAILBOX					0
+
+typedef struct {
+	struct {
+		uint8_t DLC:4;
+		uint8_t RTR:1;
+		uint8_t IDE:1;
+	};
+	union {
+		struct {
+			uint32_t SID:11;
+		};
+		struct {
+			uint32_t EID:29;
+		};
+	};
+	union {
+		uint8_t data8[8];
+		uint16_t data16[4];
+		uint32_t data32[2];
+	};
+} CANTxFrame;
+
+typedef struct {
+	struct {
+		uint8_t FMI;
+		uint16_t TIME;
+	};
+	struct {
+		uint8_t DLC:4;
+		uint8_t RTR:1;
+		uint8_t IDE:1;
+	};
+	union {
+		struct {
+			uint32_t SID:11;
+		};
+		struct {
+			uint32_t EID:29;
+		};
+	};
+	union {
+		uint8_t data8[8];
+		uint16_t data16[4];
+		uint32_t data32[2];
+	};
+} CANRxFrame;
+
+typedef struct {
+	uint32_t mcr;
+	uint32_t btr;
+} CANConfig;
+
+typedef struct {
+	const CANConfig *config;
+	event_source_t rxfull_event;
+} CANDriver;
+
+extern CANDriver CAND1;
+extern CANDriver CAND2;
+
+#define canStart(canp, cfg)				((canp)->config = (cfg))
+#define canStop(canp)					((canp)->config = 0)
+
+// Received frames are taken from and transmitted frames are passed to the
+// functions set with host_set_can_hooks. Without hooks nothing is received.
+msg_t canReceive(CANDriver *canp, uint32_t mailbox, CANRxFrame *crfp, systime_t timeout);
+msg_t canTransmit(CANDriver *canp, uint32_t mailbox, const CANTxFrame *ctfp, systime_t timeout);
+void host_set_can_hooks(bool (*rx)(CANRxFrame *crfp), void (*tx)(const CANTxFrame *ctfp));
+
+// Serial over USB, the driver is provided by the test
+struct SerialUSBDriverVMT {
+	size_t (*write)(void *instance, const uint8_t *bp, size_t n);
+	size_t (*read)(void *instance, uint8_t *bp, size_t n);
+	msg_t (*put)(void *instance, uint8_t b);
+	msg_t (*get)(void *instance);
+	msg_t (*putt)(void *instance, uint8_t b, systime_t time);
+	msg_t (*gett)(void *instance, systime_t time);
+	size_t (*writet)(void *instance, const uint8_t *bp, size_t n, systime_t time);
+	size_t (*readt)(void *instance, uint8_t *bp, size_t n, systime_t time);
+};
+
+typedef struct {
+	const struct SerialUSBDriverVMT *vmt;
+} SerialUSBDriver;
+
+typedef struct {
+	const struct SerialUSBDriverVMT *vmt;
+} BaseSequentialStream;
+
+#define chSequentialStreamRead(ip, bp, n)	((ip)->vmt->read(ip, bp, n))
+#define chSequentialStreamWrite(ip, bp, n)	((ip)->vmt->write(ip, bp, n))
+
+// Serial driver, only the USART is modeled. Nothing is received and written
+// data is dropped.
+#define CHN_INPUT_AVAILABLE				4
+
+typedef struct {
+	uint32_t speed;
+	uint16_t cr1;
+	uint16_t cr2;
+	uint16_t cr3;
+} SerialConfig;
+
+typedef struct {
+	USART_TypeDef *usart;
+	void (*rxhook)(void *p, uint16_t sr);
+	void *rxhookp;
+	event_source_t event;
+} SerialDriver;
+
+extern SerialDriver SD1;
+extern SerialDriver SD3;
+extern SerialDriver SD6;
+
+#define sdStart(sdp, cfg)				((void)(sdp), (void)(cfg))
+#define sdStop(sdp)						((void)(sdp))
+#define sdWrite(sdp, b, n)				((void)(sdp), (void)(b), (size_t)(n))
+#define sdGetTimeout(sdp, t)			((void)(sdp), (void)(t), MSG_TIMEOUT)
+
+// UART driver
+typedef struct {
+	void *txend1_cb;
+	void *txend2_cb;
+	void *rxend_cb;
+	void *rxchar_cb;
+	void *rxerr_cb;
+	uint32_t speed;
+	uint16_t cr1;
+	uint16_t cr2;
+	uint16_t cr3;
+} UARTConfig;
+
+typedef struct {
+	USART_TypeDef *usart;
+} UARTDriver;
+
+#define uartStart(uartp, cfg)			((void)(uartp), (void)(cfg))
+#define uartStop(uartp)					((void)(uartp))
+
+// I2C, no devices answer
+typedef uint16_t i2caddr_t;
+typedef uint32_t i2cflags_t;
+
+typedef enum {
+	OPMODE_I2C = 1,
+	OPMODE_SMBUS_DEVICE = 2,
+	OPMODE_SMBUS_HOST = 3
+} i2copmode_t;
+
+typedef enum {
+	STD_DUTY_CYCLE = 1,
+	FAST_DUTY_CYCLE_2 = 2,
+	FAST_DUTY_CYCLE_16_9 = 3
+} i2cdutycycle_t;
+
+typedef enum {
+	I2C_UNINIT = 0,
+	I2C_STOP = 1,
+	I2C_READY = 2,
+	I2C_ACTIVE_TX = 3,
+	I2C_ACTIVE_RX = 4,
+	I2C_LOCKED = 5
+} i2cstate_t;
+
+typedef struct {
+	i2copmode_t op_mode;
+	uint32_t clock_speed;
+	i2cdutycycle_t duty_cycle;
+} I2CConfig;
+
+typedef struct {
+	i2cstate_t state;
+	const I2CConfig *config;
+} I2CDriver;
+
+extern I2CDriver I2CD1;
+extern I2CDriver I2CD2;
+
+#define I2C_NO_ERROR					0x00
+#define I2C_ACK_FAILURE					0x04
+#define I2C_TIMEOUT						0x20
+
+#define i2cStart(i2cp, cfg)				((i2cp)->config = (cfg), (i2cp)->state = I2C_READY)
+#define i2cStop(i2cp)					((i2cp)->state = I2C_STOP)
+#define i2cAcquireBus(i2cp)				((void)(i2cp))
+#define i2cReleaseBus(i2cp)				((void)(i2cp))
+#define i2cGetErrors(i2cp)				((void)(i2cp), (i2cflags_t)I2C_ACK_FAILURE)
+#define i2cMasterTransmitTimeout(i2cp, addr, txbuf, txbytes, rxbuf, rxbytes, timeout) \
+		((void)(i2cp), (void)(addr), (void)(txbuf), (void)(txbytes), (void)(rxbuf), \
+		(void)(rxbytes), (void)(timeout), MSG_RESET)
+#define i2cMasterReceiveTimeout(i2cp, addr, rxbuf, rxbytes, timeout) \
+		((void)(i2cp), (void)(addr), (void)(rxbuf), (void)(rxbytes), (void)(timeout), MSG_RESET)
+
+// Input capture, no pulses are seen
+typedef uint16_t icucnt_t;
+typedef struct ICUDriver ICUDriver;
+typedef void (*icucallback_t)(ICUDriver *icup);
+
+typedef enum {
+	ICU_INPUT_ACTIVE_HIGH = 0,
+	ICU_INPUT_ACTIVE_LOW = 1
+} icumode_t;
+
+typedef enum {
+	ICU_CHANNEL_1 = 0,
+	ICU_CHANNEL_2 = 1
+} icuchannel_t;
+
+typedef struct {
+	icumode_t mode;
+	uint32_t frequency;
+	icucallback_t width_cb;
+	icucallback_t period_cb;
+	icucallback_t overflow_cb;
+	icuchannel_t channel;
+	uint32_t dier;
+} ICUConfig;
+
+struct ICUDriver {
+	const ICUConfig *config;
+};
+
+extern ICUDriver ICUD3;
+
+#define icuStart(icup, cfg)				((icup)->config = (cfg))
+#define icuStop(icup)					((icup)->config = 0)
+#define icuStartCapture(icup)			((void)(icup))
+#define icuEnableNotifications(icup)	((void)(icup))
+#define icuGetWidthX(icup)				((void)(icup), (icucnt_t)0)
+
+// USB
+typedef struct {
+	int dummy;
+} USBDriver;
+
+extern USBDriver USBD1;
+
+#define usbStop(usbp)					((void)(usbp))
+#define usbDisconnectBus(usbp)			((void)(usbp))
+
+// Like mcuconf.h in the firmware build, pull in the hardware configuration.
+#include "hw.h"
+
+#endif /* HOST_HAL_H_ */
@@ -0,0 +1,47 @@
+/*
+ * Host kernel for the single-threaded ch.h stand-in in this directory. The
+ * memory mapped hardware is set up by host_hal.c.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "ch.h"
+#include "hal.h"
+
+static systime_t m_systime = 0;
+static thread_t m_thread_dummy;
+static void (*m_sleep_hook)(systime_t ticks) = 0;
+
+thread_t *chThdCreateStatic(void *wsp, size_t size, tprio_t prio, void (*pf)(void *), void *arg) {
+	(void)wsp;
+	(void)size;
+	(void)prio;
+	(void)pf;
+	m_thread_dummy.arg = arg;
+	return &m_thread_dummy;
+}
+
+thread_t *chThdGetSelfX(void) {
+	return &m_thread_dummy;
+}
+
+void chThdSleep(systime_t time) {
+	m_systime += time;
+	if (m_sleep_hook) {
+		m_sleep_hook(time);
+	}
+}
+
+systime_t chVTGetSystemTimeX(void) {
+	return m_systime;
+}
+
+void host_halt(const char *reason) {
+	fprintf(stderr, "host: halted: %s\r\n", reason);
+	exit(1);
+}
+
+void host_set_sleep_hook(void (*hook)(systime_t ticks)) {
+	m_sleep_hook = hook;
+}
@@ -0,0 +1,34 @@
+# Host (x86 Linux) build of firmware modules for tests and benchmarks.
+#
+# Set FW_ROOT to the repository root before including this file. The
+# directory of this file has to come first in the include path, as its
+# ch.h, hal.h and CMSIS core headers replace the target versions.
+
+CHIBIOS = $(FW_ROOT)/ChibiOS_3.0.5
+include $(CHIBIOS)/ext/stdperiph_stm32f4/stm32lib.mk
+
+# Memory mapped hardware and HAL stand-in, also used by the simulator in sim/
+# together with its own threaded kernel.
+HOSTHALSRC = $(FW_ROOT)/tests/host/host_hal.c
+
+HOSTSRC = $(FW_ROOT)/tests/host/host.c $(HOSTHALSRC)
+
+# Flash model, to be used instead of stm32f4xx_flash.c from STM32SRC
+HOSTFLASHSRC = $(FW_ROOT)/tests/host/flash.c
+
+HOSTINC = $(FW_ROOT)/tests/host \
+          $(FW_ROOT) \
+          $(FW_ROOT)/mcconf \
+          $(FW_ROOT)/appconf \
+          $(FW_ROOT)/hwconf \
+          $(FW_ROOT)/applications \
+          $(CHIBIOS)/os/ext/CMSIS/ST \
+          $(CHIBIOS)/os/ext/CMSIS/include \
+          $(STM32INC)
+
+# The firmware stores addresses in 32-bit registers, which is harmless on the
+# host as nothing dereferences them. _GNU_SOURCE makes glibc declare sincosf,
+# which newlib provides by default.
+HOSTOPT = -DSTM32F407xx -DUSE_STDPERIPH_DRIVER -D_GNU_SOURCE \
+          -Wno-pointer-to-int-cast -Wno-int-to-pointer-cast \
+          $(addprefix -I,$(HOSTINC))
@@ -0,0 +1,33 @@
+/*
+ * Flash model for host builds, see flash.c.
+ */
+
+#ifndef HOST_FLASH_H_
+#define HOST_FLASH_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "stm32f4xx_conf.h"
+
+#define HOST_FLASH_SECTORS		12
+
+typedef struct {
+	uint32_t programs;
+	uint32_t bytes_programmed;
+	uint32_t erases;
+	// Programs that tried to set bits that were already cleared
+	uint32_t bad_programs;
+} host_flash_stats_t;
+
+extern host_flash_stats_t host_flash_stats;
+
+uint8_t *host_flash_sector_address(uint32_t sector);
+uint32_t host_flash_sector_size(uint32_t sector);
+void host_flash_erase_all(void);
+void host_flash_reset_stats(void);
+
+// Make the program or erase operation after the given number of successful
+// ones fail with status, to test error handling and power loss.
+void host_flash_fail_after(int operations, FLASH_Status status);
+
+#endif /* HOST_FLASH_H_ */
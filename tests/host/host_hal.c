@@ -0,0 +1,101 @@
+/*
+ * Host HAL runtime for the hal.h stand-in in this directory.
+ *
+ * The firmware accesses flash, the STM32 peripherals and the Cortex-M core
+ * registers through fixed addresses. On a 64-bit Linux host these ranges are
+ * normally unused, so they are mapped as plain anonymous memory before main()
+ * runs. This lets the unmodified firmware sources and the STM32 standard
+ * peripheral library run against register blocks that tests can inspect and
+ * preload. The kernel side is provided separately, by host.c for tests and
+ * by the simulator in sim/.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include <ch.h>
+#include "hal.h"
+
+#ifndef MAP_FIXED_NOREPLACE
+#define MAP_FIXED_NOREPLACE		0x100000
+#endif
+
+typedef struct {
+	uintptr_t base;
+	size_t size;
+	uint8_t fill;
+} host_region_t;
+
+static const host_region_t m_regions[] = {
+		{0x08000000, 0x00100000, 0xFF},	// Flash (erased)
+		{0x10000000, 0x00010000, 0x00},	// CCM RAM
+		{0x1FFF7800, 0x00000800, 0xFF},	// OTP and unique ID
+		{0x40000000, 0x00080000, 0x00},	// APB1, APB2 and AHB1 peripherals
+		{0x50000000, 0x00061000, 0x00},	// AHB2 peripherals
+		{0xE0000000, 0x00100000, 0x00},	// Cortex-M4 private peripherals
+};
+
+volatile uint32_t host_primask = 0;
+volatile uint32_t host_basepri = 0;
+stm32_dma_stream_t host_dma_streams[16];
+CANDriver CAND1;
+CANDriver CAND2;
+SerialDriver SD1 = {.usart = USART1};
+SerialDriver SD3 = {.usart = USART3};
+SerialDriver SD6 = {.usart = USART6};
+I2CDriver I2CD1;
+I2CDriver I2CD2;
+ICUDriver ICUD3;
+USBDriver USBD1;
+
+static bool (*m_can_rx)(CANRxFrame *crfp) = 0;
+static void (*m_can_tx)(const CANTxFrame *ctfp) = 0;
+
+__attribute__((constructor(101)))
+static void host_map_regions(void) {
+	for (unsigned int i = 0;i < sizeof(m_regions) / sizeof(m_regions[0]);i++) {
+		const host_region_t *r = &m_regions[i];
+		uintptr_t start = r->base & ~(uintptr_t)0xFFF;
+		size_t len = r->size + (r->base - start);
+
+		void *p = mmap((void*)start, len, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+
+		if (p == MAP_FAILED || (uintptr_t)p != start) {
+			fprintf(stderr, "host: could not map 0x%08lx\r\n", (unsigned long)start);
+			exit(1);
+		}
+
+		memset((void*)r->base, r->fill, r->size);
+	}
+
+	for (int i = 0;i < 16;i++) {
+		host_dma_streams[i].selfindex = i;
+		host_dma_streams[i].stream = (DMA_Stream_TypeDef*)(uintptr_t)
+				((i < 8 ? DMA1_BASE : DMA2_BASE) + 0x10 + 0x18 * (i % 8));
+	}
+}
+
+msg_t canReceive(CANDriver *canp, uint32_t mailbox, CANRxFrame *crfp, systime_t timeout) {
+	(void)canp;
+	(void)mailbox;
+	(void)timeout;
+	return (m_can_rx && m_can_rx(crfp)) ? MSG_OK : MSG_TIMEOUT;
+}
+
+msg_t canTransmit(CANDriver *canp, uint32_t mailbox, const CANTxFrame *ctfp, systime_t timeout) {
+	(void)canp;
+	(void)mailbox;
+	(void)timeout;
+	if (m_can_tx) {
+		m_can_tx(ctfp);
+	}
+	return MSG_OK;
+}
+
+void host_set_can_hooks(bool (*rx)(CANRxFrame *crfp), void (*tx)(const CANTxFrame *ctfp)) {
+	m_can_rx = rx;
+	m_can_tx = tx;
+}
@@ -0,0 +1,242 @@
+/*
+ * Statistics of the ISR profiler in isr_prof.c.
+ *
+ * isr_prof.c is included directly with a fake timer, so that the durations
+ * and the periods of the handler calls are known exactly:
+ *
+ * - Count, average period, maximum duration and jitter are exact, and the
+ *   percentiles are within the histogram accuracy of the true values.
+ * - Two motors that run the same handler keep their own statistics, so the
+ *   calls of one motor do not show up as jitter of the other.
+ * - A reset takes effect at the next call of the handler.
+ * - When the handler runs in the middle of a read, the reader copies again
+ *   and never returns statistics that are half old and half new.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+static void *test_memcpy(void *dst, const void *src, size_t len);
+
+// Both motor slots are tested
+#define HW_HAS_DUAL_MOTORS
+
+#define memcpy test_memcpy
+#include "../../isr_prof.c"
+#undef memcpy
+
+#define SAMPLES				10000
+
+static uint32_t m_now = 0;
+static volatile int m_inject_at = -1;
+static int m_copies = 0;
+static int m_errors = 0;
+
+uint32_t timer_time_now(void) {
+	return m_now;
+}
+
+// One handler call that started at t_start and took duration ticks
+static void call(isr_prof_id id, bool is_second_motor, uint32_t t_start, uint32_t duration) {
+	m_now = t_start + duration;
+	isr_prof_add(id, is_second_motor, t_start);
+}
+
+/*
+ * memcpy for isr_prof.c. When m_inject_at is set, the handler runs after that
+ * many bytes of the next copy, like it does when it preempts the reader on
+ * the MCU.
+ */
+static void *test_memcpy(void *dst, const void *src, size_t len) {
+	m_copies++;
+
+	if (m_inject_at >= 0 && (size_t)m_inject_at < len) {
+		size_t first = m_inject_at;
+		m_inject_at = -1;
+
+		memcpy(dst, src, first);
+		call(ISR_PROF_FOC_ADC, false, m_now + 500, 40);
+		memcpy((char*)dst + first, (const char*)src + first, len - first);
+	} else {
+		memcpy(dst, src, len);
+	}
+
+	return dst;
+}
+
+static void check(bool ok, const char *what) {
+	if (!ok) {
+		printf("  FAIL: %s\n", what);
+		m_errors++;
+	}
+}
+
+// Within the histogram accuracy of four bins per octave
+static bool close_to(float value, float expected) {
+	return fabsf(value - expected) <= expected * 0.13;
+}
+
+static void test_accounting(void) {
+	printf("Accounting\n");
+	isr_prof_reset();
+
+	// 50 us period, 1 tick of jitter on every tenth call. The durations are
+	// 10 us, except for 1 % that take 25 us and one that takes 40 us.
+	uint32_t t = 1000;
+	uint32_t period_sum = 0;
+	for (int i = 0;i < SAMPLES;i++) {
+		uint32_t duration = 100;
+		if (i % 100 == 99) {
+			duration = 250;
+		}
+		if (i == 5000) {
+			duration = 400;
+		}
+
+		call(ISR_PROF_FOC_ADC, false, t, duration);
+
+		uint32_t period = 500 + (i % 10 == 0 ? 1 : 0);
+		if (i < SAMPLES - 1) {
+			period_sum += period;
+		}
+		t += period;
+	}
+
+	isr_prof_stats s;
+	isr_prof_get_stats(ISR_PROF_FOC_ADC, false, &s);
+	const float tick = 1.0 / TICKS_PER_SECOND;
+
+	printf("  count %u, period %.3f us, duration p50 %.2f p99 %.2f max %.2f us, "
+			"jitter p50 %.2f p99 %.2f max %.2f us\n",
+			(unsigned int)s.count, (double)(s.period_avg * 1e6),
+			(double)(s.duration_p50 * 1e6), (double)(s.duration_p99 * 1e6), (double)(s.duration_max * 1e6),
+			(double)(s.jitter_p50 * 1e6), (double)(s.jitter_p99 * 1e6), (double)(s.jitter_max * 1e6));
+
+	check(s.count == SAMPLES, "count");
+	check(fabsf(s.period_avg - (float)period_sum / (SAMPLES - 1) * tick) < 1e-9, "average period");
+	check(s.duration_max == 400 * tick, "maximum duration");
+	check(close_to(s.duration_p50, 100 * tick), "duration p50");
+	check(close_to(s.duration_p99, 250 * tick), "duration p99");
+	check(s.jitter_max == 1 * tick, "maximum jitter");
+	check(s.jitter_p50 == 0.0, "jitter p50");
+	check(s.jitter_p99 == 1 * tick, "jitter p99");
+
+	// The other slots did not get anything
+	isr_prof_get_stats(ISR_PROF_FOC_ADC, true, &s);
+	check(s.count == 0 && s.duration_max == 0.0, "motor 2 empty");
+	isr_prof_get_stats(ISR_PROF_MC_TIMER, false, &s);
+	check(s.count == 0 && s.duration_max == 0.0, "other handler empty");
+}
+
+static void test_motors(void) {
+	printf("Two motors\n");
+	isr_prof_reset();
+
+	// Both motors at a 50 us period, motor 2 half a period later and with
+	// longer calls. In one shared slot this would be 25 us of jitter.
+	for (int i = 0;i < SAMPLES;i++) {
+		uint32_t t = 1000 + i * 500;
+		call(ISR_PROF_FOC_ADC, false, t, 80);
+		call(ISR_PROF_FOC_ADC, true, t + 250, 120);
+	}
+
+	const float tick = 1.0 / TICKS_PER_SECOND;
+	for (int m = 0;m < 2;m++) {
+		isr_prof_stats s;
+		isr_prof_get_stats(ISR_PROF_FOC_ADC, m == 1, &s);
+
+		printf("  motor %d: count %u, period %.2f us, duration max %.2f us, jitter max %.2f us\n",
+				m + 1, (unsigned int)s.count, (double)(s.period_avg * 1e6),
+				(double)(s.duration_max * 1e6), (double)(s.jitter_max * 1e6));
+
+		check(s.count == SAMPLES, "count");
+		check(fabsf(s.period_avg - 500 * tick) < 1e-9, "period");
+		check(s.duration_max == (m == 1 ? 120 : 80) * tick, "maximum duration");
+		check(s.jitter_max == 0.0, "no jitter");
+	}
+}
+
+static void test_reset(void) {
+	printf("Reset\n");
+	isr_prof_reset();
+
+	for (int i = 0;i < 100;i++) {
+		call(ISR_PROF_MC_TIMER, false, 1000 + i * 10000, 300);
+	}
+
+	isr_prof_stats s;
+	isr_prof_reset();
+
+	// The handler clears its statistics on the next call
+	isr_prof_get_stats(ISR_PROF_MC_TIMER, false, &s);
+	check(s.count == 100, "statistics kept until the next call");
+
+	for (int i = 0;i < 10;i++) {
+		call(ISR_PROF_MC_TIMER, false, 5000000 + i * 20000, 30);
+	}
+
+	isr_prof_get_stats(ISR_PROF_MC_TIMER, false, &s);
+	printf("  count %u, period %.2f us, duration max %.2f us\n", (unsigned int)s.count,
+			(double)(s.period_avg * 1e6), (double)(s.duration_max * 1e6));
+
+	const float tick = 1.0 / TICKS_PER_SECOND;
+	check(s.count == 10, "count restarted");
+	check(fabsf(s.period_avg - 20000 * tick) < 1e-9, "period restarted");
+	check(s.duration_max == 30 * tick, "maximum restarted");
+}
+
+static void test_torn_read(void) {
+	printf("Handler during the read\n");
+	isr_prof_reset();
+
+	for (int i = 0;i < 100;i++) {
+		call(ISR_PROF_FOC_ADC, false, 1000 + i * 500, 40);
+	}
+
+	// Preempt the copy at every offset. Every copy must be one consistent
+	// state, where the histograms add up to the count.
+	int retried = 0;
+	for (size_t ofs = 0;ofs < sizeof(isr_prof_state);ofs += 4) {
+		isr_prof_state copy;
+		uint32_t count_before = m_state[0][ISR_PROF_FOC_ADC].count;
+
+		m_copies = 0;
+		m_inject_at = ofs;
+		copy_state(&m_state[0][ISR_PROF_FOC_ADC], &copy);
+		retried += m_copies > 1;
+
+		uint32_t dur_sum = 0;
+		uint32_t jit_sum = 0;
+		for (int i = 0;i < BINS;i++) {
+			dur_sum += copy.duration_hist[i];
+			jit_sum += copy.jitter_hist[i];
+		}
+
+		if (dur_sum != copy.count || jit_sum != copy.count - 2 ||
+				copy.count != count_before + 1 || (copy.seq & 1)) {
+			printf("  FAIL: inconsistent copy when preempted after %u bytes\n", (unsigned int)ofs);
+			m_errors++;
+			break;
+		}
+	}
+
+	printf("  %d of %u offsets retried\n", retried, (unsigned int)(sizeof(isr_prof_state) / 4));
+	check(retried == (int)(sizeof(isr_prof_state) / 4), "every preempted copy retried");
+}
+
+int main(void) {
+	test_accounting();
+	test_motors();
+	test_reset();
+	test_torn_read();
+
+	if (m_errors) {
+		printf("\n%d errors\n", m_errors);
+		return 1;
+	}
+
+	printf("\nAll tests passed\n");
+	return 0;
+}
@@ -0,0 +1,267 @@
+/*
+ * Accuracy and speed of the math kernels in utils.c that the FOC loop uses.
+ *
+ * Every kernel is swept over its domain and compared with libm in double
+ * precision, which gives the max and RMS error. The timing is ns per call
+ * over the same inputs, with the libm float functions as a baseline. The
+ * kernels with a documented error bound are checked against it, so that
+ * the selection in mcpwm_foc.c (see FOC_OBSERVER_ATAN2 and FOC_PARK_SINCOS)
+ * can rely on it.
+ *
+ * The timing is for the host. On the Cortex-M4 a division or square root
+ * costs 14 cycles and a table load a few, so the ranking between the table
+ * and the polynomials can differ.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <math.h>
+#include <time.h>
+
+#include "utils.h"
+
+#define POINTS			100000
+#define REPETITIONS		50
+
+typedef float (*atan2_t)(float y, float x);
+typedef void (*sincos_t)(float angle, float *sin, float *cos);
+
+typedef struct {
+	const char *name;
+	const char *domain;
+	double err_max;
+	double err_sq_sum;
+	int err_cnt;
+	double ns;
+	double bound; // Documented max error, 0 if none
+} result_t;
+
+static float m_in1[POINTS];
+static float m_in2[POINTS];
+static volatile float m_sink;
+static result_t m_results[32];
+static int m_result_cnt = 0;
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+static double rand_range(double min, double max) {
+	return min + (max - min) * ((double)rand() / (double)RAND_MAX);
+}
+
+static double angle_diff(double a, double b) {
+	return remainder(a - b, 2.0 * M_PI);
+}
+
+static result_t *result_new(const char *name, const char *domain, double bound) {
+	result_t *r = &m_results[m_result_cnt++];
+	r->name = name;
+	r->domain = domain;
+	r->err_max = 0.0;
+	r->err_sq_sum = 0.0;
+	r->err_cnt = 0;
+	r->ns = 0.0;
+	r->bound = bound;
+	return r;
+}
+
+static void result_add(result_t *r, double err) {
+	err = fabs(err);
+	if (err > r->err_max || isnan(err)) {
+		r->err_max = err;
+	}
+	r->err_sq_sum += err * err;
+	r->err_cnt++;
+}
+
+// Libm wrappers with the signatures of the kernels
+static float libm_atan2(float y, float x) {
+	return atan2f(y, x);
+}
+
+static void libm_sincos(float angle, float *sin, float *cos) {
+	sincosf(angle, sin, cos);
+}
+
+static float libm_inv_sqrt(float x) {
+	return 1.0 / sqrtf(x);
+}
+
+static float libm_norm_angle_rad(float angle) {
+	return remainderf(angle, 2.0 * M_PI);
+}
+
+static float utils_norm_angle_rad_value(float angle) {
+	utils_norm_angle_rad(&angle);
+	return angle;
+}
+
+static void bench_atan2(const char *name, atan2_t func, double bound) {
+	result_t *r = result_new(name, "|v| 1e-3..1e3", bound);
+
+	for (int i = 0;i < POINTS;i++) {
+		result_add(r, angle_diff(func(m_in1[i], m_in2[i]), atan2((double)m_in1[i], (double)m_in2[i])));
+	}
+
+	double start = now();
+	for (int j = 0;j < REPETITIONS;j++) {
+		for (int i = 0;i < POINTS;i++) {
+			m_sink = func(m_in1[i], m_in2[i]);
+		}
+	}
+	r->ns = (now() - start) / (POINTS * REPETITIONS) * 1e9;
+}
+
+static void bench_sincos(const char *name, sincos_t func, double bound) {
+	result_t *r = result_new(name, "-2pi..2pi", bound);
+
+	for (int i = 0;i < POINTS;i++) {
+		float s, c;
+		func(m_in1[i], &s, &c);
+		result_add(r, s - sin((double)m_in1[i]));
+		result_add(r, c - cos((double)m_in1[i]));
+	}
+
+	double start = now();
+	for (int j = 0;j < REPETITIONS;j++) {
+		for (int i = 0;i < POINTS;i++) {
+			float s, c;
+			func(m_in1[i], &s, &c);
+			m_sink = s + c;
+		}
+	}
+	r->ns = (now() - start) / (POINTS * REPETITIONS) * 1e9;
+}
+
+static void bench_unary(const char *name, const char *domain, float (*func)(float),
+		double (*ref)(double), bool angle, bool relative, double bound) {
+	result_t *r = result_new(name, domain, bound);
+
+	for (int i = 0;i < POINTS;i++) {
+		double ref_val = ref((double)m_in1[i]);
+		double err = angle ? angle_diff(func(m_in1[i]), ref_val) : func(m_in1[i]) - ref_val;
+		result_add(r, relative ? err / ref_val : err);
+	}
+
+	double start = now();
+	for (int j = 0;j < REPETITIONS;j++) {
+		for (int i = 0;i < POINTS;i++) {
+			m_sink = func(m_in1[i]);
+		}
+	}
+	r->ns = (now() - start) / (POINTS * REPETITIONS) * 1e9;
+}
+
+static double ref_inv_sqrt(double x) {
+	return 1.0 / sqrt(x);
+}
+
+static double ref_norm_angle_rad(double x) {
+	return remainder(x, 2.0 * M_PI);
+}
+
+static void bench_saturate(void) {
+	result_t *r = result_new("utils_saturate_vector_2d", "|v| 0..2, max 1", 0.0);
+	static float x[POINTS], y[POINTS];
+
+	for (int i = 0;i < POINTS;i++) {
+		double mag = hypot(m_in1[i], m_in2[i]);
+		double f = mag > 1.0 ? 1.0 / mag : 1.0;
+		x[i] = m_in1[i];
+		y[i] = m_in2[i];
+		utils_saturate_vector_2d(&x[i], &y[i], 1.0);
+		result_add(r, x[i] - m_in1[i] * f);
+		result_add(r, y[i] - m_in2[i] * f);
+	}
+
+	double start = now();
+	for (int j = 0;j < REPETITIONS;j++) {
+		for (int i = 0;i < POINTS;i++) {
+			float xs = m_in1[i];
+			float ys = m_in2[i];
+			utils_saturate_vector_2d(&xs, &ys, 1.0);
+			m_sink = xs + ys;
+		}
+	}
+	r->ns = (now() - start) / (POINTS * REPETITIONS) * 1e9;
+}
+
+int main(void) {
+	srand(24);
+
+	// Vectors with random angles and magnitudes over six decades
+	for (int i = 0;i < POINTS;i++) {
+		double ang = rand_range(-M_PI, M_PI);
+		double mag = pow(10.0, rand_range(-3.0, 3.0));
+		m_in1[i] = mag * sin(ang);
+		m_in2[i] = mag * cos(ang);
+	}
+
+	// Exact multiples of pi / 2 are the edge cases of the octant logic
+	for (int i = 0;i < 8;i++) {
+		m_in1[i] = sin(i * M_PI / 4.0);
+		m_in2[i] = cos(i * M_PI / 4.0);
+	}
+
+	bench_atan2("atan2f (libm)", libm_atan2, 0.0);
+	bench_atan2("utils_fast_atan2", utils_fast_atan2, 0.0);
+	bench_atan2("utils_fast_atan2_poly", utils_fast_atan2_poly, 1.2e-5);
+
+	for (int i = 0;i < POINTS;i++) {
+		m_in1[i] = rand_range(-2.0 * M_PI, 2.0 * M_PI);
+	}
+
+	bench_sincos("sincosf (libm)", libm_sincos, 0.0);
+	bench_sincos("utils_fast_sincos", utils_fast_sincos, 0.0);
+	bench_sincos("utils_fast_sincos_better", utils_fast_sincos_better, 0.0);
+	bench_sincos("utils_fast_sincos_table", utils_fast_sincos_table, 7.5e-5);
+	bench_sincos("utils_fast_sincos_poly", utils_fast_sincos_poly, 1e-6);
+
+	for (int i = 0;i < POINTS;i++) {
+		m_in1[i] = pow(10.0, rand_range(-3.0, 3.0));
+	}
+
+	bench_unary("1 / sqrtf (libm)", "1e-3..1e3, rel", libm_inv_sqrt,
+			ref_inv_sqrt, false, true, 0.0);
+	bench_unary("utils_fast_inv_sqrt", "1e-3..1e3, rel", utils_fast_inv_sqrt,
+			ref_inv_sqrt, false, true, 0.0);
+
+	for (int i = 0;i < POINTS;i++) {
+		m_in1[i] = rand_range(-5.0 * M_PI, 5.0 * M_PI);
+	}
+
+	bench_unary("remainderf (libm)", "-5pi..5pi", libm_norm_angle_rad,
+			ref_norm_angle_rad, true, false, 0.0);
+	bench_unary("utils_norm_angle_rad", "-5pi..5pi", utils_norm_angle_rad_value,
+			ref_norm_angle_rad, true, false, 0.0);
+
+	for (int i = 0;i < POINTS;i++) {
+		double ang = rand_range(-M_PI, M_PI);
+		double mag = rand_range(0.0, 2.0);
+		m_in1[i] = mag * sin(ang);
+		m_in2[i] = mag * cos(ang);
+	}
+
+	bench_saturate();
+
+	int errors = 0;
+	printf("%-26s %-17s %12s %12s %9s\n", "Kernel", "Domain", "Max error", "RMS error", "ns/call");
+	for (int i = 0;i < m_result_cnt;i++) {
+		result_t *r = &m_results[i];
+		printf("%-26s %-17s %12.3e %12.3e %9.2f", r->name, r->domain, r->err_max,
+				sqrt(r->err_sq_sum / r->err_cnt), r->ns);
+
+		// Some slack for the float rounding on top of the approximation error
+		if (r->bound > 0.0 && !(r->err_max <= r->bound * 1.1 + 2e-7)) {
+			printf("  exceeds %.1e", r->bound);
+			errors++;
+		}
+		printf("\n");
+	}
+
+	return errors ? 1 : 0;
+}
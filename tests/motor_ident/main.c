@@ -0,0 +1,274 @@
+/*
+ * Host test for mcpwm_foc_measure_params.
+ *
+ * mcpwm_foc.c and virtual_motor.c are included directly, as in hfi_bench,
+ * and the virtual motor is driven from the PWM outputs. The measurement runs
+ * in this thread like it does in the terminal thread on the target, and the
+ * sleep hook of the host kernel runs the control loop for the time that it
+ * sleeps. For every motor the identified R, Ld, Lq and flux linkage are
+ * compared with the parameters of the virtual motor (see euler_ind for the
+ * inductances), and the simulated time
+ * of the measurement is compared with mcpwm_foc_measure_res_ind, which the
+ * resistance and inductance part of the detection used until now. The flux
+ * linkage measurement of the detection comes on top of that, see
+ * conf_general_measure_flux_linkage_openloop.
+ *
+ * Returns 1 if a parameter is off by more than its tolerance, or if a current
+ * close to 0 is accepted.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "stubs.h"
+#include "confgenerator.h"
+
+#include "../../mcpwm_foc.c"
+#include "../../virtual_motor.c"
+
+#define TOL_RES				0.03
+#define TOL_IND				0.05
+#define TOL_LINKAGE			0.03
+#define BENCH_DUTY			0.3
+#define BENCH_ERPM_PER_SEC	1800.0
+
+typedef struct {
+	const char *name;
+	// In the convention of the configuration
+	float res;
+	float ld;
+	float lq;
+	float linkage;
+	float J;
+	float current;
+	float v_bus;
+} bench_motor_t;
+
+// The rotor of the virtual motor has no friction, so it swings around the
+// open loop angle, and at high electrical speeds that grows until it loses
+// sync. The small motors therefore run from 12 V, where they reach the duty
+// cycle of the spin earlier.
+static const bench_motor_t m_motors[] = {
+		{"Outrunner", 0.04, 20e-6, 26e-6, 0.004, 5e-5, 20.0, 12.0},
+		{"Inrunner", 0.015, 8e-6, 12e-6, 0.0025, 2e-5, 30.0, 12.0},
+		{"Hub motor", 0.12, 250e-6, 320e-6, 0.03, 1e-3, 8.0, 30.0},
+};
+
+static float m_v_alpha;
+static float m_v_beta;
+static float m_periods_left;
+static int m_timer_cnt;
+
+/*
+ * Does what mcpwm_foc_init does, minus the ADC/DMA setup and the current
+ * offset calibration, which would wait for interrupts that never come.
+ */
+static void bench_init(mc_configuration *conf) {
+	memset((void*)&m_motor_1, 0, sizeof(motor_all_state_t));
+	m_isr_motor = 0;
+	m_motor_1.m_conf = conf;
+	chMtxObjectInit(&m_derived_mutex);
+	update_derived(&m_motor_1);
+	m_motor_1.m_state = MC_STATE_OFF;
+	m_motor_1.m_control_mode = CONTROL_MODE_NONE;
+	m_motor_1.m_hall_dt_diff_last = 1.0;
+	m_motor_1.m_curr_ofs[0] = 2048;
+	m_motor_1.m_curr_ofs[1] = 2048;
+	m_motor_1.m_curr_ofs[2] = 2048;
+	update_hfi_samples(conf->foc_hfi_samples, &m_motor_1);
+
+	timer_reinit((int)conf->foc_f_sw);
+
+	m_dccal_done = true;
+	m_init_done = true;
+}
+
+/*
+ * Connect the virtual motor at rest, with the rotor at phase 0.
+ */
+static void bench_connect_motor(const bench_motor_t *m) {
+	char args[7][32];
+	const char *argv[8];
+
+	// ml J Ld Lq Rs lambda Vbus, the inductances and the resistance in the
+	// dq frame
+	snprintf(args[0], 32, "%f", 0.0);
+	snprintf(args[1], 32, "%g", (double)m->J);
+	snprintf(args[2], 32, "%g", (double)(m->ld * (3.0 / 2.0)));
+	snprintf(args[3], 32, "%g", (double)(m->lq * (3.0 / 2.0)));
+	snprintf(args[4], 32, "%g", (double)(m->res * (3.0 / 2.0)));
+	snprintf(args[5], 32, "%g", (double)m->linkage);
+	snprintf(args[6], 32, "%f", (double)m->v_bus);
+
+	argv[0] = "connect_virtual_motor";
+	for (int i = 0;i < 7;i++) {
+		argv[i + 1] = args[i];
+	}
+
+	stubs_terminal_run(8, argv);
+
+	// No current at the start
+	virtual_motor.phi = 0.0;
+	virtual_motor.we = 0.0;
+	virtual_motor.iq = 0.0;
+	virtual_motor.id_int = virtual_motor.flux_linkage / virtual_motor.Ld;
+	m_v_alpha = 0.0;
+	m_v_beta = 0.0;
+}
+
+static void bench_disconnect_motor(void) {
+	const char *argv[] = {"disconnect_virtual_motor"};
+	stubs_terminal_run(1, argv);
+}
+
+/*
+ * The voltage vector that the PWM timer outputs, see hfi_bench.
+ */
+static void bench_pwm_voltage(float *v_alpha, float *v_beta) {
+	const float arr = (float)TIM1->ARR;
+	const float v_bus = m_motor_1.m_motor_state.v_bus;
+
+	// See TIMER_UPDATE_DUTY_M1
+	float va = ((float)TIM1->CCR1 / arr - 0.5) * v_bus;
+	float vb = ((float)TIM1->CCR3 / arr - 0.5) * v_bus;
+	float vc = ((float)TIM1->CCR2 / arr - 0.5) * v_bus;
+
+	*v_alpha = (2.0 / 3.0) * (va - 0.5 * (vb + vc));
+	*v_beta = ONE_BY_SQRT3 * (vb - vc);
+}
+
+/*
+ * Run the control loop and the 1 kHz timer thread for the time that the
+ * measurement sleeps.
+ */
+static void bench_sleep_hook(systime_t ticks) {
+	const float f_sample = 1.0 / mcpwm_foc_get_ts();
+	const int timer_div = (int)(f_sample / 1000.0);
+
+	m_periods_left += (float)ticks / (float)CH_CFG_ST_FREQUENCY * f_sample;
+
+	while (m_periods_left >= 1.0) {
+		m_periods_left -= 1.0;
+		TIM1->CR1 ^= TIM_CR1_DIR;
+
+		// The duty cycles are output in the half period after the one that
+		// the ISR runs in, see hfi_bench.
+		float v_alpha, v_beta;
+		bench_pwm_voltage(&v_alpha, &v_beta);
+		virtual_motor_int_handler(m_v_alpha, m_v_beta);
+		m_v_alpha = v_alpha;
+		m_v_beta = v_beta;
+
+		if (++m_timer_cnt >= timer_div) {
+			m_timer_cnt = 0;
+			timer_update(&m_motor_1, 0.001);
+		}
+	}
+}
+
+static void bench_setup(const bench_motor_t *m) {
+	confgenerator_set_defaults_mcconf(&stubs_mcconf, true);
+
+	// Like conf_general_detect_apply_all_foc
+	stubs_mcconf.foc_sensor_mode = FOC_SENSOR_MODE_SENSORLESS;
+	stubs_mcconf.foc_f_sw = 10000.0;
+	stubs_mcconf.foc_current_kp = 0.0005;
+	stubs_mcconf.foc_current_ki = 1.0;
+
+	// The virtual motor takes the PWM output without dead time
+	stubs_mcconf.foc_dt_us = 0.0;
+
+	// The virtual motor uses the same angle for the electrical and the
+	// mechanical rotor position, which is only consistent for one pole pair.
+	stubs_mcconf.si_motor_poles = 2;
+
+	// Normally derived from the temperature and voltage limits by mc_interface
+	stubs_mcconf.lo_current_max = stubs_mcconf.l_current_max;
+	stubs_mcconf.lo_current_min = stubs_mcconf.l_current_min;
+	stubs_mcconf.lo_in_current_max = stubs_mcconf.l_in_current_max;
+	stubs_mcconf.lo_in_current_min = stubs_mcconf.l_in_current_min;
+	stubs_mcconf.lo_current_motor_max_now = stubs_mcconf.l_current_max;
+	stubs_mcconf.lo_current_motor_min_now = stubs_mcconf.l_current_min;
+
+	bench_init(&stubs_mcconf);
+	virtual_motor_init();
+	bench_connect_motor(m);
+}
+
+/*
+ * The inductance that an exact fit gives for the virtual motor. It
+ * integrates the currents with forward Euler, so every step of ts decays the
+ * current by (1 - R * ts / L) instead of exp(-R * ts / L). That is 10 %
+ * apart when the time constant is only a few steps.
+ */
+static float euler_ind(float res, float ind, float ts) {
+	return -res * ts / logf(1.0 - res * ts / ind);
+}
+
+static float rel_err(float value, float ref) {
+	return (value - ref) / ref;
+}
+
+static bool check(const char *name, float value, float ref, float scale, const char *unit, float tol) {
+	const float err = rel_err(value, ref);
+	const bool ok = fabsf(err) <= tol;
+	printf("  %-8s %10.4f %-4s (%10.4f), error %+6.2f %%%s\r\n", name,
+			(double)(value * scale), unit, (double)(ref * scale), (double)(err * 100.0),
+			ok ? "" : "  FAIL");
+	return ok;
+}
+
+int main(void) {
+	int errors = 0;
+	host_set_sleep_hook(bench_sleep_hook);
+
+	// A current close to 0 cannot scale the capture
+	bench_setup(&m_motors[0]);
+	float dummy;
+	if (mcpwm_foc_measure_params(0.001, BENCH_DUTY, BENCH_ERPM_PER_SEC, &dummy, &dummy, &dummy, &dummy)) {
+		printf("mcpwm_foc_measure_params accepted a current of 1 mA\r\n");
+		errors++;
+	}
+	bench_disconnect_motor();
+
+	for (unsigned int i = 0;i < sizeof(m_motors) / sizeof(m_motors[0]);i++) {
+		const bench_motor_t *m = &m_motors[i];
+		printf("%s\r\n", m->name);
+
+		// One shot identification
+		bench_setup(m);
+		float res = 0.0, ld = 0.0, lq = 0.0, linkage = 0.0;
+		systime_t start = chVTGetSystemTimeX();
+		bool ok = mcpwm_foc_measure_params(m->current, BENCH_DUTY, BENCH_ERPM_PER_SEC, &res, &ld, &lq, &linkage);
+		const float t_new = (float)(chVTGetSystemTimeX() - start) / (float)CH_CFG_ST_FREQUENCY;
+		bench_disconnect_motor();
+
+		if (!ok) {
+			printf("  mcpwm_foc_measure_params failed\r\n");
+			errors++;
+			continue;
+		}
+
+		errors += !check("R", res, m->res, 1e3, "mOhm", TOL_RES);
+		const float ts = mcpwm_foc_get_ts();
+		errors += !check("Ld", ld, euler_ind(m->res, m->ld, ts), 1e6, "uH", TOL_IND);
+		errors += !check("Lq", lq, euler_ind(m->res, m->lq, ts), 1e6, "uH", TOL_IND);
+		errors += !check("lambda", linkage, m->linkage, 1e3, "mWb", TOL_LINKAGE);
+
+		// The resistance and inductance measurement of the detection so far
+		bench_setup(m);
+		float res_old = 0.0, ind_old = 0.0;
+		start = chVTGetSystemTimeX();
+		mcpwm_foc_measure_res_ind(&res_old, &ind_old);
+		const float t_old = (float)(chVTGetSystemTimeX() - start) / (float)CH_CFG_ST_FREQUENCY;
+		bench_disconnect_motor();
+
+		printf("  Time %.2f s, mcpwm_foc_measure_res_ind %.2f s without the flux linkage "
+				"(R %.4f mOhm, L %.4f uH)\r\n", (double)t_new, (double)t_old,
+				(double)(res_old * 1e3), (double)ind_old);
+		printf("\r\n");
+	}
+
+	return errors ? 1 : 0;
+}
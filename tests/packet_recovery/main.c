@@ -23,6 +23,43 @@ void process_packet_perf(unsigned char *data, unsigned int len) {
 	(void)len;
 }
 
+static double rate(const uint8_t *data, const unsigned int *offsets,
+		unsigned int offsets_num, unsigned int len, int bulk) {
+	const int rounds = 2000;
+	double bytes = 0.0;
+
+	clock_t start = clock();
+	for (int r = 0;r < rounds;r++) {
+		for (unsigned int ofs = 0;ofs < offsets_num;ofs++) {
+			packet_reset(0);
+			if (bulk) {
+				packet_process_bytes(data + offsets[ofs], len - offsets[ofs], 0);
+			} else {
+				for (unsigned int i = offsets[ofs];i < len;i++) {
+					packet_process_byte(data[i], 0);
+				}
+			}
+			bytes += len - offsets[ofs];
+		}
+	}
+	clock_t end = clock();
+
+	return bytes / ((double)(end - start) / CLOCKS_PER_SEC);
+}
+
+// Decode the data from every offset in a loop without printing and report
+// the throughput of the byte by byte and the bulk interface.
+static void print_rate(const char *name, const uint8_t *data,
+		const unsigned int *offsets, unsigned int offsets_num, unsigned int len) {
+	packet_init(send_packet, process_packet_perf, 0);
+	double byte = rate(data, offsets, offsets_num, len, 0);
+	double bulk = rate(data, offsets, offsets_num, len, 1);
+	packet_init(send_packet, process_packet, 0);
+
+	printf("%s: %.2f MB/s byte by byte, %.2f MB/s bulk\r\n",
+			name, byte / 1e6, bulk / 1e6);
+}
+
 int main(void) {
 	packet_init(send_packet, process_packet, 0);
 	
@@ -52,6 +89,8 @@ int main(void) {
 		printf("\r\n");
 	}
 	
+	print_rate("Offsets", buffer, offsets, sizeof(offsets) / sizeof(int), write);
+	
 	// Corruption
 	printf("Corruption Test\r\n");
 	buffer[12] = 91;
@@ -66,6 +105,17 @@ int main(void) {
 		packet_process_byte(buffer[i], 0);
 	}
 	
+	const unsigned int start_offset = 0;
+	printf("\r\n");
+	print_rate("Corruption", buffer, &start_offset, 1, write);
+	
+	// Noise, with plenty of start bytes that need to be rejected
+	static uint8_t noise[16384];
+	for (unsigned int i = 0;i < sizeof(noise);i++) {
+		noise[i] = rand() % 8;
+	}
+	print_rate("Noise", noise, &start_offset, 1, sizeof(noise));
+	
 	// Performance
 	printf("\r\nPerformance Test\r\n");
 	packet_init(send_packet, process_packet_perf, 0);
@@ -91,7 +141,20 @@ int main(void) {
 	end = clock();
 	cpu_time_used = ((double) (end - start)) / CLOCKS_PER_SEC;
 	
-	printf("Time: %.3f s\r\n", cpu_time_used);
+	printf("Time: %.3f s (%.2f MB/s)\r\n", cpu_time_used,
+			(sizeof(asd) + 5) / cpu_time_used);
+	
+	start = clock();
+	for (int i = 0;i < 1e6;i++) {
+		packet_send_packet(asd, sizeof(asd), 0);
+		packet_process_bytes(buffer, write, 0);
+		write = 0;
+	}
+	end = clock();
+	cpu_time_used = ((double) (end - start)) / CLOCKS_PER_SEC;
+	
+	printf("Bulk time: %.3f s (%.2f MB/s)\r\n", cpu_time_used,
+			(sizeof(asd) + 5) / cpu_time_used);
 	
 	return 0;
 }
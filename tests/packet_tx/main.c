@@ -0,0 +1,234 @@
+/*
+ * Host benchmark for the transmit side of packet.c.
+ *
+ * COMM_GET_VALUES replies are framed with packet_send_packet and handed to a
+ * fake transport, in two modes:
+ *
+ * Copy:      The previous behavior. The frame is assembled in tx_buffer and
+ *            written with one call to the send function.
+ * Coalesced: Frames are collected in tx_buffer and written with one call per
+ *            packet_flush, which the transports do after processing a batch
+ *            of received packets. Batches of 1, 4 and 16 requests are used,
+ *            e.g. VESC Tool polling one value set or several in a row.
+ *
+ * Every transport write is counted as one syscall-equivalent: on the hardware
+ * each is a chnWriteTimeout/sdWrite call that locks the system and wakes up
+ * the driver. The written stream is decoded again and has to contain the same
+ * packets in every mode.
+ *
+ * Output: transport writes and bytes copied per 1000 replies, and ns per reply
+ * on the host.
+ *
+ * Usage: ./packet_tx [replies]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "packet.h"
+#include "buffer.h"
+#include "datatypes.h"
+
+#define TX_HANDLER			0
+#define RX_HANDLER			1
+
+typedef enum {
+	MODE_COPY = 0,
+	MODE_COALESCED
+} tx_mode_t;
+
+typedef struct {
+	const char *name;
+	tx_mode_t mode;
+	int batch;
+} tx_scenario_t;
+
+typedef struct {
+	double writes;
+	double copied;
+	double ns;
+	int packets;
+	uint32_t checksum;
+} tx_result_t;
+
+static const tx_scenario_t m_scenarios[] = {
+		{"Copy", MODE_COPY, 1},
+		{"Coalesced, batch 1", MODE_COALESCED, 1},
+		{"Coalesced, batch 4", MODE_COALESCED, 4},
+		{"Coalesced, batch 16", MODE_COALESCED, 16},
+};
+
+static unsigned int m_writes = 0;
+static unsigned int m_copied = 0;
+static bool m_decode = false;
+static int m_packets_rx = 0;
+static uint32_t m_checksum = 0;
+
+static inline uint64_t bench_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+// Transport
+static void transport_write(const unsigned char *data, unsigned int len) {
+	m_writes++;
+	if (m_decode) {
+		packet_process_bytes(data, len, RX_HANDLER);
+	}
+}
+
+static void send_func(unsigned char *data, unsigned int len) {
+	m_copied += len;
+	transport_write(data, len);
+}
+
+static void process_func(unsigned char *data, unsigned int len) {
+	m_packets_rx++;
+	for (unsigned int i = 0;i < len;i++) {
+		m_checksum = m_checksum * 31 + data[i];
+	}
+}
+
+static int32_t make_values_reply(uint8_t *buffer, int n) {
+	int32_t ind = 0;
+	buffer[ind++] = COMM_GET_VALUES;
+	buffer_append_float16(buffer, 35.2 + n * 0.01, 1e1, &ind);
+	buffer_append_float16(buffer, 41.7, 1e1, &ind);
+	buffer_append_float32(buffer, 12.3 + n, 1e2, &ind);
+	buffer_append_float32(buffer, 4.5, 1e2, &ind);
+	buffer_append_float32(buffer, -0.3, 1e2, &ind);
+	buffer_append_float32(buffer, 12.1, 1e2, &ind);
+	buffer_append_float16(buffer, 0.456, 1e3, &ind);
+	buffer_append_float32(buffer, 12345.0 + n, 1e0, &ind);
+	buffer_append_float16(buffer, 48.2, 1e1, &ind);
+	buffer_append_float32(buffer, 1.234, 1e4, &ind);
+	buffer_append_float32(buffer, 0.012, 1e4, &ind);
+	buffer_append_float32(buffer, 55.1, 1e4, &ind);
+	buffer_append_float32(buffer, 0.5, 1e4, &ind);
+	buffer_append_int32(buffer, 100000 + n, &ind);
+	buffer_append_int32(buffer, 120000 + n, &ind);
+	buffer[ind++] = FAULT_CODE_NONE;
+	buffer_append_float32(buffer, 123.4, 1e6, &ind);
+	buffer[ind++] = 5;
+	buffer_append_float16(buffer, 30.0, 1e1, &ind);
+	buffer_append_float16(buffer, 31.0, 1e1, &ind);
+	buffer_append_float16(buffer, 32.0, 1e1, &ind);
+	return ind;
+}
+
+static void run(const tx_scenario_t *s, int replies, bool decode) {
+	uint8_t reply[64];
+
+	packet_init(send_func, 0, TX_HANDLER);
+	packet_set_coalescing(s->mode == MODE_COALESCED, TX_HANDLER);
+
+	m_decode = decode;
+	m_writes = 0;
+	m_copied = 0;
+
+	for (int i = 0;i < replies;i++) {
+		int32_t len = make_values_reply(reply, i);
+		packet_send_packet(reply, len, TX_HANDLER);
+
+		if (s->mode == MODE_COALESCED && ((i + 1) % s->batch) == 0) {
+			packet_flush(TX_HANDLER);
+		}
+	}
+
+	packet_flush(TX_HANDLER);
+}
+
+static tx_result_t measure(const tx_scenario_t *s, int replies) {
+	tx_result_t res;
+
+	packet_init(0, process_func, RX_HANDLER);
+	m_packets_rx = 0;
+	m_checksum = 0;
+	run(s, replies, true);
+
+	res.writes = (double)m_writes * 1000.0 / (double)replies;
+	res.copied = (double)m_copied * 1000.0 / (double)replies;
+	res.packets = m_packets_rx;
+	res.checksum = m_checksum;
+
+	int reps = 0;
+	uint64_t t_start = bench_ns();
+	uint64_t t_elapsed = 0;
+	while (t_elapsed < 200000000ULL) {
+		run(s, replies, false);
+		reps++;
+		t_elapsed = bench_ns() - t_start;
+	}
+
+	res.ns = (double)t_elapsed / ((double)reps * replies);
+	return res;
+}
+
+// Frames too large for coalescing must flush the pending ones first
+static bool test_large_frame_order(void) {
+	uint8_t data[300];
+	packet_init(0, process_func, RX_HANDLER);
+	m_packets_rx = 0;
+	m_checksum = 0;
+
+	packet_init(send_func, 0, TX_HANDLER);
+	packet_set_coalescing(true, TX_HANDLER);
+	m_decode = true;
+
+	uint32_t expected = 0;
+	for (int i = 0;i < 8;i++) {
+		unsigned int len = (i % 3) == 2 ? (unsigned int)sizeof(data) : 10 + (unsigned int)i;
+		for (unsigned int j = 0;j < len;j++) {
+			data[j] = i * 17 + j;
+			expected = expected * 31 + data[j];
+		}
+
+		packet_send_packet(data, len, TX_HANDLER);
+	}
+
+	packet_flush(TX_HANDLER);
+
+	return m_packets_rx == 8 && m_checksum == expected && packet_tx_pending(TX_HANDLER) == 0;
+}
+
+int main(int argc, char **argv) {
+	int replies = 1000;
+	if (argc > 1) {
+		replies = atoi(argv[1]);
+	}
+
+	uint8_t reply[64];
+	printf("%d COMM_GET_VALUES replies of %d bytes\r\n\r\n", replies,
+			(int)make_values_reply(reply, 0));
+	printf("Mode                  Writes/1000  Copied/1000 (B)  ns/reply\r\n");
+
+	int fails = 0;
+	tx_result_t ref;
+
+	for (unsigned int i = 0;i < sizeof(m_scenarios) / sizeof(m_scenarios[0]);i++) {
+		tx_result_t r = measure(&m_scenarios[i], replies);
+		printf("%-20s  %11.0f  %15.0f  %8.1f\r\n", m_scenarios[i].name,
+				r.writes, r.copied, r.ns);
+
+		if (i == 0) {
+			ref = r;
+		}
+
+		if (r.packets != replies || r.checksum != ref.checksum) {
+			printf("FAIL: %d of %d packets decoded, checksum %08x, expected %08x\r\n",
+					r.packets, replies, (unsigned int)r.checksum, (unsigned int)ref.checksum);
+			fails++;
+		}
+	}
+
+	if (!test_large_frame_order()) {
+		printf("FAIL: frames reordered or lost around a large frame\r\n");
+		fails++;
+	}
+
+	printf("\r\n%s\r\n", fails ? "FAILED" : "All tests passed");
+	return fails ? 1 : 0;
+}
@@ -0,0 +1,256 @@
+/*
+ * Round trip of a debug sample capture through the COMM_SAMPLE_STREAM
+ * packets, decoded the way a client would, and the number of bytes on the
+ * wire compared to one COMM_SAMPLE_PRINT packet per sample.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "sample_stream.h"
+#include "datatypes.h"
+#include "buffer.h"
+#include "minilzo.h"
+
+#define RING_LEN		2000
+#define CH16_NUM		8
+#define CH8_NUM			2
+#define FRAME_LEN		512
+
+static volatile int16_t m_ch16[CH16_NUM][RING_LEN];
+static volatile uint8_t m_ch8[CH8_NUM][RING_LEN];
+static const volatile int16_t *const m_ch16_ptr[CH16_NUM] = {
+		m_ch16[0], m_ch16[1], m_ch16[2], m_ch16[3],
+		m_ch16[4], m_ch16[5], m_ch16[6], m_ch16[7]
+};
+static const volatile uint8_t *const m_ch8_ptr[CH8_NUM] = {m_ch8[0], m_ch8[1]};
+
+// Scales of the same order as the ones mc_interface.c sends
+static const float m_scale[CH16_NUM] = {
+		0.0201416, 0.0201416, 0.0146557, 0.0146557, 0.0146557, 0.0146557,
+		0.0025177, 10.0
+};
+
+static lzo_align_t m_wrkmem[(LZO1X_1_MEM_COMPRESS + sizeof(lzo_align_t) - 1) / sizeof(lzo_align_t)];
+static uint8_t m_lzo_buffer[SAMPLE_STREAM_LZO_BUFFER_LEN(FRAME_LEN)];
+
+// Decoder state
+static int m_dec_len;
+static float m_dec_scale[CH16_NUM];
+static int16_t m_dec_ch16[CH16_NUM][RING_LEN];
+static uint8_t m_dec_ch8[CH8_NUM][RING_LEN];
+static int m_dec_received;
+static int m_errors;
+
+// Bytes on the wire for a packet with the given payload, see packet.c
+static unsigned int wire_bytes(unsigned int len) {
+	return len + (len <= 255 ? 2 : 3) + 3;
+}
+
+static void fill_capture(void) {
+	srand(6);
+
+	for (int i = 0;i < RING_LEN;i++) {
+		float ph = (float)i * 0.02;
+		int noise = rand() % 7 - 3;
+
+		m_ch16[0][i] = 1200.0 * sinf(ph) + noise;
+		m_ch16[1][i] = 1200.0 * sinf(ph - 2.094) + rand() % 7 - 3;
+		m_ch16[2][i] = 900.0 * sinf(ph) + rand() % 5 - 2;
+		m_ch16[3][i] = 900.0 * sinf(ph - 2.094) + rand() % 5 - 2;
+		m_ch16[4][i] = 900.0 * sinf(ph + 2.094) + rand() % 5 - 2;
+		m_ch16[5][i] = 1150 + rand() % 3 - 1;
+		m_ch16[6][i] = 9500 + rand() % 21 - 10;
+		m_ch16[7][i] = 2000;
+		m_ch8[0][i] = ((i / 60) % 6 + 1) | ((((i / 60) + 2) % 6 + 1) << 3);
+		m_ch8[1][i] = (uint8_t)(fmodf(ph * 57.2958, 360.0) / 360.0 * 250.0);
+	}
+}
+
+static void decode(const uint8_t *data, int len) {
+	int32_t ind = 0;
+
+	if (data[ind++] != COMM_SAMPLE_STREAM) {
+		printf("Wrong packet id %d\n", data[0]);
+		m_errors++;
+		return;
+	}
+
+	if (data[ind++] == SAMPLE_STREAM_HEADER) {
+		m_dec_len = buffer_get_uint16(data, &ind);
+		int ch16_num = data[ind++];
+		int ch8_num = data[ind++];
+		if (ch16_num != CH16_NUM || ch8_num != CH8_NUM) {
+			printf("Wrong channel count %d %d\n", ch16_num, ch8_num);
+			m_errors++;
+		}
+
+		for (int i = 0;i < ch16_num;i++) {
+			m_dec_scale[i] = buffer_get_float32_auto(data, &ind);
+		}
+
+		m_dec_received = 0;
+		return;
+	}
+
+	uint8_t flags = data[ind++];
+	int first = buffer_get_uint16(data, &ind);
+	int num = data[ind++];
+
+	uint8_t payload[FRAME_LEN];
+	lzo_uint payload_len = num * (2 * CH16_NUM + CH8_NUM);
+
+	if (flags & SAMPLE_STREAM_FLAG_LZO) {
+		lzo_uint out_len = sizeof(payload);
+		if (lzo1x_decompress_safe(data + ind, len - ind, payload, &out_len, NULL) != LZO_E_OK ||
+				out_len != payload_len) {
+			printf("Decompression failed at sample %d\n", first);
+			m_errors++;
+			return;
+		}
+	} else {
+		if ((lzo_uint)(len - ind) != payload_len) {
+			printf("Wrong payload length at sample %d\n", first);
+			m_errors++;
+			return;
+		}
+		memcpy(payload, data + ind, payload_len);
+	}
+
+	int32_t pind = 0;
+	for (int ch = 0;ch < CH16_NUM;ch++) {
+		for (int i = 0;i < num;i++) {
+			m_dec_ch16[ch][first + i] = buffer_get_int16(payload, &pind);
+		}
+	}
+	for (int ch = 0;ch < CH8_NUM;ch++) {
+		for (int i = 0;i < num;i++) {
+			m_dec_ch8[ch][first + i] = payload[pind++];
+		}
+	}
+
+	m_dec_received += num;
+}
+
+// Send a capture as stream, return the bytes on the wire
+static unsigned int send_stream(int offset, int len, bool lzo) {
+	sample_stream_src src;
+	src.ch16 = m_ch16_ptr;
+	src.ch16_scale = m_scale;
+	src.ch16_num = CH16_NUM;
+	src.ch8 = m_ch8_ptr;
+	src.ch8_num = CH8_NUM;
+	src.ring_len = RING_LEN;
+	src.offset = offset;
+	src.len = len;
+
+	uint8_t buffer[FRAME_LEN];
+	unsigned int bytes = 0;
+
+	int32_t plen = sample_stream_header(buffer, &src);
+	bytes += wire_bytes(plen);
+	decode(buffer, plen);
+
+	const int frame_samples = sample_stream_frame_samples(&src, FRAME_LEN);
+	for (int i = 0;i < len;i += frame_samples) {
+		int num = len - i < frame_samples ? len - i : frame_samples;
+		plen = sample_stream_frame(buffer, &src, i, num,
+				lzo ? m_wrkmem : 0, lzo ? m_lzo_buffer : 0);
+
+		if (plen > FRAME_LEN) {
+			printf("Frame too long: %d\n", plen);
+			m_errors++;
+		}
+
+		bytes += wire_bytes(plen);
+		decode(buffer, plen);
+	}
+
+	return bytes;
+}
+
+// Compare the decoded capture with the source and with the values the
+// COMM_SAMPLE_PRINT packets carry.
+static void check(int offset, int len) {
+	if (m_dec_len != len || m_dec_received != len) {
+		printf("Decoded %d of %d samples, expected %d\n", m_dec_received, m_dec_len, len);
+		m_errors++;
+		return;
+	}
+
+	for (int i = 0;i < len;i++) {
+		int ind = ((offset + i) % RING_LEN + RING_LEN) % RING_LEN;
+
+		for (int ch = 0;ch < CH16_NUM;ch++) {
+			if (m_dec_ch16[ch][i] != m_ch16[ch][ind]) {
+				printf("Sample %d channel %d: %d, expected %d\n", i, ch,
+						m_dec_ch16[ch][i], m_ch16[ch][ind]);
+				m_errors++;
+				return;
+			}
+
+			uint8_t buffer[8];
+			int32_t bind = 0;
+			buffer_append_float32_auto(buffer, (float)m_ch16[ch][ind] * m_scale[ch], &bind);
+			bind = 0;
+			float legacy = buffer_get_float32_auto(buffer, &bind);
+			float value = (float)m_dec_ch16[ch][i] * m_dec_scale[ch];
+
+			if (fabsf(value - legacy) > 1e-6 * fabsf(legacy) + 1e-9) {
+				printf("Sample %d channel %d: %g, legacy %g\n", i, ch, value, legacy);
+				m_errors++;
+				return;
+			}
+		}
+
+		for (int ch = 0;ch < CH8_NUM;ch++) {
+			if (m_dec_ch8[ch][i] != m_ch8[ch][ind]) {
+				printf("Sample %d byte channel %d: %d, expected %d\n", i, ch,
+						m_dec_ch8[ch][i], m_ch8[ch][ind]);
+				m_errors++;
+				return;
+			}
+		}
+	}
+}
+
+int main(void) {
+	if (lzo_init() != LZO_E_OK) {
+		printf("lzo_init failed\n");
+		return 1;
+	}
+
+	fill_capture();
+
+	// COMM_SAMPLE_PRINT: id, 8 float32_auto and 2 bytes per sample
+	const unsigned int legacy_sample = wire_bytes(1 + CH16_NUM * 4 + CH8_NUM);
+
+	// Capture now, and triggered captures that wrap around the ring
+	const int cases[][2] = {{0, 1000}, {0, 2000}, {1500, 2000}, {-300, 1000}, {1990, 7}};
+
+	printf("%-14s %8s %10s %10s %10s\n", "Capture", "Samples", "Packets", "Stream", "LZO");
+
+	for (unsigned int c = 0;c < sizeof(cases) / sizeof(cases[0]);c++) {
+		int offset = cases[c][0];
+		int len = cases[c][1];
+
+		unsigned int raw = send_stream(offset, len, false);
+		check(offset, len);
+		unsigned int lzo = send_stream(offset, len, true);
+		check(offset, len);
+
+		char name[20];
+		snprintf(name, sizeof(name), "offset %d", offset);
+		printf("%-14s %8d %10u %10u %10u\n", name, len, legacy_sample * len, raw, lzo);
+	}
+
+	if (m_errors) {
+		printf("%d errors\n", m_errors);
+		return 1;
+	}
+
+	printf("Round trip OK\n");
+	return 0;
+}
@@ -0,0 +1,271 @@
+/*
+ * The motor state snapshot of mc_interface, published with seqlock.c.
+ *
+ * The first test makes the writer publish at every byte offset of a reader
+ * copy, which is what happens when the timer thread preempts a reader on
+ * the MCU. The seqlock reader must notice and copy again, while a plain
+ * copy tears at every offset inside the struct. The second test runs a
+ * writer and readers as real threads. Last, the getter calls that the
+ * status consumers made before the snapshot are counted.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+static void *test_memcpy(void *dst, const void *src, size_t len);
+
+#define memcpy test_memcpy
+#include "../../seqlock.c"
+#undef memcpy
+
+#include "datatypes.h"
+
+#define STRESS_TIME_S		1.0
+
+static seqlock m_lock;
+static volatile mc_snapshot m_published;
+static volatile uint32_t m_next;
+static volatile int m_inject_at = -1;
+static volatile int m_stop = 0;
+static int m_fails = 0;
+
+static void make_snapshot(uint32_t k, mc_snapshot *s) {
+	memset(s, 0, sizeof(mc_snapshot));
+	s->time = k;
+	s->state = k % 4;
+	s->fault = k % 3;
+	s->v_in = 40.0 + (float)(k % 1000) * 0.01;
+	s->temp_fet = s->v_in + 1.0;
+	s->temp_motor = s->v_in + 2.0;
+	s->temp_mos_1 = s->v_in + 3.0;
+	s->temp_mos_2 = s->v_in + 4.0;
+	s->temp_mos_3 = s->v_in + 5.0;
+	s->duty_now = (float)(k % 100) * 0.01;
+	s->rpm = (float)k;
+	s->current_filtered = -(float)k;
+	s->current_in_filtered = (float)k * 0.5;
+	s->amp_hours = (float)k * 2.0;
+	s->amp_hours_charged = (float)k * 3.0;
+	s->watt_hours = (float)k * 4.0;
+	s->watt_hours_charged = (float)k * 5.0;
+	s->tachometer = k;
+	s->tachometer_abs = k * 2;
+	s->position = (float)(k % 360);
+
+	for (int i = 0;i < MC_AVG_NUM;i++) {
+		s->avg_last[i] = (float)(k + i);
+		s->avg_sum[i] = (int64_t)k * (i + 1);
+	}
+	s->avg_samples = k * 20;
+}
+
+static bool consistent(const mc_snapshot *s) {
+	mc_snapshot ref;
+	make_snapshot(s->tachometer, &ref);
+	return memcmp(s, &ref, sizeof(mc_snapshot)) == 0;
+}
+
+// What the mc_interface timer does
+static void publish(void) {
+	mc_snapshot s;
+	make_snapshot(m_next++, &s);
+	seqlock_write(&m_lock, &m_published, &s, sizeof(mc_snapshot));
+}
+
+/*
+ * memcpy for seqlock.c. When m_inject_at is set, the next copy out of the
+ * published snapshot gets preempted by the writer after that many bytes.
+ */
+static void *test_memcpy(void *dst, const void *src, size_t len) {
+	int at = m_inject_at;
+
+	if (at < 0 || src != (const void*)&m_published) {
+		return memcpy(dst, src, len);
+	}
+
+	m_inject_at = -1;
+	memcpy(dst, src, at);
+	publish();
+	memcpy((uint8_t*)dst + at, (const uint8_t*)src + at, len - at);
+	return dst;
+}
+
+static void test_preempted_reads(void) {
+	int torn_plain = 0;
+	int torn = 0;
+	int retried = 0;
+
+	for (int at = 1;at < (int)sizeof(mc_snapshot);at++) {
+		mc_snapshot s;
+
+		m_inject_at = at;
+		int retries = seqlock_read(&m_lock, &s, &m_published, sizeof(mc_snapshot));
+
+		if (!consistent(&s)) {
+			torn++;
+		}
+
+		if (retries > 0) {
+			retried++;
+		}
+
+		// The same preemption without the lock
+		m_inject_at = at;
+		test_memcpy(&s, (const void*)&m_published, sizeof(mc_snapshot));
+		if (!consistent(&s)) {
+			torn_plain++;
+		}
+	}
+
+	int offsets = sizeof(mc_snapshot) - 1;
+	printf("Writer preempting a copy of %d bytes at every offset:\r\n", (int)sizeof(mc_snapshot));
+	printf("  plain copy:   %3d of %d torn\r\n", torn_plain, offsets);
+	printf("  seqlock_read: %3d of %d torn, %d retried\r\n\r\n", torn, offsets, retried);
+
+	if (torn) {
+		printf("FAIL: torn seqlock reads\r\n");
+		m_fails++;
+	}
+
+	if (retried != offsets) {
+		printf("FAIL: the reader did not notice every preemption\r\n");
+		m_fails++;
+	}
+}
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+typedef struct {
+	long reads;
+	long retries;
+	long torn;
+} reader_stats;
+
+static void *writer_thread(void *arg) {
+	(void)arg;
+
+	while (!m_stop) {
+		publish();
+	}
+
+	return 0;
+}
+
+static void *reader_thread(void *arg) {
+	reader_stats *st = arg;
+
+	while (!m_stop) {
+		mc_snapshot s;
+		st->retries += seqlock_read(&m_lock, &s, &m_published, sizeof(mc_snapshot));
+		st->reads++;
+
+		if (!consistent(&s)) {
+			st->torn++;
+		}
+	}
+
+	return 0;
+}
+
+static void test_threads(void) {
+	pthread_t writer;
+	pthread_t readers[2];
+	reader_stats stats[2];
+	memset(stats, 0, sizeof(stats));
+
+	m_stop = 0;
+	pthread_create(&writer, 0, writer_thread, 0);
+	for (int i = 0;i < 2;i++) {
+		pthread_create(&readers[i], 0, reader_thread, &stats[i]);
+	}
+
+	double start = now();
+	while ((now() - start) < STRESS_TIME_S) {
+		struct timespec ts = {0, 10000000};
+		nanosleep(&ts, 0);
+	}
+
+	m_stop = 1;
+	pthread_join(writer, 0);
+	for (int i = 0;i < 2;i++) {
+		pthread_join(readers[i], 0);
+	}
+
+	printf("Writer and 2 reader threads for %.1f s:\r\n", STRESS_TIME_S);
+	for (int i = 0;i < 2;i++) {
+		printf("  reader %d: %ld reads, %ld retries, %ld torn\r\n",
+				i + 1, stats[i].reads, stats[i].retries, stats[i].torn);
+
+		if (stats[i].torn) {
+			printf("FAIL: torn reads\r\n");
+			m_fails++;
+		}
+	}
+	printf("\r\n");
+}
+
+/*
+ * Getter calls of the status consumers before the snapshot. Every one of
+ * them looked up the selected motor, most also branched on the motor type,
+ * and the read_reset ones reset the average for everyone else.
+ */
+static const struct {
+	const char *consumer;
+	const char *getters[24];
+} m_consumers[] = {
+		{"COMM_GET_VALUES", {"temp_fet_filtered", "temp_motor_filtered",
+				"read_reset_avg_motor_current", "read_reset_avg_input_current",
+				"read_reset_avg_id", "read_reset_avg_iq", "get_duty_cycle_now", "get_rpm",
+				"GET_INPUT_VOLTAGE", "get_amp_hours", "get_amp_hours_charged",
+				"get_watt_hours", "get_watt_hours_charged", "get_tachometer_value",
+				"get_tachometer_abs_value", "get_fault", "get_pid_pos_now",
+				"NTC_TEMP_MOS1", "NTC_TEMP_MOS2", "NTC_TEMP_MOS3",
+				"read_reset_avg_vd", "read_reset_avg_vq", 0}},
+		{"COMM_GET_VALUES_SETUP", {"temp_fet_filtered", "temp_motor_filtered",
+				"get_duty_cycle_now", "get_rpm", "GET_INPUT_VOLTAGE", "get_pid_pos_now",
+				"get_fault", 0}},
+		{"CAN status 1-5", {"get_rpm", "get_tot_current_filtered", "get_duty_cycle_now",
+				"get_amp_hours", "get_amp_hours_charged", "get_watt_hours",
+				"get_watt_hours_charged", "temp_fet_filtered", "temp_motor_filtered",
+				"get_tot_current_in_filtered", "get_pid_pos_now", "get_tachometer_value",
+				"GET_INPUT_VOLTAGE", 0}},
+		{"Blacktip speed guard", {"get_tot_current_filtered", 0}},
+};
+
+static void print_getters(void) {
+	int before = 0;
+
+	printf("Consumer                Getter calls  Snapshot copies\r\n");
+	for (unsigned int i = 0;i < sizeof(m_consumers) / sizeof(m_consumers[0]);i++) {
+		int n = 0;
+		while (m_consumers[i].getters[n]) {
+			n++;
+		}
+
+		printf("%-22s  %12d  %15d\r\n", m_consumers[i].consumer, n, 1);
+		before += n;
+	}
+
+	int consumers = sizeof(m_consumers) / sizeof(m_consumers[0]);
+	printf("%-22s  %12d  %15d\r\n\r\n", "Status cycle", before, consumers);
+	printf("%d getter calls per status cycle eliminated\r\n", before - consumers);
+}
+
+int main(void) {
+	seqlock_init(&m_lock);
+	publish();
+
+	test_preempted_reads();
+	test_threads();
+	print_getters();
+
+	printf("\r\n%s\r\n", m_fails ? "FAILED" : "All tests passed");
+	return m_fails ? 1 : 0;
+}
@@ -0,0 +1,395 @@
+/*
+ * Round trip of the telemetry stream in telemetry.c.
+ *
+ * telemetry.c is included directly, so that the sampler and the sender can be
+ * driven from here instead of from the motor interface timer and the
+ * telemetry thread. The motor snapshots are generated with values that cover
+ * the whole range of every field, including negative values and large jumps,
+ * and every COMM_TELEMETRY_DATA packet is decoded again:
+ *
+ * - The rate returned by telemetry_subscribe matches the number of records
+ *   that are taken.
+ * - Every decoded record has the time and the values of the snapshot it was
+ *   taken from, with the scales of COMM_GET_VALUES_SELECTIVE and the averages
+ *   since the previous record.
+ * - Records with different masks go to different packets.
+ * - When the ring is full, records are dropped and the count in the stream
+ *   matches.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include "../../telemetry.c"
+
+#define FIELDS_NUM			21
+#define RECORDS_MAX			4096
+
+typedef struct {
+	systime_t time;
+	uint32_t mask;
+	int num;
+	int32_t values[VALUES_MAX];
+} test_record;
+
+// Snapshot returned to telemetry.c
+static mc_snapshot m_snapshot;
+static app_configuration m_appconf;
+
+// What the receiver decoded
+static test_record m_rx[RECORDS_MAX];
+static int m_rx_num = 0;
+static uint32_t m_rx_dropped = 0;
+static int m_rx_packets = 0;
+static int m_errors = 0;
+
+static uint32_t m_rand_state = 1;
+
+// Stubs
+void mc_interface_get_snapshot(mc_snapshot *snapshot) {
+	*snapshot = m_snapshot;
+}
+
+float mc_interface_snapshot_avg(const mc_snapshot *now, const mc_snapshot *prev, mc_avg_value value) {
+	if (!prev || now->avg_samples == prev->avg_samples) {
+		return now->avg_last[value];
+	}
+
+	return (float)(now->avg_sum[value] - prev->avg_sum[value]) /
+			((float)(now->avg_samples - prev->avg_samples) * MC_AVG_SUM_SCALE);
+}
+
+const app_configuration* app_get_configuration(void) {
+	return &m_appconf;
+}
+
+static uint32_t rand_u32(void) {
+	m_rand_state ^= m_rand_state << 13;
+	m_rand_state ^= m_rand_state >> 17;
+	m_rand_state ^= m_rand_state << 5;
+	return m_rand_state;
+}
+
+static float rand_range(float min, float max) {
+	return min + (max - min) * (float)(rand_u32() & 0xFFFF) / 65535.0;
+}
+
+/*
+ * Next snapshot. Most values move a little, some jump across their whole
+ * range, so that both small and large differences are encoded.
+ */
+static void next_snapshot(int i) {
+	mc_snapshot *s = &m_snapshot;
+	bool jump = (rand_u32() % 16) == 0;
+
+	s->time = (systime_t)(i * 10 + (rand_u32() % 3));
+	s->state = MC_STATE_RUNNING;
+	s->fault = jump ? (mc_fault_code)(rand_u32() % 10) : FAULT_CODE_NONE;
+	s->v_in = rand_range(10.0, 100.0);
+	s->temp_fet = jump ? rand_range(-40.0, 150.0) : s->temp_fet + rand_range(-0.1, 0.1);
+	s->temp_motor = rand_range(-40.0, 150.0);
+	s->temp_mos_1 = rand_range(-40.0, 150.0);
+	s->temp_mos_2 = rand_range(-40.0, 150.0);
+	s->temp_mos_3 = rand_range(-40.0, 150.0);
+	s->duty_now = rand_range(-1.0, 1.0);
+	s->rpm = jump ? rand_range(-100000.0, 100000.0) : s->rpm + rand_range(-50.0, 50.0);
+	s->current_filtered = rand_range(-200.0, 200.0);
+	s->current_in_filtered = rand_range(-200.0, 200.0);
+	s->amp_hours += rand_range(0.0, 0.01);
+	s->amp_hours_charged += rand_range(0.0, 0.01);
+	s->watt_hours += rand_range(0.0, 1.0);
+	s->watt_hours_charged += rand_range(0.0, 1.0);
+	s->tachometer += (int)(rand_u32() % 200) - 100;
+	s->tachometer_abs += (int)(rand_u32() % 100);
+	s->position = rand_range(0.0, 360.0);
+
+	int samples = 10 + (int)(rand_u32() % 11);
+	s->avg_samples += (uint32_t)samples;
+	for (int j = 0;j < MC_AVG_NUM;j++) {
+		float avg = rand_range(-300.0, 300.0);
+		s->avg_last[j] = avg;
+		s->avg_sum[j] += (int64_t)(avg * samples * MC_AVG_SUM_SCALE);
+	}
+}
+
+// Same rounding as on the MCU, where the scale is a float constant
+static int32_t q(float value, float scale) {
+	return (int32_t)(value * scale);
+}
+
+/*
+ * The record that the receiver should get for the current snapshot, computed
+ * from the field list of COMM_GET_VALUES_SELECTIVE.
+ */
+static void expected_record(uint32_t mask, const mc_snapshot *prev, test_record *rec) {
+	const mc_snapshot *s = &m_snapshot;
+	rec->time = s->time;
+	rec->mask = mask;
+	rec->num = 0;
+
+	for (int f = 0;f < FIELDS_NUM;f++) {
+		if (!(mask & ((uint32_t)1 << f))) {
+			continue;
+		}
+
+		switch (f) {
+		case 0: rec->values[rec->num++] = q(s->temp_fet, 1e1); break;
+		case 1: rec->values[rec->num++] = q(s->temp_motor, 1e1); break;
+		case 2: rec->values[rec->num++] = q(mc_interface_snapshot_avg(s, prev, MC_AVG_CURRENT_MOTOR), 1e2); break;
+		case 3: rec->values[rec->num++] = q(mc_interface_snapshot_avg(s, prev, MC_AVG_CURRENT_IN), 1e2); break;
+		case 4: rec->values[rec->num++] = q(mc_interface_snapshot_avg(s, prev, MC_AVG_ID), 1e2); break;
+		case 5: rec->values[rec->num++] = q(mc_interface_snapshot_avg(s, prev, MC_AVG_IQ), 1e2); break;
+		case 6: rec->values[rec->num++] = q(s->duty_now, 1e3); break;
+		case 7: rec->values[rec->num++] = q(s->rpm, 1e0); break;
+		case 8: rec->values[rec->num++] = q(s->v_in, 1e1); break;
+		case 9: rec->values[rec->num++] = q(s->amp_hours, 1e4); break;
+		case 10: rec->values[rec->num++] = q(s->amp_hours_charged, 1e4); break;
+		case 11: rec->values[rec->num++] = q(s->watt_hours, 1e4); break;
+		case 12: rec->values[rec->num++] = q(s->watt_hours_charged, 1e4); break;
+		case 13: rec->values[rec->num++] = s->tachometer; break;
+		case 14: rec->values[rec->num++] = s->tachometer_abs; break;
+		case 15: rec->values[rec->num++] = s->fault; break;
+		case 16: rec->values[rec->num++] = q(s->position, 1e6); break;
+		case 17: rec->values[rec->num++] = m_appconf.controller_id; break;
+		case 18:
+			rec->values[rec->num++] = q(s->temp_mos_1, 1e1);
+			rec->values[rec->num++] = q(s->temp_mos_2, 1e1);
+			rec->values[rec->num++] = q(s->temp_mos_3, 1e1);
+			break;
+		case 19: rec->values[rec->num++] = q(mc_interface_snapshot_avg(s, prev, MC_AVG_VD), 1e3); break;
+		case 20: rec->values[rec->num++] = q(mc_interface_snapshot_avg(s, prev, MC_AVG_VQ), 1e3); break;
+		default: break;
+		}
+	}
+}
+
+static int values_in_mask(uint32_t mask) {
+	int n = 0;
+	for (int f = 0;f < FIELDS_NUM;f++) {
+		if (mask & ((uint32_t)1 << f)) {
+			n += f == 18 ? 3 : 1;
+		}
+	}
+	return n;
+}
+
+// Receiver
+static void rx_packet(unsigned char *data, unsigned int len) {
+	int32_t ind = 0;
+
+	if (data[ind++] != COMM_TELEMETRY_DATA) {
+		printf("Wrong packet id %d\n", data[0]);
+		m_errors++;
+		return;
+	}
+
+	uint32_t mask = buffer_get_uint32(data, &ind);
+	m_rx_dropped = buffer_get_uint32(data, &ind);
+	int count = data[ind++];
+	int num = values_in_mask(mask);
+	test_record *prev = 0;
+
+	for (int i = 0;i < count;i++) {
+		if (m_rx_num >= RECORDS_MAX) {
+			printf("Too many records\n");
+			m_errors++;
+			return;
+		}
+
+		test_record *rec = &m_rx[m_rx_num++];
+		rec->mask = mask;
+		rec->num = num;
+
+		if (!prev) {
+			rec->time = buffer_get_uint32(data, &ind);
+			for (int j = 0;j < num;j++) {
+				rec->values[j] = buffer_get_var_int32(data, &ind);
+			}
+		} else {
+			rec->time = prev->time + buffer_get_var_uint32(data, &ind);
+			for (int j = 0;j < num;j++) {
+				rec->values[j] = prev->values[j] + buffer_get_var_int32(data, &ind);
+			}
+		}
+
+		prev = rec;
+	}
+
+	if (ind != (int32_t)len) {
+		printf("Packet length %u, decoded %d\n", len, ind);
+		m_errors++;
+	}
+
+	m_rx_packets++;
+}
+
+static void drain(void) {
+	while (m_ring_read != m_ring_write) {
+		send_records();
+	}
+}
+
+static void reset(void) {
+	telemetry_init();
+	memset(&m_snapshot, 0, sizeof(m_snapshot));
+	m_rx_num = 0;
+	m_rx_dropped = 0;
+	m_rx_packets = 0;
+}
+
+static void compare(const test_record *exp, int exp_num, const char *name) {
+	if (m_rx_num != exp_num) {
+		printf("%s: %d records received, %d expected\n", name, m_rx_num, exp_num);
+		m_errors++;
+		return;
+	}
+
+	for (int i = 0;i < exp_num;i++) {
+		const test_record *a = &m_rx[i];
+		const test_record *b = &exp[i];
+		bool ok = a->time == b->time && a->mask == b->mask && a->num == b->num;
+		for (int j = 0;ok && j < a->num;j++) {
+			ok = a->values[j] == b->values[j];
+		}
+
+		if (!ok) {
+			printf("%s: record %d differs\n", name, i);
+			m_errors++;
+			return;
+		}
+	}
+}
+
+static void test_rates(void) {
+	static const int rates[][2] = {
+			// Requested, expected
+			{1000, 1000}, {5000, 1000}, {500, 500}, {300, 333}, {100, 100},
+			{7, 7}, {1, 1}, {0, 0}
+	};
+
+	for (unsigned int i = 0;i < sizeof(rates) / sizeof(rates[0]);i++) {
+		reset();
+		int rate = telemetry_subscribe(0x1, rates[i][0], rx_packet);
+		if (rate != rates[i][1]) {
+			printf("Rate %d: got %d, expected %d\n", rates[i][0], rate, rates[i][1]);
+			m_errors++;
+		}
+
+		// One second of timer iterations
+		for (int j = 0;j < MC_INTERFACE_TIMER_RATE;j++) {
+			next_snapshot(j);
+			telemetry_sample();
+			drain();
+		}
+
+		if (m_rx_num != rate) {
+			printf("Rate %d: %d records per second, expected %d\n", rates[i][0], m_rx_num, rate);
+			m_errors++;
+		}
+	}
+
+	printf("Rate selection: %s\n", m_errors ? "failed" : "ok");
+}
+
+static void test_round_trip(void) {
+	static test_record exp[RECORDS_MAX];
+	int exp_num = 0;
+	mc_snapshot prev;
+	bool prev_valid = false;
+	int errors_before = m_errors;
+
+	reset();
+	m_appconf.controller_id = 42;
+
+	uint32_t mask = FIELDS_ALL;
+	telemetry_subscribe(mask, MC_INTERFACE_TIMER_RATE, rx_packet);
+
+	for (int i = 0;i < 2000;i++) {
+		// Subscribe with a new mask now and then, while records with the
+		// old mask are still in the ring. They must go to separate packets.
+		if (i % 500 == 499) {
+			mask = rand_u32() & FIELDS_ALL;
+			mask = mask ? mask : 1;
+			telemetry_subscribe(mask, MC_INTERFACE_TIMER_RATE, rx_packet);
+			prev_valid = false;
+		}
+
+		next_snapshot(i);
+		expected_record(mask, prev_valid ? &prev : 0, &exp[exp_num++]);
+		prev = m_snapshot;
+		prev_valid = true;
+		telemetry_sample();
+
+		// Like the telemetry thread every few records
+		if (i % 7 == 6) {
+			drain();
+		}
+	}
+	drain();
+
+	compare(exp, exp_num, "Round trip");
+
+	if (m_rx_dropped != 0) {
+		printf("Round trip: %u records dropped\n", (unsigned int)m_rx_dropped);
+		m_errors++;
+	}
+
+	printf("Round trip: %d records in %d packets: %s\n",
+			m_rx_num, m_rx_packets, m_errors > errors_before ? "failed" : "ok");
+}
+
+static void test_drops(void) {
+	static test_record exp[RECORDS_MAX];
+	int exp_num = 0;
+	mc_snapshot prev;
+	bool prev_valid = false;
+	int errors_before = m_errors;
+	const int extra = 8;
+
+	reset();
+	telemetry_subscribe(FIELDS_ALL, MC_INTERFACE_TIMER_RATE, rx_packet);
+
+	// The telemetry thread does not run for a while, so the ring fills up.
+	// The averages of the next record are since the last one that was kept.
+	for (int i = 0;i < TELEMETRY_RING_LEN + extra;i++) {
+		next_snapshot(i);
+		if (i < TELEMETRY_RING_LEN) {
+			expected_record(FIELDS_ALL, prev_valid ? &prev : 0, &exp[exp_num++]);
+			prev = m_snapshot;
+			prev_valid = true;
+		}
+		telemetry_sample();
+	}
+	drain();
+
+	next_snapshot(TELEMETRY_RING_LEN + extra);
+	expected_record(FIELDS_ALL, &prev, &exp[exp_num++]);
+	telemetry_sample();
+	drain();
+
+	compare(exp, exp_num, "Drops");
+
+	if (m_rx_dropped != (uint32_t)extra) {
+		printf("Drops: count %u in the stream, expected %d\n", (unsigned int)m_rx_dropped, extra);
+		m_errors++;
+	}
+
+	printf("Full ring: %u of %d records dropped and counted: %s\n", (unsigned int)m_rx_dropped,
+			TELEMETRY_RING_LEN + extra + 1, m_errors > errors_before ? "failed" : "ok");
+}
+
+int main(void) {
+	test_rates();
+	test_round_trip();
+	test_drops();
+
+	if (m_errors) {
+		printf("\n%d errors\n", m_errors);
+		return 1;
+	}
+
+	printf("\nAll tests passed\n");
+	return 0;
+}
@@ -0,0 +1,389 @@
+/*
+ * Host model of the UART receive paths of app_uartcomm.c.
+ *
+ * A byte stream is received at a given baud rate and handed to the packet
+ * decoder in two ways:
+ *
+ * Byte:  The serial driver. Every byte goes to the input queue, and the
+ *        process thread is woken up when a byte arrives in an empty queue.
+ *        It then drains the queue with one sdGetTimeout and one
+ *        packet_process_byte call per byte.
+ * DMA:   uart_dma_rx.c, included here. The DMA stream and the USART IDLE
+ *        interrupt are emulated, and the process thread is woken up when the
+ *        line goes idle for one frame after a burst, or at every half of the
+ *        buffer. Bursts are decoded with packet_process_bytes.
+ *
+ * The thread starts running WAKEUP_LATENCY_US after being signaled. Decoding
+ * takes no simulated time, the CPU time it takes on the host is measured
+ * separately by running the same thread bodies over the whole stream.
+ *
+ * Output: wakeups and driver calls per byte, ns of CPU time per byte on the
+ * host, and the mean and worst latency from the last byte of a packet
+ * arriving to the packet being dispatched.
+ *
+ * Usage: ./uart_rx
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "packet.h"
+#include "datatypes.h"
+
+static volatile bool m_signaled = false;
+#undef chEvtSignalI
+#define chEvtSignalI(tp, m)			((void)(tp), (void)(m), m_signaled = true)
+
+#include "../../uart_dma_rx.c"
+
+#define PACKET_HANDLER			0
+#define ENCODE_HANDLER			1
+#define DMA_BUFFER_SIZE			512
+#define SERIAL_QUEUE_SIZE		128
+#define WAKEUP_LATENCY_US		20.0
+#define STREAM_MAX				(256 * 1024)
+#define PACKETS_MAX				8192
+
+typedef struct {
+	const char *name;
+	int payload_len;
+	double gap_us;
+	int packets_per_burst;
+} session_t;
+
+typedef struct {
+	double wakeups_per_byte;
+	double calls_per_byte;
+	double ns_per_byte;
+	double latency_mean_us;
+	double latency_max_us;
+	int packets;
+	uint32_t checksum;
+} rx_result_t;
+
+static const session_t m_sessions[] = {
+		{"Realtime polling", 1, 5000.0, 4},
+		{"Current control", 5, 2000.0, 1},
+		{"Firmware upload", 389, 1000.0, 1},
+		{"Terminal output", 60, 200.0, 8},
+};
+
+static const double m_bauds[] = {115200.0, 1000000.0};
+
+// Byte stream with arrival times
+static uint8_t m_stream[STREAM_MAX];
+static double m_arrival[STREAM_MAX];
+static unsigned int m_stream_len = 0;
+static double m_byte_us = 0.0;
+static unsigned int m_packet_end[PACKETS_MAX];
+static int m_packets_sent = 0;
+
+// Receiver state
+static double m_now = 0.0;
+static unsigned int m_driver_calls = 0;
+static int m_packets_rx = 0;
+static uint32_t m_checksum = 0;
+static double m_latency_sum = 0.0;
+static double m_latency_max = 0.0;
+
+static SerialDriver m_sd = {.usart = USART3};
+static uart_dma_rx m_rx;
+static uint8_t m_dma_buffer[DMA_BUFFER_SIZE];
+
+static uint8_t m_queue[SERIAL_QUEUE_SIZE];
+static unsigned int m_queue_read = 0;
+static unsigned int m_queue_write = 0;
+
+static inline uint64_t bench_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+// Stream generation
+static void stream_write(unsigned char *data, unsigned int len) {
+	if (m_stream_len + len > STREAM_MAX || m_packets_sent >= PACKETS_MAX) {
+		return;
+	}
+
+	memcpy(m_stream + m_stream_len, data, len);
+	m_stream_len += len;
+	m_packet_end[m_packets_sent++] = m_stream_len;
+}
+
+static void stream_generate(const session_t *s, double baud, double duration_us) {
+	uint8_t pl[PACKET_MAX_PL_LEN];
+	double byte_us = 10.0 * 1e6 / baud;
+	double t = 0.0;
+
+	m_byte_us = byte_us;
+
+	m_stream_len = 0;
+	m_packets_sent = 0;
+
+	while (t < duration_us && m_packets_sent < PACKETS_MAX - s->packets_per_burst) {
+		for (int i = 0;i < s->packets_per_burst;i++) {
+			unsigned int start = m_stream_len;
+
+			pl[0] = s->payload_len > 1 ? COMM_WRITE_NEW_APP_DATA : COMM_GET_VALUES;
+			for (int j = 1;j < s->payload_len;j++) {
+				pl[j] = j * 13 + m_packets_sent;
+			}
+			packet_send_packet(pl, s->payload_len, ENCODE_HANDLER);
+
+			for (unsigned int j = start;j < m_stream_len;j++) {
+				m_arrival[j] = t;
+				t += byte_us;
+			}
+		}
+
+		t += s->gap_us;
+	}
+}
+
+static void process_packet(unsigned char *data, unsigned int len) {
+	m_packets_rx++;
+	for (unsigned int i = 0;i < len;i++) {
+		m_checksum = m_checksum * 31 + data[i];
+	}
+
+	// The last byte of this packet is the last byte handed to the decoder
+	// that ends a packet, found through the packet end table.
+	static int packet_ind = 0;
+	if (m_packets_rx == 1) {
+		packet_ind = 0;
+	}
+
+	double arrived = m_arrival[m_packet_end[packet_ind++] - 1];
+	double latency = m_now - arrived;
+	m_latency_sum += latency;
+	if (latency > m_latency_max) {
+		m_latency_max = latency;
+	}
+}
+
+// Byte path
+static msg_t __attribute__((noinline)) queue_get(void) {
+	m_driver_calls++;
+	if (m_queue_read == m_queue_write) {
+		return MSG_TIMEOUT;
+	}
+
+	return m_queue[m_queue_read++ % SERIAL_QUEUE_SIZE];
+}
+
+static void byte_thread_run(void) {
+	bool rx = true;
+	while (rx) {
+		rx = false;
+		msg_t res = queue_get();
+		if (res != MSG_TIMEOUT) {
+			packet_process_byte(res, PACKET_HANDLER);
+			rx = true;
+		}
+	}
+}
+
+// DMA path
+static void dma_receive(uint8_t b) {
+	DMA_Stream_TypeDef *s = m_rx.dma->stream;
+	m_dma_buffer[DMA_BUFFER_SIZE - s->NDTR] = b;
+	s->NDTR--;
+
+	if (s->NDTR == DMA_BUFFER_SIZE / 2) {
+		dma_rx_handler(&m_rx, 0);
+	} else if (s->NDTR == 0) {
+		s->NDTR = DMA_BUFFER_SIZE;
+		dma_rx_handler(&m_rx, 0);
+	}
+}
+
+static void dma_thread_run(void) {
+	bool rx = true;
+	while (rx) {
+		rx = false;
+		const uint8_t *data;
+		m_driver_calls++;
+		unsigned int len = uart_dma_rx_get(&m_rx, &data);
+		if (len > 0) {
+			uart_dma_rx_consume(&m_rx, len);
+			packet_process_bytes(data, len, PACKET_HANDLER);
+			rx = true;
+		}
+	}
+}
+
+static void receiver_reset(void) {
+	m_now = 0.0;
+	m_driver_calls = 0;
+	m_packets_rx = 0;
+	m_checksum = 0;
+	m_latency_sum = 0.0;
+	m_latency_max = 0.0;
+	m_queue_read = 0;
+	m_queue_write = 0;
+	packet_reset(PACKET_HANDLER);
+
+	uart_dma_rx_init(&m_rx, &m_sd, STM32_DMA_STREAM(STM32_DMA_STREAM_ID(1, 1)), DMA_Channel_4, 12,
+			m_dma_buffer, sizeof(m_dma_buffer), chThdGetSelfX(), EVENT_MASK(1));
+	uart_dma_rx_start(&m_rx);
+}
+
+// Event driven simulation of the stream arriving at the receiver
+static rx_result_t simulate(bool dma) {
+	rx_result_t res;
+	int wakeups = 0;
+	double wake_at = -1.0;
+	double idle_at = -1.0;
+	unsigned int i = 0;
+
+	receiver_reset();
+	m_signaled = false;
+
+	while (i < m_stream_len || wake_at >= 0.0 ||
+			(dma && m_rx.read_pos != write_pos(&m_rx))) {
+		double next_byte = i < m_stream_len ? m_arrival[i] : 1e30;
+		double next_wake = wake_at >= 0.0 ? wake_at : 1e30;
+		double next_idle = idle_at >= 0.0 ? idle_at : 1e30;
+
+		if (next_wake <= next_byte && next_wake <= next_idle) {
+			m_now = next_wake;
+			wake_at = -1.0;
+			wakeups++;
+			if (dma) {
+				dma_thread_run();
+			} else {
+				byte_thread_run();
+			}
+		} else if (next_idle <= next_byte) {
+			// The serial driver passes the status to the hook
+			m_now = next_idle;
+			idle_at = -1.0;
+			m_sd.rxhook(m_sd.rxhookp, USART_SR_IDLE);
+		} else {
+			m_now = next_byte;
+			if (dma) {
+				dma_receive(m_stream[i++]);
+
+				// IDLE is set when the line stays high for one frame after
+				// the stop bit of this byte
+				idle_at = m_now + 2.0 * m_byte_us;
+			} else {
+				// CHN_INPUT_AVAILABLE is only broadcast for an empty queue
+				if (m_queue_read == m_queue_write) {
+					m_signaled = true;
+				}
+				m_queue[m_queue_write++ % SERIAL_QUEUE_SIZE] = m_stream[i++];
+			}
+		}
+
+		if (m_signaled && wake_at < 0.0) {
+			wake_at = m_now + WAKEUP_LATENCY_US;
+		}
+		m_signaled = false;
+	}
+
+	res.wakeups_per_byte = (double)wakeups / (double)m_stream_len;
+	res.calls_per_byte = (double)m_driver_calls / (double)m_stream_len;
+	res.latency_mean_us = m_latency_sum / (double)(m_packets_rx > 0 ? m_packets_rx : 1);
+	res.latency_max_us = m_latency_max;
+	res.packets = m_packets_rx;
+	res.checksum = m_checksum;
+	return res;
+}
+
+// CPU time of the thread bodies, with the stream arriving in bursts of the
+// size the simulation produced per wakeup.
+static double measure_cpu(bool dma, double bytes_per_wakeup) {
+	unsigned int burst = bytes_per_wakeup < 1.0 ? 1 : (unsigned int)bytes_per_wakeup;
+	uint64_t bytes = 0;
+
+	uint64_t t_start = bench_ns();
+	uint64_t t_elapsed = 0;
+	while (t_elapsed < 200000000ULL) {
+		receiver_reset();
+
+		for (unsigned int i = 0;i < m_stream_len;) {
+			unsigned int n = m_stream_len - i < burst ? m_stream_len - i : burst;
+			for (unsigned int j = 0;j < n;j++) {
+				if (dma) {
+					dma_receive(m_stream[i + j]);
+				} else {
+					m_queue[m_queue_write++ % SERIAL_QUEUE_SIZE] = m_stream[i + j];
+				}
+			}
+
+			if (dma) {
+				dma_thread_run();
+			} else {
+				byte_thread_run();
+			}
+
+			i += n;
+		}
+
+		bytes += m_stream_len;
+		t_elapsed = bench_ns() - t_start;
+	}
+
+	return (double)t_elapsed / (double)bytes;
+}
+
+static void print_result(const char *name, const rx_result_t *r) {
+	printf("  %-5s %6.3f wakeups/B  %6.3f calls/B  %6.2f ns/B  latency %7.1f us mean %7.1f us max\r\n",
+			name, r->wakeups_per_byte, r->calls_per_byte, r->ns_per_byte,
+			r->latency_mean_us, r->latency_max_us);
+}
+
+int main(void) {
+	packet_init(stream_write, 0, ENCODE_HANDLER);
+	packet_init(0, process_packet, PACKET_HANDLER);
+
+	int fails = 0;
+
+	for (unsigned int b = 0;b < sizeof(m_bauds) / sizeof(m_bauds[0]);b++) {
+		for (unsigned int i = 0;i < sizeof(m_sessions) / sizeof(m_sessions[0]);i++) {
+			const session_t *s = &m_sessions[i];
+			stream_generate(s, m_bauds[b], 1e6);
+
+			// The thread is signaled one idle frame after the end of a burst,
+			// and within a burst at most half a buffer after the end of a
+			// packet.
+			double latency_bound = (DMA_BUFFER_SIZE / 2 + 2) * m_byte_us + WAKEUP_LATENCY_US;
+
+			printf("%s at %.0f baud: %u bytes, %d packets\r\n", s->name, m_bauds[b],
+					m_stream_len, m_packets_sent);
+
+			rx_result_t byte = simulate(false);
+			byte.ns_per_byte = measure_cpu(false, 1.0 / byte.wakeups_per_byte);
+			rx_result_t dma = simulate(true);
+			dma.ns_per_byte = measure_cpu(true, 1.0 / dma.wakeups_per_byte);
+
+			print_result("Byte", &byte);
+			print_result("DMA", &dma);
+			printf("\r\n");
+
+			if (byte.packets != m_packets_sent || dma.packets != m_packets_sent ||
+					byte.checksum != dma.checksum) {
+				printf("FAIL: %d and %d of %d packets dispatched\r\n",
+						byte.packets, dma.packets, m_packets_sent);
+				fails++;
+			}
+
+			if (dma.latency_max_us > latency_bound + 1.0) {
+				printf("FAIL: latency above the bound of %.1f us\r\n", latency_bound);
+				fails++;
+			}
+
+			if (m_rx.overrun_cnt != 0) {
+				printf("FAIL: DMA overrun\r\n");
+				fails++;
+			}
+		}
+	}
+
+	printf("%s\r\n", fails ? "FAILED" : "All tests passed");
+	return fails ? 1 : 0;
+}
@@ -0,0 +1,362 @@
+/*
+ * Host benchmark for the USB receive path in comm_usb.c.
+ *
+ * comm_usb.c is included directly and SDU1 is replaced by a driver that
+ * replays a VESC Tool session, delivered in USB packets of up to 64 bytes
+ * the way the host sends it. Every packet write from VESC Tool starts a new
+ * USB packet. The sessions are generated here: realtime data polling, a
+ * firmware upload and a motor configuration write.
+ *
+ * The read and process thread bodies are run in turn until the session has
+ * been consumed, and for comparison the same is done with the previous
+ * implementation that read the stream one byte at a time and decoded every
+ * byte with packet_process_byte.
+ *
+ * Output: MB/s and ns of CPU time per byte, and the number of stream calls and
+ * process thread wakeups per byte, which dominate on the hardware where every
+ * stream call locks the system.
+ *
+ * Usage: ./usb_rx [session bytes]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../../comm_usb.c"
+#include "buffer.h"
+
+#define USB_PACKET_LEN		64
+#define SESSION_MAX			(4 * 1024 * 1024)
+#define WRITES_MAX			(SESSION_MAX / 4)
+#define ENCODE_HANDLER		1
+
+typedef struct {
+	const char *name;
+	void (*generate)(unsigned int bytes);
+} session_t;
+
+typedef struct {
+	double ns_per_byte;
+	double calls_per_byte;
+	double events_per_byte;
+	int packets;
+	uint32_t checksum;
+} replay_result_t;
+
+// Session and replay state
+static uint8_t *m_session;
+static unsigned int m_session_len = 0;
+static unsigned int *m_write_end;
+static int m_writes = 0;
+static int m_packets_sent = 0;
+
+static unsigned int m_pos = 0;
+static unsigned int m_usb_end = 0;
+static int m_write_ind = 0;
+static unsigned int m_stream_calls = 0;
+static unsigned int m_events = 0;
+static int m_packets_rx = 0;
+static uint32_t m_checksum = 0;
+
+// Previous implementation
+static uint8_t m_old_rx_buffer[SERIAL_RX_BUFFER_SIZE];
+
+// Firmware stubs
+int comm_usb_serial_configured_cnt(void) {
+	return 0;
+}
+
+void comm_usb_serial_init(void) {
+}
+
+void commands_process_packet(unsigned char *data, unsigned int len,
+		void(*reply_func)(unsigned char *data, unsigned int len)) {
+	(void)reply_func;
+	m_packets_rx++;
+	for (unsigned int i = 0;i < len;i++) {
+		m_checksum = m_checksum * 31 + data[i];
+	}
+}
+
+// USB driver replaying the session
+static unsigned int usb_available(void) {
+	if (m_pos == m_usb_end && m_pos < m_session_len) {
+		// Next USB packet
+		while (m_write_end[m_write_ind] <= m_pos) {
+			m_write_ind++;
+		}
+
+		m_usb_end = m_pos + USB_PACKET_LEN;
+		if (m_usb_end > m_write_end[m_write_ind]) {
+			m_usb_end = m_write_end[m_write_ind];
+		}
+	}
+
+	return m_usb_end - m_pos;
+}
+
+static size_t sdu_read(void *ip, uint8_t *bp, size_t n) {
+	(void)ip;
+	m_stream_calls++;
+
+	size_t r = 0;
+	while (r < n) {
+		unsigned int avail = usb_available();
+		if (avail == 0) {
+			break;
+		}
+
+		if (avail > n - r) {
+			avail = n - r;
+		}
+
+		memcpy(bp + r, m_session + m_pos, avail);
+		m_pos += avail;
+		r += avail;
+	}
+
+	return r;
+}
+
+static size_t sdu_readt(void *ip, uint8_t *bp, size_t n, systime_t time) {
+	(void)ip;
+	(void)time;
+	m_stream_calls++;
+
+	// Only what has arrived already, i.e. the rest of the current USB packet
+	unsigned int avail = m_usb_end - m_pos;
+	if (avail > n) {
+		avail = n;
+	}
+
+	memcpy(bp, m_session + m_pos, avail);
+	m_pos += avail;
+	return avail;
+}
+
+static size_t sdu_writet(void *ip, const uint8_t *bp, size_t n, systime_t time) {
+	(void)ip;
+	(void)bp;
+	(void)time;
+	return n;
+}
+
+static const struct SerialUSBDriverVMT m_sdu_vmt = {
+		0, sdu_read, 0, 0, 0, 0, sdu_writet, sdu_readt
+};
+
+SerialUSBDriver SDU1 = {&m_sdu_vmt};
+
+// Session generation
+static void session_write(unsigned char *data, unsigned int len) {
+	if (m_session_len + len > SESSION_MAX || m_writes >= WRITES_MAX) {
+		return;
+	}
+
+	memcpy(m_session + m_session_len, data, len);
+	m_session_len += len;
+	m_write_end[m_writes++] = m_session_len;
+}
+
+static void session_packet(uint8_t *data, unsigned int len) {
+	packet_send_packet(data, len, ENCODE_HANDLER);
+	m_packets_sent++;
+}
+
+static void generate_realtime(unsigned int bytes) {
+	uint8_t pl[16];
+	int i = 0;
+
+	while (m_session_len < bytes) {
+		int32_t ind = 0;
+
+		switch (i++ % 4) {
+		case 0:
+			pl[ind++] = COMM_GET_VALUES;
+			break;
+		case 1:
+			pl[ind++] = COMM_GET_VALUES_SELECTIVE;
+			buffer_append_uint32(pl, 0xFFFF, &ind);
+			break;
+		case 2:
+			pl[ind++] = COMM_SET_CURRENT;
+			buffer_append_int32(pl, 12345, &ind);
+			break;
+		default:
+			pl[ind++] = COMM_ALIVE;
+			break;
+		}
+
+		session_packet(pl, ind);
+	}
+}
+
+static void generate_fw_upload(unsigned int bytes) {
+	uint8_t pl[400];
+	uint32_t addr = 0;
+
+	while (m_session_len < bytes) {
+		int32_t ind = 0;
+		pl[ind++] = COMM_WRITE_NEW_APP_DATA;
+		buffer_append_uint32(pl, addr, &ind);
+		for (int i = 0;i < 384;i++) {
+			pl[ind++] = (addr + i) * 7;
+		}
+		addr += 384;
+		session_packet(pl, ind);
+	}
+}
+
+static void generate_conf_write(unsigned int bytes) {
+	uint8_t pl[460];
+
+	while (m_session_len < bytes) {
+		pl[0] = COMM_SET_MCCONF;
+		for (unsigned int i = 1;i < sizeof(pl);i++) {
+			pl[i] = i ^ m_packets_sent;
+		}
+		session_packet(pl, sizeof(pl));
+
+		// VESC Tool reads the configuration back
+		pl[0] = COMM_GET_MCCONF;
+		session_packet(pl, 1);
+	}
+}
+
+static const session_t m_sessions[] = {
+		{"Realtime data polling", generate_realtime},
+		{"Firmware upload", generate_fw_upload},
+		{"Configuration write", generate_conf_write},
+};
+
+// Replays
+static void replay_reset(void) {
+	m_pos = 0;
+	m_usb_end = 0;
+	m_write_ind = 0;
+	m_stream_calls = 0;
+	m_events = 0;
+	m_packets_rx = 0;
+	m_checksum = 0;
+	packet_reset(PACKET_HANDLER);
+}
+
+static void replay_bulk(void) {
+	serial_rx_read_pos = 0;
+	serial_rx_write_pos = 0;
+
+	while (m_pos < m_session_len) {
+		if (serial_rx_fill() > 0) {
+			m_events++;
+			serial_rx_drain();
+		}
+	}
+}
+
+static void replay_old(void) {
+	uint8_t buffer[2];
+	int read_pos = 0;
+	int write_pos = 0;
+
+	while (m_pos < m_session_len) {
+		int len = chSequentialStreamRead(&SDU1, buffer, 1);
+		int had_data = 0;
+
+		for (int i = 0;i < len;i++) {
+			m_old_rx_buffer[write_pos++] = buffer[i];
+			if (write_pos == SERIAL_RX_BUFFER_SIZE) {
+				write_pos = 0;
+			}
+			had_data = 1;
+		}
+
+		if (had_data) {
+			m_events++;
+
+			while (read_pos != write_pos) {
+				packet_process_byte(m_old_rx_buffer[read_pos++], PACKET_HANDLER);
+				if (read_pos == SERIAL_RX_BUFFER_SIZE) {
+					read_pos = 0;
+				}
+			}
+		}
+	}
+}
+
+static replay_result_t measure(void (*replay)(void)) {
+	replay_result_t res;
+	uint64_t bytes = 0;
+	int rounds = 0;
+
+	clock_t start = clock();
+	do {
+		replay_reset();
+		replay();
+		bytes += m_session_len;
+		rounds++;
+	} while ((clock() - start) < CLOCKS_PER_SEC / 2);
+	double cpu_s = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+	res.ns_per_byte = cpu_s * 1e9 / (double)bytes;
+	res.calls_per_byte = (double)m_stream_calls / (double)m_session_len;
+	res.events_per_byte = (double)m_events / (double)m_session_len;
+	res.packets = m_packets_rx;
+	res.checksum = m_checksum;
+	(void)rounds;
+	return res;
+}
+
+static void print_result(const char *name, const replay_result_t *r) {
+	printf("  %-8s %8.2f MB/s  %6.2f ns/byte  %5.3f calls/byte  %5.3f wakeups/byte\r\n",
+			name, 1e3 / r->ns_per_byte, r->ns_per_byte, r->calls_per_byte, r->events_per_byte);
+}
+
+int main(int argc, char **argv) {
+	unsigned int bytes = 1024 * 1024;
+	if (argc > 1) {
+		bytes = atoi(argv[1]);
+	}
+
+	if (bytes > SESSION_MAX - 1024) {
+		bytes = SESSION_MAX - 1024;
+	}
+
+	m_session = malloc(SESSION_MAX);
+	m_write_end = malloc(WRITES_MAX * sizeof(unsigned int));
+
+	comm_usb_init();
+	packet_init(session_write, 0, ENCODE_HANDLER);
+
+	int fails = 0;
+
+	for (unsigned int i = 0;i < sizeof(m_sessions) / sizeof(m_sessions[0]);i++) {
+		m_session_len = 0;
+		m_writes = 0;
+		m_packets_sent = 0;
+		m_sessions[i].generate(bytes);
+
+		printf("%s: %u bytes, %d packets\r\n", m_sessions[i].name, m_session_len, m_packets_sent);
+
+		replay_result_t old = measure(replay_old);
+		replay_result_t bulk = measure(replay_bulk);
+		print_result("Old", &old);
+		print_result("Bulk", &bulk);
+		printf("  Speedup  %.2fx\r\n\r\n", old.ns_per_byte / bulk.ns_per_byte);
+
+		if (old.packets != m_packets_sent || bulk.packets != m_packets_sent ||
+				old.checksum != bulk.checksum) {
+			printf("FAIL: %d and %d of %d packets decoded, checksums %08x %08x\r\n",
+					old.packets, bulk.packets, m_packets_sent,
+					(unsigned int)old.checksum, (unsigned int)bulk.checksum);
+			fails++;
+		}
+	}
+
+	free(m_session);
+	free(m_write_end);
+
+	printf("%s\r\n", fails ? "FAILED" : "All tests passed");
+	return fails ? 1 : 0;
+}
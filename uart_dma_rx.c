@@ -0,0 +1,267 @@
+/*
+	Copyright 2026 agent	agent@local
+
+	This file is part of the VESC firmware.
+
+	The VESC firmware is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    The VESC firmware is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+#include "uart_dma_rx.h"
+#include "stm32f4xx_conf.h"
+
+/**
+ * Receive from a USART with DMA into a circular buffer, while the serial
+ * driver keeps handling transmission.
+ *
+ * The DMA writes every received byte into the buffer. The receiving thread is
+ * signaled by the USART IDLE interrupt when the line goes idle after a burst,
+ * so that it can process each burst as one block, and at every half of the
+ * buffer during long bursts.
+ *
+ * The serial driver owns the USART interrupt. Its RX and error interrupts are
+ * disabled, and its receive hook is set, so that its interrupt handler, which
+ * still runs for transmission, leaves the data register to the DMA and hands
+ * the status to this module instead.
+ */
+
+// Private functions
+static unsigned int write_pos(uart_dma_rx *rx);
+static void dma_rx_handler(void *p, uint32_t flags);
+static void usart_rx_hook(void *p, uint16_t sr);
+
+/**
+ * Set up a DMA receiver. Nothing is started yet.
+ *
+ * @param rx
+ * The receiver.
+ *
+ * @param sd
+ * The serial driver of the USART.
+ *
+ * @param dma
+ * The RX DMA stream of the USART.
+ *
+ * @param dma_channel
+ * The channel of the USART on that stream, e.g. DMA_Channel_4.
+ *
+ * @param dma_irq_prio
+ * The priority of the DMA interrupt.
+ *
+ * @param buffer
+ * The receive buffer. A burst that is longer than half of it is handed out
+ * in parts.
+ *
+ * @param size
+ * The size of the buffer.
+ *
+ * @param thread
+ * The thread to signal when data can be processed.
+ *
+ * @param event
+ * The event mask to signal.
+ */
+void uart_dma_rx_init(uart_dma_rx *rx, SerialDriver *sd, const stm32_dma_stream_t *dma,
+		uint32_t dma_channel, uint32_t dma_irq_prio, uint8_t *buffer, unsigned int size,
+		thread_t *thread, eventmask_t event) {
+	rx->sd = sd;
+	rx->dma = dma;
+	rx->dma_channel = dma_channel;
+	rx->dma_irq_prio = dma_irq_prio;
+	rx->buffer = buffer;
+	rx->size = size;
+	rx->thread = thread;
+	rx->event = event;
+
+	rx->running = false;
+	rx->read_pos = 0;
+	rx->halves_pending = 0;
+	rx->overrun_cnt = 0;
+}
+
+/**
+ * Start receiving with DMA. Call this after sdStart, also every time sdStart
+ * has been called again, e.g. for a new baud rate.
+ *
+ * @param rx
+ * The receiver.
+ */
+void uart_dma_rx_start(uart_dma_rx *rx) {
+	if (rx->running) {
+		uart_dma_rx_stop(rx);
+	}
+
+	USART_TypeDef *u = rx->sd->usart;
+	DMA_Stream_TypeDef *s = rx->dma->stream;
+	DMA_InitTypeDef DMA_InitStructure;
+
+	dmaStreamAllocate(rx->dma, rx->dma_irq_prio, dma_rx_handler, rx);
+
+	DMA_InitStructure.DMA_Channel = rx->dma_channel;
+	DMA_InitStructure.DMA_Memory0BaseAddr = (uint32_t)rx->buffer;
+	DMA_InitStructure.DMA_PeripheralBaseAddr = (uint32_t)&u->DR;
+	DMA_InitStructure.DMA_DIR = DMA_DIR_PeripheralToMemory;
+	DMA_InitStructure.DMA_BufferSize = rx->size;
+	DMA_InitStructure.DMA_PeripheralInc = DMA_PeripheralInc_Disable;
+	DMA_InitStructure.DMA_MemoryInc = DMA_MemoryInc_Enable;
+	DMA_InitStructure.DMA_PeripheralDataSize = DMA_PeripheralDataSize_Byte;
+	DMA_InitStructure.DMA_MemoryDataSize = DMA_MemoryDataSize_Byte;
+	DMA_InitStructure.DMA_Mode = DMA_Mode_Circular;
+	DMA_InitStructure.DMA_Priority = DMA_Priority_Medium;
+	DMA_InitStructure.DMA_FIFOMode = DMA_FIFOMode_Disable;
+	DMA_InitStructure.DMA_FIFOThreshold = DMA_FIFOThreshold_1QuarterFull;
+	DMA_InitStructure.DMA_MemoryBurst = DMA_MemoryBurst_Single;
+	DMA_InitStructure.DMA_PeripheralBurst = DMA_PeripheralBurst_Single;
+	DMA_Init(s, &DMA_InitStructure);
+
+	rx->read_pos = 0;
+	rx->halves_pending = 0;
+
+	DMA_ITConfig(s, DMA_IT_HT | DMA_IT_TC, ENABLE);
+	DMA_Cmd(s, ENABLE);
+
+	// Take the receiver from the serial driver. Its interrupt handler must not
+	// read the data register any more, neither for received data nor for
+	// errors, as that would take bytes from the DMA.
+	chSysLock();
+	rx->sd->rxhookp = rx;
+	rx->sd->rxhook = usart_rx_hook;
+	u->CR1 &= ~(USART_CR1_RXNEIE | USART_CR1_PEIE);
+	u->CR3 &= ~USART_CR3_EIE;
+
+	// Clear a stale IDLE flag before the DMA owns the data register
+	(void)u->SR;
+	(void)u->DR;
+
+	u->CR3 |= USART_CR3_DMAR;
+	u->CR1 |= USART_CR1_IDLEIE;
+	rx->running = true;
+	chSysUnlock();
+}
+
+/**
+ * Stop receiving with DMA and give the receiver back to the serial driver.
+ * Call this before sdStop.
+ *
+ * @param rx
+ * The receiver.
+ */
+void uart_dma_rx_stop(uart_dma_rx *rx) {
+	if (!rx->running) {
+		return;
+	}
+
+	USART_TypeDef *u = rx->sd->usart;
+
+	chSysLock();
+	rx->running = false;
+	u->CR1 &= ~USART_CR1_IDLEIE;
+	u->CR3 &= ~USART_CR3_DMAR;
+	u->CR3 |= USART_CR3_EIE;
+	u->CR1 |= USART_CR1_RXNEIE | USART_CR1_PEIE;
+	rx->sd->rxhook = NULL;
+	chSysUnlock();
+
+	DMA_Cmd(rx->dma->stream, DISABLE);
+	dmaStreamRelease(rx->dma);
+}
+
+/**
+ * Get the received data that has not been consumed yet.
+ *
+ * @param rx
+ * The receiver.
+ *
+ * @param data
+ * Set to the start of the data.
+ *
+ * @return
+ * The number of contiguous bytes at data. Call again after consuming them
+ * if the data wraps around the end of the buffer.
+ */
+unsigned int uart_dma_rx_get(uart_dma_rx *rx, const uint8_t **data) {
+	if (!rx->running) {
+		return 0;
+	}
+
+	rx->halves_pending = 0;
+
+	unsigned int wp = write_pos(rx);
+	unsigned int rp = rx->read_pos;
+
+	*data = rx->buffer + rp;
+	return wp >= rp ? wp - rp : rx->size - rp;
+}
+
+/**
+ * Consume data returned by uart_dma_rx_get.
+ *
+ * @param rx
+ * The receiver.
+ *
+ * @param len
+ * The number of bytes.
+ */
+void uart_dma_rx_consume(uart_dma_rx *rx, unsigned int len) {
+	unsigned int rp = rx->read_pos + len;
+	if (rp >= rx->size) {
+		rp -= rx->size;
+	}
+
+	rx->read_pos = rp;
+}
+
+static unsigned int write_pos(uart_dma_rx *rx) {
+	// NDTR counts down from size to 1 and is reloaded right away
+	unsigned int pos = rx->size - rx->dma->stream->NDTR;
+	return pos >= rx->size ? 0 : pos;
+}
+
+static void dma_rx_handler(void *p, uint32_t flags) {
+	(void)flags;
+	uart_dma_rx *rx = (uart_dma_rx*)p;
+
+	// The thread has not taken the data from the last two halves, so the
+	// DMA is writing over data that has not been processed.
+	if (rx->halves_pending >= 2) {
+		rx->overrun_cnt++;
+	}
+	rx->halves_pending++;
+
+	chSysLockFromISR();
+	chEvtSignalI(rx->thread, rx->event);
+	chSysUnlockFromISR();
+}
+
+/*
+ * Called from the interrupt handler of the serial driver, also for its
+ * transmit interrupts.
+ */
+static void usart_rx_hook(void *p, uint16_t sr) {
+	uart_dma_rx *rx = (uart_dma_rx*)p;
+
+	if (!(sr & USART_SR_IDLE)) {
+		return;
+	}
+
+	// The flag is cleared by reading SR, which the driver has done, and then
+	// DR. The line is idle, so there is no byte in DR, and a new one would be
+	// taken by the DMA within a few bus cycles.
+	(void)rx->sd->usart->DR;
+
+	chSysLockFromISR();
+	if (rx->running && write_pos(rx) != rx->read_pos) {
+		chEvtSignalI(rx->thread, rx->event);
+	}
+	chSysUnlockFromISR();
+}
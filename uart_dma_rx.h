@@ -0,0 +1,56 @@
+/*
+	Copyright 2026 agent	agent@local
+
+	This file is part of the VESC firmware.
+
+	The VESC firmware is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    The VESC firmware is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+#ifndef UART_DMA_RX_H_
+#define UART_DMA_RX_H_
+
+#include "ch.h"
+#include "hal.h"
+#include <stdint.h>
+#include <stdbool.h>
+
+// Types
+typedef struct {
+	// Configuration
+	SerialDriver *sd;
+	const stm32_dma_stream_t *dma;
+	uint32_t dma_channel;
+	uint32_t dma_irq_prio;
+	uint8_t *buffer;
+	unsigned int size;
+	thread_t *thread;
+	eventmask_t event;
+
+	// State
+	volatile bool running;
+	unsigned int read_pos;
+	volatile unsigned int halves_pending;
+	volatile unsigned int overrun_cnt;
+} uart_dma_rx;
+
+// Functions
+void uart_dma_rx_init(uart_dma_rx *rx, SerialDriver *sd, const stm32_dma_stream_t *dma,
+		uint32_t dma_channel, uint32_t dma_irq_prio, uint8_t *buffer, unsigned int size,
+		thread_t *thread, eventmask_t event);
+void uart_dma_rx_start(uart_dma_rx *rx);
+void uart_dma_rx_stop(uart_dma_rx *rx);
+unsigned int uart_dma_rx_get(uart_dma_rx *rx, const uint8_t **data);
+void uart_dma_rx_consume(uart_dma_rx *rx, unsigned int len);
+
+#endif /* UART_DMA_RX_H_ */
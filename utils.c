@@ -26,9 +26,59 @@
 #include <string.h>
 #include <stdlib.h>
 
+// Settings
+#define SIN_TABLE_SIZE		256 // Entries per turn, has to be a power of two
+
 // Private variables
 static volatile int sys_lock_cnt = 0;
 
+// One turn of sin plus the first entry again, for utils_fast_sincos_table
+static const float sin_table[SIN_TABLE_SIZE + 1] = {
+		0.000000000, 0.024541229, 0.049067674, 0.073564564, 0.098017140, 0.122410675,
+		0.146730474, 0.170961889, 0.195090322, 0.219101240, 0.242980180, 0.266712757,
+		0.290284677, 0.313681740, 0.336889853, 0.359895037, 0.382683432, 0.405241314,
+		0.427555093, 0.449611330, 0.471396737, 0.492898192, 0.514102744, 0.534997620,
+		0.555570233, 0.575808191, 0.595699304, 0.615231591, 0.634393284, 0.653172843,
+		0.671558955, 0.689540545, 0.707106781, 0.724247083, 0.740951125, 0.757208847,
+		0.773010453, 0.788346428, 0.803207531, 0.817584813, 0.831469612, 0.844853565,
+		0.857728610, 0.870086991, 0.881921264, 0.893224301, 0.903989293, 0.914209756,
+		0.923879533, 0.932992799, 0.941544065, 0.949528181, 0.956940336, 0.963776066,
+		0.970031253, 0.975702130, 0.980785280, 0.985277642, 0.989176510, 0.992479535,
+		0.995184727, 0.997290457, 0.998795456, 0.999698819, 1.000000000, 0.999698819,
+		0.998795456, 0.997290457, 0.995184727, 0.992479535, 0.989176510, 0.985277642,
+		0.980785280, 0.975702130, 0.970031253, 0.963776066, 0.956940336, 0.949528181,
+		0.941544065, 0.932992799, 0.923879533, 0.914209756, 0.903989293, 0.893224301,
+		0.881921264, 0.870086991, 0.857728610, 0.844853565, 0.831469612, 0.817584813,
+		0.803207531, 0.788346428, 0.773010453, 0.757208847, 0.740951125, 0.724247083,
+		0.707106781, 0.689540545, 0.671558955, 0.653172843, 0.634393284, 0.615231591,
+		0.595699304, 0.575808191, 0.555570233, 0.534997620, 0.514102744, 0.492898192,
+		0.471396737, 0.449611330, 0.427555093, 0.405241314, 0.382683432, 0.359895037,
+		0.336889853, 0.313681740, 0.290284677, 0.266712757, 0.242980180, 0.219101240,
+		0.195090322, 0.170961889, 0.146730474, 0.122410675, 0.098017140, 0.073564564,
+		0.049067674, 0.024541229, 0.000000000, -0.024541229, -0.049067674, -0.073564564,
+		-0.098017140, -0.122410675, -0.146730474, -0.170961889, -0.195090322, -0.219101240,
+		-0.242980180, -0.266712757, -0.290284677, -0.313681740, -0.336889853, -0.359895037,
+		-0.382683432, -0.405241314, -0.427555093, -0.449611330, -0.471396737, -0.492898192,
+		-0.514102744, -0.534997620, -0.555570233, -0.575808191, -0.595699304, -0.615231591,
+		-0.634393284, -0.653172843, -0.671558955, -0.689540545, -0.707106781, -0.724247083,
+		-0.740951125, -0.757208847, -0.773010453, -0.788346428, -0.803207531, -0.817584813,
+		-0.831469612, -0.844853565, -0.857728610, -0.870086991, -0.881921264, -0.893224301,
+		-0.903989293, -0.914209756, -0.923879533, -0.932992799, -0.941544065, -0.949528181,
+		-0.956940336, -0.963776066, -0.970031253, -0.975702130, -0.980785280, -0.985277642,
+		-0.989176510, -0.992479535, -0.995184727, -0.997290457, -0.998795456, -0.999698819,
+		-1.000000000, -0.999698819, -0.998795456, -0.997290457, -0.995184727, -0.992479535,
+		-0.989176510, -0.985277642, -0.980785280, -0.975702130, -0.970031253, -0.963776066,
+		-0.956940336, -0.949528181, -0.941544065, -0.932992799, -0.923879533, -0.914209756,
+		-0.903989293, -0.893224301, -0.881921264, -0.870086991, -0.857728610, -0.844853565,
+		-0.831469612, -0.817584813, -0.803207531, -0.788346428, -0.773010453, -0.757208847,
+		-0.740951125, -0.724247083, -0.707106781, -0.689540545, -0.671558955, -0.653172843,
+		-0.634393284, -0.615231591, -0.595699304, -0.575808191, -0.555570233, -0.534997620,
+		-0.514102744, -0.492898192, -0.471396737, -0.449611330, -0.427555093, -0.405241314,
+		-0.382683432, -0.359895037, -0.336889853, -0.313681740, -0.290284677, -0.266712757,
+		-0.242980180, -0.219101240, -0.195090322, -0.170961889, -0.146730474, -0.122410675,
+		-0.098017140, -0.073564564, -0.049067674, -0.024541229, 0.000000000
+};
+
 void utils_step_towards(float *value, float goal, float step) {
     if (*value < goal) {
         if ((*value + step) < goal) {
@@ -285,7 +335,7 @@ int utils_middle_of_3_int(int a, int b, int c) {
 float utils_fast_inv_sqrt(float x) {
 	union {
 		float as_float;
-		long as_int;
+		int32_t as_int;
 	} un;
 
 	float xhalf = 0.5f*x;
@@ -347,15 +397,16 @@ float utils_fast_atan2(float y, float x) {
  */
 bool utils_saturate_vector_2d(float *x, float *y, float max) {
 	bool retval = false;
-	float mag = sqrtf(SQ(*x) + SQ(*y));
+	float mag_sq = SQ(*x) + SQ(*y);
 	max = fabsf(max);
 
-	if (mag < 1e-10) {
-		mag = 1e-10;
+	if (mag_sq < 1e-20) {
+		mag_sq = 1e-20;
 	}
 
-	if (mag > max) {
-		const float f = max / mag;
+	// Only take the square root when saturating, which is rare
+	if (mag_sq > SQ(max)) {
+		const float f = max / sqrtf(mag_sq);
 		*x *= f;
 		*y *= f;
 		retval = true;
@@ -479,6 +530,134 @@ void utils_fast_sincos_better(float angle, float *sin, float *cos) {
 	}
 }
 
+/**
+ * Fast atan2 with a higher order polynomial. About as fast as
+ * utils_fast_atan2 on the FPU, but around 100 times more accurate.
+ *
+ * The ratio of the smaller and the larger magnitude is in 0 to 1, where
+ * atan is approximated with the 9th order minimax polynomial from
+ * Abramowitz and Stegun 4.4.49. The octant is restored from the signs
+ * and magnitudes. Max error 1.2e-5 rad with float rounding.
+ *
+ * @param y
+ * y
+ *
+ * @param x
+ * x
+ *
+ * @return
+ * The angle in radians
+ */
+float utils_fast_atan2_poly(float y, float x) {
+	float abs_x = fabsf(x);
+	float abs_y = fabsf(y);
+	bool y_larger = abs_y > abs_x;
+
+	float t = y_larger ? abs_x / abs_y : abs_y / (abs_x + 1e-20);
+	float t_sq = t * t;
+	float angle = t * (0.9998660 + t_sq * (-0.3302995 + t_sq * (0.1801410 +
+			t_sq * (-0.0851330 + t_sq * 0.0208351))));
+
+	if (y_larger) {
+		angle = (M_PI / 2.0) - angle;
+	}
+
+	if (x < 0) {
+		angle = M_PI - angle;
+	}
+
+	if (y < 0) {
+		return -angle;
+	} else {
+		return angle;
+	}
+}
+
+/**
+ * Fast sine and cosine from a table with linear interpolation. The table
+ * has 256 entries per turn, which gives a max error of 7.5e-5.
+ *
+ * Unlike utils_fast_sincos this works with any angle that fits in an int
+ * after scaling, without a wrapping loop. The accuracy drops slowly for
+ * large angles as the fraction loses bits.
+ *
+ * @param angle
+ * The angle in radians
+ *
+ * @param sin
+ * A pointer to store the sine value.
+ *
+ * @param cos
+ * A pointer to store the cosine value.
+ */
+void utils_fast_sincos_table(float angle, float *sin, float *cos) {
+	float pos = angle * (SIN_TABLE_SIZE / (2.0 * M_PI));
+	int ind = (int)pos;
+
+	// The conversion truncates towards zero
+	if (pos < 0.0) {
+		ind--;
+	}
+
+	float frac = pos - (float)ind;
+	int ind_s = ind & (SIN_TABLE_SIZE - 1);
+	int ind_c = (ind + SIN_TABLE_SIZE / 4) & (SIN_TABLE_SIZE - 1);
+
+	*sin = sin_table[ind_s] + frac * (sin_table[ind_s + 1] - sin_table[ind_s]);
+	*cos = sin_table[ind_c] + frac * (sin_table[ind_c + 1] - sin_table[ind_c]);
+}
+
+/**
+ * Fast sine and cosine with higher order polynomials, accurate to about
+ * one float epsilon for moderate angles.
+ *
+ * The angle is reduced to -pi/4 to pi/4 and a quadrant, and the reduced
+ * angle goes through the minimax polynomials of the Cephes sinf and cosf.
+ *
+ * @param angle
+ * The angle in radians
+ * WARNING: Don't use too large angles.
+ *
+ * @param sin
+ * A pointer to store the sine value.
+ *
+ * @param cos
+ * A pointer to store the cosine value.
+ */
+void utils_fast_sincos_poly(float angle, float *sin, float *cos) {
+	float pos = angle * (2.0 / M_PI);
+	int quadrant = (int)(pos < 0.0 ? pos - 0.5 : pos + 0.5);
+
+	// pi / 2 in two parts, so that the reduction does not lose bits
+	float x = angle - (float)quadrant * 1.5707963705062866;
+	x -= (float)quadrant * -4.3711388e-8;
+	float x_sq = x * x;
+
+	float s = x + x * x_sq * (-1.6666654611e-1 + x_sq * (8.3321608736e-3 +
+			x_sq * -1.9515295891e-4));
+	float c = 1.0 - 0.5 * x_sq + x_sq * x_sq * (4.166664568298827e-2 +
+			x_sq * (-1.388731625493765e-3 + x_sq * 2.443315711809948e-5));
+
+	switch (quadrant & 3) {
+	case 0:
+		*sin = s;
+		*cos = c;
+		break;
+	case 1:
+		*sin = c;
+		*cos = -s;
+		break;
+	case 2:
+		*sin = -s;
+		*cos = -c;
+		break;
+	default:
+		*sin = -c;
+		*cos = s;
+		break;
+	}
+}
+
 /**
  * Calculate the values with the lowest magnitude.
  *
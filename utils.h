@@ -43,6 +43,9 @@ float utils_fast_atan2(float y, float x);
 bool utils_saturate_vector_2d(float *x, float *y, float max);
 void utils_fast_sincos(float angle, float *sin, float *cos);
 void utils_fast_sincos_better(float angle, float *sin, float *cos);
+float utils_fast_atan2_poly(float y, float x);
+void utils_fast_sincos_table(float angle, float *sin, float *cos);
+void utils_fast_sincos_poly(float angle, float *sin, float *cos);
 float utils_min_abs(float va, float vb);
 float utils_max_abs(float va, float vb);
 void utils_byte_to_binary(int x, char *b);